@@ -5,7 +5,7 @@
 
 #include <stdio.h>
 
-typedef enum { ADD_CMD, QUERY_CMD, END_CMD, N_CMDS } CmdType;
+typedef enum { ADD_CMD, QUERY_CMD, STATS_CMD, END_CMD, N_CMDS } CmdType;
 
 typedef struct {
   const char *user;
@@ -16,35 +16,56 @@ typedef struct {
 } AddCmd;
 
 typedef struct {
-  const char *room;
+  const char *room;      // rooms[0]
+  size_t nRooms;
+  const char **rooms;    // rooms[nRooms]
   size_t count;
   size_t nTopics;
   const char **topics;   // topics[nTopics]
 } QueryCmd;
 
+/** max COUNT of top topics which may be requested by a STATS command */
+enum { MAX_TOP_TOPICS = 100 };
+
+typedef struct {
+  const char *room;
+  size_t count;          // max # of top topics; <= MAX_TOP_TOPICS
+} StatsCmd;
+
 typedef struct {
   CmdType type;
   union {
     AddCmd add;
     QueryCmd query;
+    StatsCmd stats;
   };
 } ChatCmd;
 
 /** fill in cmd by parsing input.  Note that all strings in cmd share
- *  storage with strings in input.  Print error message on err if
- *  an error is detected and return non-zero; return 0 otherwise.
+ *  storage with strings in input.  On success, the USER, ROOM and
+ *  TOPIC strings in input are folded to lower-case in-place and
+ *  duplicate topics are removed from an ADD command.  Print error
+ *  message on err if an error is detected and return non-zero; return
+ *  0 otherwise.
  */
 int parse_cmd(const MsgArgs *input, ChatCmd *cmd, FILE *err);
 
 /** fill in cmd by parsing input for user logged into chat-room room.
  *  Note that all strings in cmd share storage with strings in input
- *  as well as user and room.  Print error message on err if an error
- *  is detected and return non-zero; return 0 otherwise.
+ *  as well as user and room.  Strings in input are normalized as for
+ *  parse_cmd(), but user and room are used as given.  Print error
+ *  message on err if an error is detected and return non-zero; return
+ *  0 otherwise.
  */
 int parse_loggedin_cmd(const MsgArgs *input, const char *user, const char *room,
                        ChatCmd *cmd, FILE *err);
 
 
+/** convert ASCII upper-case characters in NUL-terminated name to
+ *  lower-case in-place a word at a time.  Return name.
+ */
+char *fold_case_name(char *name);
+
 /** utility routine to print cmd on out; use for debugging. */
 void print_cmd(FILE *out, const ChatCmd *cmd);
 
@@ -0,0 +1,152 @@
+#ifndef EXECUTOR_H_
+#define EXECUTOR_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/** A work-stealing executor which runs tasks on a fixed set of worker
+ *  threads.  Each worker has its own deque of tasks: a task submitted
+ *  by a worker is pushed on that worker's deque and a task submitted
+ *  by any other thread is pushed on the deque of the next worker in
+ *  round-robin order.  A worker runs tasks from its own deque in LIFO
+ *  order; when its deque is empty it steals the oldest half of the
+ *  tasks from another worker's deque, and sleeps only when there are
+ *  no pending tasks anywhere.
+ *
+ *  Completion of a task can be awaited using a Future.
+ */
+
+/** routines which return int use the return value to indicate the
+ *  error status.  0 if everything okay, non-zero for an allocation
+ *  error or if the executor is shutting down.
+ */
+
+/** a task runs fn(arg) */
+typedef void TaskFn(void *arg);
+
+/** completion status of a task.
+ *
+ *  clients responsible for allocation/deallocation of this structure.
+ *  note that clients should regard the insides of this struct as
+ *  private.
+ */
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool isDone;
+} Future;
+
+/** initialize future.  A future may be reused for another task only
+ *  after the previous task has completed.
+ */
+int init_future(Future *future);
+
+/** free all resources used by future.  Does not free the future
+ *  structure itself.
+ *
+ *  No error return.
+ */
+void free_future(Future *future);
+
+/** block until the task for future has completed.
+ *
+ *  No error return.
+ */
+void wait_future(Future *future);
+
+/** return true iff the task for future has completed.
+ *
+ *  No error return.
+ */
+bool is_done_future(Future *future);
+
+
+/** options for an Executor */
+typedef struct {
+  /** # of worker threads; 0 for the # of online CPUs */
+  unsigned nWorkers;
+  /** if true, worker i is pinned to the i'th CPU (modulo the # of
+   *  CPUs) on which the process may run.
+   */
+  bool doPin;
+} ExecutorOptions;
+
+/** statistics for an Executor; counts maintained by workers may be
+ *  slightly out of date.
+ */
+typedef struct {
+  unsigned nWorkers;     /** # of worker threads */
+  size_t nTasks;         /** # of tasks run */
+  size_t nSteals;        /** # of successful steals */
+  size_t nStolen;        /** # of tasks stolen */
+} ExecutorStats;
+
+typedef struct _ExecutorWorker ExecutorWorker;
+
+// clients responsible for allocation/deallocation of this structure.
+// note that clients should regard the insides of this struct as
+// private.
+typedef struct {
+  unsigned nWorkers;
+  ExecutorWorker *workers;   /** [nWorkers] */
+  atomic_uint nextWorker;    /** round-robin index for other threads */
+  atomic_size_t nPending;    /** # of tasks in deques */
+  atomic_uint nIdle;         /** # of workers waiting on idleCond */
+  atomic_bool isShutdown;
+  pthread_mutex_t idleLock;
+  pthread_cond_t idleCond;   /** signalled when a task is submitted */
+} Executor;
+
+/** initialize executor and start its workers.  If options is NULL,
+ *  then default options are used.
+ */
+int init_executor(Executor *executor, const ExecutorOptions *options);
+
+/** shut down executor: wait for all submitted tasks, including those
+ *  submitted by tasks while shutting down, to complete, then stop its
+ *  workers and free all resources used by it.  *MUST* be called when
+ *  executor is no longer needed, and not from one of its own tasks.
+ *  Does not free the executor structure itself.
+ *
+ *  No error return.
+ */
+void free_executor(Executor *executor);
+
+/** submit a task to run fn(arg) on executor.  If future is not NULL,
+ *  it must have been initialized and is completed when fn returns.
+ *  Once executor has started shutting down, only its own tasks may
+ *  submit further tasks.
+ */
+int submit_executor(Executor *executor, TaskFn *fn, void *arg,
+                    Future *future);
+
+/** run fn(arg) on executor and wait for it to complete.  When called
+ *  from one of executor's own tasks, fn(arg) is run directly, since a
+ *  worker which blocked waiting for another task could deadlock the
+ *  executor.
+ */
+int run_executor(Executor *executor, TaskFn *fn, void *arg);
+
+/** return true iff the caller is running on one of executor's workers.
+ *
+ *  No error return.
+ */
+bool is_worker_executor(const Executor *executor);
+
+/** return the index in [0, # of workers) of the worker of executor
+ *  running on the calling thread; -1 if the caller is not one of its
+ *  workers.  Lets tasks use per-worker resources without locking.
+ *
+ *  No error return.
+ */
+int worker_index_executor(const Executor *executor);
+
+/** set *stats to statistics for executor.
+ *
+ *  No error return.
+ */
+void stats_executor(Executor *executor, ExecutorStats *stats);
+
+#endif //#ifndef EXECUTOR_H_
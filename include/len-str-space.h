@@ -0,0 +1,127 @@
+#ifndef LEN_STR_SPACE_H_
+#define LEN_STR_SPACE_H_
+
+#include "arena.h"
+
+#include <stddef.h>
+
+/** Management of dynamically-allocated space for NUL-terminated
+ *  strings, like StrSpace, but with the length of each string stored
+ *  immediately before it.  This gives O(1) iteration and length
+ *  access, and appends which memcpy() strings of known length.
+ */
+
+/** routines which return int use the return value to indicate the
+ *  error status.  0 if everything okay, non-zero for a memory
+ *  allocation error.
+ */
+
+// clients responsible for allocation/deallocation of this structure.
+// note that clients should regard the insides of this struct as
+// private.
+typedef struct {
+  size_t size;   /** # of allocated bytes in buf */
+  size_t index;  /** index of next free location in buf */
+  size_t last;   /** index in buf of length of last string, if any */
+  size_t nStrs;  /** # of strings in buf */
+  char *buf;     /** dynamically allocated buffer: each string is
+                     preceded by its length and NUL-terminated */
+  Arena *arena;  /** if non-NULL, buf is allocated from arena */
+} LenStrSpace;
+
+
+/** initialize this string space.  Must be called before first
+ *  use of this strSpace.
+ *
+ *  No error return.
+ */
+void init_len_str_space(LenStrSpace *strSpace);
+
+/** initialize this string space to allocate its buffer from arena
+ *  rather than using malloc().  The buffer is released when arena is
+ *  reset or rewound, so free_len_str_space() is optional.
+ *
+ *  No error return.
+ */
+void init_len_str_space_with_arena(LenStrSpace *strSpace, Arena *arena);
+
+/** free all dynamic memory used by this strSpace.  *MUST* be called
+ *  when strSpace is no longer needed. Note that this routine does not
+ *  free the strSpace structure itself, as its lifetime is assumed to
+ *  be controlled by the client.
+ *
+ *  No error return.
+ */
+void free_len_str_space(LenStrSpace *strSpace);
+
+/** clear this string space so that it does not store any strings
+ *
+ *  No error return.
+ */
+void clear_len_str_space(LenStrSpace *strSpace);
+
+/** add NUL-terminated string str to strSpace.  Note that str can be
+ *  "" to start a new string for append_len_str_space() or
+ *  append_sprintf_len_str_space().
+ */
+int add_len_str_space(LenStrSpace *strSpace, const char *str);
+
+/** add the n chars str[n] as a new NUL-terminated string to
+ *  strSpace.  str[n] need not be NUL-terminated and should not
+ *  contain a NUL.
+ */
+int add_n_len_str_space(LenStrSpace *strSpace, const char *str, size_t n);
+
+/** append NUL-terminated string str to last str in strSpace.  If called
+ *  when strSpace is empty, then simply adds string to strSpace.
+ */
+int append_len_str_space(LenStrSpace *strSpace, const char *str);
+
+/** append the n chars str[n] to last str in strSpace.  If called
+ *  when strSpace is empty, then simply adds str[n] to strSpace.
+ */
+int append_n_len_str_space(LenStrSpace *strSpace, const char *str, size_t n);
+
+/** appends a string specified by a sprintf() string to the last
+ *  string in strSpace, or adds it if strSpace is empty.  The string
+ *  is formatted directly into strSpace and is only formatted a second
+ *  time if strSpace must grow to hold it.
+ */
+__attribute__ ((format(printf, 2, 3)))
+int append_sprintf_len_str_space(LenStrSpace *strSpace, const char *fmt, ...);
+
+/** External iterator used to iterate through strings in strSpace
+ *  using lastStr, as for iter_str_space().  Specifically, if called
+ *  with lastStr NULL, it returns a pointer to the first string in
+ *  strSpace; if called with non-NULL, then it returns a pointer to
+ *  the next string in strSpace after lastStr, NULL if none.  Each
+ *  step is O(1).
+ *
+ *  To iterate over all strings in strSpace:
+ *  for (const char *str = iter_len_str_space(strSpace, NULL);
+ *       str != NULL;
+ *       str = iter_len_str_space(strSpace, str)) {
+ *    // do something with str
+ *  }
+ *
+ *  The results are undefined if strSpace is modified during the iteration.
+ *
+ *  No error return.
+ */
+const char *iter_len_str_space(const LenStrSpace *strSpace,
+                               const char *lastStr);
+
+/** return the length of str, which must have been returned by
+ *  iter_len_str_space().  O(1).
+ *
+ *  No error return.
+ */
+size_t str_len_len_str_space(const char *str);
+
+/** return the # of strings in strSpace.
+ *
+ *  No error return.
+ */
+size_t n_strs_len_str_space(const LenStrSpace *strSpace);
+
+#endif //#ifndef LEN_STR_SPACE_H_
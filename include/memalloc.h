@@ -1,6 +1,8 @@
 #ifndef MEMALLOC_H_
 #define MEMALLOC_H_
 
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 //Error checking wrappers around memory allocation routines.  Will
@@ -12,4 +14,73 @@ void *reallocChk(void *ptr, size_t size);
 
 void *callocChk(size_t nmemb, size_t size);
 
+
+/** Accounting allocator: malloc_tag(), calloc_tag() and realloc_tag()
+ *  are like their standard counterparts, but charge each block to a
+ *  MemTag identifying the subsystem which uses it.  For each tag, the
+ *  # of bytes and blocks currently allocated are tracked along with
+ *  their high-water marks, so that the memory used by a subsystem
+ *  (and its growth per connection or per query) can be monitored.
+ *
+ *  Each block is preceded by a small header recording its size and
+ *  tag, so a block *MUST* be freed using free_tag() (or reallocated
+ *  using realloc_tag()) and never passed to free() or realloc().
+ *  All routines are thread-safe.
+ */
+
+/** subsystems to which allocations are charged */
+typedef enum {
+  MEM_TAG_OTHER,        /** anything not covered below */
+  MEM_TAG_DB,           /** long-lived db caches and aggregates */
+  MEM_TAG_QUERY,        /** query scratch memory */
+  MEM_TAG_CONN,         /** per-connection server state */
+  MEM_TAG_MSG,          /** message buffers while parsing or adding */
+  N_MEM_TAGS
+} MemTag;
+
+/** statistics for a tag */
+typedef struct {
+  size_t bytes;         /** # of bytes currently allocated */
+  size_t maxBytes;      /** high-water mark of bytes */
+  size_t count;         /** # of blocks currently allocated */
+  size_t maxCount;      /** high-water mark of count */
+  uint64_t nAllocs;     /** # of blocks allocated over lifetime */
+} MemTagStats;
+
+/** return a block of size bytes charged to tag; NULL on error */
+void *malloc_tag(MemTag tag, size_t size);
+
+/** return a zeroed block of nmemb * size bytes charged to tag; NULL
+ *  on error (including overflow).
+ */
+void *calloc_tag(MemTag tag, size_t nmemb, size_t size);
+
+/** resize block ptr (which may be NULL) returned by one of these
+ *  routines to size bytes, charging it to tag.  Returns NULL on
+ *  error, in which case ptr is unchanged.
+ */
+void *realloc_tag(MemTag tag, void *ptr, size_t size);
+
+/** free block ptr returned by one of these routines; a NOP if ptr is
+ *  NULL.  Can be used as a destructor callback.
+ *
+ *  No error return.
+ */
+void free_tag(void *ptr);
+
+/** return name of tag, like "query" for MEM_TAG_QUERY */
+const char *name_mem_tag(MemTag tag);
+
+/** set *stats to the current statistics for tag.
+ *
+ *  No error return.
+ */
+void stats_mem_tag(MemTag tag, MemTagStats *stats);
+
+/** write the statistics for all tags to out in the Prometheus text
+ *  format used by dump_metrics() (see metrics.h), labeled by tag
+ *  name.  Returns non-zero on an I/O error.
+ */
+int dump_mem_tags(FILE *out);
+
 #endif /* #ifndef MEMALLOC_H_ */
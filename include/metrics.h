@@ -0,0 +1,236 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include "ring.h"       //for CACHE_LINE_SIZE
+
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/** Metrics for monitoring a running program:
+ *
+ *    Counter:   a monotonically increasing count.
+ *
+ *    Gauge:     a value which may go up or down.
+ *
+ *    Histogram: a log-linear histogram of values (typically latencies
+ *               in nanoseconds) supporting percentile queries.
+ *
+ *  Counters and histograms are sharded: each thread updates one of
+ *  several cache-line separated shards using relaxed atomics, and
+ *  reads sum over all shards, so that updates from many threads do
+ *  not contend.
+ *
+ *  Metrics are normally registered by name in a Metrics registry,
+ *  usually the process-wide global_metrics(), which can dump all its
+ *  metrics in a text exposition format.  Registering an existing name
+ *  returns the existing metric, so independent modules (or multiple
+ *  instances of a module) can share metrics.  All update functions
+ *  accept a NULL metric as a no-op, so a failed registration need not
+ *  be checked on hot paths.
+ */
+
+/** # of shards of a counter or histogram */
+enum { N_COUNTER_SHARDS = 8, N_HISTOGRAM_SHARDS = 4 };
+
+/** A histogram records values < 2^HISTOGRAM_SUB_BITS exactly; larger
+ *  values fall in buckets 2^(k - HISTOGRAM_SUB_BITS + 1) wide for a
+ *  value with its most significant bit at position k, so percentiles
+ *  are accurate to within 1 part in 2^(HISTOGRAM_SUB_BITS - 1).
+ *  Values >= 2^HISTOGRAM_MAX_BITS are all counted in the last bucket.
+ */
+enum {
+  HISTOGRAM_SUB_BITS = 6,
+  HISTOGRAM_MAX_BITS = 40,      //~18 minutes when recording nanos
+  N_HISTOGRAM_BUCKETS =
+    (HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 2) << (HISTOGRAM_SUB_BITS - 1),
+};
+
+// clients responsible for allocation/deallocation of the following
+// structs unless obtained from a Metrics registry.  Each must be
+// initialized by its init_*() function.  Note that clients should
+// regard the insides of these structs as private.
+
+typedef struct {
+  struct {
+    alignas(CACHE_LINE_SIZE) atomic_uint_fast64_t value;
+  } shards[N_COUNTER_SHARDS];
+} Counter;
+
+typedef struct {
+  alignas(CACHE_LINE_SIZE) atomic_int_fast64_t value;
+} Gauge;
+
+typedef struct {
+  struct {
+    alignas(CACHE_LINE_SIZE) atomic_uint_fast64_t count;
+    atomic_uint_fast64_t sum;
+    atomic_uint_fast64_t notMin;        /** ~min, so 0 is empty */
+    atomic_uint_fast64_t max;
+    atomic_uint_fast64_t buckets[N_HISTOGRAM_BUCKETS];
+  } shards[N_HISTOGRAM_SHARDS];
+} Histogram;
+
+/** a point-in-time copy of a histogram; clients may read the fields
+ *  other than buckets[].
+ */
+typedef struct {
+  uint64_t count;       /** # of values recorded */
+  uint64_t sum;         /** sum of all values */
+  uint64_t min;         /** smallest value; UINT64_MAX if count == 0 */
+  uint64_t max;         /** largest value; 0 if count == 0 */
+  uint64_t buckets[N_HISTOGRAM_BUCKETS];
+} HistogramSnapshot;
+
+/** initialize counter to 0.
+ *
+ *  No error return.
+ */
+void init_counter(Counter *counter);
+
+/** add n to counter; a NOP if counter is NULL.
+ *
+ *  No error return.
+ */
+void add_counter(Counter *counter, uint64_t n);
+
+/** return current value of counter; 0 if counter is NULL.
+ *
+ *  No error return.
+ */
+uint64_t value_counter(const Counter *counter);
+
+/** initialize gauge to 0.
+ *
+ *  No error return.
+ */
+void init_gauge(Gauge *gauge);
+
+/** set gauge to value; a NOP if gauge is NULL.
+ *
+ *  No error return.
+ */
+void set_gauge(Gauge *gauge, int64_t value);
+
+/** add delta (which may be negative) to gauge; a NOP if gauge is NULL.
+ *
+ *  No error return.
+ */
+void add_gauge(Gauge *gauge, int64_t delta);
+
+/** return current value of gauge; 0 if gauge is NULL.
+ *
+ *  No error return.
+ */
+int64_t value_gauge(const Gauge *gauge);
+
+/** initialize histogram to empty.
+ *
+ *  No error return.
+ */
+void init_histogram(Histogram *histogram);
+
+/** record value in histogram; a NOP if histogram is NULL.
+ *
+ *  No error return.
+ */
+void record_histogram(Histogram *histogram, uint64_t value);
+
+/** set *snapshot to the current contents of histogram, merged over all
+ *  shards.  Values recorded concurrently may or may not be included.
+ *
+ *  No error return.
+ */
+void snapshot_histogram(const Histogram *histogram,
+                        HistogramSnapshot *snapshot);
+
+/** initialize snapshot to an empty histogram.
+ *
+ *  No error return.
+ */
+void init_histogram_snapshot(HistogramSnapshot *snapshot);
+
+/** merge the values of src into dest.
+ *
+ *  No error return.
+ */
+void merge_histogram_snapshot(HistogramSnapshot *dest,
+                              const HistogramSnapshot *src);
+
+/** return the value at percentile p (0 <= p <= 100) of snapshot: the
+ *  largest value in the bucket which contains the p'th percentile,
+ *  limited to [min, max].  Returns 0 if snapshot is empty.
+ *
+ *  No error return.
+ */
+uint64_t percentile_histogram_snapshot(const HistogramSnapshot *snapshot,
+                                       double p);
+
+/** add the counts in snapshot to buckets[nBuckets], where buckets[i]
+ *  counts values in [2^i, 2^(i+1)), with buckets[0] also counting 0
+ *  and buckets[nBuckets - 1] also counting all larger values.
+ *
+ *  No error return.
+ */
+void log2_histogram_snapshot(const HistogramSnapshot *snapshot,
+                             size_t nBuckets, uint64_t buckets[nBuckets]);
+
+
+/** type of a registered metric */
+typedef enum { COUNTER_METRIC, GAUGE_METRIC, HISTOGRAM_METRIC } MetricType;
+
+typedef struct _Metric Metric;
+
+// clients responsible for allocation/deallocation of this structure.
+// note that clients should regard the insides of this struct as
+// private.
+typedef struct {
+  pthread_mutex_t lock;         /** protects registration */
+  Metric *metrics;              /** list in registration order */
+  Metric **last;                /** next field of last metric */
+} Metrics;
+
+/** routines which return int use the return value to indicate the
+ *  error status.  0 if everything okay, non-zero for an allocation
+ *  or I/O error.
+ */
+
+/** initialize an empty registry */
+int init_metrics(Metrics *metrics);
+
+/** free registry and all metrics registered in it.  Does not free the
+ *  metrics structure itself.
+ *
+ *  No error return.
+ */
+void free_metrics(Metrics *metrics);
+
+/** return process-wide registry, which is never freed; NULL on an
+ *  allocation error.
+ */
+Metrics *global_metrics(void);
+
+/** return counter registered in metrics under name, registering a new
+ *  counter with help text help if there is none.  Returns NULL if
+ *  metrics is NULL, name is registered with a different type, or on
+ *  an allocation error.
+ */
+Counter *counter_metrics(Metrics *metrics, const char *name,
+                         const char *help);
+
+/** like counter_metrics(), but for a gauge */
+Gauge *gauge_metrics(Metrics *metrics, const char *name, const char *help);
+
+/** like counter_metrics(), but for a histogram */
+Histogram *histogram_metrics(Metrics *metrics, const char *name,
+                             const char *help);
+
+/** write all metrics in metrics to out in the Prometheus text format,
+ *  with each histogram written as a summary with its count, sum and
+ *  0.5, 0.9, 0.99, 0.999 and 1 quantiles.
+ */
+int dump_metrics(Metrics *metrics, FILE *out);
+
+#endif //#ifndef METRICS_H_
@@ -0,0 +1,141 @@
+#ifndef SLAB_H_
+#define SLAB_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+/** Slab allocation of fixed-size objects.  A SlabPool carves objects
+ *  of a single size out of large slabs obtained from malloc(), and
+ *  recycles freed objects for later allocations of the same size
+ *  rather than returning them to malloc(), so that churn of
+ *  short-lived objects neither calls malloc() nor fragments its
+ *  heap.  Slabs are only released when the pool is freed.
+ *
+ *  Each thread using a pool has a small magazine of free objects from
+ *  which it allocates and to which it frees without locking; the pool
+ *  is locked only to move a batch of objects between a magazine and
+ *  the pool.  An object may be freed by a thread other than the one
+ *  which allocated it.
+ *
+ *  A SlabAllocator is a set of pools for a range of size classes;
+ *  requests larger than the largest class are passed on to malloc().
+ */
+
+/** routines which return int use the return value to indicate the
+ *  error status.  0 if everything okay, non-zero for an allocation
+ *  error.
+ */
+
+/** allocation statistics */
+typedef struct {
+  size_t nSlabs;         /** # of slabs malloc()'d */
+  size_t nSlabBytes;     /** total size of slabs */
+  size_t nAllocs;        /** # of objects allocated */
+  size_t nFrees;         /** # of objects freed */
+  size_t nInUse;         /** # of objects currently allocated */
+  size_t nLarge;         /** # of allocations passed on to malloc() */
+} SlabStats;
+
+typedef struct _SlabMagazine SlabMagazine;
+
+// clients responsible for allocation/deallocation of this structure.
+// note that clients should regard the insides of this struct as
+// private.
+typedef struct {
+  size_t objSize;            /** size of each object */
+  size_t nObjsPerSlab;       /** # of objects in each slab */
+  pthread_key_t key;         /** key for calling thread's magazine */
+  pthread_mutex_t lock;      /** protects all fields below */
+  void *freeObjs;            /** list of free objects not in magazines */
+  void *slabs;               /** list of all slabs */
+  SlabMagazine *magazines;   /** list of all magazines */
+  size_t nSlabs;             /** # of slabs */
+  atomic_size_t nAllocs;     /** # of allocations by exited threads */
+  atomic_size_t nFrees;      /** # of frees by exited threads */
+} SlabPool;
+
+/** initialize pool for objects of objSize bytes.  Objects are
+ *  aligned to alignof(max_align_t).
+ */
+int init_slab_pool(SlabPool *pool, size_t objSize);
+
+/** free all memory used by pool, including all objects allocated from
+ *  it.  *MUST* be called when pool is no longer needed, and only when
+ *  no other thread is using it.  Does not free the pool structure
+ *  itself.
+ *
+ *  No error return.
+ */
+void free_slab_pool(SlabPool *pool);
+
+/** return an object from pool; NULL on an allocation error */
+void *alloc_slab_pool(SlabPool *pool);
+
+/** return obj, which must have been allocated from pool, to pool.
+ *
+ *  No error return.
+ */
+void dealloc_slab_pool(SlabPool *pool, void *obj);
+
+/** set *stats to statistics for pool.  Counts maintained by other
+ *  threads may be slightly out of date.
+ *
+ *  No error return.
+ */
+void stats_slab_pool(SlabPool *pool, SlabStats *stats);
+
+
+/** size classes of a SlabAllocator; each is 1.5x or 2x the previous */
+#define SLAB_SIZE_CLASSES \
+  16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048
+enum { N_SLAB_SIZE_CLASSES = 14 };
+
+/** largest size allocated from a slab by a SlabAllocator */
+enum { MAX_SLAB_SIZE_CLASS = 2048 };
+
+// clients responsible for allocation/deallocation of this structure.
+// note that clients should regard the insides of this struct as
+// private.
+typedef struct {
+  SlabPool pools[N_SLAB_SIZE_CLASSES];
+  atomic_size_t nLarge;      /** # of allocations passed to malloc() */
+} SlabAllocator;
+
+/** initialize allocator.  No memory is allocated until the first
+ *  allocation.
+ */
+int init_slab_allocator(SlabAllocator *allocator);
+
+/** free all memory used by allocator, including all objects allocated
+ *  from its pools, but not objects larger than MAX_SLAB_SIZE_CLASS.
+ *  *MUST* be called when allocator is no longer needed, and only when
+ *  no other thread is using it.  Does not free the allocator
+ *  structure itself.
+ *
+ *  No error return.
+ */
+void free_slab_allocator(SlabAllocator *allocator);
+
+/** return size bytes from the pool for the smallest size class which
+ *  can hold size, or from malloc() if size > MAX_SLAB_SIZE_CLASS.
+ *  NULL on an allocation error.
+ */
+void *alloc_slab_allocator(SlabAllocator *allocator, size_t size);
+
+/** return ptr, which must have been returned by
+ *  alloc_slab_allocator() for the same size, to allocator.  ptr may
+ *  be NULL.
+ *
+ *  No error return.
+ */
+void dealloc_slab_allocator(SlabAllocator *allocator, void *ptr, size_t size);
+
+/** set *stats to the sum of the statistics for all pools in
+ *  allocator, together with the # of large allocations.
+ *
+ *  No error return.
+ */
+void stats_slab_allocator(SlabAllocator *allocator, SlabStats *stats);
+
+#endif //#ifndef SLAB_H_
@@ -1,7 +1,13 @@
 #ifndef VECTOR_H_
 #define VECTOR_H_
 
+#include "arena.h"
+
+#include <assert.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 /** dynamically grown vector of arbitrary sized elements */
 
@@ -12,13 +18,21 @@ typedef struct {
   size_t len;
   size_t elementSize;
   size_t capacity;
-  void **elements;      //dynamically managed by this module
+  char *elements;       //dynamically managed by this module
+  Arena *arena;         //if non-NULL, elements allocated from arena
 } Vector;
 
 
 /** initialize vec to store elements of size elementSize.  No error return */
 void init_vector(Vector *vec, size_t elementSize);
 
+/** initialize vec as for init_vector(), but to allocate its elements
+ *  from arena rather than using malloc().  The elements are released
+ *  when arena is reset or rewound, so free_vector() is optional.
+ *  No error return.
+ */
+void init_vector_with_arena(Vector *vec, size_t elementSize, Arena *arena);
+
 /** clear out vec */
 void clear_vector(Vector *vec);
 
@@ -47,4 +61,153 @@ int get_element_vector(const Vector *vec, size_t index, void *element);
 /** return base of vector[n_elements].  Valid only while no elements added */
 void *get_base_vector(const Vector *vec);
 
+
+/************************** Typed Vectors ******************************/
+
+/** DEFINE_VECTOR(Name, T, inlineN) defines a vector type Name of
+ *  elements of type T, where T must be usable as a declarator prefix
+ *  (a scalar, pointer, struct or typedef name), together with the
+ *  following static inline functions:
+ *
+ *    void init_Name(Name *vec);
+ *    void init_Name_with_arena(Name *vec, Arena *arena);
+ *    void free_Name(Name *vec);
+ *    void clear_Name(Name *vec);
+ *    int reserve_Name(Name *vec, size_t n);
+ *    int shrink_Name(Name *vec);
+ *    int add_Name(Name *vec, T element);
+ *    size_t n_elements_Name(const Name *vec);
+ *    T get_Name(const Name *vec, size_t index);
+ *    T *get_base_Name(const Name *vec);
+ *
+ *  Unlike Vector, elements are stored and copied with their static
+ *  type, and the first inlineN (> 0) elements are stored within the
+ *  Name struct itself, so that short vectors do no allocation at all.
+ *  Since elements may point into the struct, a Name must not be
+ *  copied or moved by the client once initialized.
+ *
+ *  The routines returning int return 0 if ok, non-zero on an
+ *  allocation error, in which case vec is unchanged.
+ *
+ *  The pointer returned by get_base_Name() is a view of
+ *  vec[n_elements] which remains valid while elements are added as
+ *  long as the vector does not grow beyond its capacity; after a
+ *  successful reserve_Name(vec, n), the view is stable until the
+ *  vector holds more than n elements, or is shrunk, cleared by
+ *  free_Name() or its arena is rewound.
+ */
+#define DEFINE_VECTOR(Name, T, inlineN)                                 \
+  /* clients should regard the insides of this struct as private */    \
+  typedef struct {                                                      \
+    size_t len;                                                         \
+    size_t capacity;                                                    \
+    T *elements;          /* inlineElements or dynamically allocated */ \
+    Arena *arena;         /* if non-NULL, elements allocated from it */ \
+    T inlineElements[inlineN];                                          \
+  } Name;                                                               \
+                                                                        \
+  /* initialize vec to allocate from arena rather than using malloc() */ \
+  static inline void                                                    \
+  init_##Name##_with_arena(Name *vec, Arena *arena)                     \
+  {                                                                     \
+    vec->len = 0; vec->capacity = (inlineN);                            \
+    vec->elements = vec->inlineElements; vec->arena = arena;            \
+  }                                                                     \
+                                                                        \
+  static inline void                                                    \
+  init_##Name(Name *vec)                                                \
+  {                                                                     \
+    init_##Name##_with_arena(vec, NULL);                                \
+  }                                                                     \
+                                                                        \
+  static inline void                                                    \
+  free_##Name(Name *vec)                                                \
+  {                                                                     \
+    if (vec->elements != vec->inlineElements && !vec->arena) {          \
+      free(vec->elements);                                              \
+    }                                                                   \
+    init_##Name(vec);                                                   \
+  }                                                                     \
+                                                                        \
+  static inline void                                                    \
+  clear_##Name(Name *vec)                                               \
+  {                                                                     \
+    vec->len = 0;                                                       \
+  }                                                                     \
+                                                                        \
+  /* ensure vec has capacity for at least n elements */                 \
+  static inline int                                                     \
+  reserve_##Name(Name *vec, size_t n)                                   \
+  {                                                                     \
+    if (n <= vec->capacity) return 0;                                   \
+    if (n > SIZE_MAX / sizeof(T)) return 1;                             \
+    T *p;                                                               \
+    if (vec->elements == vec->inlineElements) {                         \
+      p = vec->arena                                                    \
+        ? alloc_arena(vec->arena, n * sizeof(T))                        \
+        : malloc(n * sizeof(T));                                        \
+      if (p) memcpy(p, vec->elements, vec->len * sizeof(T));            \
+    }                                                                   \
+    else {                                                              \
+      p = vec->arena                                                    \
+        ? realloc_arena(vec->arena, vec->elements,                      \
+                        vec->capacity * sizeof(T), n * sizeof(T))       \
+        : realloc(vec->elements, n * sizeof(T));                        \
+    }                                                                   \
+    if (!p) return 1;                                                   \
+    vec->elements = p; vec->capacity = n;                               \
+    return 0;                                                           \
+  }                                                                     \
+                                                                        \
+  /* reduce capacity of vec to its # of elements, moving them back */   \
+  /* into the inline buffer if they fit */                              \
+  static inline int                                                     \
+  shrink_##Name(Name *vec)                                              \
+  {                                                                     \
+    if (vec->elements == vec->inlineElements) return 0;                 \
+    if (vec->len <= (inlineN)) {                                        \
+      memcpy(vec->inlineElements, vec->elements, vec->len * sizeof(T)); \
+      if (!vec->arena) free(vec->elements);                             \
+      vec->elements = vec->inlineElements; vec->capacity = (inlineN);   \
+      return 0;                                                         \
+    }                                                                   \
+    T *p = vec->arena                                                   \
+      ? realloc_arena(vec->arena, vec->elements,                        \
+                      vec->capacity * sizeof(T), vec->len * sizeof(T))  \
+      : realloc(vec->elements, vec->len * sizeof(T));                   \
+    if (!p) return 1;                                                   \
+    vec->elements = p; vec->capacity = vec->len;                        \
+    return 0;                                                           \
+  }                                                                     \
+                                                                        \
+  static inline int                                                     \
+  add_##Name(Name *vec, T element)                                      \
+  {                                                                     \
+    if (vec->len == vec->capacity &&                                    \
+        reserve_##Name(vec, 2 * vec->capacity) != 0) {                  \
+      return 1;                                                         \
+    }                                                                   \
+    vec->elements[vec->len++] = element;                                \
+    return 0;                                                           \
+  }                                                                     \
+                                                                        \
+  static inline size_t                                                  \
+  n_elements_##Name(const Name *vec)                                    \
+  {                                                                     \
+    return vec->len;                                                    \
+  }                                                                     \
+                                                                        \
+  static inline T                                                       \
+  get_##Name(const Name *vec, size_t index)                             \
+  {                                                                     \
+    assert(index < vec->len);                                           \
+    return vec->elements[index];                                        \
+  }                                                                     \
+                                                                        \
+  static inline T *                                                     \
+  get_base_##Name(const Name *vec)                                      \
+  {                                                                     \
+    return vec->elements;                                               \
+  }
+
 #endif //#ifndef VECTOR_H_
@@ -2,6 +2,9 @@
 
 #include "errnum.h"
 
+#include <slab.h>
+#include <str-map.h>
+
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,10 +13,19 @@
 #include <trace.h>
 
 //node in singly-linked list
-struct _Chat {
-  MsgInfo info;
-  struct _Chat *next;
+typedef struct _ChatNode {
+  MsgInfo info;  //must be first, as query_chat() returns &node->info
+  struct _ChatNode *next;
+  size_t size;   //size of this node, needed to return it to nodes
   char mem[]; //storage for strings in info: user, room, msg, topics
+} ChatNode;
+
+struct _Chat {
+  ChatNode *chats;    //most recent first
+  SlabAllocator nodes;  //allocator for chats; avoids a malloc() per chat
+  StrMap rooms;       //case-insensitive set of rooms in chats
+  StrMap topics;      //case-insensitive set of topics in chats
+  StrMap addTopics;   //scratch for de-duplicating topics in add_chat()
 };
 
 /** copy NUL-terminated string from src to dest, converting it to
@@ -36,23 +48,56 @@ stpcpy_lc(char *dest, char *src)
 Chat *
 make_chat(ErrNum *err) {
   Chat *chat = calloc(1, sizeof(Chat));
+  if (chat && init_slab_allocator(&chat->nodes) != 0) {
+    free(chat); chat = NULL;
+  }
   *err = chat ? NO_ERR :  MEM_ERR;
+  if (chat) {
+    init_str_map(&chat->rooms, true);
+    init_str_map(&chat->topics, true);
+    init_str_map(&chat->addTopics, true);
+  }
   return chat;
 }
 
 /** free previously created chat instance */
 void
 free_chat(Chat *chat) {
-  Chat *p1;
-  for (Chat *p = chat->next; p != NULL; p = p1) {
+  ChatNode *p1;
+  for (ChatNode *p = chat->chats; p != NULL; p = p1) {
     p1 = p->next;
-    free(p);
+    dealloc_slab_allocator(&chat->nodes, p, p->size);
   }
+  free_slab_allocator(&chat->nodes);
+  free_str_map(&chat->rooms);
+  free_str_map(&chat->topics);
+  free_str_map(&chat->addTopics);
   free(chat);
 }
 
+/** add key to set unless already present, using newChat as its value
+ *  so that it can be identified by remove_new_keys().
+ */
+static int
+add_new_key(StrMap *set, const char *key, ChatNode *newChat)
+{
+  const uint64_t hash = hash_str_map(set, key);
+  if (get_hashed_str_map(set, key, hash, NULL)) return 0;
+  return put_hashed_str_map(set, key, hash, newChat);
+}
+
+/** remove key from set if it was added by add_new_key() for newChat */
+static void
+remove_new_key(StrMap *set, const char *key, ChatNode *newChat)
+{
+  void *value;
+  if (get_str_map(set, key, &value) && value == newChat) {
+    remove_str_map(set, key);
+  }
+}
+
 /** extract and add fields from add to chat */
-// link in new Chat node at head of chat list
+// link in new ChatNode at head of chat list
 void
 add_chat(Chat *chat, const MsgArgs *add, ErrNum *err)
 {
@@ -63,38 +108,50 @@ add_chat(Chat *chat, const MsgArgs *add, ErrNum *err)
     size_mem += strlen(add->args[i]) + 1;
   }
   size_mem += strlen(add->msg) + 1;
-  Chat *newChat = malloc(sizeof(Chat) + size_mem);
+  const size_t size = sizeof(ChatNode) + size_mem;
+  ChatNode *newChat = alloc_slab_allocator(&chat->nodes, size);
   if (!newChat) {
     *err = MEM_ERR;
     return;
   }
-  newChat->next = chat->next; chat->next = newChat;
+  newChat->size = size;
   char *p = newChat->mem;
   newChat->info.user = p;  p = stpcpy_lc(p, add->args[1]) + 1;
   newChat->info.room = p;  p = stpcpy_lc(p, add->args[2]) + 1;
   newChat->info.msg = p; p = stpcpy(p, add->msg) + 1;
   newChat->info.topics = p;
   size_t nTopics = 0;
-  char *p0 = p;
-  for (int i = 3; i < add->nArgs; i++) {
+  StrMap *addTopics = &chat->addTopics;
+  clear_str_map(addTopics);
+  bool isOk = add_new_key(&chat->rooms, newChat->info.room, newChat) == 0;
+  for (int i = 3; isOk && i < add->nArgs; i++) {
     char *topic = add->args[i];
-    int j;
-    char *p1 = p0;
-    for (j = 0; j < nTopics; j++) {
-      if (strcasecmp(topic, p1) == 0) break;
-      p1 += strlen(p1) + 1;
-    }
-    if (j == nTopics) { //new topic
-      p = stpcpy_lc(p, topic) + 1; nTopics++;
-    }
+    const uint64_t hash = hash_str_map(addTopics, topic);
+    if (get_hashed_str_map(addTopics, topic, hash, NULL)) continue;
+    const char *copy = p;
+    p = stpcpy_lc(p, topic) + 1; nTopics++;
+    isOk = put_hashed_str_map(addTopics, topic, hash, NULL) == 0 &&
+      add_new_key(&chat->topics, copy, newChat) == 0;
   }
   newChat->info.nTopics = nTopics;
+  if (!isOk) {
+    //undo additions to known rooms and topics which refer to newChat
+    remove_new_key(&chat->rooms, newChat->info.room, newChat);
+    const char *t = newChat->info.topics;
+    for (size_t i = 0; i < nTopics; i++, t += strlen(t) + 1) {
+      remove_new_key(&chat->topics, t, newChat);
+    }
+    dealloc_slab_allocator(&chat->nodes, newChat, size);
+    *err = MEM_ERR;
+    return;
+  }
+  newChat->next = chat->chats; chat->chats = newChat;
   TRACE("added chat with %zu topics", nTopics);
 }
 
 
 static bool
-has_topic(const Chat *chat, const char *topic)
+has_topic(const ChatNode *chat, const char *topic)
 {
   const char *p = chat->info.topics;
   for (int i = 0; i < chat->info.nTopics; i++) {
@@ -105,7 +162,7 @@ has_topic(const Chat *chat, const char *topic)
 }
 
 static bool
-chat_match(const Chat *chat, const MsgArgs *query) {
+chat_match(const ChatNode *chat, const MsgArgs *query) {
   if (strcasecmp(chat->info.room, query->args[1]) != 0) return false;
   for (int i = (query->args[2][0] == '#') ? 2 : 3; i < query->nArgs; i++) {
     const char *topic = query->args[i];
@@ -119,8 +176,8 @@ chat_match(const Chat *chat, const MsgArgs *query) {
 MsgInfo *
 query_chat(const Chat *chat, const MsgArgs *query, const MsgInfo *lastMatch)
 {
-  const Chat* lastMatch1 = (const Chat *)lastMatch;
-  for (Chat *p = (lastMatch1) ? lastMatch1->next : chat->next;
+  const ChatNode* lastMatch1 = (const ChatNode *)lastMatch;
+  for (ChatNode *p = (lastMatch1) ? lastMatch1->next : chat->chats;
        p != NULL;
        p = p->next) {
     if (chat_match(p, query)) return &p->info;
@@ -131,17 +188,11 @@ query_chat(const Chat *chat, const MsgArgs *query, const MsgInfo *lastMatch)
 bool
 is_known_room(const Chat *chat, const char* room)
 {
-  for (const Chat *p = chat->next; p != NULL; p = p->next) {
-    if (strcasecmp(p->info.room, room) == 0) return true;
-  }
-  return false;
+  return get_str_map(&chat->rooms, room, NULL);
 }
 
 bool
 is_known_topic(const Chat *chat, const char *topic)
 {
-  for (const Chat *p = chat->next; p != NULL; p = p->next) {
-    if (has_topic(p, topic)) return true;
-  }
-  return false;
+  return get_str_map(&chat->topics, topic, NULL);
 }
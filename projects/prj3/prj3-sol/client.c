@@ -123,6 +123,12 @@ do_client_cmd(Client *client, const ChatCmd *cmd)
     receive_res(client);
     break;
   case QUERY_CMD:
+    if (cmd->query.nRooms > 1) {
+      fprintf(client->err,
+              ERROR "BAD_COMMAND: multi-room query not supported\n");
+      fflush(client->err);
+      break;
+    }
     send_query_req(client, &cmd->query);
     receive_res(client);
     break;
@@ -131,6 +137,10 @@ do_client_cmd(Client *client, const ChatCmd *cmd)
     write_header(&hdr, client->serverOut);
     break;
   }
+  case STATS_CMD:
+    fprintf(client->err, ERROR "BAD_COMMAND: stats command not supported\n");
+    fflush(client->err);
+    break;
   default:
     assert(0);
   }
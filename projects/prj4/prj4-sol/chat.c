@@ -246,6 +246,11 @@ do_chat_cmd(Chat *chat, const ChatCmd *cmd)
     receive_res(shm, out, err);
     break;
   case QUERY_CMD:
+    if (cmd->query.nRooms > 1) {
+      fprintf(err, ERROR "BAD_COMMAND: multi-room query not supported\n");
+      fflush(err);
+      break;
+    }
     send_query_req(shm, &cmd->query);
     receive_res(shm, out, err);
     break;
@@ -262,6 +267,10 @@ do_chat_cmd(Chat *chat, const ChatCmd *cmd)
       }
       break;
     }
+  case STATS_CMD:
+    fprintf(err, ERROR "BAD_COMMAND: stats command not supported\n");
+    fflush(err);
+    break;
   default:
     assert(0);
   }
@@ -97,7 +97,9 @@ static void
 send_query_req(Chat *chat, const QueryCmd *cmd)
 {
   size_t nBytes = 0;
-  nBytes += (strlen(cmd->room) + 1);
+  for (int i = 0; i < cmd->nRooms; i++) {
+    nBytes += strlen(cmd->rooms[i]) + 1;  //' ' or NUL terminator
+  }
   for (int i = 0; i < cmd->nTopics; i++) {
     nBytes += strlen(cmd->topics[i]) + 1;
   }
@@ -110,13 +112,36 @@ send_query_req(Chat *chat, const QueryCmd *cmd)
   };
   FILE *out = chat->serverOut;
   if (write_header(&hdr, out) != 0) fatal("send_query_req(): write header:");
-  fwrite(cmd->room, 1, strlen(cmd->room)+1, out);
+  //rooms separated by ' ' in a single NUL-terminated string
+  for (int i = 0; i < cmd->nRooms; i++) {
+    fwrite(cmd->rooms[i], 1, strlen(cmd->rooms[i]), out);
+    fputc(i == cmd->nRooms - 1 ? '\0' : ' ', out);
+  }
   for (int i = 0; i < cmd->nTopics; i++) {
     fwrite(cmd->topics[i], 1, strlen(cmd->topics[i])+1, out);
   }
   fflush(out);
 }
 
+/** send params for stats cmd to remote server specified by chat,
+ *  as per protocol.
+ */
+static void
+send_stats_req(Chat *chat, const StatsCmd *cmd)
+{
+  Hdr hdr = {
+    .hdrType = CLIENT_HDR,
+    .cmdType = STATS_CMD,
+    .count = cmd->count,
+    .nTopics = 0,
+    .nBytes = strlen(cmd->room) + 1,
+  };
+  FILE *out = chat->serverOut;
+  if (write_header(&hdr, out) != 0) fatal("send_stats_req(): write header:");
+  fwrite(cmd->room, 1, strlen(cmd->room)+1, out);
+  fflush(out);
+}
+
 /** receive response from remote server as per protocol, copying
  *  response onto appropriate chat stream: out if response was okay,
  *  err if response was in error.
@@ -189,6 +214,9 @@ do_chat_cmd(Chat *chat, const ChatCmd *cmd)
   case QUERY_CMD:
     send_query_req(chat, &cmd->query);
     break;
+  case STATS_CMD:
+    send_stats_req(chat, &cmd->stats);
+    break;
   case END_CMD: {
     Hdr hdr = { .hdrType = CLIENT_HDR, .cmdType = END_CMD };
     if (write_header(&hdr, chat->serverOut) != 0) {
@@ -26,7 +26,7 @@ typedef struct {
   union {
     struct {          // type == CLIENT_HDR
       CmdType cmdType;// ADD_CMD, QUERY_CMD, END_CMD or INIT_CMD
-      int count;      // count for QUERY requests, not used for other requests
+      int count;      // count for QUERY/STATS requests, not used for others
       size_t nTopics; // # of topics
     };
     struct {          // type == SERVER_HDR
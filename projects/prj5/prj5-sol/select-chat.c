@@ -6,6 +6,8 @@
 #include <msgargs.h>
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -33,7 +35,7 @@ struct _Chat {
   const char *user;
   const char *room;
   const char *prompt;
-  MsgArgs *msgArgs;
+  MsgArgsParser *parser; //for commands read from in
 };
 
 // prefix for all error messages
@@ -100,7 +102,9 @@ static void
 send_query_req(Chat *chat, const QueryCmd *cmd)
 {
   size_t nBytes = 0;
-  nBytes += (strlen(cmd->room) + 1);
+  for (int i = 0; i < cmd->nRooms; i++) {
+    nBytes += strlen(cmd->rooms[i]) + 1;  //' ' or NUL terminator
+  }
   for (int i = 0; i < cmd->nTopics; i++) {
     nBytes += strlen(cmd->topics[i]) + 1;
   }
@@ -113,13 +117,36 @@ send_query_req(Chat *chat, const QueryCmd *cmd)
   };
   FILE *out = chat->serverOut;
   if (write_header(&hdr, out) != 0) fatal("send_query_req(): write header:");
-  fwrite(cmd->room, 1, strlen(cmd->room)+1, out);
+  //rooms separated by ' ' in a single NUL-terminated string
+  for (int i = 0; i < cmd->nRooms; i++) {
+    fwrite(cmd->rooms[i], 1, strlen(cmd->rooms[i]), out);
+    fputc(i == cmd->nRooms - 1 ? '\0' : ' ', out);
+  }
   for (int i = 0; i < cmd->nTopics; i++) {
     fwrite(cmd->topics[i], 1, strlen(cmd->topics[i])+1, out);
   }
   fflush(out);
 }
 
+/** send params for stats cmd to remote server specified by chat,
+ *  as per protocol.
+ */
+static void
+send_stats_req(Chat *chat, const StatsCmd *cmd)
+{
+  Hdr hdr = {
+    .hdrType = CLIENT_HDR,
+    .cmdType = STATS_CMD,
+    .count = cmd->count,
+    .nTopics = 0,
+    .nBytes = strlen(cmd->room) + 1,
+  };
+  FILE *out = chat->serverOut;
+  if (write_header(&hdr, out) != 0) fatal("send_stats_req(): write header:");
+  fwrite(cmd->room, 1, strlen(cmd->room)+1, out);
+  fflush(out);
+}
+
 /** receive response from remote server as per protocol, copying
  *  response onto appropriate chat stream: out if response was okay,
  *  err if response was in error.
@@ -181,6 +208,9 @@ do_chat_cmd(Chat *chat, const ChatCmd *cmd)
   case QUERY_CMD:
     send_query_req(chat, &cmd->query);
     break;
+  case STATS_CMD:
+    send_stats_req(chat, &cmd->stats);
+    break;
   case END_CMD: {
     Hdr hdr = { .hdrType = CLIENT_HDR, .cmdType = END_CMD };
     if (write_header(&hdr, chat->serverOut) != 0) {
@@ -213,26 +243,67 @@ make_client_sock(const char *host, int port)
   return s;
 }
 
+/** parse msgArgs and perform the resulting command */
+static void
+do_msg_args(Chat *chat, const MsgArgs *msgArgs)
+{
+  ChatCmd cmd;
+  int rc = parse_loggedin_cmd(msgArgs, chat->user, chat->room, &cmd,
+                              chat->err);
+  if (rc == 0) do_chat_cmd(chat, &cmd);
+  fprintf(chat->out, "%s", chat->prompt); fflush(chat->out);
+}
+
+/** read whatever input is available on chat->in without blocking and
+ *  perform all commands completed by it.  Return true on EOF.
+ */
 static bool
 do_read(Chat *chat)
 {
+  enum { READ_SIZE = 4096 };
+  char bytes[READ_SIZE];
   ErrNum errNum;
-  ChatCmd cmd;
-  chat->msgArgs = read_line_args(chat->in, chat->msgArgs, &errNum);
-  if (chat->msgArgs != NULL) {
-    if (errNum != NO_ERR) { fatal("%s", errnum_to_string(errNum)); }
-    int rc = parse_loggedin_cmd(chat->msgArgs, chat->user, chat->room, &cmd,
-                                chat->err);
-    if (rc == 0) do_chat_cmd(chat, &cmd);
-    fprintf(chat->out, "%s", chat->prompt); fflush(chat->out);
-    return false;
+  //read() returns available input rather than waiting for a full line
+  ssize_t n;
+  do {
+    n = read(fileno(chat->in), bytes, sizeof(bytes));
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) fatal("cannot read input:");
+  for (size_t nConsumed, i = 0; i < n; i += nConsumed) {
+    const MsgArgs *msgArgs =
+      push_msg_args_parser(chat->parser, &bytes[i], n - i, &nConsumed, &errNum);
+    if (errNum != NO_ERR) fatal("%s", errnum_to_string(errNum));
+    if (msgArgs) do_msg_args(chat, msgArgs);
   }
-  else {
-    // send END_CMD
-    cmd.type = END_CMD;
-    do_chat_cmd(chat, &cmd);
-    return true;
+  if (n > 0) return false;
+  const MsgArgs *msgArgs = end_msg_args_parser(chat->parser, &errNum);
+  if (errNum != NO_ERR) fatal("%s", errnum_to_string(errNum));
+  if (msgArgs) do_msg_args(chat, msgArgs);
+  // send END_CMD
+  ChatCmd cmd = { .type = END_CMD };
+  do_chat_cmd(chat, &cmd);
+  return true;
+}
+
+/** return true iff input is available on in without blocking: either
+ *  already buffered in in or pending on its descriptor.  Since select()
+ *  only sees the descriptor, this is used to consume responses which
+ *  were read into in's buffer along with an earlier one.
+ */
+static bool
+is_input_ready(FILE *in)
+{
+  const int fd = fileno(in);
+  const int flags = fcntl(fd, F_GETFL);
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  const int c = getc(in);
+  fcntl(fd, F_SETFL, flags);
+  if (c == EOF) {
+    clearerr(in); //EAGAIN or EOF; a real EOF is seen by the next read
+    return false;
   }
+  ungetc(c, in);
+  return true;
 }
 
 #define PROMPT ">> "
@@ -271,9 +342,15 @@ do_chat(const ChatParams *params)
     return "cannot create w-FILE on client socket";
   }
   TRACE("created socket and FILEs");
+  ErrNum errNum;
+  MsgArgsParser *parser = make_msg_args_parser(true, &errNum);
+  if (!parser) {
+    fclose(serverIn);
+    return "cannot create command parser";
+  }
   Chat chatStruct = { .in = params->in, .out = params->out, .err = params->err,
     .serverIn = serverIn, .serverOut = serverOut,
-    .user = params->user, .room = params->room, .msgArgs = NULL,
+    .user = params->user, .room = params->room, .parser = parser,
     .prompt = PROMPT,
   };
   Chat *chat = &chatStruct;
@@ -291,7 +368,7 @@ do_chat(const ChatParams *params)
     FD_SET(inFd, &fds);
     int nReady = select(nFds, &fds, NULL, NULL, NULL);
     if (nReady < 0) {
-      error("select:");
+      if (errno != EINTR) error("select:");
     }
     else {
       for (int i = 0; i < nReady; i++) {
@@ -303,7 +380,9 @@ do_chat(const ChatParams *params)
         }
         else if (FD_ISSET(clientSockFd, &fds)) {
           FD_CLR(clientSockFd, &fds);
-          receive_res(chat);
+          do {
+            receive_res(chat);
+          } while (is_input_ready(chat->serverIn));
           continue;
         }
         else {
@@ -312,5 +391,6 @@ do_chat(const ChatParams *params)
       } //for
     } //else nReady >= 0
   }  //while (!isDone)
+  free_msg_args_parser(parser);
   return NULL;
 }
@@ -2,17 +2,24 @@
 
 #include "common.h"
 
+#include <arena.h>
 #include <chat-cmd.h>
 #include <errors.h>
+#include <executor.h>
+#include <interner.h>
+#include <memalloc.h>
+#include <metrics.h>
 
 #include <chat-db.h>
 
-//uncomment next line to turn on tracing; use TRACE() with printf-style args
-//#define DO_TRACE
+//tracing is compiled in, but costs only a branch unless enabled at
+//runtime (see trace.h); use TRACE() with printf-style integer args
+#define DO_TRACE
 #include <trace.h>
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -22,6 +29,7 @@
 #include <netinet/in.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -32,13 +40,50 @@
 
 struct ThreadInfo_;  //forward reference
 
+/** metrics for one kind of command */
+typedef struct {
+  Counter *requests;            //# of requests
+  Histogram *nanos;             //request latencies, including DB work
+} CmdMetrics;
+
+/** server metrics registered in global_metrics(); NULL members are
+ *  NOPs when updated.
+ */
+typedef struct {
+  Gauge *connections;           //# of connected clients
+  Counter *broadcastMsgs;       //# of messages sent to other clients
+  CmdMetrics add;
+  CmdMetrics query;
+  CmdMetrics stats;
+} ServerMetrics;
+
 /** track information about all possible client threads */
 typedef struct {
   pthread_rwlock_t rwlock;
   struct ThreadInfo_ *infoArray;
   int nInfoArray;
+  Interner rooms;               //names of rooms joined by clients
+  Executor *executor;           //runs commands and broadcast sends
+  pthread_mutex_t dbLock;       //serializes commands on the shared chatDb
+  ChatDb **workerDbs;           //[# of executor workers] connections for
+                                //queries; NULL if they use shared chatDb
+  ServerMetrics metrics;
 } AllThreadInfos;
 
+/** roomId of a client which has not yet joined a room */
+enum { NO_ROOM_ID = UINT_MAX };
+
+/** limits on client requests, so that the memory used for a request
+ *  does not depend on what a client sends; a request which exceeds
+ *  them is rejected.
+ */
+enum {
+  MAX_REQUEST_BYTES = 16*1024*1024,  //max # of bytes in a request body
+  MAX_REQUEST_TOPICS = 256,          //max # of topics in a request
+  MAX_QUERY_ROOMS = 256,             //max # of rooms in a QUERY request
+  BROADCAST_CHUNK_SIZE = 4*1024,     //max # of bytes per broadcast write
+};
+
 /** information tracked for each client thread; not all the fields are
  *  necessary but can be useful when debugging.
  */
@@ -52,8 +97,12 @@ typedef struct ThreadInfo_ {
   FILE *in;
   FILE *out;
   //filled in after initialization
-  char *user;
-  char *room;
+  char *user;                   //allocated from arena
+  const char *room;             //interned in allThreadInfos->rooms
+  unsigned roomId;              //id of room in allThreadInfos->rooms
+  Arena arena;                  //reset when the client disconnects, but
+                                //its chunks are retained for the next
+                                //client on the same descriptor
 } ThreadInfo;
 
 typedef struct {
@@ -94,12 +143,15 @@ init_thread_info(ChatDb *chatDb, int clientSockFd,
     .out = out,
     .user = NULL,
     .room = NULL,
+    .roomId = NO_ROOM_ID,
+    .arena = threadInfo->arena,
     .isValid = true,
   };
   if (pthread_rwlock_unlock(&allThreadInfos->rwlock) != 0) {
     error("cannot unlock write lock: %s", strerror(errno));
     goto FAIL;
   }
+  add_gauge(allThreadInfos->metrics.connections, 1);
   return 0;
  FAIL:
   //if we get here with the rwlock, then we must have already failed unlocking!
@@ -113,11 +165,13 @@ cleanup_thread_info(ThreadInfo *threadInfo)
 {
   pthread_rwlock_wrlock(&threadInfo->allThreadInfos->rwlock);
   threadInfo->isValid = false;
-  free(threadInfo->room);
-  free(threadInfo->user);
+  threadInfo->room = threadInfo->user = NULL;
+  threadInfo->roomId = NO_ROOM_ID;
+  reset_arena(&threadInfo->arena);
   fclose(threadInfo->out);
   fclose(threadInfo->in);
   pthread_rwlock_unlock(&threadInfo->allThreadInfos->rwlock);
+  add_gauge(threadInfo->allThreadInfos->metrics.connections, -1);
 }
 
 /********************** Transmission Utilities *************************/
@@ -140,121 +194,269 @@ end_server_response(ChatDb *chatDb, ServerStatus status,
   fflush(out);
 }
 
+/** read the clientHdr->nBytes request body into a NUL-terminated
+ *  buffer *buf which must be released using free_tag().  If the
+ *  request exceeds MAX_REQUEST_BYTES or MAX_REQUEST_TOPICS, then its
+ *  body is discarded without being stored and *buf is set to NULL.
+ *  Return non-zero on error.
+ */
+static int
+read_request_body(const ThreadInfo *server, const Hdr *clientHdr, char **buf)
+{
+  const size_t nBytes = clientHdr->nBytes;
+  if (nBytes > MAX_REQUEST_BYTES || clientHdr->nTopics > MAX_REQUEST_TOPICS) {
+    char discard[BROADCAST_CHUNK_SIZE];
+    for (size_t n = nBytes; n > 0; ) {
+      const size_t chunk = (n < sizeof(discard)) ? n : sizeof(discard);
+      if (fread(discard, 1, chunk, server->in) != chunk) return 1;
+      n -= chunk;
+    }
+    *buf = NULL;
+    return 0;
+  }
+  *buf = malloc_tag(MEM_TAG_MSG, nBytes + 1);
+  if (*buf == NULL) {
+    error("cannot allocate %zu-byte request body", nBytes);
+    return 1;
+  }
+  if (fread(*buf, 1, nBytes, server->in) != nBytes) {
+    free_tag(*buf);
+    return 1;
+  }
+  (*buf)[nBytes] = '\0';
+  return 0;
+}
+
+/** a message sent to clients is the concatenation of its parts */
+typedef struct {
+  const char *text;
+  size_t len;
+} MsgPart;
+
+/** send the message made up of parts[nParts] to client server, writing
+ *  each part in chunks of at most BROADCAST_CHUNK_SIZE bytes, so that
+ *  a large part goes straight to the socket rather than being copied.
+ *  The stream is locked so that the message is not interleaved with a
+ *  response being written for the client.
+ */
 static void
-send_msg(const ThreadInfo *server, const char *msg, size_t msgLen)
+send_msg(const ThreadInfo *server, size_t nParts, const MsgPart parts[nParts])
 {
+  size_t msgLen = 0;
+  for (int i = 0; i < nParts; i++) msgLen += parts[i].len;
   Hdr hdr = { .hdrType = SERVER_HDR, .status = OK_STATUS, .nBytes = msgLen };
+  flockfile(server->out);
   write_header(&hdr, server->out);
-  fwrite(msg, 1, msgLen, server->out);
+  for (int i = 0; i < nParts; i++) {
+    for (size_t j = 0; j < parts[i].len; j += BROADCAST_CHUNK_SIZE) {
+      const size_t n = (parts[i].len - j < BROADCAST_CHUNK_SIZE)
+        ? parts[i].len - j : BROADCAST_CHUNK_SIZE;
+      fwrite(&parts[i].text[j], 1, n, server->out);
+    }
+  }
   end_server_response(server->chatDb, OK_STATUS, NULL, server->out);
+  funlockfile(server->out);
+}
+
+/** a send of a broadcast message to one client, run on the executor */
+typedef struct {
+  const ThreadInfo *client;
+  size_t nParts;
+  const MsgPart *parts;
+  Future future;
+} SendTask;
+
+static void
+do_send_task(void *arg)
+{
+  const SendTask *task = arg;
+  send_msg(task->client, task->nParts, task->parts);
 }
 
+/** send the message made up of parts[nParts] to all other clients in
+ *  the room of the sending client.  The sends are submitted to the
+ *  executor so that they proceed in parallel, and are awaited so that
+ *  parts need only outlive this call.  Must not be called from an
+ *  executor task, since a worker which waited for other tasks could
+ *  deadlock the executor.
+ */
 static void
-broadcast_to_room(const ThreadInfo *server, const char *msg, size_t msgLen)
+broadcast_to_room(const ThreadInfo *server, size_t nParts,
+                  const MsgPart parts[nParts])
 {
-  pthread_rwlock_rdlock(&server->allThreadInfos->rwlock);
-  const char *room = server->room;
-  for (int i = 0; i < server->allThreadInfos->nInfoArray; i++) {
-    const ThreadInfo *p = &server->allThreadInfos->infoArray[i];
-    if (p != server && p->isValid && strcmp(p->room, room) == 0) {
-      send_msg(p, msg, msgLen);
+  AllThreadInfos *allThreadInfos = server->allThreadInfos;
+  assert(!is_worker_executor(allThreadInfos->executor));
+  pthread_rwlock_rdlock(&allThreadInfos->rwlock);
+  SendTask *tasks =
+    calloc_tag(MEM_TAG_MSG, allThreadInfos->nInfoArray, sizeof(SendTask));
+  //room names are interned, so comparing ids suffices
+  const unsigned roomId = server->roomId;
+  uint64_t nSent = 0;
+  size_t nTasks = 0;
+  for (int i = 0; i < allThreadInfos->nInfoArray; i++) {
+    const ThreadInfo *p = &allThreadInfos->infoArray[i];
+    if (p == server || !p->isValid || p->roomId != roomId) continue;
+    nSent++;
+    if (tasks != NULL) {
+      SendTask *task = &tasks[nTasks];
+      *task = (SendTask) { .client = p, .nParts = nParts, .parts = parts };
+      if (init_future(&task->future) == 0) {
+        if (submit_executor(allThreadInfos->executor, do_send_task, task,
+                            &task->future) == 0) {
+          nTasks++;
+          continue;
+        }
+        free_future(&task->future);
+      }
     }
+    send_msg(p, nParts, parts);  //send directly if it cannot be submitted
   }
-  pthread_rwlock_unlock(&server->allThreadInfos->rwlock);
+  for (size_t i = 0; i < nTasks; i++) {
+    wait_future(&tasks[i].future);
+    free_future(&tasks[i].future);
+  }
+  free_tag(tasks);
+  pthread_rwlock_unlock(&allThreadInfos->rwlock);
+  add_counter(allThreadInfos->metrics.broadcastMsgs, nSent);
 }
 
 
 /************************** Message Broadcasts *************************/
 
+/** broadcast "user USER" followed by msgSuffix */
 static void
-broadcast_enter_msg(const ThreadInfo *server)
+broadcast_user_msg(const ThreadInfo *server, const char *msgSuffix)
 {
-  const char *user = server->user;
   const char *msgPrefix = "user ";
-  const char *msgSuffix = " has entered the room\n";
-  const int msgSize = strlen(msgPrefix) + strlen(user) + strlen(msgSuffix) + 1;
-  char msg[msgSize];
-  int n = snprintf(msg, msgSize, "%s%s%s", msgPrefix, user, msgSuffix);
-  assert(n == msgSize - 1);
-  TRACE("broadcast msg = %s", msg);
-  broadcast_to_room(server, msg, n);
+  const char *user = server->user;
+  const MsgPart parts[] = {
+    { msgPrefix, strlen(msgPrefix) },
+    { user, strlen(user) },
+    { msgSuffix, strlen(msgSuffix) },
+  };
+  TRACE("broadcast msg = %s%s%s", msgPrefix, user, msgSuffix);
+  broadcast_to_room(server, sizeof(parts)/sizeof(parts[0]), parts);
+}
+
+static void
+broadcast_enter_msg(const ThreadInfo *server)
+{
+  broadcast_user_msg(server, " has entered the room\n");
 }
 
 static void
 broadcast_leave_msg(const ThreadInfo *server)
 {
   TRACE("broadcast_leave() entry");
-  const char *user = server->user;
-  const char *msgPrefix = "user ";
-  const char *msgSuffix = " has left the room\n";
-  const int msgSize = strlen(msgPrefix) + strlen(user) + strlen(msgSuffix) + 1;
-  char msg[msgSize];
-  int n = snprintf(msg, msgSize, "%s%s%s", msgPrefix, user, msgSuffix);
-  assert(n == msgSize - 1);
-  broadcast_to_room(server, msg, n);
+  broadcast_user_msg(server, " has left the room\n");
   TRACE("broadcast_leave() exit");
 }
 
+/** broadcast message added by user with topics[nTopics]; only the
+ *  line giving the user and the topics is built in memory, the
+ *  message itself is sent from the request body.
+ */
 static void
 broadcast_add_msg(const ThreadInfo *server, const char *user,
                   size_t nTopics, const char *topics[nTopics],
                   const char *message)
 {
   const char *msgPrefix = "message from ";
-  int msgSize = strlen(msgPrefix) + strlen(user) + 1; //+1 for newline
-  for (int i = 0; i < nTopics; i++) { msgSize += strlen(topics[i]) + 1; }
-  msgSize += strlen(message) + 1; //+ 1 for snprintf '\0'
-  char msg[msgSize];
-  int n = 0;
-  n += snprintf(&msg[n], msgSize - n, "%s%s\n", msgPrefix, user);
+  size_t headSize = strlen(msgPrefix) + strlen(user) + 1; //+1 for newline
+  for (int i = 0; i < nTopics; i++) { headSize += strlen(topics[i]) + 1; }
+  headSize += 1; //for snprintf '\0'
+  char *head = malloc_tag(MEM_TAG_MSG, headSize);
+  if (head == NULL) {
+    error("cannot allocate %zu bytes for broadcast", headSize);
+    return;
+  }
+  size_t n = 0;
+  n += snprintf(&head[n], headSize - n, "%s%s\n", msgPrefix, user);
   for (int i = 0; i < nTopics; i++) {
-    n += snprintf(&msg[n], msgSize - n, "%s ", topics[i]);
+    n += snprintf(&head[n], headSize - n, "%s ", topics[i]);
   }
-  n += snprintf(&msg[n], msgSize - n, "%s", message);
-  assert(n == msgSize - 1);
-  broadcast_to_room(server, msg, n);
+  assert(n == headSize - 1);
+  const MsgPart parts[] = {
+    { head, n },
+    { message, strlen(message) },
+  };
+  broadcast_to_room(server, sizeof(parts)/sizeof(parts[0]), parts);
+  free_tag(head);
 }
 
 /******************** Client Thread Initialization *********************/
 
-static void
+/** set up server for the user and room sent by its client; return
+ *  non-zero if the client connection is no longer usable.
+ */
+static int
 do_init_cmd(ThreadInfo *server, const Hdr *clientHdr)
 {
   TRACE("do_init_cmd()");
-  FILE *in = server->in;
-
-  char buf[clientHdr->nBytes];
-  fread(buf, 1, clientHdr->nBytes, in);
+  char *buf;
+  if (read_request_body(server, clientHdr, &buf) != 0) return 1;
+  if (buf == NULL) {
+    error("init_cmd(): %zu-byte request rejected", clientHdr->nBytes);
+    return 1;
+  }
   TRACE("nBytes = %zu; buf = %s", clientHdr->nBytes, buf);
   const char *user = buf;
   const char *room = user + strlen(user) + 1;
-  server->user = malloc(strlen(user) + 1);
+  if (room > buf + clientHdr->nBytes) room = "";
+  server->user = alloc_align_arena(&server->arena, strlen(user) + 1, 1);
   if (server->user == NULL) {
-    error("init_cmd(): cannot malloc for user \"%s\"", user);
+    error("init_cmd(): cannot allocate for user \"%s\"", user);
     goto FAIL;
   }
   strcpy(server->user, user);
-  server->room = malloc(strlen(room) + 1);
-  if (server->room == NULL) {
-    error("init_cmd(): cannot malloc for user \"%s\"", user);
+  AllThreadInfos *allThreadInfos = server->allThreadInfos;
+  pthread_rwlock_wrlock(&allThreadInfos->rwlock);
+  unsigned roomId;
+  const int err = add_interner(&allThreadInfos->rooms, room, &roomId);
+  if (err == 0) {
+    server->roomId = roomId;
+    server->room = str_interner(&allThreadInfos->rooms, roomId);
+  }
+  pthread_rwlock_unlock(&allThreadInfos->rwlock);
+  if (err != 0) {
+    error("init_cmd(): cannot intern room \"%s\"", room);
     goto FAIL;
   }
-  strcpy(server->room, room);
+  free_tag(buf);
   TRACE("server->user = %s; server->room = %s", server->room, server->user);
   broadcast_enter_msg(server);
-  return;
+  return 0;
  FAIL:
-  cleanup_thread_info(server);
-
+  free_tag(buf);
+  return 1;
 }
 
 /**************************** Query Command ****************************/
 
+/** ctx for query_iterator() */
+typedef struct {
+  ChatDb *chatDb;               //connection running the query
+  FILE *out;                    //client stream written by response
+  size_t nStreamed;             //# of bytes of current message written
+  bool isTruncated;             //true if a response body was cut short
+} QueryCtx;
+
+/** sink for streaming a message into the response */
+static int
+message_sink(const char *chunk, size_t chunkLen, void *ctx)
+{
+  QueryCtx *queryCtx = ctx;
+  if (fwrite(chunk, 1, chunkLen, queryCtx->out) != chunkLen) return 1;
+  queryCtx->nStreamed += chunkLen;
+  return 0;
+}
+
 static int
 query_iterator(const ChatInfo *result, void *ctx)
 {
   TRACE("entry");
-  const ThreadInfo *server = ctx;
+  QueryCtx *queryCtx = ctx;
+  FILE *out = queryCtx->out;
   const size_t nTopics = result->nTopics;
   size_t nBytes = strlen(ISO_8601_FORMAT) + 1;
   nBytes += strlen(result->user) + 1 +
@@ -263,122 +465,422 @@ query_iterator(const ChatInfo *result, void *ctx)
     nBytes += strlen(result->topics[i]) + (i < nTopics - 1);
   }
   nBytes += 1; //for '\n'
-  nBytes += strlen(result->message);
-  char buf[nBytes];
-  char *p = buf;
-  p += timestamp_to_iso8601(result->timestamp, nBytes, p);
-  p += sprintf(p, "\n%s %s%s", result->user, result->room,
-               (nTopics > 0) ? " " : "");
+  Hdr hdr = {
+    .hdrType = SERVER_HDR, .status = OK_STATUS,
+    .nBytes = nBytes + result->messageLen,
+  };
+  write_header(&hdr, out);
+  //everything but the message, which is streamed after it
+  char timestamp[ISO_8601_LEN + 1];
+  timestamp_to_iso8601(result->timestamp, sizeof(timestamp), timestamp);
+  fprintf(out, "%s\n%s %s%s", timestamp, result->user, result->room,
+          (nTopics > 0) ? " " : "");
   for (int i = 0; i < nTopics; i++) {
-    p += sprintf(p, "%s%s", result->topics[i], (i < nTopics - 1) ? " " : "");
+    fprintf(out, "%s%s", result->topics[i], (i < nTopics - 1) ? " " : "");
+  }
+  fputc('\n', out);
+  //the header promises the whole message
+  queryCtx->nStreamed = 0;
+  const int errCode =
+    stream_message_chat_db(queryCtx->chatDb, result, message_sink, ctx);
+  if (errCode != 0 || queryCtx->nStreamed != result->messageLen) {
+    queryCtx->isTruncated = true;
+    return 1;
   }
-  p += sprintf(p, "\n");
-  p += sprintf(p, "%s", result->message);
-  Hdr hdr = { .hdrType = SERVER_HDR, .status = OK_STATUS, .nBytes = nBytes };
-  write_header(&hdr, server->out);
-  fwrite(buf, 1, nBytes, server->out);
   return 0;
 }
 
 
-static void
-do_query_cmd(const ThreadInfo *server, const Hdr *clientHdr)
+static int
+do_query_cmd(const ThreadInfo *server, ChatDb *chatDb, const Hdr *clientHdr,
+             char *buf, FILE *out)
 {
-  ChatDb *chatDb = server->chatDb;
-  FILE *in = server->in;
-  FILE *out = server->out;
-
   size_t nBytes = clientHdr->nBytes;
-  char buf[nBytes];
-  fread(buf, 1, nBytes, in);
   TRACE("nBytes = %zu; buf = %.*s", nBytes, (int) nBytes, buf);
-  const char *room = buf;
-  size_t count;
-  int errCode = count_room_chat_db(chatDb, room, &count);
-  if (errCode != 0) {
-    end_server_response(chatDb, SYS_ERR_STATUS, error_chat_db(chatDb), out);
-    return;
+  //rooms are separated by ' ' within the first NUL-terminated string
+  char *roomsStr = buf;
+  const char *p = buf + strlen(roomsStr) + 1;
+  const char *rooms[MAX_QUERY_ROOMS];
+  size_t nRooms = 0;
+  char *saveP;
+  for (char *room = strtok_r(roomsStr, " ", &saveP); room != NULL;
+       room = strtok_r(NULL, " ", &saveP)) {
+    if (nRooms == MAX_QUERY_ROOMS) {
+      end_server_response(chatDb, USER_ERR_STATUS,
+                          "BAD_REQUEST: too many rooms", out);
+      return 0;
+    }
+    rooms[nRooms++] = room;
   }
-  else if (count == 0) {
+  if (nRooms == 0) {
     end_server_response(chatDb, USER_ERR_STATUS, "BAD_ROOM: unknown room", out);
-    return;
+    return 0;
+  }
+  size_t count;
+  int errCode;
+  for (int i = 0; i < nRooms; i++) {
+    errCode = count_room_chat_db(chatDb, rooms[i], &count);
+    if (errCode != 0) {
+      end_server_response(chatDb, SYS_ERR_STATUS, error_chat_db(chatDb), out);
+      return 0;
+    }
+    else if (count == 0) {
+      end_server_response(chatDb, USER_ERR_STATUS, "BAD_ROOM: unknown room",
+                          out);
+      return 0;
+    }
   }
   const size_t nTopics = clientHdr->nTopics;
-  const char *topics[nTopics];
-  const char *p = buf + strlen(room) + 1;
-  TRACE("room = %s, topics[0] = %s",
-        room, nTopics > 0 ? p : "");
+  const char *topics[MAX_REQUEST_TOPICS];
+  TRACE("nRooms = %zu, rooms[0] = %s, topics[0] = %s",
+        nRooms, rooms[0], nTopics > 0 ? p : "");
   for (int i = 0; i < nTopics; i++) {
     topics[i] = p;
     p += strlen(p) + 1;
     errCode = count_topic_chat_db(chatDb, topics[i], &count);
     if (errCode != 0) {
       end_server_response(chatDb, SYS_ERR_STATUS, error_chat_db(chatDb), out);
-      return;
+      return 0;
     }
     else if (count == 0) {
       end_server_response(chatDb, USER_ERR_STATUS,
                           "BAD_TOPIC: unknown topic", out);
-      return;
+      return 0;
     }
   }
-  const char **topicsP = (nTopics == 0) ? NULL : topics;
-  errCode = query_chat_db(chatDb, room, nTopics, topicsP, clientHdr->count,
-                              query_iterator, (void *)server);
-  TRACE("query_chat_db(%p, %s, %zu, %p, %d, %p, %p) = %d",
-        chatDb, room, nTopics, topicsP, clientHdr->count,
+  //messages are streamed to the client rather than retrieved in full
+  const ChatQuery query = {
+    .nRooms = nRooms, .rooms = rooms,
+    .nTopics = nTopics, .topics = (nTopics == 0) ? NULL : topics,
+    .count = clientHdr->count,
+    .fields = USER_FIELD|ROOM_FIELD|TOPICS_FIELD|TIMESTAMP_FIELD|
+              STREAM_MESSAGE_FIELD,
+  };
+  QueryCtx ctx = { .chatDb = chatDb, .out = out };
+  errCode = run_query_chat_db(chatDb, &query, query_iterator, &ctx);
+  TRACE("run_query_chat_db(%p, %zu rooms, %zu topics, %d, %p, %p) = %d",
+        chatDb, nRooms, nTopics, clientHdr->count,
         query_iterator, server, errCode);
+  if (ctx.isTruncated) {
+    //the header of the cut-short result promised a longer body which
+    //has already been partly sent, so the client cannot be resynced
+    error("query for user %s: cannot stream message", server->user);
+    return 1;
+  }
   ServerStatus status = (errCode == 0) ? OK_STATUS : SYS_ERR_STATUS;
   const char *errMsg = (errCode == 0) ? NULL : error_chat_db(chatDb);
   end_server_response(chatDb, status, errMsg, out);
+  return 0;
+}
+
+/**************************** Stats Command ****************************/
+
+static int
+do_stats_cmd(const ThreadInfo *server, ChatDb *chatDb, const Hdr *clientHdr,
+             char *buf, FILE *out)
+{
+  const char *room = buf;
+  TRACE("room = %s; count = %d", room, clientHdr->count);
+  size_t count;
+  if (count_room_chat_db(chatDb, room, &count) != 0) {
+    end_server_response(chatDb, SYS_ERR_STATUS, error_chat_db(chatDb), out);
+    return 0;
+  }
+  else if (count == 0) {
+    end_server_response(chatDb, USER_ERR_STATUS, "BAD_ROOM: unknown room", out);
+    return 0;
+  }
+  //clamp count since a client need not have validated it
+  const size_t k = (clientHdr->count < 0) ? 0
+    : (clientHdr->count > MAX_TOP_TOPICS) ? MAX_TOP_TOPICS
+    : clientHdr->count;
+  TopicCount *topTopics = calloc_tag(MEM_TAG_QUERY, k + 1, sizeof(TopicCount));
+  if (topTopics == NULL) {
+    end_server_response(chatDb, SYS_ERR_STATUS, "cannot allocate topics", out);
+    return 0;
+  }
+  RoomStats stats;
+  if (stats_room_chat_db(chatDb, room, k, topTopics, &stats) != 0) {
+    free_tag(topTopics);
+    end_server_response(chatDb, SYS_ERR_STATUS, error_chat_db(chatDb), out);
+    return 0;
+  }
+  //the text is sized by formatting it once without output, so that
+  //it can be written to out after its header without being buffered
+  const char *summaryFormat =
+    "%s: %zu chats (%.2f/min), ~%zu users in last %lld min\n";
+  const long long windowMinutes = stats.windowMillis / (60*1000);
+  size_t textLen = snprintf(NULL, 0, summaryFormat, room, stats.nChats,
+                            stats.chatsPerMinute, stats.nUsers,
+                            windowMinutes);
+  for (int i = 0; i < stats.nTopTopics; i++) {
+    textLen += snprintf(NULL, 0, "%s %zu\n",
+                        topTopics[i].topic, topTopics[i].count);
+  }
+  Hdr hdr = { .hdrType = SERVER_HDR, .status = OK_STATUS, .nBytes = textLen };
+  write_header(&hdr, out);
+  fprintf(out, summaryFormat, room, stats.nChats, stats.chatsPerMinute,
+          stats.nUsers, windowMinutes);
+  for (int i = 0; i < stats.nTopTopics; i++) {
+    fprintf(out, "%s %zu\n", topTopics[i].topic, topTopics[i].count);
+  }
+  free_tag(topTopics);
+  end_server_response(chatDb, OK_STATUS, NULL, out);
+  return 0;
 }
 
 /***************************** Add Command *****************************/
 
+/** fields of an ADD request body */
+typedef struct {
+  const char *user;
+  const char *room;
+  const char *message;
+} AddBody;
+
+/** split ADD request body buf into *add and topics[clientHdr->nTopics] */
 static void
-do_add_cmd(const ThreadInfo *server, const Hdr *clientHdr)
+parse_add_body(const Hdr *clientHdr, const char *buf, AddBody *add,
+               const char *topics[])
 {
-  ChatDb *chatDb = server->chatDb;
-  FILE *in = server->in;
-  FILE *out = server->out;
-
-  char buf[clientHdr->nBytes];
-  fread(buf, 1, clientHdr->nBytes, in);
-  TRACE("nBytes = %zu; buf = %s", clientHdr->nBytes, buf);
   const char *user = buf;
   const char *room = user + strlen(user) + 1;
   const char *message = room + strlen(room) + 1;
   const char *p = message + strlen(message) + 1;
-  const size_t nTopics = clientHdr->nTopics;
-  const char *topics[nTopics];
   TRACE("user = %s, room = %s, message = %s, topics[0] = %s",
-        user, room, message, nTopics > 0 ? p : "");
-  for (int i = 0; i < nTopics; i++) {
+        user, room, message, clientHdr->nTopics > 0 ? p : "");
+  for (int i = 0; i < clientHdr->nTopics; i++) {
     topics[i] = p;
     p += strlen(p) + 1;
   }
+  *add = (AddBody) { .user = user, .room = room, .message = message };
+}
+
+static int
+do_add_cmd(const ThreadInfo *server, ChatDb *chatDb, const Hdr *clientHdr,
+           char *buf, FILE *out)
+{
+  TRACE("nBytes = %zu; buf = %s", clientHdr->nBytes, buf);
+  const size_t nTopics = clientHdr->nTopics;
+  const char *topics[MAX_REQUEST_TOPICS];
+  AddBody add;
+  parse_add_body(clientHdr, buf, &add, topics);
   const char **topicsP = (nTopics == 0) ? NULL : topics;
-  int errCode = add_chat_db(chatDb, user, room, nTopics, topicsP, message);
+  int errCode =
+    add_chat_db(chatDb, add.user, add.room, nTopics, topicsP, add.message);
   TRACE("add_chat_db(%p, %s, %s, %zu, %p, %s) = %d",
-        chatDb, user, room, nTopics, topicsP, message, errCode);
+        chatDb, add.user, add.room, nTopics, topicsP, add.message, errCode);
   ServerStatus status = (errCode == 0) ? OK_STATUS : SYS_ERR_STATUS;
   const char *errMsg = (errCode == 0) ? NULL : error_chat_db(chatDb);
   end_server_response(chatDb, status, errMsg, out);
-  broadcast_add_msg(server, user, nTopics, topics, message);
+  return 0;
+}
+
+/** broadcast the chat added by an ADD request to the room; runs on
+ *  the client thread once the response has been sent.
+ */
+static void
+broadcast_add_cmd(const ThreadInfo *server, const Hdr *clientHdr, char *buf)
+{
+  const size_t nTopics = clientHdr->nTopics;
+  const char *topics[MAX_REQUEST_TOPICS];
+  AddBody add;
+  parse_add_body(clientHdr, buf, &add, topics);
+  broadcast_add_msg(server, add.user, nTopics, topics, add.message);
+}
+
+/****************************** Metrics ********************************/
+
+static uint64_t
+now_nanos(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static CmdMetrics
+make_cmd_metrics(Metrics *global, const char *requestsName,
+                 const char *nanosName, const char *cmd)
+{
+  char help[64];
+  snprintf(help, sizeof(help), "# of %s requests", cmd);
+  Counter *requests = counter_metrics(global, requestsName, help);
+  snprintf(help, sizeof(help), "%s request latency in nanoseconds", cmd);
+  return (CmdMetrics) {
+    .requests = requests,
+    .nanos = histogram_metrics(global, nanosName, help),
+  };
+}
+
+static void
+init_server_metrics(ServerMetrics *metrics)
+{
+  Metrics *global = global_metrics();
+  *metrics = (ServerMetrics) {
+    .connections = gauge_metrics(global, "chatd_connections",
+                                 "# of connected clients"),
+    .broadcastMsgs = counter_metrics(global, "chatd_broadcast_msgs_total",
+                                     "# of messages broadcast to clients"),
+    .add = make_cmd_metrics(global, "chatd_add_requests_total",
+                            "chatd_add_nanos", "add"),
+    .query = make_cmd_metrics(global, "chatd_query_requests_total",
+                              "chatd_query_nanos", "query"),
+    .stats = make_cmd_metrics(global, "chatd_stats_requests_total",
+                              "chatd_stats_nanos", "stats"),
+  };
 }
 
+/** interval between metrics exports */
+enum { METRICS_EXPORT_SECONDS = 1 };
+
+/** thread function which periodically exports global_metrics() and
+ *  the memory usage of each allocation tag to the path specified by
+ *  arg, replacing it atomically so that a reader never sees a partial
+ *  export.
+ */
+static void *
+export_metrics(void *arg)
+{
+  const char *path = arg;
+  char tmpPath[PATH_MAX];
+  snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+  while (true) {
+    FILE *out = fopen(tmpPath, "w");
+    if (!out) {
+      error("cannot write metrics to %s:", tmpPath);
+    }
+    else {
+      const int err =
+        dump_metrics(global_metrics(), out) || dump_mem_tags(out);
+      if (fclose(out) != 0 || err != 0 || rename(tmpPath, path) != 0) {
+        error("cannot export metrics to %s:", path);
+      }
+    }
+    sleep(METRICS_EXPORT_SECONDS);
+  }
+  return NULL;
+}
+
+/** if the CHATD_METRICS environment variable is set to a path, then
+ *  start a thread which exports metrics to that path.
+ */
+static void
+start_metrics_export(void)
+{
+  const char *path = getenv("CHATD_METRICS");
+  if (!path || *path == '\0') return;
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, export_metrics, (void *)path) != 0 ||
+      pthread_detach(tid) != 0) {
+    error("cannot start metrics export thread:");
+  }
+}
+
+
 /************************** Top-Level Routines *************************/
 
+/** a command, run on the executor: given the request body buf read
+ *  by the client thread, do its DB work using chatDb and write its
+ *  complete response to the client stream out.  Return non-zero if
+ *  the client connection is no longer usable.
+ */
+typedef int CmdFn(const ThreadInfo *server, ChatDb *chatDb,
+                  const Hdr *clientHdr, char *buf, FILE *out);
+
+/** work done by the client thread after sending the response to a
+ *  command with request body buf; NULL if none.
+ */
+typedef void PostCmdFn(const ThreadInfo *server, const Hdr *clientHdr,
+                       char *buf);
+
+typedef struct {
+  CmdFn *fn;
+  bool useWorkerDb;             //run fn on the worker's own connection
+  const ThreadInfo *server;
+  const Hdr *clientHdr;
+  char *buf;
+  int err;                      //set to non-zero if connection unusable
+} CmdTask;
+
+static void
+do_cmd_task(void *arg)
+{
+  CmdTask *task = arg;
+  const ThreadInfo *server = task->server;
+  AllThreadInfos *allThreadInfos = server->allThreadInfos;
+  const int worker = worker_index_executor(allThreadInfos->executor);
+  //the client stream is locked so that broadcasts cannot interleave
+  //with the response
+  flockfile(server->out);
+  if (task->useWorkerDb && worker >= 0 &&
+      allThreadInfos->workerDbs != NULL) {
+    //the worker's own connection, so no other thread uses its
+    //cached statements
+    ChatDb *chatDb = allThreadInfos->workerDbs[worker];
+    task->err =
+      task->fn(server, chatDb, task->clientHdr, task->buf, server->out);
+  }
+  else {
+    //adds go through the shared connection, since its name filters
+    //and room activities must see every chat added
+    pthread_mutex_lock(&allThreadInfos->dbLock);
+    task->err =
+      task->fn(server, server->chatDb, task->clientHdr, task->buf,
+               server->out);
+    pthread_mutex_unlock(&allThreadInfos->dbLock);
+  }
+  if (fflush(server->out) != 0) task->err = 1;
+  funlockfile(server->out);
+}
+
+/** run a command for a client: its request body is read by the
+ *  client thread, then fn is run on the executor, writing its
+ *  response directly to the client stream.  If useWorkerDb, fn runs
+ *  on the worker's own db connection without taking the db lock.  If
+ *  postFn is non-NULL, it is called on the client thread after the
+ *  response has been sent.  Return non-zero if the client connection
+ *  is no longer usable.
+ */
+static int
+run_cmd(CmdFn *fn, bool useWorkerDb, PostCmdFn *postFn, CmdMetrics *metrics,
+        const ThreadInfo *server, const Hdr *clientHdr)
+{
+  const uint64_t t0 = now_nanos();
+  char *buf;
+  if (read_request_body(server, clientHdr, &buf) != 0) return 1;
+  if (buf == NULL) {
+    flockfile(server->out);
+    end_server_response(server->chatDb, USER_ERR_STATUS,
+                        "BAD_REQUEST: request too large", server->out);
+    funlockfile(server->out);
+    return 0;
+  }
+  CmdTask task = {
+    .fn = fn, .useWorkerDb = useWorkerDb, .server = server,
+    .clientHdr = clientHdr, .buf = buf,
+  };
+  if (run_executor(server->allThreadInfos->executor, do_cmd_task,
+                   &task) != 0) {
+    do_cmd_task(&task);
+  }
+  if (task.err == 0 && postFn != NULL) postFn(server, clientHdr, buf);
+  free_tag(buf);
+  add_counter(metrics->requests, 1);
+  record_histogram(metrics->nanos, now_nanos() - t0);
+  return task.err;
+}
+
 /** thread function */
 static void *
 server_loop(void *threadArg)
 {
-  ThreadArg *argP = (ThreadArg *)threadArg;
+  const ThreadArg *argP = (const ThreadArg *)threadArg;
   ThreadInfo *threadInfo = argP->threadInfo;
+  ServerMetrics *metrics = &argP->allThreadInfos->metrics;
   int err =
     init_thread_info(argP->chatDb, argP->clientSockFd, argP->allThreadInfos,
                      threadInfo);
-  free(argP);
   if (err != 0) return NULL;
   bool isDone = false;
   while (!isDone) {
@@ -386,11 +888,17 @@ server_loop(void *threadArg)
     if (read_header(&hdr, threadInfo->in) != 0) goto CLEANUP;
     switch (hdr.cmdType) {
     case ADD_CMD:
-      do_add_cmd(threadInfo, &hdr);
+      isDone = run_cmd(do_add_cmd, false, broadcast_add_cmd, &metrics->add,
+                       threadInfo, &hdr) != 0;
       break;
     case QUERY_CMD:
       TRACE("query");
-      do_query_cmd(threadInfo, &hdr);
+      isDone = run_cmd(do_query_cmd, true, NULL, &metrics->query,
+                       threadInfo, &hdr) != 0;
+      break;
+    case STATS_CMD:
+      isDone = run_cmd(do_stats_cmd, false, NULL, &metrics->stats,
+                       threadInfo, &hdr) != 0;
       break;
     case END_CMD: {
       const Hdr serverHdr = {
@@ -401,7 +909,7 @@ server_loop(void *threadArg)
       break;
     }
     case INIT_CMD:
-      do_init_cmd(threadInfo, &hdr);
+      if (do_init_cmd(threadInfo, &hdr) != 0) goto CLEANUP;
       break;
     default:
       error("serve(): impossible cmdType = %d\n", hdr.cmdType);
@@ -417,12 +925,46 @@ server_loop(void *threadArg)
 }
 
 
-//accept loop, start a new thread for each client connection */
+/** how long a db connection waits for a lock held by another one */
+enum { DB_BUSY_TIMEOUT_MILLIS = 5000 };
+
+/** return an array of nWorkers connections to the db at dbPath for
+ *  running queries, one per executor worker; NULL if they cannot all
+ *  be opened, in which case queries use the shared connection.  They
+ *  keep no name filters or room activities, since only the shared
+ *  connection sees the chats being added.
+ */
+static ChatDb **
+open_worker_dbs(const char *dbPath, unsigned nWorkers)
+{
+  const ChatDbOptions options = {
+    .filterFpRate = -1,
+    .activityWindowMillis = -1,
+    .busyTimeoutMillis = DB_BUSY_TIMEOUT_MILLIS,
+  };
+  ChatDb **workerDbs = calloc_tag(MEM_TAG_DB, nWorkers, sizeof(ChatDb *));
+  if (workerDbs == NULL) return NULL;
+  for (unsigned i = 0; i < nWorkers; i++) {
+    MakeChatDbResult result;
+    if (make_chat_db_with_options(dbPath, &options, &result) != 0) {
+      error("cannot open query connection to %s: %s", dbPath, result.err);
+      for (unsigned j = 0; j < i; j++) free_chat_db(workerDbs[j]);
+      free_tag(workerDbs);
+      return NULL;
+    }
+    workerDbs[i] = result.chatDb;
+  }
+  return workerDbs;
+}
+
+//accept loop, start a new thread for each client connection; client
+//threads run their commands and broadcast sends on a shared executor */
 void
 do_serve(int serverSockFd, const char *dbPath)
 {
+  const ChatDbOptions options = { .busyTimeoutMillis = DB_BUSY_TIMEOUT_MILLIS };
   MakeChatDbResult result;
-  if (make_chat_db(dbPath, &result) != 0) {
+  if (make_chat_db_with_options(dbPath, &options, &result) != 0) {
     //should not happen, since we already checked, but if it does,
     //there isn't much we can really do, so crash.
     fatal("cannot open db at %s: %s", dbPath, result.err);
@@ -431,6 +973,14 @@ do_serve(int serverSockFd, const char *dbPath)
   enum { MAX_FDS = 20 };
   ThreadInfo threadInfos[MAX_FDS];  //indexed by accepted descriptor
   memset(threadInfos, 0, sizeof(ThreadInfo)*MAX_FDS);
+  enum { THREAD_ARENA_CHUNK_SIZE = 256 };
+  for (int i = 0; i < MAX_FDS; i++) {
+    init_arena(&threadInfos[i].arena, THREAD_ARENA_CHUNK_SIZE);
+    set_tag_arena(&threadInfos[i].arena, MEM_TAG_CONN);
+  }
+  //thread args are indexed by accepted descriptor too, so they need
+  //not be allocated per connection
+  ThreadArg threadArgs[MAX_FDS];
   AllThreadInfos allInfos = {
     .infoArray = threadInfos,
     .nInfoArray = MAX_FDS,
@@ -438,12 +988,26 @@ do_serve(int serverSockFd, const char *dbPath)
   if (pthread_rwlock_init(&allInfos.rwlock, NULL) != 0) {
     fatal("cannot init rwlock:");
   }
+  if (pthread_mutex_init(&allInfos.dbLock, NULL) != 0) {
+    fatal("cannot init db lock:");
+  }
+  init_interner(&allInfos.rooms, false);
+  //one worker per online CPU
+  Executor executor;
+  if (init_executor(&executor, NULL) != 0) {
+    fatal("cannot init executor");
+  }
+  allInfos.executor = &executor;
+  ExecutorStats executorStats;
+  stats_executor(&executor, &executorStats);
+  allInfos.workerDbs = open_worker_dbs(dbPath, executorStats.nWorkers);
+  init_server_metrics(&allInfos.metrics);
+  start_metrics_export();
   while (true) {
     TRACE("service loop");
     struct sockaddr_in rsin;
     socklen_t rlen = sizeof(rsin);
     int clientSockFd = -1;
-    ThreadArg *argP = NULL;
     clientSockFd = accept(serverSockFd, (struct sockaddr*)&rsin, &rlen);
     if (clientSockFd < 0) {
       error("accept:"); goto FAIL;
@@ -451,10 +1015,7 @@ do_serve(int serverSockFd, const char *dbPath)
     if (clientSockFd >= MAX_FDS) {
       fatal("clientSockFd %d >= MAX_FDS %d", clientSockFd, MAX_FDS);
     }
-    argP = malloc(sizeof(ThreadArg));
-    if (argP == NULL) {
-      error("cannot malloc ThreadArg:"); goto FAIL;
-    };
+    ThreadArg *argP = &threadArgs[clientSockFd];
     *argP = (ThreadArg){
       .allThreadInfos = &allInfos,
       .clientSockFd = clientSockFd,
@@ -470,7 +1031,6 @@ do_serve(int serverSockFd, const char *dbPath)
     }
     continue;
   FAIL:
-    if (argP != NULL) free(argP);
     if (clientSockFd >= 0) close(clientSockFd);
     // would like to cancel thread, but not covered in class
     continue;
@@ -1,36 +1,112 @@
 #include "chat-db.h"
 
 #include <assert.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
 
+enum { ISO_8601_PREFIX_LEN = sizeof("YYYY-MM-DDThh:mm:") - 1 };
+
+/** broken-down local time for the minute containing the last
+ *  timestamp formatted by this thread.  Assumes that timezone offset
+ *  changes happen on minute boundaries, so that all timestamps within
+ *  the cached minute share its "YYYY-MM-DDThh:mm:" prefix.
+ *
+ *  The cache is keyed on the timezone and daylight globals set by
+ *  tzset(), so it is invalidated when tzset() switches to a zone with
+ *  a different offset or DST usage.  A switch between zones which
+ *  agree on both but differ in their DST rules is not detected.
+ */
+typedef struct {
+  bool isValid;
+  time_t minuteStart;        //seconds since epoch at start of minute
+  long timezone;             //timezone global when prefix was cached
+  int daylight;              //daylight global when prefix was cached
+  char prefix[ISO_8601_PREFIX_LEN];
+} Iso8601Cache;
+
+static _Thread_local Iso8601Cache iso8601Cache;
+
+/** write n as nDigits decimal digits to buf; return buf + nDigits */
+static inline char *
+put_digits(char *buf, unsigned n, int nDigits)
+{
+  for (int i = nDigits - 1; i >= 0; i--) {
+    buf[i] = '0' + n % 10;
+    n /= 10;
+  }
+  return buf + nDigits;
+}
+
+/** write ISO-8601 representation of timestamp into
+ *  buf[ISO_8601_LEN + 1] using cache.
+ */
+static void
+format_iso8601(Iso8601Cache *cache, TimeMillis timestamp,
+               char buf[ISO_8601_LEN + 1])
+{
+  time_t t = timestamp/1000;
+  int millis = timestamp%1000;
+  if (millis < 0) { millis += 1000; t--; }
+  if (!cache->isValid || t < cache->minuteStart ||
+      t >= cache->minuteStart + 60 || cache->timezone != timezone ||
+      cache->daylight != daylight) {
+    struct tm tm;
+    localtime_r(&t, &tm);
+    const int sec = tm.tm_sec < 60 ? tm.tm_sec : 59; //leap second
+    cache->minuteStart = t - sec;
+    char *p = cache->prefix;
+    p = put_digits(p, tm.tm_year + 1900, 4); *p++ = '-';
+    p = put_digits(p, tm.tm_mon + 1, 2); *p++ = '-';
+    p = put_digits(p, tm.tm_mday, 2); *p++ = 'T';
+    p = put_digits(p, tm.tm_hour, 2); *p++ = ':';
+    p = put_digits(p, tm.tm_min, 2); *p++ = ':';
+    cache->timezone = timezone;
+    cache->daylight = daylight;
+    cache->isValid = true;
+  }
+  memcpy(buf, cache->prefix, ISO_8601_PREFIX_LEN);
+  char *p = put_digits(&buf[ISO_8601_PREFIX_LEN], t - cache->minuteStart, 2);
+  *p++ = '.';
+  p = put_digits(p, millis, 3);
+  *p = '\0';
+}
+
 /** set buf to ISO-8601 representation of timestamp in localtime.
  *  Should have bufSize > strlen(ISO_8601_FMT).
  *
  *  Will not exceed bufSize.  Return value like snprintf():
  *  # of characters which would have been output (not counting the NUL).
+ *
+ *  The local time of the current minute is cached per thread, so
+ *  successive calls with nearby timestamps do not call localtime_r().
  */
 size_t
 timestamp_to_iso8601(TimeMillis timestamp, size_t bufSize, char buf[bufSize])
 {
-  size_t iso8601Len = strlen(ISO_8601_FORMAT);
-  if (iso8601Len + 1 > bufSize) return iso8601Len;
-  time_t t = timestamp/1000;
-  int millis = timestamp%1000;
-  struct tm brokenDownTime;
-  localtime_r(&t, &brokenDownTime);
-  // return value is 0 if buf not big enough, hence use precomputed ret value
-  size_t n = strftime(buf, bufSize, "%Y-%m-%dT%H:%M:%S", &brokenDownTime);
-  snprintf(&buf[n], bufSize - n, ".%03d", millis);
-  return iso8601Len;
+  if (ISO_8601_LEN + 1 > bufSize) return ISO_8601_LEN;
+  format_iso8601(&iso8601Cache, timestamp, buf);
+  return ISO_8601_LEN;
+}
+
+/** set bufs[i] to the ISO-8601 representation of timestamps[i] in
+ *  localtime for i in [0, n).  Each bufs[i] is NUL-terminated.
+ */
+void
+timestamps_to_iso8601(size_t n, const TimeMillis timestamps[n],
+                      char bufs[n][ISO_8601_LEN + 1])
+{
+  Iso8601Cache *cache = &iso8601Cache;
+  for (size_t i = 0; i < n; i++) {
+    format_iso8601(cache, timestamps[i], bufs[i]);
+  }
 }
 
 /** For debugging: write chatInfo on out.  Always returns 0. */
 int
 out_chat_info(const ChatInfo *chatInfo, FILE *out)
 {
-  size_t ISO_8601_LEN = strlen(ISO_8601_FORMAT);
   char iso8601[ISO_8601_LEN + 1];
   timestamp_to_iso8601(chatInfo->timestamp, ISO_8601_LEN+1, iso8601);
   fprintf(out, "%s\n", iso8601);
@@ -41,3 +117,89 @@ out_chat_info(const ChatInfo *chatInfo, FILE *out)
   fprintf(out, "\n%s\n", chatInfo->message);
   return 0;
 }
+
+
+#ifdef TEST_CHAT_BASE
+
+#include <unit-test.h> //for CHKF() macro
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/** return reference ISO-8601 representation of timestamp in buf */
+static const char *
+ref_iso8601(TimeMillis timestamp, char buf[ISO_8601_LEN + 1])
+{
+  time_t t = timestamp/1000;
+  int millis = timestamp%1000;
+  struct tm tm;
+  localtime_r(&t, &tm);
+  size_t n = strftime(buf, ISO_8601_LEN + 1, "%Y-%m-%dT%H:%M:%S", &tm);
+  snprintf(&buf[n], ISO_8601_LEN + 1 - n, ".%03d", millis);
+  return buf;
+}
+
+/** test cached ISO-8601 formatting against localtime_r()/strftime()
+ *  after a timezone change, across a DST transition and at random
+ *  times.
+ */
+static int
+test_iso8601(void)
+{
+  int nErrors = 0;
+  const char *tz = getenv("TZ");
+  char *savedTz = tz ? strdup(tz) : NULL;
+  const TimeMillis dstStart = 1710054000000; //2024-03-10T07:00Z
+  char utc[ISO_8601_LEN + 1];
+  setenv("TZ", "UTC", 1);
+  tzset();
+  timestamp_to_iso8601(dstStart, sizeof(utc), utc); //cache UTC minute
+  setenv("TZ", "America/New_York", 1);
+  tzset();
+  char ny[ISO_8601_LEN + 1];
+  char nyRef[ISO_8601_LEN + 1];
+  timestamp_to_iso8601(dstStart, sizeof(ny), ny);
+  ref_iso8601(dstStart, nyRef);
+  const bool isTzOk = strcmp(ny, nyRef) == 0;
+  CHKF(isTzOk, "iso8601 after tzset(): %s != %s (was %s)", ny, nyRef, utc);
+  if (!isTzOk) nErrors++;
+  enum { N = 7200 };
+  TimeMillis timestamps[N];
+  uint64_t x = 88172645463325252ULL;
+  for (int i = 0; i < N; i++) {
+    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+    timestamps[i] = (i < N/2)
+      ? dstStart - 3600*1000 + i*1999 + x % 1000 //around transition
+      : x % (4102444800000ULL);                  //before 2100
+  }
+  char bufs[N][ISO_8601_LEN + 1];
+  timestamps_to_iso8601(N, timestamps, bufs);
+  for (int i = 0; i < N; i++) {
+    char buf[ISO_8601_LEN + 1];
+    char ref[ISO_8601_LEN + 1];
+    const size_t n = timestamp_to_iso8601(timestamps[i], sizeof(buf), buf);
+    ref_iso8601(timestamps[i], ref);
+    const bool chk = n == ISO_8601_LEN && strcmp(buf, ref) == 0 &&
+      strcmp(bufs[i], ref) == 0;
+    CHKF(chk, "iso8601(%lld): %s, batch %s != %s",
+         (long long)timestamps[i], buf, bufs[i], ref);
+    if (!chk && ++nErrors > 5) break;
+  }
+  char small[ISO_8601_LEN] = "";
+  const bool chk = timestamp_to_iso8601(dstStart, sizeof(small), small) ==
+    ISO_8601_LEN && small[0] == '\0';
+  CHK(chk, "iso8601 wrote into too small buffer");
+  if (!chk) nErrors++;
+  if (savedTz) setenv("TZ", savedTz, 1); else unsetenv("TZ");
+  tzset();
+  free(savedTz);
+  return nErrors;
+}
+
+int
+main()
+{
+  return test_iso8601() == 0 ? 0 : 1;
+}
+
+#endif //ifdef TEST_CHAT_BASE
@@ -22,13 +22,25 @@ int out_chat_info(const ChatInfo *chatInfo, FILE *out);
 /** exact format produced by timestamp_to_iso8601() */
 #define ISO_8601_FORMAT "YYYY-MM-DDThh:mm:ss.ttt"
 
+/** length of ISO_8601_FORMAT */
+#define ISO_8601_LEN (sizeof(ISO_8601_FORMAT) - 1)
+
 /** set buf to ISO-8601 representation of timestamp in localtime.
  *  Should have bufSize > strlen(ISO_8601_FMT).
  *
  *  Will not exceed bufSize.  Return value like snprintf():
  *  # of characters which would have been output (not counting the NUL).
+ *
+ *  The local time of the current minute is cached per thread, so
+ *  successive calls with nearby timestamps do not call localtime_r().
  */
 size_t timestamp_to_iso8601(TimeMillis timestamp,
                             size_t bufSize, char buf[bufSize]);
 
+/** set bufs[i] to the ISO-8601 representation of timestamps[i] in
+ *  localtime for i in [0, n).  Each bufs[i] is NUL-terminated.
+ */
+void timestamps_to_iso8601(size_t n, const TimeMillis timestamps[n],
+                           char bufs[n][ISO_8601_LEN + 1]);
+
 #endif //#ifndef CHAT_BASE_H_
@@ -5,11 +5,83 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #define ERROR "err "
 
+/****************************** Case Folding ***************************/
+
+enum { WORD_SIZE = sizeof(uint64_t) };
+
+#define BYTES(b) (0x0101010101010101ULL * (b))
+
+/** return word with each of its ASCII upper-case bytes converted to
+ *  lower-case.  Non-ASCII bytes (high bit set) are left unchanged.
+ */
+static inline uint64_t
+fold_case_word(uint64_t word)
+{
+  //adding to the low 7 bits of each byte cannot carry into the next byte
+  const uint64_t low7 = word & ~BYTES(0x80);
+  const uint64_t geA = low7 + BYTES(0x80 - 'A');      //high bit set iff >= 'A'
+  const uint64_t gtZ = low7 + BYTES(0x80 - 'Z' - 1);  //high bit set iff > 'Z'
+  const uint64_t isUpper = geA & ~gtZ & ~word & BYTES(0x80);
+  return word | (isUpper >> 2);                       //0x80 >> 2 == 'a' - 'A'
+}
+
+/** convert ASCII upper-case characters in NUL-terminated name to
+ *  lower-case in-place a word at a time.  Return name.
+ */
+char *
+fold_case_name(char *name)
+{
+  const size_t n = strlen(name);
+  size_t i = 0;
+  for (; i + WORD_SIZE <= n; i += WORD_SIZE) {
+    uint64_t word;
+    memcpy(&word, &name[i], WORD_SIZE);
+    word = fold_case_word(word);
+    memcpy(&name[i], &word, WORD_SIZE);
+  }
+  for (; i < n; i++) {
+    if ('A' <= name[i] && name[i] <= 'Z') name[i] += 'a' - 'A';
+  }
+  return name;
+}
+
+/** fold case of input->args[lo, input->nArgs) in-place.  The strings
+ *  are owned by input and are writable even though args[] is declared
+ *  const for clients.
+ */
+static void
+fold_case_args(const MsgArgs *input, int lo)
+{
+  for (int i = lo; i < input->nArgs; i++) {
+    fold_case_name((char *)input->args[i]);
+  }
+}
+
+/** remove duplicate topics from already folded add command, retaining
+ *  the first occurrence of each topic.  Compacts the topics[] array
+ *  in-place.
+ */
+static void
+dedup_add_topics(AddCmd *add)
+{
+  size_t n = 0;
+  for (size_t i = 0; i < add->nTopics; i++) {
+    size_t j = 0;
+    while (j < n && strcmp(add->topics[j], add->topics[i]) != 0) j++;
+    if (j == n) add->topics[n++] = add->topics[i];
+  }
+  add->nTopics = n;
+}
+
+/**************************** Command Parsing **************************/
+
 static int
 parse_add_cmd(const MsgArgs *add, ChatCmd *cmd, FILE *err)
 {
@@ -54,13 +126,18 @@ parse_query_cmd(const MsgArgs *query, ChatCmd *cmd, FILE *err)
     return errorf(err, ERROR "BAD_ROOM: ROOM arg \"%s\" "
                   "does not start with a letter", query->args[1]);
   }
-  if (query->nArgs > 2 && isdigit(query->args[2][0])) {
-    char *p;
-    count = strtol(query->args[2], &p, 10);
+  while (topicsIndex < query->nArgs && isalpha(query->args[topicsIndex][0])) {
     topicsIndex++;
+  }
+  const int nRooms = topicsIndex - 1;
+  if (query->nArgs > topicsIndex && isdigit(query->args[topicsIndex][0])) {
+    char *p;
+    count = strtol(query->args[topicsIndex], &p, 10);
     if (*p != '\0') {
-      return errorf(err, ERROR "BAD_COUNT: bad COUNT arg \"%s\"", query->args[2]);
+      return errorf(err, ERROR "BAD_COUNT: bad COUNT arg \"%s\"",
+                    query->args[topicsIndex]);
     }
+    topicsIndex++;
   }
   if (query->msg != NULL) {
     return errorf(err, ERROR "BAD_MESSAGE: query command cannot have a message");
@@ -75,23 +152,61 @@ parse_query_cmd(const MsgArgs *query, ChatCmd *cmd, FILE *err)
   //all okay, fill out *cmd
   cmd->type = QUERY_CMD;
   cmd->query.room = query->args[1];
+  cmd->query.nRooms = nRooms;
+  cmd->query.rooms = &query->args[1];
   cmd->query.count = count;
   cmd->query.nTopics = query->nArgs - topicsIndex;
   cmd->query.topics = &query->args[topicsIndex];
   return 0;
 }
 
-// input should specify an ADD or QUERY command:
+static int
+parse_stats_cmd(const MsgArgs *stats, ChatCmd *cmd, FILE *err)
+{
+  long count = 5;
+  assert(strcmp(stats->args[0], "%") == 0);
+  if (stats->nArgs < 2) return errorf(err, ERROR "BAD_ROOM: missing ROOM arg");
+  if (!isalpha(stats->args[1][0])) {
+    return errorf(err, ERROR "BAD_ROOM: ROOM arg \"%s\" "
+                  "does not start with a letter", stats->args[1]);
+  }
+  if (stats->nArgs > 2) {
+    char *p;
+    count = strtol(stats->args[2], &p, 10);
+    if (!isdigit(stats->args[2][0]) || *p != '\0') {
+      return errorf(err, ERROR "BAD_COUNT: bad COUNT arg \"%s\"",
+                    stats->args[2]);
+    }
+    if (count > MAX_TOP_TOPICS) {
+      return errorf(err, ERROR "BAD_COUNT: COUNT arg \"%s\" exceeds %d",
+                    stats->args[2], MAX_TOP_TOPICS);
+    }
+  }
+  if (stats->nArgs > 3) {
+    return errorf(err, ERROR "BAD_ARGS: extra argument \"%s\"",
+                  stats->args[3]);
+  }
+  if (stats->msg != NULL) {
+    return errorf(err, ERROR "BAD_MESSAGE: stats command cannot have a message");
+  }
+
+  //all okay, fill out *cmd
+  cmd->type = STATS_CMD;
+  cmd->stats.room = stats->args[1];
+  cmd->stats.count = count;
+  return 0;
+}
+
+// input should specify an ADD, QUERY or STATS command:
 // ADD: should have input->args[] "+" USER ROOM TOPIC*  and input->msg.
-// QUERY: should have input->args[] "?" ROOM COUNT? TOPIC*, no input->msg.
+// QUERY: should have input->args[] "?" ROOM+ COUNT? TOPIC*, no input->msg.
+// STATS: should have input->args[] "%" ROOM COUNT?, no input->msg;
+//        COUNT is the max # of top topics (default 5, at most
+//        MAX_TOP_TOPICS).
 // USER must start @, ROOM with letter, COUNT with digit, TOPIC with #.
 
-/** fill in cmd by parsing input.  Note that all strings in cmd share
- *  storage with strings in input.  Print error message on err if
- *  an error is detected and return non-zero; return 0 otherwise.
- */
-int
-parse_cmd(const MsgArgs *input, ChatCmd *cmd, FILE *err)
+static int
+parse_unfolded_cmd(const MsgArgs *input, ChatCmd *cmd, FILE *err)
 {
   const char *cmdSpec = (input->nArgs == 0) ? "" : input->args[0];
   if (strcmp(cmdSpec, "+") == 0) {
@@ -100,6 +215,9 @@ parse_cmd(const MsgArgs *input, ChatCmd *cmd, FILE *err)
   else if (strcmp(cmdSpec, "?") == 0) {
     return parse_query_cmd(input, cmd, err);
   }
+  else if (strcmp(cmdSpec, "%") == 0) {
+    return parse_stats_cmd(input, cmd, err);
+  }
   else if (strlen(cmdSpec) == 0) {
     errorf(err, ERROR "BAD_COMMAND: missing command");
     return 1;
@@ -110,20 +228,51 @@ parse_cmd(const MsgArgs *input, ChatCmd *cmd, FILE *err)
   }
 }
 
+/** fold case of the names in successfully parsed cmd in a single
+ *  pass over input->args[lo, input->nArgs), then remove duplicate
+ *  topics from an ADD command.
+ */
+static void
+normalize_cmd(const MsgArgs *input, int lo, ChatCmd *cmd)
+{
+  fold_case_args(input, lo);
+  if (cmd->type == ADD_CMD) dedup_add_topics(&cmd->add);
+}
+
+/** fill in cmd by parsing input.  Note that all strings in cmd share
+ *  storage with strings in input.  On success, the USER, ROOM and
+ *  TOPIC strings in input are folded to lower-case in-place and
+ *  duplicate topics are removed from an ADD command.  Print error
+ *  message on err if an error is detected and return non-zero; return
+ *  0 otherwise.
+ */
+int
+parse_cmd(const MsgArgs *input, ChatCmd *cmd, FILE *err)
+{
+  const int rc = parse_unfolded_cmd(input, cmd, err);
+  if (rc == 0) normalize_cmd(input, 1, cmd);
+  return rc;
+}
+
 /** fill in cmd by parsing input for user logged into chat-room room.
  *  Note that all strings in cmd share storage with strings in input
- *  as well as user and room.  Print error message on err if an error
- *  is detected and return non-zero; return 0 otherwise.
+ *  as well as user and room.  Strings in input are normalized as for
+ *  parse_cmd(), but user and room are used as given.  Print error
+ *  message on err if an error is detected and return non-zero; return
+ *  0 otherwise.
  */
 int
 parse_loggedin_cmd(const MsgArgs *input, const char *user, const char *room,
                    ChatCmd *cmd, FILE *err)
 {
-  if (strcmp(input->args[0], "+") == 0) {
+  const bool isAdd = strcmp(input->args[0], "+") == 0;
+  if (isAdd) {
     input->args[1] = user;
     input->args[2] = room;
   }
-  return parse_cmd(input, cmd, err);
+  const int rc = parse_unfolded_cmd(input, cmd, err);
+  if (rc == 0) normalize_cmd(input, isAdd ? 3 : 1, cmd);
+  return rc;
 }
 
 /** utility routine to print cmd on out; use for debugging. */
@@ -139,12 +288,19 @@ print_cmd(FILE *out, const ChatCmd *cmd) {
     fprintf(out, "%s", cmd->add.message);
     break;
   case QUERY_CMD:
-    fprintf(out, "QUERY %s %zu ", cmd->query.room, cmd->query.count);
+    fprintf(out, "QUERY ");
+    for (int i = 0; i < cmd->query.nRooms; i++) {
+      fprintf(out, "%s ", cmd->query.rooms[i]);
+    }
+    fprintf(out, "%zu ", cmd->query.count);
     for (int i = 0; i < cmd->query.nTopics; i++) {
       fprintf(out, "%s ", cmd->query.topics[i]);
     }
     fprintf(out, "\n");
     break;
+  case STATS_CMD:
+    fprintf(out, "STATS %s %zu\n", cmd->stats.room, cmd->stats.count);
+    break;
   case END_CMD:
     fprintf(out, "END\n");
     break;
@@ -162,6 +318,12 @@ char *testLines =
   ".\n"
   "? room 22 #topic\n"              //QUERY
   ".\n"
+  "? room1 room2 5 #topic\n"        //multi-room QUERY
+  ".\n"
+  "% room 3\n"                      //STATS
+  ".\n"
+  "% room 3 #topic\n"               //err BAD_ARGS
+  ".\n"
   "- room 22 #topic\n"              //err BAD_CMD
   ".\n"
   "+ room 22 #topic\n"              //err BAD_USER
@@ -169,6 +331,11 @@ char *testLines =
   "+ @ZDU 22 #topic\n"              //err BAD_ROOM
   ".\n"
   "+ @ZDU room 22 #topic\n"         //err BAD_TOPIC
+  ".\n"
+  "+ @ZDU Room #Topic1 #TOPIC1 #topic2 #topic1\n" //ADD @zdu room #topic1 #topic2
+  "Mixed Case Message\n"
+  ".\n"
+  "? ROOM1 rOOm2 5 #A_Very_Long_Topic_Name\n"       //QUERY room1 room2
   ".\n";
 
 
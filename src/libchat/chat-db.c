@@ -1,7 +1,14 @@
 #include "chat-db.h"
+#include "room-activity.h"
 #include "schema.sql.cpp"
 
+#include <arena.h>
+#include <bloom.h>
 #include <errors.h>
+#include <len-str-space.h>
+#include <lz.h>
+#include <memalloc.h>
+#include <metrics.h>
 #include <str-space.h>
 #include <vector.h>
 
@@ -12,11 +19,14 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdalign.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 
 // *Important Note*: sqlite3 uses 1-based indexes for binding
@@ -45,28 +55,153 @@ enum {
 
 enum { MAX_CHATS_QUERY_N_TOPICS_PREP = 4 };
 
+/** max # of room cursors of a multi-room query which use cached
+ *  statements; further cursors prepare their own.
+ */
+enum { MAX_CACHED_ROOM_CURSORS = 8 };
+
 /** IDs for cached prepared statements */
 enum {
   ROOM_COUNT_PREP,             //count chats for a room
   TOPIC_COUNT_PREP,            //count chats for a topic
   CHATS_ADD_PREP,              //insert chats row
+  CHATS_ADD_TIME_PREP,         //insert chats row with specified creationTime
   TOPICS_ADD_PREP,             //insert topics row
   TOPICS_QUERY_PREP,           //query all topics given chatId
+  DATA_VERSION_PREP,           //query data version for name filters
   CHATS_QUERY_TOPICS_0_PREP,   //query chats, topics joined with 0 topics
   CHATS_QUERY_TOPICS_1_PREP,   //query chats, topics joined with 1 topic
   CHATS_QUERY_TOPICS_2_PREP,   //query chats, topics joined with 2 topics
   CHATS_QUERY_TOPICS_3_PREP,   //query chats, topics joined with 3 topics
+  CHATS_STREAM_QUERY_TOPICS_0_PREP, //streaming query chats with 0 topics
+  CHATS_STREAM_QUERY_TOPICS_1_PREP, //streaming query chats with 1 topic
+  CHATS_STREAM_QUERY_TOPICS_2_PREP, //streaming query chats with 2 topics
+  CHATS_STREAM_QUERY_TOPICS_3_PREP, //streaming query chats with 3 topics
   N_PREPS  //must be last
 };
 
+/** # of cached chats queries; these must be the last preps */
+enum { N_CHATS_QUERY_PREPS = N_PREPS - CHATS_QUERY_TOPICS_0_PREP };
+
+/** IDs for latency histograms: one for each cached prepared
+ *  statement (using its prep ID), followed by the rest.
+ */
+enum {
+  OTHER_SQL_STAT = N_PREPS,    //all SQL not using a cached statement
+  ADD_CHAT_STAT,               //add_chat_db() overall
+  RUN_QUERY_STAT,              //run_query_chat_db() overall
+  N_LATENCY_STATS  //must be last
+};
+
+static const char *LATENCY_STAT_NAMES[] = {
+  "ROOM_COUNT_PREP",
+  "TOPIC_COUNT_PREP",
+  "CHATS_ADD_PREP",
+  "CHATS_ADD_TIME_PREP",
+  "TOPICS_ADD_PREP",
+  "TOPICS_QUERY_PREP",
+  "DATA_VERSION_PREP",
+  "CHATS_QUERY_TOPICS_0_PREP",
+  "CHATS_QUERY_TOPICS_1_PREP",
+  "CHATS_QUERY_TOPICS_2_PREP",
+  "CHATS_QUERY_TOPICS_3_PREP",
+  "CHATS_STREAM_QUERY_TOPICS_0_PREP",
+  "CHATS_STREAM_QUERY_TOPICS_1_PREP",
+  "CHATS_STREAM_QUERY_TOPICS_2_PREP",
+  "CHATS_STREAM_QUERY_TOPICS_3_PREP",
+  "OTHER_SQL",
+  "add_chat_db",
+  "run_query_chat_db",
+};
+static_assert(sizeof(LATENCY_STAT_NAMES)/sizeof(LATENCY_STAT_NAMES[0])
+              == N_LATENCY_STATS, "LATENCY_STAT_NAMES out of sync");
+
+/** start time for a running SQL statement */
+typedef struct {
+  sqlite3_stmt *stmt;           //NULL if slot unused
+  uint64_t start;               //nanos when stmt started running
+} StmtTimer;
+
+/** max # of concurrently running statements timed by chat-db itself */
+enum { MAX_STMT_TIMERS = 16 };
+
+/** IDs for filters of known names */
+typedef enum {
+  ROOMS_FILTER,
+  TOPICS_FILTER,
+  N_FILTERS   //must be last
+} FilterId;
+
+/** in-memory filter of known names */
+typedef struct {
+  BloomFilter bloom;
+  size_t capacity;              //# of names bloom sized for
+  size_t nRejects;              //# of lookups rejected by bloom
+  size_t nFalsePositives;       //# of lookups passed by bloom but not in db
+} NameFilter;
+
+/** process-wide metrics registered in global_metrics(); any of these
+ *  may be NULL if registration failed, making its updates NOPs.
+ */
+typedef struct {
+  Counter *adds;                //# of add_chat_db() calls
+  Counter *addErrors;           //# of add_chat_db() calls which failed
+  Histogram *addNanos;          //add_chat_db() latencies
+  Counter *queries;             //# of run_query_chat_db() calls
+  Counter *queryErrors;         //# of run_query_chat_db() calls which failed
+  Histogram *queryNanos;        //run_query_chat_db() latencies
+} ChatDbMetrics;
+
 struct _ChatDb {
   const char *path;             //path for db file
   sqlite3 *db;                  //sqlite db handle
   StrSpace errSpace;            //used for errors and results
   const char *err;              //point to err msg, usually in err
   sqlite3_stmt *preps[N_PREPS]; //cache for lazily initialized prepare statements
+  //cached chats queries for the 2nd and later cursors of a multi-room
+  //query, indexed by offset from CHATS_QUERY_TOPICS_0_PREP and cursor
+  sqlite3_stmt *roomCursorPreps[N_CHATS_QUERY_PREPS]
+                               [MAX_CACHED_ROOM_CURSORS - 1];
+  bool isInMemory;              //true for transient in-memory db
+  double filterFpRate;          //0 if filters disabled
+  NameFilter filters[N_FILTERS];//filters for known rooms and topics
+  RowId syncedChatId;           //all chats with id <= this are in filters
+  int64_t dataVersion;          //PRAGMA data_version when filters synced
+  bool isBulkLoad;              //true between begin/end_bulk_load_chat_db()
+  int64_t savedSynchronous;     //PRAGMA synchronous before bulk load
+  bool isStats;                 //true iff collecting latency stats
+  uint64_t slowNanos;           //log SQL taking at least this long
+  FILE *slowLog;                //NULL if not logging slow SQL
+  Histogram *latencies;         //[N_LATENCY_STATS]; NULL until stats enabled
+  void *latenciesBlock;         //MEM_TAG_DB block holding latencies
+  ChatDbMetrics metrics;        //process-wide metrics shared by all dbs
+  StmtTimer stmtTimers[MAX_STMT_TIMERS]; //start times of running statements
+  bool hasActivities;           //false if room activities disabled
+  pthread_mutex_t activitiesLock; //guards activities when hasActivities
+  RoomActivities activities;    //sliding-window room activity aggregates
+  ChatDbCompressionStats compression; //minSize 0 if compression disabled
+};
+
+/** state for streaming the message of the chat at the current row of
+ *  a chats query; lives on the stack of the query while its ChatInfo
+ *  is passed to an IterFn.
+ */
+struct ChatStream {
+  sqlite3_stmt *query;          //chats query at row of chat
+  RowId id;                     //id of chat
+  Arena *arena;                 //the query's arena for decompression
 };
 
+/** values for chats encoding column */
+typedef enum {
+  PLAIN_ENCODING,               //message is plain text (or a large blob)
+  LZ_ENCODING,                  //message is a blob compressed by compress_lz()
+} MessageEncoding;
+
+/** vector of topic pointers; most chats have only a few topics */
+enum { N_INLINE_TOPICS = 8 };
+DEFINE_VECTOR(TopicsVector, const char *, N_INLINE_TOPICS)
+
 
 //sqlite3 specification for an in-memory db
 #define SQLITE3_MEMORY_DB ":memory:"
@@ -139,6 +274,213 @@ run_count_stmt(ChatDb *chatDb, sqlite3_stmt *stmt, const char *key,
   return NO_ERR;
 }
 
+/************************* Latency Statistics **************************/
+
+/** register chatDb's metrics in global_metrics(); since registration
+ *  returns an existing metric, all dbs in a process share metrics.
+ */
+static void
+init_metrics_chat_db(ChatDb *chatDb)
+{
+  Metrics *global = global_metrics();
+  chatDb->metrics = (ChatDbMetrics) {
+    .adds = counter_metrics(global, "chat_db_adds_total",
+                            "# of chats added"),
+    .addErrors = counter_metrics(global, "chat_db_add_errors_total",
+                                 "# of failed chat adds"),
+    .addNanos = histogram_metrics(global, "chat_db_add_nanos",
+                                  "chat add latency in nanoseconds"),
+    .queries = counter_metrics(global, "chat_db_queries_total",
+                               "# of chat queries run"),
+    .queryErrors = counter_metrics(global, "chat_db_query_errors_total",
+                                   "# of failed chat queries"),
+    .queryNanos = histogram_metrics(global, "chat_db_query_nanos",
+                                    "chat query latency in nanoseconds"),
+  };
+}
+
+static uint64_t
+now_nanos(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** record nanos in chatDb's histogram for latency stat id if
+ *  collecting stats.
+ */
+static void
+record_latency(ChatDb *chatDb, int id, uint64_t nanos)
+{
+  if (chatDb->isStats) record_histogram(&chatDb->latencies[id], nanos);
+}
+
+/** return an upper bound for the p'th percentile (0 <= p <= 100) of
+ *  the latencies in histogram, accurate to within a factor of 2.
+ */
+uint64_t
+percentile_latency_histogram(const LatencyHistogram *histogram, double p)
+{
+  if (histogram->count == 0) return 0;
+  const double rank = p / 100 * histogram->count;
+  uint64_t n = 0;
+  for (int i = 0; i < N_LATENCY_BUCKETS - 1; i++) {
+    if ((n += histogram->buckets[i]) >= rank && n > 0) {
+      const uint64_t bound = (2ULL << i) - 1;
+      return bound < histogram->maxNanos ? bound : histogram->maxNanos;
+    }
+  }
+  return histogram->maxNanos;
+}
+
+/** return slot in chatDb->stmtTimers[] for stmt; if not found,
+ *  return an empty slot if newStmt is non-NULL, else NULL.
+ */
+static StmtTimer *
+find_stmt_timer(ChatDb *chatDb, sqlite3_stmt *stmt, sqlite3_stmt *newStmt)
+{
+  StmtTimer *empty = NULL;
+  for (int i = 0; i < MAX_STMT_TIMERS; i++) {
+    StmtTimer *timer = &chatDb->stmtTimers[i];
+    if (timer->stmt == stmt) return timer;
+    if (!empty && timer->stmt == NULL) empty = timer;
+  }
+  return newStmt ? empty : NULL;
+}
+
+/** sqlite3_trace_v2() callback.  The SQLITE_TRACE_PROFILE run time
+ *  reported by sqlite only has the resolution of the VFS clock
+ *  (milliseconds), so we time statements ourselves from their
+ *  SQLITE_TRACE_STMT event (first step) to their SQLITE_TRACE_PROFILE
+ *  event (finish), falling back on the sqlite time if there are too
+ *  many statements running concurrently.
+ */
+static int
+trace_stats(unsigned type, void *ctx, void *p, void *x)
+{
+  ChatDb *chatDb = ctx;
+  sqlite3_stmt *stmt = p;
+  if (type == SQLITE_TRACE_STMT) {
+    //trigger sub-programs are reported with SQL starting with "--"
+    if (strncmp((const char *)x, "--", 2) == 0) return 0;
+    StmtTimer *timer = find_stmt_timer(chatDb, stmt, stmt);
+    if (timer) *timer = (StmtTimer) { .stmt = stmt, .start = now_nanos() };
+    return 0;
+  }
+  StmtTimer *timer = find_stmt_timer(chatDb, stmt, NULL);
+  uint64_t nanos = *(sqlite3_int64 *)x;
+  if (timer) {
+    nanos = now_nanos() - timer->start;
+    timer->stmt = NULL;
+  }
+  int id = OTHER_SQL_STAT;
+  for (int i = 0; i < N_PREPS; i++) {
+    if (chatDb->preps[i] == stmt) { id = i; break; }
+  }
+  for (int i = 0; id == OTHER_SQL_STAT && i < N_CHATS_QUERY_PREPS; i++) {
+    for (int j = 0; j < MAX_CACHED_ROOM_CURSORS - 1; j++) {
+      if (chatDb->roomCursorPreps[i][j] == stmt) {
+        id = CHATS_QUERY_TOPICS_0_PREP + i;
+        break;
+      }
+    }
+  }
+  record_latency(chatDb, id, nanos);
+  if (chatDb->slowLog && chatDb->slowNanos > 0 && nanos >= chatDb->slowNanos) {
+    char *sql = sqlite3_expanded_sql(stmt);
+    fprintf(chatDb->slowLog, "slow SQL %s %.3fms: %s\n",
+            LATENCY_STAT_NAMES[id], nanos / 1e6,
+            sql ? sql : sqlite3_sql(stmt));
+    sqlite3_free(sql);
+  }
+  return 0;
+}
+
+/** Start or stop collecting latency statistics for chatDb as per
+ *  *options; if options is NULL, then stop.  Latencies are collected
+ *  for each cached prepared statement, for all other SQL statements
+ *  together and for add_chat_db() and run_query_chat_db() calls
+ *  overall.  Statement latencies are measured from the first step
+ *  of a statement until it is reset, so query statements include
+ *  time spent in the caller's IterFn.  Collection is off by
+ *  default; when off, SQL statements are not traced.  Note that
+ *  add_chat_db() and run_query_chat_db() are always timed for the
+ *  process-wide chat_db_*_nanos metrics, whether or not collection
+ *  is on.
+ *
+ *  Previously collected statistics are retained.
+ */
+int
+set_stats_chat_db(ChatDb *chatDb, const ChatDbStatsOptions *options)
+{
+  const bool isStats = options != NULL && options->isEnabled;
+  if (isStats && !chatDb->latencies) {
+    //histograms are large, so allocate only when first needed; tagged
+    //blocks are not cache-line aligned, so over-allocate and align
+    const size_t align = alignof(Histogram);
+    const size_t size = N_LATENCY_STATS * sizeof(Histogram) + align - 1;
+    chatDb->latenciesBlock = malloc_tag(MEM_TAG_DB, size);
+    if (!chatDb->latenciesBlock) {
+      return str_space_error(chatDb, "cannot allocate latency histograms");
+    }
+    const uintptr_t addr = (uintptr_t)chatDb->latenciesBlock;
+    chatDb->latencies = (Histogram *)((addr + align - 1) & ~(align - 1));
+    clear_stats_chat_db(chatDb);
+  }
+  const unsigned mask = SQLITE_TRACE_STMT|SQLITE_TRACE_PROFILE;
+  int rc = isStats
+    ? sqlite3_trace_v2(chatDb->db, mask, trace_stats, chatDb)
+    : sqlite3_trace_v2(chatDb->db, 0, NULL, NULL);
+  if (rc != SQLITE_OK) return sqlite3_error(chatDb);
+  chatDb->isStats = isStats;
+  memset(chatDb->stmtTimers, 0, sizeof(chatDb->stmtTimers));
+  chatDb->slowNanos = isStats ? options->slowNanos : 0;
+  chatDb->slowLog = isStats ? options->slowLog : NULL;
+  return NO_ERR;
+}
+
+/** reset all latency statistics collected for chatDb */
+int
+clear_stats_chat_db(ChatDb *chatDb)
+{
+  for (int i = 0; chatDb->latencies && i < N_LATENCY_STATS; i++) {
+    init_histogram(&chatDb->latencies[i]);
+  }
+  return NO_ERR;
+}
+
+/** call iterFn(name, histogram, ctx) for each latency histogram
+ *  collected for chatDb, including empty ones.  The statement
+ *  histograms are named by their prepared statement id (like
+ *  "ROOM_COUNT_PREP"), with "OTHER_SQL" for uncached statements;
+ *  the overall histograms are named "add_chat_db" and
+ *  "run_query_chat_db".  If iterFn() returns non-zero, then the
+ *  iteration is terminated.
+ */
+int
+iter_stats_chat_db(const ChatDb *chatDb, LatencyIterFn *iterFn, void *ctx)
+{
+  HistogramSnapshot snapshot;
+  for (int i = 0; i < N_LATENCY_STATS; i++) {
+    if (chatDb->latencies) {
+      snapshot_histogram(&chatDb->latencies[i], &snapshot);
+    }
+    else {
+      init_histogram_snapshot(&snapshot);
+    }
+    LatencyHistogram histogram = {
+      .count = snapshot.count,
+      .totalNanos = snapshot.sum,
+      .maxNanos = snapshot.max,
+    };
+    log2_histogram_snapshot(&snapshot, N_LATENCY_BUCKETS, histogram.buckets);
+    if (iterFn(LATENCY_STAT_NAMES[i], &histogram, ctx) != 0) break;
+  }
+  return NO_ERR;
+}
+
+
 /************************** DB Initialization **************************/
 
 /** Set *exists to true iff tableName exists in db.  Note that since
@@ -174,8 +516,33 @@ table_exists(ChatDb *chatDb, const char *tableName, bool *exists)
 }
 
 
+/** set *exists to true iff table tableName has a column columnName.
+ *  Returns non-zero on error.
+ */
+static int
+column_exists(ChatDb *chatDb, const char *tableName, const char *columnName,
+              bool *exists)
+{
+  const char *sql = "SELECT name FROM pragma_table_info(?) WHERE name=?;";
+  sqlite3_stmt *stmt;
+  int errCode = prepare_stmt(chatDb, sql, -1, &stmt);
+  if (errCode != NO_ERR) return errCode;
+  sqlite3_bind_text(stmt, 1, tableName, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 2, columnName, -1, SQLITE_STATIC);
+  int rc = sqlite3_step(stmt);
+  if (rc != SQLITE_DONE && rc != SQLITE_ROW) errCode = sqlite3_error(chatDb);
+  *exists = (rc == SQLITE_ROW);
+  sqlite3_finalize(stmt);
+  return errCode;
+}
+
 /** If CHATS table does not exist, then assume db needs to be
  *  set up.  Use DDL statements from schema.sql.cpp to create tables.
+ *  A db created before messages could be compressed is upgraded by
+ *  adding the chats encoding column.  Since the DDL statements are
+ *  all IF NOT EXISTS, they are also run for an existing db so as to
+ *  restore the roomx and topicx indexes if they were left dropped by
+ *  a bulk load which did not complete.
  */
 static int
 init_db(ChatDb *chatDb)
@@ -184,8 +551,22 @@ init_db(ChatDb *chatDb)
   if (table_exists(chatDb, CHATS_TABLE, &dbExists) != NO_ERR) {
     return DB_ERR;
   }
-  if (dbExists) return NO_ERR;
-  const char *sqls[] = { CREATE_CHATS_SQL_STR, CREATE_TOPICS_SQL_STR };
+  if (dbExists) {
+    bool hasEncoding;
+    if (column_exists(chatDb, CHATS_TABLE, "encoding", &hasEncoding)
+        != NO_ERR) {
+      return DB_ERR;
+    }
+    if (!hasEncoding) {
+      const char *sql =
+        "ALTER TABLE chats ADD COLUMN encoding INTEGER DEFAULT 0";
+      int rc = sqlite3_exec(chatDb->db, sql, NULL, 0, NULL);
+      if (rc != SQLITE_OK) return DB_ERR;
+    }
+  }
+  const char *sqls[] = {
+    CREATE_CHATS_SQL_STR, CREATE_TOPICS_SQL_STR, CREATE_FILTERS_SQL_STR,
+  };
   for (int i = 0; i < sizeof(sqls)/sizeof(sqls[0]); i++) {
     const char *sql = sqls[i];
     char *err;
@@ -196,35 +577,582 @@ init_db(ChatDb *chatDb)
   return NO_ERR;
 }
 
+/**************************** Name Filters *****************************/
+
+// Bloom filters of known rooms and topics allow rejecting unknown
+// names without running any SQL.  Since names are stored lower-cased,
+// the filters ignore case.
+//
+// The filters contain the names from all chats with id <=
+// chatDb->syncedChatId, as well as those from chats added using this
+// chatDb.  Since other connections may add chats to a file db, a name
+// rejected by a filter for a file db is trusted only if PRAGMA
+// data_version shows that no other connection has committed since
+// the filters were last synced; otherwise the filters are first
+// brought up-to-date by scanning only the newer chats.
+//
+// The filters are persisted in the filters table by free_chat_db()
+// and reloaded by make_chat_db(), so that only chats added in the
+// interim need to be scanned.
+
+enum { MIN_FILTER_CAPACITY = 1024 };
+
+//indexed by FilterId; used as keys in filters table
+static const char *filterNames[] = { "rooms", "topics" };
+
+static inline bool
+has_filters(const ChatDb *chatDb)
+{
+  return chatDb->filterFpRate > 0;
+}
+
+/** set *value to single integer result of running sql */
+static int
+run_int_query(ChatDb *chatDb, const char *sql, int prepIndex, int64_t *value)
+{
+  sqlite3_stmt *stmt;
+  int errCode = prepare_stmt(chatDb, sql, prepIndex, &stmt);
+  if (errCode != NO_ERR) return errCode;
+  int rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW) {
+    *value = sqlite3_column_int64(stmt, 0);
+    errCode = NO_ERR;
+  }
+  else {
+    errCode = sqlite3_error(chatDb);
+  }
+  if (prepIndex >= 0) sqlite3_reset(stmt); else sqlite3_finalize(stmt);
+  return errCode;
+}
+
+/** (re-)initialize filter id to be empty and sized for capacity names */
+static int
+init_name_filter(ChatDb *chatDb, FilterId id, size_t capacity)
+{
+  NameFilter *filter = &chatDb->filters[id];
+  free_bloom_filter(&filter->bloom);
+  if (capacity < MIN_FILTER_CAPACITY) capacity = MIN_FILTER_CAPACITY;
+  if (init_bloom_filter(&filter->bloom, capacity, chatDb->filterFpRate,
+                        true) != 0) {
+    return str_space_error(chatDb, "cannot allocate name filter");
+  }
+  filter->capacity = capacity;
+  return NO_ERR;
+}
+
+static void
+add_name_filter(ChatDb *chatDb, FilterId id, const char *name)
+{
+  if (name != NULL) {
+    add_bloom_filter(&chatDb->filters[id].bloom, name, strlen(name));
+  }
+}
+
+#define CHATS_SCAN_SQL "SELECT id, room FROM chats WHERE id > ? ORDER BY id;"
+#define TOPICS_SCAN_SQL \
+  "SELECT topic FROM topics WHERE chatId > ? AND chatId <= ?;"
+
+/** add names from all chats with id > chatDb->syncedChatId to filters */
+static int
+scan_filters(ChatDb *chatDb)
+{
+  sqlite3_stmt *chatsScan = NULL;
+  sqlite3_stmt *topicsScan = NULL;
+  int rc;
+  //use a single read transaction so that both scans see the same chats
+  sqlite3_exec(chatDb->db, "BEGIN TRANSACTION", 0, 0, 0);
+  int64_t dataVersion;
+  int errCode = run_int_query(chatDb, "PRAGMA data_version;",
+                              DATA_VERSION_PREP, &dataVersion);
+  if (errCode != NO_ERR) goto CLEANUP;
+  errCode = prepare_stmt(chatDb, CHATS_SCAN_SQL, -1, &chatsScan);
+  if (errCode != NO_ERR) goto CLEANUP;
+  RowId maxChatId = chatDb->syncedChatId;
+  sqlite3_bind_int64(chatsScan, 1, chatDb->syncedChatId);
+  while ((rc = sqlite3_step(chatsScan)) == SQLITE_ROW) {
+    maxChatId = sqlite3_column_int64(chatsScan, 0);
+    add_name_filter(chatDb, ROOMS_FILTER,
+                    (const char *)sqlite3_column_text(chatsScan, 1));
+  }
+  if (rc != SQLITE_DONE) { errCode = sqlite3_error(chatDb); goto CLEANUP; }
+  errCode = prepare_stmt(chatDb, TOPICS_SCAN_SQL, -1, &topicsScan);
+  if (errCode != NO_ERR) goto CLEANUP;
+  sqlite3_bind_int64(topicsScan, 1, chatDb->syncedChatId);
+  sqlite3_bind_int64(topicsScan, 2, maxChatId);
+  while ((rc = sqlite3_step(topicsScan)) == SQLITE_ROW) {
+    add_name_filter(chatDb, TOPICS_FILTER,
+                    (const char *)sqlite3_column_text(topicsScan, 0));
+  }
+  if (rc != SQLITE_DONE) { errCode = sqlite3_error(chatDb); goto CLEANUP; }
+  TRACE("synced filters from chat id %ld to %ld",
+        (long)chatDb->syncedChatId, (long)maxChatId);
+  chatDb->syncedChatId = maxChatId;
+  chatDb->dataVersion = dataVersion;
+ CLEANUP:
+  sqlite3_finalize(chatsScan);  //NOP on NULL
+  sqlite3_finalize(topicsScan);
+  sqlite3_exec(chatDb->db, "COMMIT TRANSACTION", 0, 0, 0);
+  return errCode;
+}
+
+static int sync_filters(ChatDb *chatDb);
+
+/** rebuild any filter containing more names than it was sized for */
+static int
+grow_filters(ChatDb *chatDb)
+{
+  bool isGrown = false;
+  for (FilterId id = 0; id < N_FILTERS; id++) {
+    const NameFilter *filter = &chatDb->filters[id];
+    const size_t nItems = n_items_bloom_filter(&filter->bloom);
+    if (nItems <= filter->capacity) continue;
+    int errCode = init_name_filter(chatDb, id, 2*nItems);
+    if (errCode != NO_ERR) return errCode;
+    isGrown = true;
+  }
+  if (!isGrown) return NO_ERR;
+  chatDb->syncedChatId = 0;  //rescan all chats
+  return sync_filters(chatDb);
+}
+
+/** bring filters up-to-date with all chats in db */
+static int
+sync_filters(ChatDb *chatDb)
+{
+  int errCode = scan_filters(chatDb);
+  if (errCode != NO_ERR) return errCode;
+  return grow_filters(chatDb);
+}
+
+/** set *isAbsent to true only if name is definitely not a name in
+ *  filter id, in which case no SQL need be run to validate name.
+ */
+static int
+check_name_filter(ChatDb *chatDb, FilterId id, const char *name,
+                  bool *isAbsent)
+{
+  *isAbsent = false;
+  if (!has_filters(chatDb)) return NO_ERR;
+  NameFilter *filter = &chatDb->filters[id];
+  const size_t nameLen = strlen(name);
+  if (maybe_has_bloom_filter(&filter->bloom, name, nameLen)) return NO_ERR;
+  if (!chatDb->isInMemory) {
+    //name may have been added by another connection since last sync
+    int64_t dataVersion;
+    int errCode = run_int_query(chatDb, "PRAGMA data_version;",
+                                DATA_VERSION_PREP, &dataVersion);
+    if (errCode != NO_ERR) return errCode;
+    if (dataVersion != chatDb->dataVersion) {
+      errCode = sync_filters(chatDb);
+      if (errCode != NO_ERR) return errCode;
+      if (maybe_has_bloom_filter(&filter->bloom, name, nameLen)) {
+        return NO_ERR;
+      }
+    }
+  }
+  filter->nRejects++;
+  *isAbsent = true;
+  return NO_ERR;
+}
+
+/** note that name passed filter id but was not found in db */
+static void
+note_false_positive(ChatDb *chatDb, FilterId id)
+{
+  if (has_filters(chatDb)) chatDb->filters[id].nFalsePositives++;
+}
+
+/** add names from chat with id chatId just added using this chatDb */
+static int
+add_chat_filters(ChatDb *chatDb, RowId chatId, const char *room,
+                 size_t nTopics, const char *topics[nTopics])
+{
+  if (!has_filters(chatDb)) return NO_ERR;
+  add_name_filter(chatDb, ROOMS_FILTER, room);
+  for (int i = 0; i < nTopics; i++) {
+    add_name_filter(chatDb, TOPICS_FILTER, topics[i]);
+  }
+  //no chat from another connection can precede this one unseen
+  if (chatId == chatDb->syncedChatId + 1) chatDb->syncedChatId = chatId;
+  return grow_filters(chatDb);
+}
+
+#define FILTER_LOAD_SQL \
+  "SELECT nHashes, nItems, capacity, syncedChatId, bits " \
+  "FROM filters WHERE name = ?;"
+
+/** load filter id from filters table if possible, setting *isLoaded */
+static int
+load_name_filter(ChatDb *chatDb, FilterId id, RowId *syncedChatId,
+                 bool *isLoaded)
+{
+  *isLoaded = false;
+  sqlite3_stmt *stmt;
+  int errCode = prepare_stmt(chatDb, FILTER_LOAD_SQL, -1, &stmt);
+  if (errCode != NO_ERR) return errCode;
+  sqlite3_bind_text(stmt, 1, filterNames[id], -1, SQLITE_STATIC);
+  int rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW) {
+    const unsigned nHashes = sqlite3_column_int(stmt, 0);
+    const size_t nItems = sqlite3_column_int64(stmt, 1);
+    const size_t capacity = sqlite3_column_int64(stmt, 2);
+    *syncedChatId = sqlite3_column_int64(stmt, 3);
+    const void *bits = sqlite3_column_blob(stmt, 4);
+    const size_t nBytes = sqlite3_column_bytes(stmt, 4);
+    //persisted filter is usable only if it was built for the same fpRate
+    if (nHashes == n_hashes_bloom_filter(chatDb->filterFpRate)) {
+      NameFilter *filter = &chatDb->filters[id];
+      free_bloom_filter(&filter->bloom);
+      *isLoaded = load_bloom_filter(&filter->bloom, nHashes, nItems, true,
+                                    nBytes, bits) == 0;
+      filter->capacity = capacity;
+    }
+  }
+  else if (rc != SQLITE_DONE) {
+    errCode = sqlite3_error(chatDb);
+  }
+  sqlite3_finalize(stmt);
+  return errCode;
+}
+
+#define COUNT_ROOM_NAMES_SQL "SELECT COUNT(DISTINCT room) FROM chats;"
+#define COUNT_TOPIC_NAMES_SQL "SELECT COUNT(DISTINCT topic) FROM topics;"
+
+/** set up filters from their persisted copies if possible, otherwise
+ *  by scanning all chats.
+ */
+static int
+init_filters(ChatDb *chatDb)
+{
+  if (!has_filters(chatDb)) return NO_ERR;
+  bool isLoaded = false;
+  bool filtersExist;
+  if (table_exists(chatDb, FILTERS_TABLE, &filtersExist) != NO_ERR) {
+    return DB_ERR;
+  }
+  if (filtersExist) {
+    RowId syncedChatIds[N_FILTERS];
+    isLoaded = true;
+    for (FilterId id = 0; isLoaded && id < N_FILTERS; id++) {
+      int errCode =
+        load_name_filter(chatDb, id, &syncedChatIds[id], &isLoaded);
+      if (errCode != NO_ERR) return errCode;
+      isLoaded = isLoaded && syncedChatIds[id] == syncedChatIds[0];
+    }
+    if (isLoaded) chatDb->syncedChatId = syncedChatIds[0];
+  }
+  if (!isLoaded) {
+    const char *countSqls[] = { COUNT_ROOM_NAMES_SQL, COUNT_TOPIC_NAMES_SQL };
+    for (FilterId id = 0; id < N_FILTERS; id++) {
+      int64_t nNames;
+      int errCode = run_int_query(chatDb, countSqls[id], -1, &nNames);
+      if (errCode != NO_ERR) return errCode;
+      errCode = init_name_filter(chatDb, id, 2*nNames);
+      if (errCode != NO_ERR) return errCode;
+    }
+    chatDb->syncedChatId = 0;
+  }
+  TRACE("filters %s; synced to chat id %ld",
+        isLoaded ? "loaded" : "initialized", (long)chatDb->syncedChatId);
+  return sync_filters(chatDb);
+}
+
+#define FILTER_SAVE_SQL \
+  "INSERT OR REPLACE INTO filters " \
+  "(name, nHashes, nItems, capacity, syncedChatId, bits) " \
+  "VALUES (?, ?, ?, ?, ?, ?);"
+
+/** persist filters into filters table */
+static int
+save_filters(ChatDb *chatDb)
+{
+  if (!has_filters(chatDb) || chatDb->isInMemory) return NO_ERR;
+  if (sqlite3_exec(chatDb->db, CREATE_FILTERS_SQL_STR, 0, 0, 0) != SQLITE_OK) {
+    return sqlite3_error(chatDb);
+  }
+  sqlite3_stmt *stmt;
+  int errCode = prepare_stmt(chatDb, FILTER_SAVE_SQL, -1, &stmt);
+  if (errCode != NO_ERR) return errCode;
+  sqlite3_exec(chatDb->db, "BEGIN TRANSACTION", 0, 0, 0);
+  for (FilterId id = 0; errCode == NO_ERR && id < N_FILTERS; id++) {
+    const NameFilter *filter = &chatDb->filters[id];
+    size_t nBytes;
+    const void *bits = bits_bloom_filter(&filter->bloom, &nBytes);
+    sqlite3_bind_text(stmt, 1, filterNames[id], -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, n_hashes_bloom_filter(chatDb->filterFpRate));
+    sqlite3_bind_int64(stmt, 3, n_items_bloom_filter(&filter->bloom));
+    sqlite3_bind_int64(stmt, 4, filter->capacity);
+    sqlite3_bind_int64(stmt, 5, chatDb->syncedChatId);
+    sqlite3_bind_blob(stmt, 6, bits, nBytes, SQLITE_STATIC);
+    if (sqlite3_step(stmt) != SQLITE_DONE) errCode = sqlite3_error(chatDb);
+    sqlite3_reset(stmt);
+  }
+  sqlite3_finalize(stmt);
+  const char *endTxn =
+    (errCode == NO_ERR) ? "COMMIT TRANSACTION" : "ROLLBACK TRANSACTION";
+  sqlite3_exec(chatDb->db, endTxn, 0, 0, 0);
+  return errCode;
+}
+
+static void
+free_filters(ChatDb *chatDb)
+{
+  for (FilterId id = 0; id < N_FILTERS; id++) {
+    free_bloom_filter(&chatDb->filters[id].bloom);
+  }
+}
+
+/************************* Activity Aggregates *************************/
+
+// The sliding-window room activity aggregates (see room-activity.h)
+// are kept only in memory.  They are initialized from the chats in
+// the db within the window when chatDb is created and updated as
+// chats are added through chatDb.  Since both adding a chat and
+// computing stats may slide the window and grow the aggregates, all
+// access is serialized by chatDb->activitiesLock.
+
+/** return current time in milliseconds since the epoch */
+static TimeMillis
+now_millis(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/** add chat with timestamp to activity aggregates */
+static int
+add_chat_activity(ChatDb *chatDb, const char *user, const char *room,
+                  size_t nTopics, const char *topics[nTopics],
+                  TimeMillis timestamp)
+{
+  if (!chatDb->hasActivities) return NO_ERR;
+  pthread_mutex_lock(&chatDb->activitiesLock);
+  const int rc = add_room_activities(&chatDb->activities, user, room,
+                                     nTopics, topics, timestamp);
+  pthread_mutex_unlock(&chatDb->activitiesLock);
+  if (rc != 0) return str_space_error(chatDb, "cannot allocate room activity");
+  return NO_ERR;
+}
+
+#define RECENT_CHATS_SQL \
+  "SELECT id, user, room, creationTime FROM chats WHERE creationTime >= ?;"
+
+#define CHAT_TOPICS_SQL "SELECT topic FROM topics WHERE chatId = ?;"
+
+/** add the chats in the db which are within the window to the
+ *  activity aggregates.
+ */
+static int
+load_activities(ChatDb *chatDb)
+{
+  sqlite3_stmt *chatsScan = NULL;
+  sqlite3_stmt *topicsScan = NULL;
+  StrSpace names;
+  init_str_space(&names);
+  TopicsVector topics;
+  init_TopicsVector(&topics);
+  int errCode = prepare_stmt(chatDb, RECENT_CHATS_SQL, -1, &chatsScan);
+  if (errCode != NO_ERR) goto CLEANUP;
+  errCode = prepare_stmt(chatDb, CHAT_TOPICS_SQL, -1, &topicsScan);
+  if (errCode != NO_ERR) goto CLEANUP;
+  const TimeMillis windowMillis =
+    N_ACTIVITY_BUCKETS * chatDb->activities.bucketMillis;
+  sqlite3_bind_int64(chatsScan, 1, now_millis() - windowMillis);
+  int rc;
+  while ((rc = sqlite3_step(chatsScan)) == SQLITE_ROW) {
+    clear_str_space(&names);
+    clear_TopicsVector(&topics);
+    const TimeMillis timestamp = sqlite3_column_int64(chatsScan, 3);
+    bool isOk = true;
+    for (int colN = 1; colN < 3; colN++) {
+      const char *text = (const char *)sqlite3_column_text(chatsScan, colN);
+      isOk = isOk && add_str_space(&names, text) == 0;
+    }
+    sqlite3_bind_int64(topicsScan, 1, sqlite3_column_int64(chatsScan, 0));
+    while ((rc = sqlite3_step(topicsScan)) == SQLITE_ROW) {
+      const char *topic = (const char *)sqlite3_column_text(topicsScan, 0);
+      isOk = isOk && add_str_space(&names, topic) == 0;
+    }
+    if (sqlite3_reset(topicsScan) != SQLITE_OK) {
+      errCode = sqlite3_error(chatDb);
+      goto CLEANUP;
+    }
+    //names[] has user, room, topics...; pointers stable only once added
+    const char *user = iter_str_space(&names, NULL);
+    const char *room = iter_str_space(&names, user);
+    for (const char *t = iter_str_space(&names, room); isOk && t != NULL;
+         t = iter_str_space(&names, t)) {
+      isOk = add_TopicsVector(&topics, t) == 0;
+    }
+    if (!isOk) {
+      errCode = str_space_error(chatDb, "cannot allocate activity names");
+      goto CLEANUP;
+    }
+    errCode = add_chat_activity(chatDb, user, room,
+                                n_elements_TopicsVector(&topics),
+                                get_base_TopicsVector(&topics), timestamp);
+    if (errCode != NO_ERR) goto CLEANUP;
+  }
+  if (rc != SQLITE_DONE) errCode = sqlite3_error(chatDb);
+ CLEANUP:
+  sqlite3_finalize(chatsScan);
+  sqlite3_finalize(topicsScan);
+  free_str_space(&names);
+  free_TopicsVector(&topics);
+  return errCode;
+}
+
+/** initialize activity aggregates for a window of windowMillis: 0
+ *  for the default window, < 0 to disable.
+ */
+static int
+init_activities(ChatDb *chatDb, TimeMillis windowMillis)
+{
+  chatDb->hasActivities = false;
+  if (windowMillis < 0) return NO_ERR;
+  if (windowMillis == 0) windowMillis = DEFAULT_ACTIVITY_WINDOW_MILLIS;
+  if (init_room_activities(&chatDb->activities, windowMillis) != 0) {
+    return str_space_error(chatDb, "cannot initialize room activities");
+  }
+  pthread_mutex_init(&chatDb->activitiesLock, NULL);
+  chatDb->hasActivities = true;
+  return load_activities(chatDb);
+}
+
+static void
+free_activities(ChatDb *chatDb)
+{
+  if (chatDb->hasActivities) {
+    free_room_activities(&chatDb->activities);
+    pthread_mutex_destroy(&chatDb->activitiesLock);
+  }
+  chatDb->hasActivities = false;
+}
+
+
 /*********************** Chat Message Addition *************************/
 
 #define CHAT_INSERT_SQL \
-  "INSERT INTO chats (user, room, message) VALUES(lower(?), lower(?), ?)"
+  "INSERT INTO chats (user, room, message, encoding) \
+     VALUES(lower(?), lower(?), ?, ?) RETURNING creationTime"
+#define CHAT_INSERT_TIME_SQL \
+  "INSERT INTO chats (user, room, message, encoding, creationTime) \
+     VALUES(lower(?), lower(?), ?, ?, ?) RETURNING creationTime"
 #define TOPIC_INSERT_SQL \
   "INSERT INTO topics (chatId, topic) VALUES(?, lower(?))"
 
+/** write message[messageLen] into the zero-filled message blob of
+ *  the chats row having id rowId.  This avoids having sqlite copy
+ *  large messages into a bound parameter and then into a record.
+ */
+static int
+write_message_blob(ChatDb *chatDb, sqlite3_int64 rowId,
+                   const char *message, size_t messageLen)
+{
+  sqlite3_blob *blob;
+  int rc = sqlite3_blob_open(chatDb->db, "main", CHATS_TABLE, "message",
+                             rowId, 1, &blob);
+  if (rc != SQLITE_OK) return sqlite3_error(chatDb);
+  rc = sqlite3_blob_write(blob, message, messageLen, 0);
+  int errCode = (rc == SQLITE_OK) ? NO_ERR : sqlite3_error(chatDb);
+  sqlite3_blob_close(blob);
+  return errCode;
+}
+
+/** bind message[messageLen] compressed as parameter index of stmt
+ *  if it is long enough and compresses to fewer bytes.  Set
+ *  *isCompressed to true iff it was bound, in which case *storedLen
+ *  is set to its compressed length.
+ */
+static int
+bind_compressed_message(ChatDb *chatDb, sqlite3_stmt *stmt, int index,
+                        const char *message, size_t messageLen,
+                        bool *isCompressed, size_t *storedLen)
+{
+  const size_t minSize = chatDb->compression.minSize;
+  *isCompressed = false;
+  if (minSize == 0 || messageLen < minSize) return NO_ERR;
+  char *compressed =
+    malloc_tag(MEM_TAG_MSG, max_compressed_size_lz(messageLen));
+  if (!compressed) return str_space_error(chatDb, "cannot allocate compressed");
+  const size_t n = compress_lz(message, messageLen, compressed);
+  if (n >= messageLen) {
+    free_tag(compressed);
+    return NO_ERR;
+  }
+  //sqlite frees compressed when it is no longer needed
+  if (sqlite3_bind_blob64(stmt, index, compressed, n, free_tag) != SQLITE_OK) {
+    return sqlite3_error(chatDb);
+  }
+  *isCompressed = true;
+  *storedLen = n;
+  return NO_ERR;
+}
+
+/** insert chats row, setting *rowId to its id and *creationTime to
+ *  its stored creationTime; if timestamp is non-zero, then it is used
+ *  as the creationTime rather than the current time.  Messages are
+ *  stored compressed if enabled and worthwhile; otherwise large
+ *  messages are inserted as a zero-filled blob which is then written
+ *  in place.
+ */
 static int
 add_chat(ChatDb *chatDb, const char *user, const char *room,
-         size_t nTopics, const char *message, sqlite3_int64 *rowId)
+         size_t nTopics, const char *message, TimeMillis timestamp,
+         sqlite3_int64 *rowId, TimeMillis *creationTime)
 {
   sqlite3_stmt *addChatStmt = NULL;
-  int errCode =
-    prepare_stmt(chatDb, CHAT_INSERT_SQL, CHATS_ADD_PREP, &addChatStmt);
+  int errCode = (timestamp == 0)
+    ? prepare_stmt(chatDb, CHAT_INSERT_SQL, CHATS_ADD_PREP, &addChatStmt)
+    : prepare_stmt(chatDb, CHAT_INSERT_TIME_SQL, CHATS_ADD_TIME_PREP,
+                   &addChatStmt);
+  if (errCode != NO_ERR) return errCode;
+  const size_t messageLen = strlen(message);
+  bool isCompressed;
+  size_t storedLen = messageLen;
+  errCode = bind_compressed_message(chatDb, addChatStmt, 3, message,
+                                    messageLen, &isCompressed, &storedLen);
   if (errCode != NO_ERR) return errCode;
+  const bool isLarge = !isCompressed && messageLen >= LARGE_MESSAGE_SIZE;
   const char *texts[] = { user, room, message };
   const size_t nTexts = sizeof(texts)/sizeof(texts[0]);
   for (int i = 0; i < nTexts; i++) {
     const char *val = texts[i];
-    errCode = sqlite3_bind_text(addChatStmt, i+1, val, -1, SQLITE_TRANSIENT);
+    if (val == message && isCompressed) continue; //already bound
+    errCode = (isLarge && val == message)
+      ? sqlite3_bind_zeroblob64(addChatStmt, i+1, messageLen)
+      : sqlite3_bind_text(addChatStmt, i+1, val, -1, SQLITE_TRANSIENT);
     if (errCode != SQLITE_OK) {
       return sqlite3_error(chatDb);
     }
   }
+  const MessageEncoding encoding = isCompressed ? LZ_ENCODING : PLAIN_ENCODING;
+  errCode = sqlite3_bind_int(addChatStmt, nTexts + 1, encoding);
+  if (errCode != SQLITE_OK) return sqlite3_error(chatDb);
+  if (timestamp != 0) {
+    errCode = sqlite3_bind_int64(addChatStmt, nTexts + 2, timestamp);
+    if (errCode != SQLITE_OK) return sqlite3_error(chatDb);
+  }
 
   errCode = sqlite3_step(addChatStmt);
+  if (errCode == SQLITE_ROW) {
+    *creationTime = sqlite3_column_int64(addChatStmt, 0);
+    errCode = sqlite3_step(addChatStmt);
+  }
   sqlite3_reset(addChatStmt); //not checking for error here
   if (errCode != SQLITE_DONE) return sqlite3_error(chatDb);
   *rowId = sqlite3_last_insert_rowid(chatDb->db);
+  if (isLarge) {
+    errCode = write_message_blob(chatDb, *rowId, message, messageLen);
+    if (errCode != NO_ERR) return errCode;
+  }
+  //callers restore these stats if the enclosing transaction is rolled back
+  ChatDbCompressionStats *stats = &chatDb->compression;
+  stats->nMessages++;
+  stats->nMessageBytes += messageLen;
+  stats->nCompressed += isCompressed;
+  stats->nStoredBytes += storedLen;
   return NO_ERR;
 }
 
@@ -258,28 +1186,187 @@ add_topics(ChatDb *chatDb, sqlite3_int64 rowId,
   return NO_ERR;
 }
 
-/** Add chat message with specified params to chatDb */
-int
-add_chat_db(ChatDb *chatDb0, const char *user, const char *room,
-            size_t nTopics, const char *topics[nTopics], const char *message)
+static int
+add_chat_message(ChatDb *chatDb, const char *user, const char *room,
+                 size_t nTopics, const char *topics[nTopics],
+                 const char *message)
 {
-  ChatDb *chatDb = (ChatDb *)chatDb0;
+  const ChatDbCompressionStats compression = chatDb->compression;
   sqlite3_exec(chatDb->db, "BEGIN TRANSACTION", 0, 0, 0);
   sqlite3_int64 rowId;
-  int errCode = add_chat(chatDb, user, room, nTopics, message, &rowId);
+  TimeMillis creationTime;
+  int errCode = add_chat(chatDb, user, room, nTopics, message, 0, &rowId,
+                         &creationTime);
+  if (errCode == NO_ERR) errCode = add_topics(chatDb, rowId, nTopics, topics);
   if (errCode != NO_ERR) {
     sqlite3_exec(chatDb->db, "ROLLBACK TRANSACTION", 0, 0, 0);
+    chatDb->compression = compression;
     return errCode;
   }
-  errCode = add_topics(chatDb, rowId, nTopics, topics);
+  sqlite3_exec(chatDb->db, "COMMIT TRANSACTION", 0, 0, 0);
+  errCode = add_chat_filters(chatDb, rowId, room, nTopics, topics);
+  if (errCode != NO_ERR) return errCode;
+  return add_chat_activity(chatDb, user, room, nTopics, topics, creationTime);
+}
+
+/** Add chat message with specified params to chatDb */
+int
+add_chat_db(ChatDb *chatDb, const char *user, const char *room,
+            size_t nTopics, const char *topics[nTopics], const char *message)
+{
+  const uint64_t t0 = now_nanos();
+  int errCode = add_chat_message(chatDb, user, room, nTopics, topics, message);
+  const uint64_t nanos = now_nanos() - t0;
+  ChatDbMetrics *metrics = &chatDb->metrics;
+  add_counter(metrics->adds, 1);
+  if (errCode != NO_ERR) add_counter(metrics->addErrors, 1);
+  record_histogram(metrics->addNanos, nanos);
+  record_latency(chatDb, ADD_CHAT_STAT, nanos);
+  return errCode;
+}
+
+/** Add all chats[nChats] to chatDb within a single transaction: either
+ *  all of them are added or none of them are.  If the timestamp of a
+ *  chats[] element is non-zero, then it is used as the creation time
+ *  of that message; otherwise the current time is used.
+ */
+int
+add_chats_chat_db(ChatDb *chatDb, size_t nChats, const ChatInfo chats[nChats])
+{
+  if (nChats == 0) return NO_ERR;
+  //row id and stored creationTime of each chats[] element
+  struct { sqlite3_int64 rowId; TimeMillis creationTime; } *added =
+    malloc_tag(MEM_TAG_MSG, nChats * sizeof(*added));
+  if (!added) return str_space_error(chatDb, "cannot allocate chat row ids");
+  const ChatDbCompressionStats compression = chatDb->compression;
+  int errCode = NO_ERR;
+  sqlite3_exec(chatDb->db, "BEGIN TRANSACTION", 0, 0, 0);
+  for (size_t i = 0; errCode == NO_ERR && i < nChats; i++) {
+    const ChatInfo *c = &chats[i];
+    errCode = add_chat(chatDb, c->user, c->room, c->nTopics, c->message,
+                       c->timestamp, &added[i].rowId, &added[i].creationTime);
+    if (errCode == NO_ERR) {
+      errCode = add_topics(chatDb, added[i].rowId, c->nTopics, c->topics);
+    }
+  }
   if (errCode != NO_ERR) {
     sqlite3_exec(chatDb->db, "ROLLBACK TRANSACTION", 0, 0, 0);
-    return errCode;
+    chatDb->compression = compression;
   }
-  sqlite3_exec(chatDb->db, "COMMIT TRANSACTION", 0, 0, 0);
+  else if (sqlite3_exec(chatDb->db, "COMMIT TRANSACTION", 0, 0, 0)
+           != SQLITE_OK) {
+    errCode = sqlite3_error(chatDb);
+    chatDb->compression = compression;
+  }
+  //filters and activities updated only for committed chats
+  for (size_t i = 0; errCode == NO_ERR && i < nChats; i++) {
+    const ChatInfo *c = &chats[i];
+    errCode =
+      add_chat_filters(chatDb, added[i].rowId, c->room, c->nTopics, c->topics);
+    if (errCode != NO_ERR) break;
+    errCode = add_chat_activity(chatDb, c->user, c->room, c->nTopics,
+                                c->topics, added[i].creationTime);
+  }
+  free_tag(added);
+  return errCode;
+}
+
+// During a bulk load, the secondary indexes on chats.room and
+// topics.topic are dropped so that the inserts need only append to
+// the table b-trees; the indexes are rebuilt in a single pass by
+// end_bulk_load_chat_db().  The unique index on topics(chatId, topic)
+// is retained since add_topics() relies on it to ignore repeated
+// topics.
+
+#define BULK_LOAD_DROP_INDEXES_SQL \
+  "DROP INDEX IF EXISTS roomx; DROP INDEX IF EXISTS topicx;"
+
+/** Prepare chatDb for a bulk load of chats using add_chats_chat_db().
+ *  Index maintenance and syncing to disk are suspended until
+ *  end_bulk_load_chat_db() is called; queries remain correct but
+ *  may be slow in the interim.
+ */
+int
+begin_bulk_load_chat_db(ChatDb *chatDb)
+{
+  if (chatDb->isBulkLoad) return NO_ERR;
+  int errCode = run_int_query(chatDb, "PRAGMA synchronous;", -1,
+                              &chatDb->savedSynchronous);
+  if (errCode != NO_ERR) return errCode;
+  const char *sql = BULK_LOAD_DROP_INDEXES_SQL "PRAGMA synchronous = OFF;";
+  if (sqlite3_exec(chatDb->db, sql, 0, 0, 0) != SQLITE_OK) {
+    return sqlite3_error(chatDb);
+  }
+  chatDb->isBulkLoad = true;
   return NO_ERR;
 }
 
+/** End a bulk load started by begin_bulk_load_chat_db(): rebuild the
+ *  indexes and restore syncing to disk.
+ */
+int
+end_bulk_load_chat_db(ChatDb *chatDb)
+{
+  if (!chatDb->isBulkLoad) return NO_ERR;
+  chatDb->isBulkLoad = false;
+  char sql[64];
+  snprintf(sql, sizeof(sql), "PRAGMA synchronous = %d;",
+           (int)chatDb->savedSynchronous);
+  if (sqlite3_exec(chatDb->db, CREATE_CHATS_SQL_STR, 0, 0, 0) != SQLITE_OK ||
+      sqlite3_exec(chatDb->db, CREATE_TOPICS_SQL_STR, 0, 0, 0) != SQLITE_OK ||
+      sqlite3_exec(chatDb->db, sql, 0, 0, 0) != SQLITE_OK) {
+    return sqlite3_error(chatDb);
+  }
+  return NO_ERR;
+}
+
+/***************************** Query Arenas ****************************/
+
+// All scratch memory for a query, like its SQL text, results and
+// decompressed messages, comes from an arena private to the calling
+// thread, so that queries run concurrently by different threads on
+// the same chatDb do not share it.  The arena is rewound after each
+// query, but its chunks are retained for the thread's later queries
+// and freed when the thread exits.
+
+static pthread_once_t queryArenaKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t queryArenaKey;
+
+static _Thread_local Arena *threadQueryArena;
+
+static void
+release_query_arena(void *arena)
+{
+  free_arena(arena);
+  free_tag(arena);
+}
+
+static void
+make_query_arena_key(void)
+{
+  pthread_key_create(&queryArenaKey, release_query_arena);
+}
+
+/** return the query arena for the calling thread, creating it if
+ *  necessary; NULL with chatDb->err set on an allocation error.
+ */
+static Arena *
+query_arena(ChatDb *chatDb)
+{
+  if (threadQueryArena) return threadQueryArena;
+  pthread_once(&queryArenaKeyOnce, make_query_arena_key);
+  Arena *arena = malloc_tag(MEM_TAG_QUERY, sizeof(Arena));
+  if (!arena) {
+    str_space_error(chatDb, "cannot allocate query arena");
+    return NULL;
+  }
+  init_arena(arena, 0);
+  set_tag_arena(arena, MEM_TAG_QUERY);
+  pthread_setspecific(queryArenaKey, arena);
+  threadQueryArena = arena;
+  return arena;
+}
+
 /*************************** CHAT_DB Query *****************************/
 
 // Run ChatsQuery to iterate through all chats and topics rows which
@@ -289,7 +1376,7 @@ add_chat_db(ChatDb *chatDb0, const char *user, const char *room,
 // Build up prepared stmt chatsQuery for variable # of topics which
 // looks like (for two topics):
 //
-// SELECT user, room, message, creationTime, id
+// SELECT user, room, message, creationTime, id, NULL
 //   FROM topics T0, topics T1, chats
 //   WHERE T0.topic = lower(?) AND T1.topic = lower(?) AND room = lower(?)
 //   ORDER BY id DESC;
@@ -297,64 +1384,154 @@ add_chat_db(ChatDb *chatDb0, const char *user, const char *room,
 // Need to tediously build this up manually because of the variable #
 // of topics.
 
-#define CHATS_QUERY_PREFIX \
-  "SELECT user, room, message, creationTime, id FROM "
+/** *_FIELD values for ChatInfo fields retrieved from chats columns */
+enum {
+  CHATS_COLUMN_FIELDS = USER_FIELD|ROOM_FIELD|MESSAGE_FIELD|TIMESTAMP_FIELD|
+                        STREAM_MESSAGE_FIELD
+};
+
+// the chats query always has columns user, room, message,
+// creationTime, id, blobLen, encoding; columns for fields not
+// selected are NULL.  When streaming without MESSAGE_FIELD, message
+// is retrieved only if it is not a large uncompressed blob, and
+// blobLen is its length if it is; length() of a blob column is
+// computed without reading it.
+#define CHATS_QUERY_PREFIX "SELECT %s, %s, %s, %s, id, %s, encoding FROM "
+#define STREAM_MESSAGE_COLUMN \
+  "CASE WHEN typeof(message) = 'blob' AND encoding = 0 \
+     THEN NULL ELSE message END"
+#define STREAM_BLOB_LEN_COLUMN \
+  "CASE WHEN typeof(message) = 'blob' AND encoding = 0 \
+     THEN length(message) END"
+
+/** return the message column expression for fields */
+static const char *
+message_column(unsigned fields)
+{
+  return (fields & MESSAGE_FIELD) ? "message"
+    : (fields & STREAM_MESSAGE_FIELD) ? STREAM_MESSAGE_COLUMN
+    : "NULL";
+}
+
+/** return the cache slot for the chats query statement used by the
+ *  cursorIndex'th room cursor of a query for nTopics topics,
+ *  isOldestFirst and fields; NULL if that statement is not cached.
+ */
+static sqlite3_stmt **
+chats_query_cache(ChatDb *chatDb, size_t nTopics, bool isOldestFirst,
+                  unsigned fields, size_t cursorIndex)
+{
+  //only most-recent-first queries retrieving all non-streamed columns
+  //or streaming the message (as done by the server) are cached
+  const unsigned columnFields = fields & CHATS_COLUMN_FIELDS;
+  const int prep0 =
+    (columnFields == (CHATS_COLUMN_FIELDS & ALL_FIELDS))
+    ? CHATS_QUERY_TOPICS_0_PREP
+    : (columnFields == (USER_FIELD|ROOM_FIELD|TIMESTAMP_FIELD|
+                        STREAM_MESSAGE_FIELD))
+    ? CHATS_STREAM_QUERY_TOPICS_0_PREP
+    : -1;
+  const bool isCacheableStmt = !isOldestFirst && prep0 >= 0 &&
+    nTopics < MAX_CHATS_QUERY_N_TOPICS_PREP &&
+    cursorIndex < MAX_CACHED_ROOM_CURSORS;
+  if (!isCacheableStmt) return NULL;
+  const int prepIndex = prep0 + nTopics;
+  return (cursorIndex == 0)
+    ? &chatDb->preps[prepIndex]
+    : &chatDb->roomCursorPreps[prepIndex - CHATS_QUERY_TOPICS_0_PREP]
+                              [cursorIndex - 1];
+}
 
+/** set *chatsQuery to a prepared statement for querying chats in a
+ *  room having nTopics topics, oldest first if isOldestFirst, most
+ *  recent first otherwise, retrieving only the columns for fields,
+ *  for use by the cursorIndex'th room cursor of a query.  *isCached
+ *  is set to true if the statement is cached in chatDb; a statement
+ *  which is not cached must be released using free_chats_query().
+ */
 static int
-prepare_chats_query(ChatDb *chatDb, size_t nTopics, sqlite3_stmt **chatsQuery)
+prepare_chats_query(ChatDb *chatDb, size_t nTopics, bool isOldestFirst,
+                    unsigned fields, size_t cursorIndex,
+                    sqlite3_stmt **chatsQuery, bool *isCached)
 {
-  bool isCacheableStmt = nTopics < MAX_CHATS_QUERY_N_TOPICS_PREP;
-  int prepIndex = isCacheableStmt ? CHATS_QUERY_TOPICS_0_PREP + nTopics : -1;
-  if (isCacheableStmt && chatDb->preps[prepIndex]) {
-    //cached
-    *chatsQuery = chatDb->preps[CHATS_QUERY_TOPICS_0_PREP + nTopics];
+  sqlite3_stmt **cache =
+    chats_query_cache(chatDb, nTopics, isOldestFirst, fields, cursorIndex);
+  *isCached = (cache != NULL);
+  if (cache && *cache) {
+    *chatsQuery = *cache;
     return NO_ERR;
   }
-  StrSpace sqlSpace;
-  init_str_space(&sqlSpace);
+  //SQL text only needs to live until the statement is prepared
+  Arena *arena = query_arena(chatDb);
+  if (!arena) return MEM_ERR;
+  const ArenaMark mark = mark_arena(arena);
+  LenStrSpace sqlSpace;
+  init_len_str_space_with_arena(&sqlSpace, arena);
   const char *err;
-  if (add_str_space(&sqlSpace, CHATS_QUERY_PREFIX) != 0) {
+  if (append_sprintf_len_str_space(&sqlSpace, CHATS_QUERY_PREFIX,
+                                   (fields & USER_FIELD) ? "user" : "NULL",
+                                   (fields & ROOM_FIELD) ? "room" : "NULL",
+                                   message_column(fields),
+                                   (fields & TIMESTAMP_FIELD)
+                                   ? "creationTime" : "NULL",
+                                   (fields & STREAM_MESSAGE_FIELD)
+                                   ? STREAM_BLOB_LEN_COLUMN : "NULL") != 0) {
     err = "cannot add query chats prefix to sqlSpace";
     goto STR_SPACE_ERROR;
   }
   for (int i = 0; i < nTopics; i++) {
-    if (append_sprintf_str_space(&sqlSpace, "topics T%d, ", i) != 0) {
+    if (append_sprintf_len_str_space(&sqlSpace, "topics T%d, ", i) != 0) {
       err = "cannot add topics table spec to sqlSpace";
       goto STR_SPACE_ERROR;
     }
   }
-  if (append_str_space(&sqlSpace, "chats WHERE ") != 0) {
+  static const char WHERE[] = "chats WHERE ";
+  if (append_n_len_str_space(&sqlSpace, WHERE, sizeof(WHERE) - 1) != 0) {
     err = "cannot add query chats WHERE to sqlSpace";
     goto STR_SPACE_ERROR;
   }
   for (int i = 0; i < nTopics; i++) {
-    if (append_sprintf_str_space(&sqlSpace, "T%d.chatId = id AND "
-                                 "T%d.topic = lower(?) AND ", i, i)  != 0) {
+    if (append_sprintf_len_str_space(&sqlSpace, "T%d.chatId = id AND "
+                                     "T%d.topic = lower(?) AND ", i, i)  != 0) {
       err = "cannot add topic constraint to sqlSpace";
       goto STR_SPACE_ERROR;
     }
   }
-  if (append_str_space(&sqlSpace, "room = lower(?) ORDER BY id DESC;") != 0) {
+  if (append_sprintf_len_str_space(&sqlSpace,
+                                   "room = lower(?) ORDER BY id %s;",
+                                   isOldestFirst ? "ASC" : "DESC") != 0) {
     err = "cannot add room constraint to sqlSpace";
     goto STR_SPACE_ERROR;
   }
-  const char *sql = iter_str_space(&sqlSpace, NULL);
+  const char *sql = iter_len_str_space(&sqlSpace, NULL);
   sqlite3_stmt *stmt;
-  int errCode = prepare_stmt(chatDb, sql, prepIndex, &stmt);
+  int errCode = prepare_stmt(chatDb, sql, -1, &stmt);
   TRACE("prepared chatsQuery for nTopics = %zu: %p %s", nTopics, stmt, sql);
-  free_str_space(&sqlSpace);
+  rewind_arena(arena, mark);
   if (errCode != NO_ERR) return errCode;
+  if (cache) *cache = stmt;
   *chatsQuery = stmt;
   return NO_ERR;
  STR_SPACE_ERROR:
-    free_str_space(&sqlSpace);
+    rewind_arena(arena, mark);
     return str_space_error(chatDb, err);
 }
 
 static void
-free_chats_query(ChatDb *chatDb, size_t nTopics, sqlite3_stmt *chatsQuery)
+free_chats_query(ChatDb *chatDb, bool isCached, sqlite3_stmt *chatsQuery)
+{
+  if (!isCached) sqlite3_finalize(chatsQuery);
+}
+
+/** finalize the statements cached for the 2nd and later room cursors */
+static void
+free_room_cursor_preps(ChatDb *chatDb)
 {
-  if (nTopics >= MAX_CHATS_QUERY_N_TOPICS_PREP) sqlite3_finalize(chatsQuery);
+  for (int i = 0; i < N_CHATS_QUERY_PREPS; i++) {
+    for (int j = 0; j < MAX_CACHED_ROOM_CURSORS - 1; j++) {
+      sqlite3_finalize(chatDb->roomCursorPreps[i][j]); //NOP on NULL
+    }
+  }
 }
 
 static int
@@ -381,6 +1558,253 @@ prepare_topics_query(ChatDb *chatDb, sqlite3_stmt **topicsQuery)
   return prepare_stmt(chatDb, TOPICS_QUERY, TOPICS_QUERY_PREP, topicsQuery);
 }
 
+// A multi-room query runs a separate chatsQuery cursor for each room.
+// Since the room index implicitly includes the rowid, each cursor
+// produces the chats for its room in id order without any sorting.
+// The cursors are kept in a heap keyed by the id of their current
+// row (a max-heap for most-recent-first, a min-heap for
+// oldest-first), so that the next result is always at the top of the
+// heap.  A cursor is stepped only when its current row has been
+// consumed and another result is needed, so no room is read further
+// than the merge requires.
+
+/** cursor over the chats for a single room of a query */
+typedef struct {
+  sqlite3_stmt *stmt;           //chatsQuery positioned at current row
+  bool isCached;                //true if stmt is in chatDb->preps[]
+  RowId id;                     //id of current row
+} RoomCursor;
+
+/** reset and release the statement for cursor */
+static int
+close_room_cursor(ChatDb *chatDb, RoomCursor *cursor)
+{
+  int errCode = NO_ERR;
+  if (sqlite3_reset(cursor->stmt) != SQLITE_OK) errCode = DB_ERR;
+  free_chats_query(chatDb, cursor->isCached, cursor->stmt);
+  cursor->stmt = NULL;
+  return errCode;
+}
+
+/** step cursor to its next row, setting *hasRow to false (and closing
+ *  cursor) if there is no such row.
+ */
+static int
+step_room_cursor(ChatDb *chatDb, RoomCursor *cursor, bool *hasRow)
+{
+  int rc = sqlite3_step(cursor->stmt);
+  *hasRow = (rc == SQLITE_ROW);
+  if (*hasRow) {
+    cursor->id = sqlite3_column_int64(cursor->stmt, 4);
+    return NO_ERR;
+  }
+  int errCode = (rc == SQLITE_DONE) ? NO_ERR : sqlite3_error(chatDb);
+  close_room_cursor(chatDb, cursor);
+  return errCode;
+}
+
+/** open *cursor, the cursorIndex'th open cursor of a query, for chats
+ *  in room having all topics[nTopics], retrieving the columns for
+ *  fields, positioned at its first row.  Sets *hasRow to false (with
+ *  cursor already closed) if room has no matching chats.
+ */
+static int
+open_room_cursor(ChatDb *chatDb, const char *room,
+                 size_t nTopics, const char *topics[nTopics],
+                 bool isOldestFirst, unsigned fields, size_t cursorIndex,
+                 RoomCursor *cursor, bool *hasRow)
+{
+  *hasRow = false;
+  int errCode = prepare_chats_query(chatDb, nTopics, isOldestFirst, fields,
+                                    cursorIndex, &cursor->stmt,
+                                    &cursor->isCached);
+  if (errCode != NO_ERR) return errCode;
+  TRACE("prepared chatsQuery: %p", cursor->stmt);
+  errCode = fill_chats_query(chatDb, room, nTopics, topics, cursor->stmt);
+  if (errCode != NO_ERR) {
+    close_room_cursor(chatDb, cursor);
+    return errCode;
+  }
+  TRACE("expanded chats query: %p: %s", cursor->stmt,
+        sqlite3_expanded_sql(cursor->stmt));
+  return step_room_cursor(chatDb, cursor, hasRow);
+}
+
+/** return true iff the current row of cursor a should be output
+ *  before that of cursor b.
+ */
+static inline bool
+is_before_room_cursor(const RoomCursor *a, const RoomCursor *b,
+                      bool isOldestFirst)
+{
+  return isOldestFirst ? a->id < b->id : a->id > b->id;
+}
+
+/** restore heap order on id for cursors[nCursors] when the cursor at
+ *  index i may be out of order with its children.
+ */
+static void
+sift_down_room_cursors(size_t nCursors, RoomCursor cursors[nCursors],
+                       size_t i, bool isOldestFirst)
+{
+  while (true) {
+    size_t top = i;
+    const size_t left = 2*i + 1, right = left + 1;
+    if (left < nCursors &&
+        is_before_room_cursor(&cursors[left], &cursors[top], isOldestFirst)) {
+      top = left;
+    }
+    if (right < nCursors &&
+        is_before_room_cursor(&cursors[right], &cursors[top], isOldestFirst)) {
+      top = right;
+    }
+    if (top == i) break;
+    RoomCursor tmp = cursors[i];
+    cursors[i] = cursors[top];
+    cursors[top] = tmp;
+    i = top;
+  }
+}
+
+/** qsort() comparison function for case-insensitive room names */
+static int
+compare_rooms(const void *p1, const void *p2)
+{
+  return strcasecmp(*(const char *const *)p1, *(const char *const *)p2);
+}
+
+/** set *text to the message at the current row of chatsQuery and
+ *  *textLen to its length, decompressing it into memory allocated
+ *  from arena if it is compressed.  The message column must have
+ *  been selected.
+ */
+static int
+get_message(ChatDb *chatDb, sqlite3_stmt *chatsQuery, Arena *arena,
+            const char **text, size_t *textLen)
+{
+  if (sqlite3_column_int(chatsQuery, 6) != LZ_ENCODING) {
+    *text = (const char *)sqlite3_column_text(chatsQuery, 2);
+    *textLen = sqlite3_column_bytes(chatsQuery, 2);
+    return NO_ERR;
+  }
+  const void *compressed = sqlite3_column_blob(chatsQuery, 2);
+  const size_t n = sqlite3_column_bytes(chatsQuery, 2);
+  size_t len;
+  if (decompressed_size_lz(compressed, n, &len) != 0) {
+    chatDb->err = "corrupt compressed message";
+    return DB_ERR;
+  }
+  char *buf = alloc_align_arena(arena, len + 1, 1);
+  if (!buf) return str_space_error(chatDb, "cannot allocate message");
+  if (decompress_lz(compressed, n, buf, len) != 0) {
+    chatDb->err = "corrupt compressed message";
+    return DB_ERR;
+  }
+  buf[len] = '\0';
+  *text = buf;
+  *textLen = len;
+  return NO_ERR;
+}
+
+/** call iterFn() with the fields of the chat at the current row of
+ *  chatsQuery, using topicsQuery to retrieve all its topics if
+ *  TOPICS_FIELD is in fields.  A compressed message is decompressed
+ *  into arena, which is rewound once iterFn() returns.  Set *isDone
+ *  to true if iterFn() returns non-zero.
+ */
+static int
+out_chat_row(ChatDb *chatDb, sqlite3_stmt *chatsQuery, unsigned fields,
+             sqlite3_stmt *topicsQuery, LenStrSpace *results,
+             TopicsVector *topicsResult, Arena *arena,
+             IterFn *iterFn, void *ctx, bool *isDone)
+{
+  static const unsigned textFields[] = { USER_FIELD, ROOM_FIELD };
+  enum { N_TEXT_FIELDS = sizeof(textFields)/sizeof(textFields[0]) };
+  clear_len_str_space(results);
+  clear_TopicsVector(topicsResult);
+  for (int colN = 0; colN < N_TEXT_FIELDS; colN++) {
+    if (!(fields & textFields[colN])) continue;
+    const char *text = (const char *)sqlite3_column_text(chatsQuery, colN);
+    const int len = sqlite3_column_bytes(chatsQuery, colN);
+    if (add_n_len_str_space(results, text, len) != 0) {
+      return str_space_error(chatDb, "cannot add chat field to results");
+    }
+    TRACE("retrieved colN %d: %s", colN, text);
+  }
+  int64_t ints[] = { /*creationTime*/ 0, /*id*/ 0, };
+  for (int colN = 3; colN < 5; colN++) {
+    ints[colN - 3] = sqlite3_column_int64(chatsQuery, colN);
+    TRACE("retrieved colN %d: %ld", colN, ints[colN - 3]);
+  }
+  TimeMillis creationTime = ints[0];
+  RowId id = ints[1];
+  //message is used directly from chatsQuery, which is not stepped
+  //until iterFn() returns
+  const char *message = NULL;
+  size_t messageLen = 0;
+  const ArenaMark mark = mark_arena(arena);
+  if (fields & MESSAGE_FIELD) {
+    int errCode =
+      get_message(chatDb, chatsQuery, arena, &message, &messageLen);
+    if (errCode != NO_ERR) return errCode;
+  }
+  else if (sqlite3_column_type(chatsQuery, 5) != SQLITE_NULL) {
+    messageLen = sqlite3_column_int64(chatsQuery, 5);  //large blob
+  }
+  else if (fields & STREAM_MESSAGE_FIELD) {
+    const void *text = sqlite3_column_blob(chatsQuery, 2);
+    messageLen = sqlite3_column_bytes(chatsQuery, 2);
+    if (sqlite3_column_int(chatsQuery, 6) == LZ_ENCODING &&
+        decompressed_size_lz(text, messageLen, &messageLen) != 0) {
+      chatDb->err = "corrupt compressed message";
+      return DB_ERR;
+    }
+  }
+  int retNTopics = 0;
+  if (fields & TOPICS_FIELD) {
+    int rc = sqlite3_bind_int64(topicsQuery, 1, id);
+    if (rc != SQLITE_OK) return sqlite3_error(chatDb);
+    TRACE("expanded topics query: %p: %s", topicsQuery,
+          sqlite3_expanded_sql(topicsQuery));
+    while ((rc = sqlite3_step(topicsQuery)) == SQLITE_ROW) {
+      const char *topic = (const char *)sqlite3_column_text(topicsQuery, 0);
+      const int len = sqlite3_column_bytes(topicsQuery, 0);
+      if (add_n_len_str_space(results, topic, len) != 0) {
+        return str_space_error(chatDb, "cannot add topic to results");
+      }
+      TRACE("topic = %s", topic);
+      retNTopics++;
+    }
+    rc = sqlite3_reset(topicsQuery);
+    if (rc != SQLITE_OK) return sqlite3_error(chatDb);
+  }
+  ChatInfo chatInfo = {
+    .timestamp = creationTime, .nTopics = retNTopics,
+    .message = message, .messageLen = messageLen,
+  };
+  const char **texts[] = { &chatInfo.user, &chatInfo.room };
+  int iterN = 0;
+  for (const char *str = iter_len_str_space(results, NULL);
+       str != NULL;
+       str = iter_len_str_space(results, str)) {
+    TRACE("iter-str = %s", str);
+    while (iterN < N_TEXT_FIELDS && !(fields & textFields[iterN])) iterN++;
+    if (iterN < N_TEXT_FIELDS) {
+      *texts[iterN++] = str;
+    }
+    else if (add_TopicsVector(topicsResult, str) != 0) {
+      return str_space_error(chatDb, "cannot add topic to topics result");
+    }
+  }
+  assert(retNTopics == n_elements_TopicsVector(topicsResult));
+  chatInfo.topics =
+    (fields & TOPICS_FIELD) ? get_base_TopicsVector(topicsResult) : NULL;
+  const ChatStream stream = { .query = chatsQuery, .id = id, .arena = arena };
+  chatInfo.stream = &stream;
+  *isDone = (iterFn(&chatInfo, ctx) != 0);
+  rewind_arena(arena, mark);
+  return NO_ERR;
+}
 
 /** Query chat-db using an internal iterator.  Specifically, call
  *  iterFn() for each chat message from chatDb which matches room and
@@ -396,92 +1820,206 @@ query_chat_db(ChatDb *chatDb, const char *room,
               size_t nTopics, const char *topics[], size_t count,
               IterFn *iterFn, void *ctx)
 {
-  int errCode = NO_ERR;
-  StrSpace results;
-  init_str_space(&results);
-  Vector topicsResult;
-  init_vector(&topicsResult, sizeof(char *));
+  const ChatQuery query = {
+    .nRooms = 1, .rooms = &room,
+    .nTopics = nTopics, .topics = topics,
+    .count = count,
+  };
+  return run_query_chat_db(chatDb, &query, iterFn, ctx);
+}
 
-  sqlite3_stmt *chatsQuery = NULL;
+static int
+run_query(ChatDb *chatDb, const ChatQuery *query, IterFn *iterFn, void *ctx)
+{
+  const size_t nTopics = query->nTopics;
+  const char **topics = query->topics;
+  const unsigned fields = (query->fields == 0) ? ALL_FIELDS : query->fields;
+  int errCode = NO_ERR;
+  //all scratch memory for the query comes from the thread's query
+  //arena, whose chunks are reused by later queries
+  Arena *arena = query_arena(chatDb);
+  if (!arena) return MEM_ERR;
+  const ArenaMark mark = mark_arena(arena);
+  LenStrSpace results;
+  init_len_str_space_with_arena(&results, arena);
+  TopicsVector topicsResult;
+  init_TopicsVector_with_arena(&topicsResult, arena);
+
+  RoomCursor *cursors = NULL;
+  size_t nCursors = 0;
   sqlite3_stmt *topicsQuery = NULL;
-  errCode = prepare_chats_query(chatDb, nTopics, &chatsQuery);
-  if (errCode != NO_ERR) goto CLEANUP;
-  TRACE("prepared chatsQuery: %p", chatsQuery);
-  errCode = fill_chats_query(chatDb, room, nTopics, topics, chatsQuery);
-  if (errCode != NO_ERR) goto CLEANUP;
-  TRACE("expanded chats query: %p: %s", chatsQuery,
-        sqlite3_expanded_sql(chatsQuery));
-  errCode = prepare_topics_query(chatDb, &topicsQuery);
-  if (errCode != NO_ERR) goto CLEANUP;
-  TRACE("prepared topicsQuery = %p", topicsQuery);
-  for (int i = 0; i < count; i++) {
-    clear_str_space(&results);
-    clear_vector(&topicsResult);
-    int rc = sqlite3_step(chatsQuery);
-    if (rc == SQLITE_DONE) break;
-    if (rc != SQLITE_ROW) { errCode = sqlite3_error(chatDb); break; }
-    for (int colN = 0; colN < 3; colN++) {
-      const char *text = (const char *)sqlite3_column_text(chatsQuery, colN);
-      add_str_space(&results, text);
-      TRACE("retrieved colN %d: %s", colN, text);
-    }
-    int64_t ints[] = { /*creationTime*/ 0, /*id*/ 0, };
-    for (int colN = 3; colN < 5; colN++) {
-      ints[colN - 3] = sqlite3_column_int64(chatsQuery, colN);
-      TRACE("retrieved colN %d: %ld", colN, ints[colN - 3]);
-    }
-    TimeMillis creationTime = ints[0];
-    RowId id = ints[1];
-    rc = sqlite3_bind_int64(topicsQuery, 1, id);
-    if (rc != SQLITE_OK) { errCode = sqlite3_error(chatDb); break; }
-    TRACE("expanded topics query: %p: %s", topicsQuery, sqlite3_expanded_sql(topicsQuery));
-    int retNTopics = 0;
-    while ((rc = sqlite3_step(topicsQuery)) == SQLITE_ROW) {
-      const char *topic = (const char *)sqlite3_column_text(topicsQuery, 0);
-      add_str_space(&results, topic);
-      TRACE("topic = %s", topic);
-      retNTopics++;
+  bool isAbsent = false;
+  for (int i = 0; errCode == NO_ERR && !isAbsent && i < nTopics; i++) {
+    errCode = check_name_filter(chatDb, TOPICS_FILTER, topics[i], &isAbsent);
+  }
+  if (errCode != NO_ERR || isAbsent) goto CLEANUP; //no matches if isAbsent
+  if (query->nRooms == 0 || query->count == 0) goto CLEANUP;
+  cursors = alloc_arena(arena, query->nRooms * sizeof(RoomCursor));
+  const char **rooms = alloc_arena(arena, query->nRooms * sizeof(const char *));
+  if (!cursors || !rooms) {
+    errCode = str_space_error(chatDb, "cannot allocate room cursors");
+    goto CLEANUP;
+  }
+  //sort rooms so that repeated rooms are adjacent
+  memcpy(rooms, query->rooms, query->nRooms * sizeof(const char *));
+  qsort(rooms, query->nRooms, sizeof(const char *), compare_rooms);
+  for (size_t i = 0; i < query->nRooms; i++) {
+    const char *room = rooms[i];
+    if (i > 0 && strcasecmp(room, rooms[i - 1]) == 0) continue;
+    errCode = check_name_filter(chatDb, ROOMS_FILTER, room, &isAbsent);
+    if (errCode != NO_ERR) goto CLEANUP;
+    if (isAbsent) continue;
+    bool hasRow;
+    errCode = open_room_cursor(chatDb, room, nTopics, topics,
+                               query->isOldestFirst, fields, nCursors,
+                               &cursors[nCursors], &hasRow);
+    if (errCode != NO_ERR) goto CLEANUP;
+    if (hasRow) nCursors++;
+  }
+  for (size_t i = nCursors/2; i > 0; i--) {
+    sift_down_room_cursors(nCursors, cursors, i - 1, query->isOldestFirst);
+  }
+  if (fields & TOPICS_FIELD) {
+    errCode = prepare_topics_query(chatDb, &topicsQuery);
+    if (errCode != NO_ERR) goto CLEANUP;
+    TRACE("prepared topicsQuery = %p", topicsQuery);
+  }
+  for (size_t i = 0; i < query->count && nCursors > 0; i++) {
+    if (i > 0) {
+      //consumed row at top of heap; advance only now that it is needed
+      bool hasRow;
+      errCode = step_room_cursor(chatDb, &cursors[0], &hasRow);
+      if (!hasRow) cursors[0] = cursors[--nCursors];
+      if (errCode != NO_ERR) break;
+      sift_down_room_cursors(nCursors, cursors, 0, query->isOldestFirst);
+      if (nCursors == 0) break;
     }
-    rc = sqlite3_reset(topicsQuery);
-    if (rc != SQLITE_OK) { errCode = sqlite3_error(chatDb); break; }
-    int iterN = 0;
-    ChatInfo chatInfo = { .timestamp = creationTime, .nTopics = retNTopics };
-    for (const char *str = iter_str_space(&results, NULL);
-         str != NULL;
-         str = iter_str_space(&results, str)) {
-      TRACE("iter-str = %s", str);
-      switch (iterN) {
-      case 0:
-        chatInfo.user = str;
-        break;
-      case 1:
-        chatInfo.room = str;
-        break;
-      case 2:
-        chatInfo.message = str;
-        break;
-      default:
-        add_vector(&topicsResult, (void *)&str);
-        break;
-      }
-      iterN++;
+    bool isDone;
+    errCode = out_chat_row(chatDb, cursors[0].stmt, fields, topicsQuery,
+                           &results, &topicsResult, arena,
+                           iterFn, ctx, &isDone);
+    if (errCode != NO_ERR || isDone) break;
+  }
+ CLEANUP:
+  TRACE("cleanup: errCode = %d, nCursors = %zu, topicsQuery = %p",
+        errCode, nCursors, topicsQuery);
+  for (size_t i = 0; i < nCursors; i++) {
+    if (close_room_cursor(chatDb, &cursors[i]) != NO_ERR) errCode = DB_ERR;
+  }
+  if (topicsQuery != NULL) {
+    if (sqlite3_reset(topicsQuery) != SQLITE_OK) errCode = DB_ERR;
+  }
+  rewind_arena(arena, mark);
+  return errCode;
+}
+
+/** Like query_chat_db(), but with the query specified by *query.
+ *  The messages from all of query->rooms[] are merged into a single
+ *  sequence which is iterated most recent first (oldest first if
+ *  query->isOldestFirst).  Rooms which are unknown or repeated in
+ *  query->rooms[] are ignored.
+ *
+ *  Only the ChatInfo fields selected by query->fields are retrieved;
+ *  in particular, the topics lookup for each result is skipped
+ *  unless TOPICS_FIELD is selected.
+ */
+int
+run_query_chat_db(ChatDb *chatDb, const ChatQuery *query,
+                  IterFn *iterFn, void *ctx)
+{
+  const uint64_t t0 = now_nanos();
+  int errCode = run_query(chatDb, query, iterFn, ctx);
+  const uint64_t nanos = now_nanos() - t0;
+  ChatDbMetrics *metrics = &chatDb->metrics;
+  add_counter(metrics->queries, 1);
+  if (errCode != NO_ERR) add_counter(metrics->queryErrors, 1);
+  record_histogram(metrics->queryNanos, nanos);
+  record_latency(chatDb, RUN_QUERY_STAT, nanos);
+  return errCode;
+}
+
+/** Stream the message of result, the chat being passed to an IterFn
+ *  by run_query_chat_db(), to sinkFn() in chunks of at most
+ *  MESSAGE_CHUNK_SIZE bytes, passing ctx as the last argument.  Large
+ *  messages are read directly from the db so that memory used is
+ *  bounded independent of the message size.  May only be called from
+ *  within that IterFn for a query which selected MESSAGE_FIELD or
+ *  STREAM_MESSAGE_FIELD.  Streaming stops without error if sinkFn()
+ *  returns non-zero.
+ */
+int
+stream_message_chat_db(ChatDb *chatDb, const ChatInfo *result,
+                       MessageSinkFn *sinkFn, void *ctx)
+{
+  const ChatStream *stream = result->stream;
+  sqlite3_stmt *stmt = (stream == NULL) ? NULL : stream->query;
+  if (stmt == NULL) {
+    chatDb->err = "stream_message_chat_db() called outside query iteration";
+    return DB_ERR;
+  }
+  if (sqlite3_column_type(stmt, 2) != SQLITE_NULL) {
+    //message already retrieved by the query; note that a compressed
+    //message is decompressed in full
+    const char *text = result->message;
+    size_t len = result->messageLen;
+    const ArenaMark mark = mark_arena(stream->arena);
+    if (text == NULL) {
+      int errCode = get_message(chatDb, stmt, stream->arena, &text, &len);
+      if (errCode != NO_ERR) return errCode;
+    }
+    for (size_t offset = 0; offset < len; offset += MESSAGE_CHUNK_SIZE) {
+      const size_t n =
+        (len - offset < MESSAGE_CHUNK_SIZE) ? len - offset : MESSAGE_CHUNK_SIZE;
+      if (sinkFn(text + offset, n, ctx) != 0) break;
+    }
+    rewind_arena(stream->arena, mark);
+    return NO_ERR;
+  }
+  if (sqlite3_column_type(stmt, 5) == SQLITE_NULL) {
+    chatDb->err = "stream_message_chat_db(): message not selected by query";
+    return DB_ERR;
+  }
+  //large uncompressed blob
+  sqlite3_blob *blob;
+  int rc = sqlite3_blob_open(chatDb->db, "main", CHATS_TABLE, "message",
+                             stream->id, 0, &blob);
+  if (rc != SQLITE_OK) return sqlite3_error(chatDb);
+  const size_t len = sqlite3_blob_bytes(blob);
+  char chunk[MESSAGE_CHUNK_SIZE];
+  int errCode = NO_ERR;
+  for (size_t offset = 0; offset < len; offset += MESSAGE_CHUNK_SIZE) {
+    const size_t n =
+      (len - offset < MESSAGE_CHUNK_SIZE) ? len - offset : MESSAGE_CHUNK_SIZE;
+    if (sqlite3_blob_read(blob, chunk, n, offset) != SQLITE_OK) {
+      errCode = sqlite3_error(chatDb);
+      break;
     }
-    assert(retNTopics == n_elements_vector(&topicsResult));
-    chatInfo.topics = get_base_vector(&topicsResult);
-    if (iterFn(&chatInfo, ctx) != 0) break;
-  } //for int i = 0; i < count; i++)
- CLEANUP:
-  TRACE("cleanup: errCode = %d, chatsQuery = %p, topicsQuery = %p",
-        errCode, chatsQuery, topicsQuery);
-  free_str_space(&results);
-  free_vector(&topicsResult);
-  if (chatsQuery != NULL) {
-    if (sqlite3_reset(chatsQuery) != SQLITE_OK) errCode = DB_ERR;
-    free_chats_query(chatDb, nTopics, chatsQuery);
+    if (sinkFn(chunk, n, ctx) != 0) break;
   }
-  if (topicsQuery != NULL) {
-    if (sqlite3_reset(topicsQuery) != SQLITE_OK) errCode = DB_ERR;
+  sqlite3_blob_close(blob);
+  return errCode;
+}
+
+
+#define ROOMS_QUERY "SELECT DISTINCT room FROM chats ORDER BY room;"
+
+/** call iterFn(room, ctx) for each distinct room in chatDb in
+ *  lexicographic order.  If iterFn() returns non-zero, then the
+ *  iteration is terminated.
+ */
+int
+iter_rooms_chat_db(ChatDb *chatDb, NameIterFn *iterFn, void *ctx)
+{
+  sqlite3_stmt *stmt;
+  int errCode = prepare_stmt(chatDb, ROOMS_QUERY, -1, &stmt);
+  if (errCode != NO_ERR) return errCode;
+  int rc;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    const char *room = (const char *)sqlite3_column_text(stmt, 0);
+    if (iterFn(room, ctx) != 0) { rc = SQLITE_DONE; break; }
   }
+  if (rc != SQLITE_DONE) errCode = sqlite3_error(chatDb);
+  sqlite3_finalize(stmt);
   return errCode;
 }
 
@@ -510,6 +2048,16 @@ query_chat_db(ChatDb *chatDb, const char *room,
  */
 int
 make_chat_db(const char *path, MakeChatDbResult *resultP)
+{
+  return make_chat_db_with_options(path, NULL, resultP);
+}
+
+/** Like make_chat_db(), but with options specified by *options.
+ *  If options is NULL, then use default options.
+ */
+int
+make_chat_db_with_options(const char *path, const ChatDbOptions *options,
+                          MakeChatDbResult *resultP)
 {
   // resources to be cleaned up on error
   // note for all these types clean up when resource pointer is NULL is a NOP
@@ -524,7 +2072,7 @@ make_chat_db(const char *path, MakeChatDbResult *resultP)
   const bool isInMemory = path == NULL || strcmp(path, SQLITE3_MEMORY_DB) == 0;
   if (isInMemory) path = SQLITE3_MEMORY_DB;
   const char *prefix = isInMemory ? "" : "./";
-  path1 = malloc(strlen(prefix) + strlen(path) + 1);
+  path1 = malloc_tag(MEM_TAG_DB, strlen(prefix) + strlen(path) + 1);
   if (!path1) {
     resultP->err = "path memory allocation failure";
     errCode = MEM_ERR;
@@ -539,8 +2087,14 @@ make_chat_db(const char *path, MakeChatDbResult *resultP)
     errCode = DB_ERR;
     goto CLEANUP;
   }
+  if (options != NULL && options->busyTimeoutMillis > 0 &&
+      sqlite3_busy_timeout(db, options->busyTimeoutMillis) != SQLITE_OK) {
+    resultP->err = "db busy timeout error";
+    errCode = DB_ERR;
+    goto CLEANUP;
+  }
 
-  chatDb = calloc(1, sizeof(ChatDb));
+  chatDb = calloc_tag(MEM_TAG_DB, 1, sizeof(ChatDb));
   if (!chatDb) {
     resultP-> err = "ChatDb memory allocation failure";
     errCode = MEM_ERR;
@@ -550,6 +2104,15 @@ make_chat_db(const char *path, MakeChatDbResult *resultP)
   //looking good, initialize *chatDb
   chatDb->path = path1;
   chatDb->db = db;
+  chatDb->isInMemory = isInMemory;
+  const double fpRate =
+    (options == NULL || options->filterFpRate == 0)
+    ? DEFAULT_FILTER_FP_RATE
+    : options->filterFpRate;
+  chatDb->filterFpRate = (fpRate > 0 && fpRate < 1) ? fpRate : 0;
+  chatDb->compression.minSize =
+    (options == NULL) ? 0 : options->compressMinSize;
+  init_metrics_chat_db(chatDb);
   resultP->chatDb = chatDb;
   init_str_space(&chatDb->errSpace); errSpace = &chatDb->errSpace;
 
@@ -558,13 +2121,29 @@ make_chat_db(const char *path, MakeChatDbResult *resultP)
     errCode = DB_ERR;
     goto CLEANUP;
   }
+  if ((errCode = init_filters(chatDb)) != NO_ERR) {
+    resultP->err = "name filters initialization error";
+    goto CLEANUP;
+  }
+  const TimeMillis windowMillis =
+    (options == NULL) ? 0 : options->activityWindowMillis;
+  if ((errCode = init_activities(chatDb, windowMillis)) != NO_ERR) {
+    resultP->err = "room activities initialization error";
+    goto CLEANUP;
+  }
   assert(errCode == NO_ERR);
   return errCode;
  CLEANUP:
+  if (chatDb) {
+    for (int i = 0; i < N_PREPS; i++) sqlite3_finalize(chatDb->preps[i]);
+    free_room_cursor_preps(chatDb);
+    free_filters(chatDb);
+    free_activities(chatDb);
+  }
   sqlite3_close(db);
   if (errSpace) free_str_space(errSpace);
-  free((void*)path1);
-  free(chatDb);
+  free_tag((void*)path1);
+  free_tag(chatDb);
   return errCode;
 }
 
@@ -572,15 +2151,21 @@ make_chat_db(const char *path, MakeChatDbResult *resultP)
 int
 free_chat_db(ChatDb *chatDb)
 {
+  //on failure, filters will simply be rebuilt by next make_chat_db()
+  save_filters(chatDb);
+  free_filters(chatDb);
+  free_activities(chatDb);
   for (int i = 0; i < N_PREPS; i++) {   // clean up cached prepared statements
     sqlite3_finalize(chatDb->preps[i]); //calling on NULL is a NOP
   }
+  free_room_cursor_preps(chatDb);
   if (sqlite3_close(chatDb->db) != SQLITE_OK) {
     return sqlite3_error((ChatDb *)chatDb);
   }
-  free((void *)chatDb->path);
+  free_tag(chatDb->latenciesBlock);
+  free_tag((void *)chatDb->path);
   free_str_space(&chatDb->errSpace);
-  free((void *)chatDb);
+  free_tag((void *)chatDb);
   return NO_ERR;
 }
 
@@ -600,11 +2185,19 @@ error_chat_db(const ChatDb *chatDb)
 int
 count_room_chat_db(ChatDb *chatDb, const char *room, size_t *count)
 {
+  bool isAbsent;
+  int errCode = check_name_filter(chatDb, ROOMS_FILTER, room, &isAbsent);
+  if (errCode != NO_ERR) return errCode;
+  if (isAbsent) { *count = 0; return NO_ERR; }
   sqlite3_stmt *countStmt;
-  int errCode = prepare_stmt(chatDb, COUNT_ROOM_CHATS_SQL, ROOM_COUNT_PREP,
+  errCode = prepare_stmt(chatDb, COUNT_ROOM_CHATS_SQL, ROOM_COUNT_PREP,
                              &countStmt);
   if (errCode != NO_ERR) return errCode;
-  return run_count_stmt(chatDb, countStmt, room, count);
+  errCode = run_count_stmt(chatDb, countStmt, room, count);
+  if (errCode == NO_ERR && *count == 0) {
+    note_false_positive(chatDb, ROOMS_FILTER);
+  }
+  return errCode;
 }
 
 #define COUNT_TOPIC_CHATS_SQL \
@@ -614,11 +2207,78 @@ count_room_chat_db(ChatDb *chatDb, const char *room, size_t *count)
 int
 count_topic_chat_db(ChatDb *chatDb, const char *topic, size_t *count)
 {
+  bool isAbsent;
+  int errCode = check_name_filter(chatDb, TOPICS_FILTER, topic, &isAbsent);
+  if (errCode != NO_ERR) return errCode;
+  if (isAbsent) { *count = 0; return NO_ERR; }
   sqlite3_stmt *countStmt;
-  int errCode = prepare_stmt(chatDb, COUNT_TOPIC_CHATS_SQL, TOPIC_COUNT_PREP,
+  errCode = prepare_stmt(chatDb, COUNT_TOPIC_CHATS_SQL, TOPIC_COUNT_PREP,
                              &countStmt);
   if (errCode != NO_ERR) return errCode;
-  return run_count_stmt(chatDb, countStmt, topic, count);
+  errCode = run_count_stmt(chatDb, countStmt, topic, count);
+  if (errCode == NO_ERR && *count == 0) {
+    note_false_positive(chatDb, TOPICS_FILTER);
+  }
+  return errCode;
+}
+
+/** Fill in *stats with activity statistics for room over the sliding
+ *  window which ends now, with up to k of its most mentioned topics
+ *  in topTopics[k] in non-increasing order of count.  The topic
+ *  strings remain valid until chatDb is freed.
+ *
+ *  The statistics are maintained incrementally as chats are added,
+ *  so this runs in O(k) time independent of the # of chats.  They
+ *  reflect the chats which were in chatDb when it was created along
+ *  with those subsequently added through chatDb, but not those
+ *  added by other processes.  The window slides in steps of 1/12 of
+ *  its duration.
+ */
+int
+stats_room_chat_db(ChatDb *chatDb, const char *room, size_t k,
+                   TopicCount topTopics[k], RoomStats *stats)
+{
+  if (!chatDb->hasActivities) {
+    *stats = (RoomStats) { .windowMillis = 0 };
+    return NO_ERR;
+  }
+  pthread_mutex_lock(&chatDb->activitiesLock);
+  stats_room_activities(&chatDb->activities, room, now_millis(), k, topTopics,
+                        stats);
+  pthread_mutex_unlock(&chatDb->activitiesLock);
+  return NO_ERR;
+}
+
+/** fill in *stats with statistics for filters used by chatDb */
+int
+filter_stats_chat_db(const ChatDb *chatDb, ChatDbFilterStats *stats)
+{
+  *stats = (ChatDbFilterStats) { .fpRate = chatDb->filterFpRate };
+  if (!has_filters(chatDb)) return NO_ERR;
+  NameFilterStats *filterStats[] = { &stats->rooms, &stats->topics };
+  for (FilterId id = 0; id < N_FILTERS; id++) {
+    const NameFilter *filter = &chatDb->filters[id];
+    BloomStats bloomStats;
+    stats_bloom_filter(&filter->bloom, &bloomStats);
+    *filterStats[id] = (NameFilterStats) {
+      .nItems = bloomStats.nItems,
+      .capacity = filter->capacity,
+      .fpRate = bloomStats.fpRate,
+      .nRejects = filter->nRejects,
+      .nFalsePositives = filter->nFalsePositives,
+    };
+  }
+  return NO_ERR;
+}
+
+/** fill in *stats with compression statistics for messages added
+ *  using chatDb since it was created.
+ */
+int
+compression_stats_chat_db(const ChatDb *chatDb, ChatDbCompressionStats *stats)
+{
+  *stats = chatDb->compression;
+  return NO_ERR;
 }
 
 
@@ -952,6 +2612,735 @@ test_counts(ChatDb *chatDb)
   return nErrors;
 }
 
+/** returns # of errors */
+static int
+test_filters(ChatDb *chatDb)
+{
+  int nErrors = 0;
+  bool chk;
+  size_t count;
+  ChatDbFilterStats stats;
+
+  filter_stats_chat_db(chatDb, &stats);
+  chk = stats.fpRate == DEFAULT_FILTER_FP_RATE;
+  CHKF(chk, "filter fp rate %g != %g", stats.fpRate, DEFAULT_FILTER_FP_RATE);
+  if (!chk) nErrors++;
+  chk = stats.rooms.nItems == 1 && stats.topics.nItems == 13;
+  CHKF(chk, "filter # of rooms %zu != 1 or # of topics %zu != 13",
+       stats.rooms.nItems, stats.topics.nItems);
+  if (!chk) nErrors++;
+  //test_counts() looked up one unknown room and one unknown topic
+  chk = stats.rooms.nRejects == 1 && stats.topics.nRejects == 1;
+  CHKF(chk, "filter room rejects %zu != 1 or topic rejects %zu != 1",
+       stats.rooms.nRejects, stats.topics.nRejects);
+  if (!chk) nErrors++;
+
+  //filters must track added names
+  const char *topics[] = { "#NewTopic" };
+  add_chat_db(chatDb, "@zdu", "NewRoom", 1, topics, "new");
+  count_room_chat_db(chatDb, "newroom", &count);
+  chk = count == 1;
+  CHKF(chk, "count room newroom messages: %zu != 1 (expected)", count);
+  if (!chk) nErrors++;
+  count_topic_chat_db(chatDb, "#newtopic", &count);
+  chk = count == 1;
+  CHKF(chk, "count topic #newtopic messages: %zu != 1 (expected)", count);
+  if (!chk) nErrors++;
+
+  //filters must see chats added by another connection to a file db and
+  //must be persisted
+  const char *dbPath = "test-chat-db-filters.db";
+  remove(dbPath);
+  MakeChatDbResult result0, result1;
+  if (make_chat_db(dbPath, &result0) != 0 ||
+      make_chat_db(dbPath, &result1) != 0) {
+    return error("cannot create file db %s", dbPath);
+  }
+  ChatDb *chatDb0 = result0.chatDb;
+  ChatDb *chatDb1 = result1.chatDb;
+  count_room_chat_db(chatDb0, "OtherRoom", &count); //rejected by filter
+  add_chat_db(chatDb1, "@zdu", "OtherRoom", 1, topics, "other");
+  count_room_chat_db(chatDb0, "otherroom", &count);
+  chk = count == 1;
+  CHKF(chk, "count shared room otherroom messages: %zu != 1 (expected)",
+       count);
+  if (!chk) nErrors++;
+  free_chat_db(chatDb0);
+  free_chat_db(chatDb1);
+  if (make_chat_db(dbPath, &result0) != 0) {
+    return error("cannot reopen file db %s", dbPath);
+  }
+  chatDb0 = result0.chatDb;
+  filter_stats_chat_db(chatDb0, &stats);
+  chk = stats.rooms.nItems == 1 && stats.topics.nItems == 1;
+  CHKF(chk, "reloaded filter # of rooms %zu or # of topics %zu != 1",
+       stats.rooms.nItems, stats.topics.nItems);
+  if (!chk) nErrors++;
+  count_room_chat_db(chatDb0, "otherroom", &count);
+  chk = count == 1;
+  CHKF(chk, "count reloaded room otherroom messages: %zu != 1 (expected)",
+       count);
+  if (!chk) nErrors++;
+  free_chat_db(chatDb0);
+  remove(dbPath);
+
+  return nErrors;
+}
+
+// used as query iteration function: appends result message to ctx
+static int
+add_message_iter_fn(const ChatInfo *result, void *ctx)
+{
+  StrSpace *messages = ctx;
+  add_str_space(messages, result->message);
+  return 0;
+}
+
+/** returns # of errors */
+static int
+test_multi_rooms(ChatDb *chatDb)
+{
+  int nErrors = 0;
+  bool chk;
+  //test_filters() added "new" to room newroom after data[] in sysprog
+  add_chat_db(chatDb, "@zdu", "OtherRoom", 0, NULL, "other");
+  add_chat_db(chatDb, "@zdu", "Sysprog", 0, NULL, "last");
+  const struct {
+    const char *label;
+    ChatQuery query;
+    const char *expected;  //expected messages, each followed by '|'
+  } multiTests[] = {
+    { .label = "merged rooms",
+      .query = { .nRooms = 3,
+                 .rooms = (const char *[]){ "NewRoom", "sysprog", "otherroom" },
+                 .count = 3, },
+      .expected = "last|other|new|",
+    },
+    { .label = "merged rooms with count",
+      .query = { .nRooms = 2,
+                 .rooms = (const char *[]){ "NewRoom", "sysprog" },
+                 .count = 2, },
+      .expected = "last|new|",
+    },
+    { .label = "repeated and unknown rooms",
+      .query = { .nRooms = 4,
+                 .rooms = (const char *[]){ "NoRoom", "NewRoom", "NEWROOM",
+                                            "OtherRoom" },
+                 .count = 10, },
+      .expected = "other|new|",
+    },
+    { .label = "merged rooms with topic",
+      .query = { .nRooms = 2,
+                 .rooms = (const char *[]){ "sysprog", "newroom" },
+                 .nTopics = 1, .topics = (const char *[]){ "#syscall" },
+                 .count = 10, },
+      .expected = NULL, //data3 then data2 messages
+    },
+  };
+  StrSpace messages;
+  init_str_space(&messages);
+  for (int t = 0; t < sizeof(multiTests)/sizeof(multiTests[0]); t++) {
+    clear_str_space(&messages);
+    int err = run_query_chat_db(chatDb, &multiTests[t].query,
+                                add_message_iter_fn, &messages);
+    if (err != NO_ERR) {
+      error("%s: %s", multiTests[t].label, error_chat_db(chatDb));
+      nErrors++;
+      continue;
+    }
+    //concatenate results
+    char actual[1024] = "";
+    for (const char *str = iter_str_space(&messages, NULL); str != NULL;
+         str = iter_str_space(&messages, str)) {
+      strncat(actual, str, sizeof(actual) - strlen(actual) - 2);
+      strcat(actual, "|");
+    }
+    char expected[1024];
+    if (multiTests[t].expected) {
+      strcpy(expected, multiTests[t].expected);
+    }
+    else {
+      snprintf(expected, sizeof(expected), "%s|%s|",
+               data3.message, data2.message);
+    }
+    chk = strcmp(actual, expected) == 0;
+    CHKF(chk, "%s: results \"%s\" != \"%s\"",
+         multiTests[t].label, actual, expected);
+    if (!chk) nErrors++;
+  }
+  free_str_space(&messages);
+  return nErrors;
+}
+
+/** ctx for fields_iter_fn(): summarizes the fields of the results */
+typedef struct {
+  size_t nResults;
+  size_t nUsers, nRooms, nMessages, nTimestamps; //# of non-NULL/non-0 fields
+  size_t nTopics;                                //total # of topics
+} FieldsCtx;
+
+static int
+fields_iter_fn(const ChatInfo *info, void *ctx)
+{
+  FieldsCtx *fieldsCtx = ctx;
+  fieldsCtx->nResults++;
+  fieldsCtx->nUsers += (info->user != NULL);
+  fieldsCtx->nRooms += (info->room != NULL);
+  fieldsCtx->nMessages += (info->message != NULL);
+  fieldsCtx->nTimestamps += (info->timestamp != 0);
+  fieldsCtx->nTopics += info->nTopics;
+  return 0;
+}
+
+/** test that queries retrieve only the selected fields */
+static int
+test_fields(ChatDb *chatDb)
+{
+  int nErrors = 0;
+  const char *room = "sysprog";
+  const unsigned fieldsList[] = {
+    0, MESSAGE_FIELD, USER_FIELD|TOPICS_FIELD, ROOM_FIELD|TIMESTAMP_FIELD,
+  };
+  for (int t = 0; t < sizeof(fieldsList)/sizeof(fieldsList[0]); t++) {
+    const unsigned fields = (fieldsList[t] == 0) ? ALL_FIELDS : fieldsList[t];
+    for (int isOldestFirst = 0; isOldestFirst < 2; isOldestFirst++) {
+      const ChatQuery query = {
+        .nRooms = 1, .rooms = &room, .count = 100,
+        .isOldestFirst = isOldestFirst, .fields = fieldsList[t],
+      };
+      FieldsCtx ctx = { 0 };
+      if (run_query_chat_db(chatDb, &query, fields_iter_fn, &ctx) != NO_ERR) {
+        error("fields %#x: %s", fields, error_chat_db(chatDb));
+        nErrors++;
+        continue;
+      }
+      const size_t n = ctx.nResults;
+      bool chk = n > 0 &&
+        ctx.nUsers == ((fields & USER_FIELD) ? n : 0) &&
+        ctx.nRooms == ((fields & ROOM_FIELD) ? n : 0) &&
+        ctx.nMessages == ((fields & MESSAGE_FIELD) ? n : 0) &&
+        ctx.nTimestamps == ((fields & TIMESTAMP_FIELD) ? n : 0) &&
+        ((fields & TOPICS_FIELD) ? ctx.nTopics > 0 : ctx.nTopics == 0);
+      CHKF(chk, "fields %#x: %zu results with %zu users, %zu rooms, "
+           "%zu messages, %zu timestamps, %zu topics",
+           fields, n, ctx.nUsers, ctx.nRooms, ctx.nMessages,
+           ctx.nTimestamps, ctx.nTopics);
+      if (!chk) nErrors++;
+    }
+  }
+  return nErrors;
+}
+
+// used as rooms iteration function: appends room to ctx
+static int
+add_room_iter_fn(const char *room, void *ctx)
+{
+  return add_str_space((StrSpace *)ctx, room);
+}
+
+// used as query iteration function: checks timestamp of result
+static int
+check_timestamp_iter_fn(const ChatInfo *result, void *ctx)
+{
+  TimeMillis *timestamp = ctx;
+  CHKF(result->timestamp == *timestamp, "bulk load timestamp %lld != %lld",
+       (long long)result->timestamp, (long long)*timestamp);
+  *timestamp += 1000;
+  return 0;
+}
+
+// used as stats iteration function: copies histogram named by first
+// element of ctx into histogram pointed to by second element
+static int
+find_stats_iter_fn(const char *name, const LatencyHistogram *histogram,
+                   void *ctx)
+{
+  void **args = ctx;
+  if (strcmp(name, args[0]) != 0) return 0;
+  *(LatencyHistogram *)args[1] = *histogram;
+  return 1;
+}
+
+static LatencyHistogram
+find_stats(const ChatDb *chatDb, const char *name)
+{
+  LatencyHistogram histogram = { .count = SIZE_MAX };
+  iter_stats_chat_db(chatDb, find_stats_iter_fn,
+                     (void *[]) { (void *)name, &histogram });
+  return histogram;
+}
+
+/** returns # of errors */
+static int
+test_stats(void)
+{
+  int nErrors = 0;
+  bool chk;
+  MakeChatDbResult result;
+  if (make_chat_db(NULL, &result) != 0) {
+    return error("cannot create db: %s", result.err);
+  }
+  ChatDb *chatDb = result.chatDb;
+  char *logText = NULL;
+  size_t logSize = 0;
+  FILE *slowLog = open_memstream(&logText, &logSize);
+  if (!slowLog) fatal("cannot open slow log:");
+
+  //stats not collected until enabled
+  add_chat_db(chatDb, "@zdu", "room", 0, NULL, "untimed");
+  chk = find_stats(chatDb, "add_chat_db").count == 0;
+  CHK(chk, "stats collected before enabled");
+  if (!chk) nErrors++;
+
+  const ChatDbStatsOptions options = {
+    .isEnabled = true, .slowNanos = 1, .slowLog = slowLog,
+  };
+  MemTagStats dbMem0, dbMem1;
+  stats_mem_tag(MEM_TAG_DB, &dbMem0);
+  if (set_stats_chat_db(chatDb, &options) != 0) {
+    error("set stats: %s", error_chat_db(chatDb));
+    free_chat_db(chatDb);
+    return nErrors + 1;
+  }
+  //histograms are charged to the db tag, aligned like a Histogram
+  stats_mem_tag(MEM_TAG_DB, &dbMem1);
+  chk = dbMem1.bytes - dbMem0.bytes >= N_LATENCY_STATS*sizeof(Histogram) &&
+        (uintptr_t)chatDb->latencies % alignof(Histogram) == 0;
+  CHKF(chk, "latency histograms: %zu db bytes at %p",
+       dbMem1.bytes - dbMem0.bytes, (void *)chatDb->latencies);
+  if (!chk) nErrors++;
+  add_chat_db(chatDb, "@zdu", "room", 1, (const char *[]){ "#slow" }, "timed");
+  add_chat_db(chatDb, "@zdu", "room", 0, NULL, "timed");
+  size_t count;
+  count_room_chat_db(chatDb, "room", &count);
+  StrSpace messages;
+  init_str_space(&messages);
+  query_chat_db(chatDb, "room", 0, NULL, 10, add_message_iter_fn, &messages);
+  free_str_space(&messages);
+  //the message-streaming query used by the server is also cached
+  const ChatQuery streamQuery = {
+    .nRooms = 1, .rooms = (const char *[]){ "room" }, .count = 10,
+    .fields = USER_FIELD|ROOM_FIELD|TOPICS_FIELD|TIMESTAMP_FIELD|
+              STREAM_MESSAGE_FIELD,
+  };
+  FieldsCtx fieldsCtx = { .nResults = 0 };
+  run_query_chat_db(chatDb, &streamQuery, fields_iter_fn, &fieldsCtx);
+
+  const struct { const char *name; uint64_t count; } expected[] = {
+    { "add_chat_db", 2 },
+    { "run_query_chat_db", 2 },
+    { "CHATS_ADD_PREP", 2 },
+    { "TOPICS_ADD_PREP", 1 },
+    { "ROOM_COUNT_PREP", 1 },
+    { "CHATS_QUERY_TOPICS_0_PREP", 1 },
+    { "CHATS_STREAM_QUERY_TOPICS_0_PREP", 1 },
+  };
+  for (int i = 0; i < sizeof(expected)/sizeof(expected[0]); i++) {
+    LatencyHistogram histogram = find_stats(chatDb, expected[i].name);
+    chk = histogram.count == expected[i].count;
+    CHKF(chk, "%s: count %ju != expected %ju", expected[i].name,
+         (uintmax_t)histogram.count, (uintmax_t)expected[i].count);
+    if (!chk) nErrors++;
+    const uint64_t p99 = percentile_latency_histogram(&histogram, 99);
+    chk = histogram.count == 0 ||
+      (0 < p99 && p99 <= histogram.maxNanos &&
+       histogram.maxNanos <= histogram.totalNanos);
+    CHKF(chk, "%s: bad p99 %ju or max %ju", expected[i].name,
+         (uintmax_t)p99, (uintmax_t)histogram.maxNanos);
+    if (!chk) nErrors++;
+  }
+
+  //every statement is slow with slowNanos = 1; log has expanded SQL
+  fflush(slowLog);
+  chk = strstr(logText, "slow SQL TOPICS_ADD_PREP") != NULL &&
+    strstr(logText, "'#slow'") != NULL;
+  CHK(chk, "slow log missing expanded TOPICS_ADD_PREP SQL");
+  if (!chk) nErrors++;
+
+  //stats not collected after disabled
+  set_stats_chat_db(chatDb, NULL);
+  add_chat_db(chatDb, "@zdu", "room", 0, NULL, "untimed");
+  chk = find_stats(chatDb, "add_chat_db").count == 2;
+  CHK(chk, "stats collected after disabled");
+  if (!chk) nErrors++;
+  clear_stats_chat_db(chatDb);
+  chk = find_stats(chatDb, "CHATS_ADD_PREP").count == 0;
+  CHK(chk, "stats not cleared");
+  if (!chk) nErrors++;
+
+  free_chat_db(chatDb);
+  fclose(slowLog);
+  free(logText);
+  return nErrors;
+}
+
+/** returns # of errors */
+static int
+test_activities(void)
+{
+  int nErrors = 0;
+  bool chk;
+  MakeChatDbResult result;
+  const ChatDbOptions options = { .activityWindowMillis = 60*1000 };
+  if (make_chat_db_with_options(NULL, &options, &result) != 0) {
+    return error("cannot create db: %s", result.err);
+  }
+  ChatDb *chatDb = result.chatDb;
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  const TimeMillis now = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+  const ChatInfo chats[] = {
+    { .user = "@zdu", .room = "Sysprog", .nTopics = 3,
+      .topics = (const char *[]) { "#db", "#unix", "#DB" },
+      .message = "1", .timestamp = now - 40*1000, },
+    { .user = "@ZDU", .room = "sysprog", .nTopics = 1,
+      .topics = (const char *[]) { "#db" },
+      .message = "2", .timestamp = now - 30*1000, },
+    { .user = "@tom", .room = "sysprog", .nTopics = 2,
+      .topics = (const char *[]) { "#fork", "#db" },
+      .message = "3", .timestamp = now, },
+    { .user = "@tom", .room = "sysprog", .nTopics = 1,
+      .topics = (const char *[]) { "#fork" },
+      .message = "4", .timestamp = now, },
+    { .user = "@jane", .room = "Sysprog", .nTopics = 1,
+      .topics = (const char *[]) { "#pipe" },
+      .message = "old", .timestamp = now - 5*60*1000, },
+    { .user = "@jane", .room = "other", .nTopics = 1,
+      .topics = (const char *[]) { "#pipe" },
+      .message = "other", .timestamp = now, },
+  };
+  if (add_chats_chat_db(chatDb, sizeof(chats)/sizeof(chats[0]), chats) != 0) {
+    error("add chats: %s", error_chat_db(chatDb));
+    free_chat_db(chatDb);
+    return nErrors + 1;
+  }
+  enum { K = 2 };
+  TopicCount topTopics[K + 1];
+  RoomStats stats;
+  stats_room_chat_db(chatDb, "SYSPROG", K, topTopics, &stats);
+  chk = stats.nChats == 4 && stats.nUsers == 2 && stats.nTopTopics == K &&
+    stats.windowMillis == 60*1000 && stats.chatsPerMinute > 4 - 1e-6;
+  CHKF(chk, "sysprog: nChats %zu, nUsers %zu, nTopTopics %zu, rate %g",
+       stats.nChats, stats.nUsers, stats.nTopTopics, stats.chatsPerMinute);
+  if (!chk) nErrors++;
+  chk = stats.nTopTopics == K &&
+    strcmp(topTopics[0].topic, "#db") == 0 && topTopics[0].count == 3 &&
+    strcmp(topTopics[1].topic, "#fork") == 0 && topTopics[1].count == 2;
+  CHKF(chk, "sysprog top topics: %s %zu, %s %zu",
+       topTopics[0].topic, topTopics[0].count,
+       topTopics[1].topic, topTopics[1].count);
+  if (!chk) nErrors++;
+
+  stats_room_chat_db(chatDb, "unknown", K, topTopics, &stats);
+  chk = stats.nChats == 0 && stats.nTopTopics == 0;
+  CHKF(chk, "unknown room: nChats %zu", stats.nChats);
+  if (!chk) nErrors++;
+
+  //a chat 55s in the future slides the window past the first 2 chats
+  const ChatInfo future = {
+    .user = "@bill", .room = "sysprog", .nTopics = 1,
+    .topics = (const char *[]) { "#unix" },
+    .message = "future", .timestamp = now + 55*1000,
+  };
+  add_chats_chat_db(chatDb, 1, &future);
+  stats_room_chat_db(chatDb, "sysprog", K + 1, topTopics, &stats);
+  chk = stats.nChats == 3 && stats.nUsers == 2 && stats.nTopTopics == 3;
+  CHKF(chk, "slid sysprog: nChats %zu, nUsers %zu, nTopTopics %zu",
+       stats.nChats, stats.nUsers, stats.nTopTopics);
+  if (!chk) nErrors++;
+  chk = stats.nTopTopics == 3 &&
+    strcmp(topTopics[0].topic, "#fork") == 0 && topTopics[0].count == 2 &&
+    topTopics[1].count == 1 && topTopics[2].count == 1;
+  CHKF(chk, "slid sysprog top topic: %s %zu", topTopics[0].topic,
+       topTopics[0].count);
+  if (!chk) nErrors++;
+
+  free_chat_db(chatDb);
+  return nErrors;
+}
+
+/** ctx for stream_iter_fn() */
+typedef struct {
+  ChatDb *chatDb;
+  FILE *out;                    //streamed messages written here
+  size_t maxChunkLen;           //length of longest chunk streamed
+  size_t nMessages;             //# of results with non-NULL message
+  size_t messageLen;            //messageLen of last result
+} StreamCtx;
+
+static int
+stream_sink_fn(const char *chunk, size_t chunkLen, void *ctx)
+{
+  StreamCtx *streamCtx = ctx;
+  if (chunkLen > streamCtx->maxChunkLen) streamCtx->maxChunkLen = chunkLen;
+  fwrite(chunk, 1, chunkLen, streamCtx->out);
+  return 0;
+}
+
+static int
+stream_iter_fn(const ChatInfo *info, void *ctx)
+{
+  StreamCtx *streamCtx = ctx;
+  streamCtx->nMessages += (info->message != NULL);
+  streamCtx->messageLen = info->messageLen;
+  return stream_message_chat_db(streamCtx->chatDb, info, stream_sink_fn, ctx);
+}
+
+/** test storing and streaming large messages */
+static int
+test_large_messages(void)
+{
+  int nErrors = 0;
+  bool chk;
+  MakeChatDbResult result;
+  if (make_chat_db(NULL, &result) != 0) {
+    return error("cannot create db: %s", result.err);
+  }
+  ChatDb *chatDb = result.chatDb;
+  const size_t lens[] = { 5, LARGE_MESSAGE_SIZE - 1, 3*LARGE_MESSAGE_SIZE + 7 };
+  const unsigned fieldsList[] = {
+    ALL_FIELDS, STREAM_MESSAGE_FIELD, ALL_FIELDS|STREAM_MESSAGE_FIELD,
+  };
+  for (int i = 0; i < sizeof(lens)/sizeof(lens[0]); i++) {
+    const size_t len = lens[i];
+    char *message = malloc(len + 1);
+    if (!message) fatal("cannot malloc message:");
+    for (size_t j = 0; j < len; j++) message[j] = 'a' + (i + j) % 26;
+    message[len] = '\0';
+    if (add_chat_db(chatDb, "@zdu", "room", 0, NULL, message) != NO_ERR) {
+      error("add %zu: %s", len, error_chat_db(chatDb));
+      free(message);
+      nErrors++;
+      continue;
+    }
+    for (int t = 0; t < sizeof(fieldsList)/sizeof(fieldsList[0]); t++) {
+      const char *room = "room";
+      const ChatQuery query = {
+        .nRooms = 1, .rooms = &room, .count = 1, .fields = fieldsList[t],
+      };
+      char *streamed = NULL;
+      size_t streamedLen = 0;
+      StreamCtx ctx = {
+        .chatDb = chatDb, .out = open_memstream(&streamed, &streamedLen),
+      };
+      if (!ctx.out) fatal("cannot open stream:");
+      int err = run_query_chat_db(chatDb, &query, stream_iter_fn, &ctx);
+      fclose(ctx.out);
+      chk = err == NO_ERR && streamedLen == len && ctx.messageLen == len &&
+        memcmp(streamed, message, len) == 0 &&
+        ctx.maxChunkLen <= MESSAGE_CHUNK_SIZE &&
+        ctx.nMessages == ((fieldsList[t] & MESSAGE_FIELD) ? 1 : 0);
+      CHKF(chk, "len %zu, fields %#x: err %d, streamed %zu bytes, "
+           "messageLen %zu, max chunk %zu, %zu messages", len, fieldsList[t],
+           err, streamedLen, ctx.messageLen, ctx.maxChunkLen, ctx.nMessages);
+      if (!chk) nErrors++;
+      free(streamed);
+    }
+    free(message);
+  }
+  const ChatInfo notQueried = { .message = "x", .messageLen = 1 };
+  chk = stream_message_chat_db(chatDb, &notQueried, stream_sink_fn, NULL)
+    != NO_ERR;
+  CHK(chk, "streaming outside query iteration did not fail");
+  if (!chk) nErrors++;
+  free_chat_db(chatDb);
+  return nErrors;
+}
+
+/** test transparent compression of long messages */
+static int
+test_compression(void)
+{
+  int nErrors = 0;
+  bool chk;
+  const ChatDbOptions options = { .compressMinSize = 256 };
+  MakeChatDbResult result;
+  if (make_chat_db_with_options(NULL, &options, &result) != 0) {
+    return error("cannot create db: %s", result.err);
+  }
+  ChatDb *chatDb = result.chatDb;
+  const size_t lens[] = { 100, 1000, 2*LARGE_MESSAGE_SIZE };
+  const unsigned fieldsList[] = {
+    ALL_FIELDS, STREAM_MESSAGE_FIELD, USER_FIELD|MESSAGE_FIELD,
+  };
+  for (int i = 0; i < sizeof(lens)/sizeof(lens[0]); i++) {
+    const size_t len = lens[i];
+    char *message = malloc(len + 1);
+    if (!message) fatal("cannot malloc message:");
+    for (size_t j = 0; j < len; j++) message[j] = "chat room message "[j % 18];
+    message[len] = '\0';
+    if (add_chat_db(chatDb, "@zdu", "room", 0, NULL, message) != NO_ERR) {
+      error("add %zu: %s", len, error_chat_db(chatDb));
+      free(message);
+      nErrors++;
+      continue;
+    }
+    for (int t = 0; t < sizeof(fieldsList)/sizeof(fieldsList[0]); t++) {
+      const char *room = "room";
+      const ChatQuery query = {
+        .nRooms = 1, .rooms = &room, .count = 1, .fields = fieldsList[t],
+      };
+      char *streamed = NULL;
+      size_t streamedLen = 0;
+      StreamCtx ctx = {
+        .chatDb = chatDb, .out = open_memstream(&streamed, &streamedLen),
+      };
+      if (!ctx.out) fatal("cannot open stream:");
+      int err = run_query_chat_db(chatDb, &query, stream_iter_fn, &ctx);
+      fclose(ctx.out);
+      chk = err == NO_ERR && streamedLen == len &&
+        memcmp(streamed, message, len) == 0 &&
+        ctx.nMessages == ((fieldsList[t] & MESSAGE_FIELD) ? 1 : 0);
+      CHKF(chk, "compressed len %zu, fields %#x: err %d, streamed %zu bytes, "
+           "%zu messages", len, fieldsList[t], err, streamedLen,
+           ctx.nMessages);
+      if (!chk) nErrors++;
+      free(streamed);
+    }
+    free(message);
+  }
+  ChatDbCompressionStats stats;
+  compression_stats_chat_db(chatDb, &stats);
+  chk = stats.minSize == 256 && stats.nMessages == 3 &&
+    stats.nCompressed == 2 && stats.nStoredBytes < stats.nMessageBytes;
+  CHKF(chk, "compression stats: minSize %zu, %zu messages, %zu compressed, "
+       "%zu stored bytes for %zu bytes", stats.minSize, stats.nMessages,
+       stats.nCompressed, (size_t)stats.nStoredBytes,
+       (size_t)stats.nMessageBytes);
+  if (!chk) nErrors++;
+
+  //stats unchanged when a bulk add is rolled back after a compressed add
+  const char *failSql =
+    "CREATE TEMP TRIGGER failAdd BEFORE INSERT ON chats "
+    "WHEN NEW.user = '@fail' BEGIN SELECT RAISE(ABORT, 'fail'); END;";
+  if (sqlite3_exec(chatDb->db, failSql, 0, 0, 0) != SQLITE_OK) {
+    fatal("cannot create trigger: %s", sqlite3_errmsg(chatDb->db));
+  }
+  char message[1000 + 1];
+  memset(message, 'x', sizeof(message) - 1);
+  message[sizeof(message) - 1] = '\0';
+  const ChatInfo chats[] = {
+    { .user = "@zdu", .room = "room", .message = message },
+    { .user = "@fail", .room = "room", .message = message },
+  };
+  const int err = add_chats_chat_db(chatDb, 2, chats);
+  ChatDbCompressionStats failStats;
+  compression_stats_chat_db(chatDb, &failStats);
+  chk = err != NO_ERR && failStats.nMessages == stats.nMessages &&
+    failStats.nCompressed == stats.nCompressed &&
+    failStats.nStoredBytes == stats.nStoredBytes;
+  CHKF(chk, "rolled back compression stats: err %d, %zu messages, "
+       "%zu compressed", err, failStats.nMessages, failStats.nCompressed);
+  if (!chk) nErrors++;
+  free_chat_db(chatDb);
+  return nErrors;
+}
+
+/** returns # of errors */
+static int
+test_bulk_load(void)
+{
+  int nErrors = 0;
+  bool chk;
+  MakeChatDbResult result;
+  if (make_chat_db(NULL, &result) != 0) {
+    return error("cannot create db: %s", result.err);
+  }
+  ChatDb *chatDb = result.chatDb;
+  const TimeMillis t0 = 1700000000000;
+  const ChatInfo chats[] = {
+    { .user = "@zdu", .room = "Beta", .nTopics = 2,
+      .topics = (const char *[]) { "#db", "#DB" },
+      .message = "first", .timestamp = t0, },
+    { .user = "@tom", .room = "alpha", .message = "second",
+      .timestamp = t0 + 1000, },
+    { .user = "@tom", .room = "beta", .nTopics = 1,
+      .topics = (const char *[]) { "#db" },
+      .message = "third", .timestamp = t0 + 2000, },
+  };
+  const size_t nChats = sizeof(chats)/sizeof(chats[0]);
+  if (begin_bulk_load_chat_db(chatDb) != 0 ||
+      add_chats_chat_db(chatDb, nChats, chats) != 0 ||
+      end_bulk_load_chat_db(chatDb) != 0) {
+    error("bulk load: %s", error_chat_db(chatDb));
+    free_chat_db(chatDb);
+    return 1;
+  }
+
+  StrSpace rooms;
+  init_str_space(&rooms);
+  iter_rooms_chat_db(chatDb, add_room_iter_fn, &rooms);
+  const char *room0 = iter_str_space(&rooms, NULL);
+  const char *room1 = room0 ? iter_str_space(&rooms, room0) : NULL;
+  chk = room0 && strcmp(room0, "alpha") == 0 &&
+        room1 && strcmp(room1, "beta") == 0 &&
+        iter_str_space(&rooms, room1) == NULL;
+  CHKF(chk, "bulk load rooms %s %s != alpha beta", room0, room1);
+  if (!chk) nErrors++;
+  free_str_space(&rooms);
+
+  size_t count;
+  count_topic_chat_db(chatDb, "#db", &count);
+  chk = count == 2;
+  CHKF(chk, "bulk load count topic #db messages: %zu != 2", count);
+  if (!chk) nErrors++;
+
+  TimeMillis timestamp = t0;
+  const ChatQuery query = {
+    .nRooms = 2, .rooms = (const char *[]) { "alpha", "beta" },
+    .count = 10, .isOldestFirst = true,
+  };
+  run_query_chat_db(chatDb, &query, check_timestamp_iter_fn, &timestamp);
+  chk = timestamp == t0 + nChats*1000;
+  CHKF(chk, "bulk load oldest first: %zu results != %zu",
+       (size_t)((timestamp - t0)/1000), nChats);
+  if (!chk) nErrors++;
+  free_chat_db(chatDb);
+  return nErrors;
+}
+
+/** test that a ChatDb waits for a lock held by another ChatDb on the
+ *  same db file only as long as its busy timeout.
+ */
+static int
+test_busy_timeout(void)
+{
+  int nErrors = 0;
+  bool chk;
+  const char *path = "test-busy-timeout.db";
+  enum { TIMEOUT_MILLIS = 100 };
+  remove(path);
+  MakeChatDbResult result1, result2;
+  if (make_chat_db(path, &result1) != 0) {
+    return error("cannot create db: %s", result1.err);
+  }
+  ChatDb *holder = result1.chatDb;
+  const ChatDbOptions options = { .busyTimeoutMillis = TIMEOUT_MILLIS };
+  if (make_chat_db_with_options(path, &options, &result2) != 0) {
+    free_chat_db(holder);
+    remove(path);
+    return error("cannot create db: %s", result2.err);
+  }
+  ChatDb *waiter = result2.chatDb;
+  sqlite3_exec(holder->db, "BEGIN EXCLUSIVE", NULL, NULL, NULL);
+  const uint64_t t0 = now_nanos();
+  int err = add_chat_db(waiter, "@zdu", "busy", 0, NULL, "blocked");
+  const uint64_t millis = (now_nanos() - t0)/1000000;
+  chk = err != 0 && millis >= TIMEOUT_MILLIS;
+  CHKF(chk, "add with lock held: err %d after %llu ms", err,
+       (unsigned long long)millis);
+  if (!chk) nErrors++;
+  sqlite3_exec(holder->db, "COMMIT", NULL, NULL, NULL);
+  err = add_chat_db(waiter, "@zdu", "busy", 0, NULL, "unblocked");
+  chk = err == 0;
+  CHKF(chk, "add after lock released: %s", error_chat_db(waiter));
+  if (!chk) nErrors++;
+  free_chat_db(waiter);
+  free_chat_db(holder);
+  remove(path);
+  return nErrors;
+}
+
 /** returns # of errors */
 static int
 do_tests(ChatDb *chatDb)
@@ -976,7 +3365,16 @@ do_tests(ChatDb *chatDb)
          tests[t].label, resultIndex, tests[t].nExpected);
     if (!chk) nErrors++;
   }
-  return nErrors + test_counts(chatDb);
+  nErrors += test_counts(chatDb);
+  nErrors += test_filters(chatDb);
+  nErrors += test_multi_rooms(chatDb);
+  nErrors += test_fields(chatDb);
+  nErrors += test_stats();
+  nErrors += test_activities();
+  nErrors += test_large_messages();
+  nErrors += test_compression();
+  nErrors += test_busy_timeout();
+  return nErrors + test_bulk_load();
 }
 
 #endif //ifndef MANUAL_TEST_CHAT_DB
@@ -1,6 +1,7 @@
 #ifndef CHAT_DB_H_
 #define CHAT_DB_H_
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 
@@ -20,7 +21,13 @@ typedef struct _ChatDb ChatDb;
 
 typedef int64_t TimeMillis;
 
-/** complete information for a chat message */
+/** opaque state used by stream_message_chat_db() for a query result */
+typedef struct ChatStream ChatStream;
+
+/** complete information for a chat message.  When a query selects
+ *  only some fields, the unselected string fields are NULL, an
+ *  unselected topics has nTopics 0 and an unselected timestamp is 0.
+ */
 typedef struct {
   const char *user;
   const char *room;
@@ -28,8 +35,17 @@ typedef struct {
   const char **topics; //const char *topics[nTopics]
   const char *message;
   TimeMillis timestamp;
+  size_t messageLen;   //strlen(message); set only by queries
+  const ChatStream *stream; //set only by queries; owned by the query
 } ChatInfo;
 
+/** Messages having at least LARGE_MESSAGE_SIZE bytes are written
+ *  directly into the db through a blob handle rather than being
+ *  bound as a copied parameter.  Messages are streamed back by
+ *  stream_message_chat_db() in chunks of MESSAGE_CHUNK_SIZE bytes.
+ */
+enum { LARGE_MESSAGE_SIZE = 16*1024, MESSAGE_CHUNK_SIZE = 4*1024 };
+
 /** used for holding result of make_chat_db() */
 typedef union {
   ChatDb *chatDb;       //success result: handle to ChatDb object
@@ -58,6 +74,49 @@ typedef union {
  */
 int make_chat_db(const char *path, MakeChatDbResult *resultP);
 
+/** options which can be specified when creating a ChatDb; a
+ *  zero-initialized options struct selects the defaults.
+ */
+typedef struct {
+  /** target false-positive rate for the in-memory filters of known
+   *  rooms and topics used to reject unknown names without running
+   *  any SQL.  0 selects the default rate; a rate < 0 or >= 1
+   *  disables the filters.
+   */
+  double filterFpRate;
+
+  /** duration of the sliding window over which room activity is
+   *  aggregated for stats_room_chat_db().  0 selects the default
+   *  window; a window < 0 disables the aggregates.
+   */
+  TimeMillis activityWindowMillis;
+
+  /** messages having at least this many bytes are stored compressed
+   *  when that makes them smaller; they are decompressed only when
+   *  their message is retrieved or streamed by a query.  0 disables
+   *  compression.
+   */
+  size_t compressMinSize;
+
+  /** how long a statement waits for a lock on the db held by another
+   *  connection to it before failing with a DB error.  0 fails at
+   *  once; set it when several ChatDbs share a db file.
+   */
+  int busyTimeoutMillis;
+} ChatDbOptions;
+
+/** default value for ChatDbOptions.filterFpRate */
+#define DEFAULT_FILTER_FP_RATE 0.01
+
+/** default value for ChatDbOptions.activityWindowMillis: 1 hour */
+#define DEFAULT_ACTIVITY_WINDOW_MILLIS (60*60*1000)
+
+/** Like make_chat_db(), but with options specified by *options.
+ *  If options is NULL, then use default options.
+ */
+int make_chat_db_with_options(const char *path, const ChatDbOptions *options,
+                              MakeChatDbResult *resultP);
+
 /** Free all resources used by chatDb. */
 int free_chat_db(ChatDb *chatDb);
 
@@ -66,6 +125,26 @@ int add_chat_db(ChatDb *chatDb, const char *user, const char *room,
                 size_t nTopics, const char *topics[nTopics],
                 const char *message);
 
+/** Add all chats[nChats] to chatDb within a single transaction: either
+ *  all of them are added or none of them are.  If the timestamp of a
+ *  chats[] element is non-zero, then it is used as the creation time
+ *  of that message; otherwise the current time is used.
+ */
+int add_chats_chat_db(ChatDb *chatDb, size_t nChats,
+                      const ChatInfo chats[nChats]);
+
+/** Prepare chatDb for a bulk load of chats using add_chats_chat_db().
+ *  Index maintenance and syncing to disk are suspended until
+ *  end_bulk_load_chat_db() is called; queries remain correct but
+ *  may be slow in the interim.
+ */
+int begin_bulk_load_chat_db(ChatDb *chatDb);
+
+/** End a bulk load started by begin_bulk_load_chat_db(): rebuild the
+ *  indexes and restore syncing to disk.
+ */
+int end_bulk_load_chat_db(ChatDb *chatDb);
+
 /** Function Type used for iterating through query results: called for
  *  each result.  The ctx argument can be used by the caller to
  *  read/update arbitrary context.
@@ -86,12 +165,205 @@ int query_chat_db(ChatDb *chatDb, const char *room,
                   size_t nTopics, const char *topics[], size_t count,
                   IterFn *iterFn, void *ctx);
 
+/** bit-mask values for ChatQuery.fields selecting ChatInfo fields */
+enum {
+  USER_FIELD = 0x1,
+  ROOM_FIELD = 0x2,
+  TOPICS_FIELD = 0x4,
+  MESSAGE_FIELD = 0x8,
+  TIMESTAMP_FIELD = 0x10,
+  ALL_FIELDS = 0x1f,
+  STREAM_MESSAGE_FIELD = 0x20, //messageLen only; see stream_message_chat_db()
+};
+
+/** specification of a query */
+typedef struct {
+  size_t nRooms;
+  const char **rooms;   //rooms[nRooms]: match messages in any of these
+  size_t nTopics;
+  const char **topics;  //topics[nTopics]: match messages having all of these
+  size_t count;         //max # of results
+  bool isOldestFirst;   //iterate oldest first rather than most recent first
+  unsigned fields;      //*_FIELD mask of ChatInfo fields wanted; 0 means all
+} ChatQuery;
+
+/** Like query_chat_db(), but with the query specified by *query.
+ *  The messages from all of query->rooms[] are merged into a single
+ *  sequence which is iterated most recent first (oldest first if
+ *  query->isOldestFirst).  Rooms which are unknown or repeated in
+ *  query->rooms[] are ignored.
+ *
+ *  Only the ChatInfo fields selected by query->fields are retrieved;
+ *  in particular, the topics lookup for each result is skipped
+ *  unless TOPICS_FIELD is selected.  If STREAM_MESSAGE_FIELD is
+ *  selected without MESSAGE_FIELD, then ChatInfo.message is NULL but
+ *  ChatInfo.messageLen is set, and large messages are not read until
+ *  streamed using stream_message_chat_db().
+ */
+int run_query_chat_db(ChatDb *chatDb, const ChatQuery *query,
+                      IterFn *iterFn, void *ctx);
+
+/** Function type used for streaming a message: called with successive
+ *  chunks chunk[chunkLen] of the message.  Return non-zero to stop
+ *  the stream.
+ */
+typedef int MessageSinkFn(const char *chunk, size_t chunkLen, void *ctx);
+
+/** Stream the message of result, the chat being passed to an IterFn
+ *  by run_query_chat_db(), to sinkFn() in chunks of at most
+ *  MESSAGE_CHUNK_SIZE bytes, passing ctx as the last argument.  Large
+ *  messages are read directly from the db so that memory used is
+ *  bounded independent of the message size.  May only be called from
+ *  within that IterFn for a query which selected MESSAGE_FIELD or
+ *  STREAM_MESSAGE_FIELD.  Streaming stops without error if sinkFn()
+ *  returns non-zero.
+ */
+int stream_message_chat_db(ChatDb *chatDb, const ChatInfo *result,
+                           MessageSinkFn *sinkFn, void *ctx);
+
+/** Function type used for iterating through names */
+typedef int NameIterFn(const char *name, void *ctx);
+
+/** call iterFn(room, ctx) for each distinct room in chatDb in
+ *  lexicographic order.  If iterFn() returns non-zero, then the
+ *  iteration is terminated.
+ */
+int iter_rooms_chat_db(ChatDb *chatDb, NameIterFn *iterFn, void *ctx);
+
 /** set count to # of messages for room */
 int count_room_chat_db(ChatDb *chatDb, const char *room, size_t *count);
 
 /** set count to # of messages for topic */
 int count_topic_chat_db(ChatDb *chatDb, const char *topic, size_t *count);
 
+/** statistics for a filter of known names */
+typedef struct {
+  size_t nItems;           /** # of distinct names in filter */
+  size_t capacity;         /** # of names filter is currently sized for */
+  double fpRate;           /** false-positive rate estimated from fill */
+  size_t nRejects;         /** # of lookups rejected without running SQL */
+  size_t nFalsePositives;  /** # of lookups passed by filter but not in db */
+} NameFilterStats;
+
+/** statistics for the filters of known rooms and topics */
+typedef struct {
+  double fpRate;           /** configured rate; 0 if filters disabled */
+  NameFilterStats rooms;
+  NameFilterStats topics;
+} ChatDbFilterStats;
+
+/** fill in *stats with statistics for filters used by chatDb */
+int filter_stats_chat_db(const ChatDb *chatDb, ChatDbFilterStats *stats);
+
+/** statistics for compression of messages added using a ChatDb */
+typedef struct {
+  size_t minSize;          /** ChatDbOptions.compressMinSize; 0 if disabled */
+  size_t nMessages;        /** # of messages added */
+  size_t nCompressed;      /** # of those messages stored compressed */
+  uint64_t nMessageBytes;  /** total # of bytes in messages added */
+  uint64_t nStoredBytes;   /** total # of bytes stored for those messages */
+} ChatDbCompressionStats;
+
+/** fill in *stats with compression statistics for messages added
+ *  using chatDb since it was created.
+ */
+int compression_stats_chat_db(const ChatDb *chatDb,
+                              ChatDbCompressionStats *stats);
+
+/** # of buckets in a LatencyHistogram: bucket i counts latencies in
+ *  [2^i, 2^(i+1)) nanoseconds, with bucket 0 also counting 0 and the
+ *  last bucket also counting all larger latencies.
+ */
+enum { N_LATENCY_BUCKETS = 40 };
+
+/** log2 histogram of latencies */
+typedef struct {
+  uint64_t count;          /** # of latencies recorded */
+  uint64_t totalNanos;     /** sum of all latencies */
+  uint64_t maxNanos;       /** largest latency */
+  uint64_t buckets[N_LATENCY_BUCKETS];
+} LatencyHistogram;
+
+/** return an upper bound for the p'th percentile (0 <= p <= 100) of
+ *  the latencies in histogram, accurate to within a factor of 2.
+ */
+uint64_t percentile_latency_histogram(const LatencyHistogram *histogram,
+                                      double p);
+
+/** options for collecting latency statistics */
+typedef struct {
+  bool isEnabled;          /** collect statistics iff true */
+  /** if slowLog is non-NULL and slowNanos > 0, then each SQL
+   *  statement which takes at least slowNanos is logged on slowLog
+   *  along with its expanded SQL.
+   */
+  uint64_t slowNanos;
+  FILE *slowLog;
+} ChatDbStatsOptions;
+
+/** Start or stop collecting latency statistics for chatDb as per
+ *  *options; if options is NULL, then stop.  Latencies are collected
+ *  for each cached prepared statement, for all other SQL statements
+ *  together and for add_chat_db() and run_query_chat_db() calls
+ *  overall.  Statement latencies are measured from the first step
+ *  of a statement until it is reset, so query statements include
+ *  time spent in the caller's IterFn.  Collection is off by
+ *  default; when off, SQL statements are not traced.  Note that
+ *  add_chat_db() and run_query_chat_db() are always timed for the
+ *  process-wide chat_db_*_nanos metrics, whether or not collection
+ *  is on.
+ *
+ *  Previously collected statistics are retained.
+ */
+int set_stats_chat_db(ChatDb *chatDb, const ChatDbStatsOptions *options);
+
+/** reset all latency statistics collected for chatDb */
+int clear_stats_chat_db(ChatDb *chatDb);
+
+/** Function type used for iterating through latency statistics */
+typedef int LatencyIterFn(const char *name,
+                          const LatencyHistogram *histogram, void *ctx);
+
+/** call iterFn(name, histogram, ctx) for each latency histogram
+ *  collected for chatDb, including empty ones.  The statement
+ *  histograms are named by their prepared statement id (like
+ *  "ROOM_COUNT_PREP"), with "OTHER_SQL" for uncached statements;
+ *  the overall histograms are named "add_chat_db" and
+ *  "run_query_chat_db".  If iterFn() returns non-zero, then the
+ *  iteration is terminated.
+ */
+int iter_stats_chat_db(const ChatDb *chatDb, LatencyIterFn *iterFn, void *ctx);
+
+/** a topic and the # of chats which mention it */
+typedef struct {
+  const char *topic;
+  size_t count;
+} TopicCount;
+
+/** activity statistics for a room over a recent window of time */
+typedef struct {
+  TimeMillis windowMillis; /** duration of window; 0 if not aggregated */
+  size_t nChats;           /** # of chats in room within window */
+  double chatsPerMinute;   /** average rate of chats within window */
+  size_t nUsers;           /** approximate # of distinct users in window */
+  size_t nTopTopics;       /** # of topTopics[] filled in */
+} RoomStats;
+
+/** Fill in *stats with activity statistics for room over the sliding
+ *  window which ends now, with up to k of its most mentioned topics
+ *  in topTopics[k] in non-increasing order of count.  The topic
+ *  strings remain valid until chatDb is freed.
+ *
+ *  The statistics are maintained incrementally as chats are added,
+ *  so this runs in O(k) time independent of the # of chats.  They
+ *  reflect the chats which were in chatDb when it was created along
+ *  with those subsequently added through chatDb, but not those
+ *  added by other processes.  The window slides in steps of 1/12 of
+ *  its duration.
+ */
+int stats_room_chat_db(ChatDb *chatDb, const char *room, size_t k,
+                       TopicCount topTopics[k], RoomStats *stats);
+
 /** return error message for last error on chatDb. */
 const char *error_chat_db(const ChatDb *chatDb);
 
@@ -101,13 +373,25 @@ int out_chat_info(const ChatInfo *chatInfo, FILE *out);
 /** exact format produced by timestamp_to_iso8601() */
 #define ISO_8601_FORMAT "YYYY-MM-DDThh:mm:ss.ttt"
 
+/** length of ISO_8601_FORMAT */
+#define ISO_8601_LEN (sizeof(ISO_8601_FORMAT) - 1)
+
 /** set buf to ISO-8601 representation of timestamp in localtime.
  *  Should have bufSize > strlen(ISO_8601_FMT).
  *
  *  Will not exceed bufSize.  Return value like snprintf():
  *  # of characters which would have been output (not counting the NUL).
+ *
+ *  The local time of the current minute is cached per thread, so
+ *  successive calls with nearby timestamps do not call localtime_r().
  */
 size_t timestamp_to_iso8601(TimeMillis timestamp,
                             size_t bufSize, char buf[bufSize]);
 
+/** set bufs[i] to the ISO-8601 representation of timestamps[i] in
+ *  localtime for i in [0, n).  Each bufs[i] is NUL-terminated.
+ */
+void timestamps_to_iso8601(size_t n, const TimeMillis timestamps[n],
+                           char bufs[n][ISO_8601_LEN + 1]);
+
 #endif //ifndef CHAT_DB_H_
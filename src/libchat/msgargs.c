@@ -1,36 +1,57 @@
 #include "msgargs.h"
 
 #include <errors.h>
+#include <memalloc.h>
 
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 
-typedef struct {
-  MsgArgs msgArgs;
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/** clients should regard insides as private */
+struct _MsgArgsParser {
+  MsgArgs msgArgs;    //must be first: returned by read_*_args()
+  bool isLine;        //parse as for read_line_args()
+  bool isDone;        //msgArgs returned; reset before accepting more input
   size_t argsSize;
   size_t bufSize;
-  char *buf;
-} XMsgArgs;
+  char *buf;          //text of current command, always NUL-terminated
+  size_t nc;          //# of chars in buf
+  size_t lineStart;   //index in buf of start of current line
+  size_t lineSize;
+  char *line;         //line read by getline()
+};
 
+/** result of pushing input into a parser */
+typedef enum {
+  NEED_MORE,          //input consumed without completing a command
+  HAVE_ARGS,          //parser->msgArgs set up for a complete command
+  HAVE_EMPTY,         //complete command was empty
+} PushStatus;
 
 static void
-ensure_arg1_space(XMsgArgs *msgArgs, ErrNum *err)
+ensure_arg1_space(MsgArgsParser *parser, ErrNum *err)
 {
   enum { INIT_ARGS_SIZE = 2, };
-  if (msgArgs->msgArgs.nArgs == msgArgs->argsSize) {
+  if (parser->msgArgs.nArgs == parser->argsSize) {
     size_t newSize =
-      msgArgs->argsSize == 0 ? INIT_ARGS_SIZE : 2 * msgArgs->argsSize;
-    char **args = realloc(msgArgs->msgArgs.args, newSize*sizeof(char *));
+      parser->argsSize == 0 ? INIT_ARGS_SIZE : 2 * parser->argsSize;
+    char **args = realloc_tag(MEM_TAG_MSG, parser->msgArgs.args,
+                              newSize*sizeof(char *));
     if (args == NULL) {
       *err = MEM_ERR;
     }
     else {
-      msgArgs->msgArgs.args = (const char **)args;
-      msgArgs->argsSize = newSize;
+      parser->msgArgs.args = (const char **)args;
+      parser->argsSize = newSize;
     }
   }
 }
@@ -43,94 +64,299 @@ skip_space(char *p)
 }
 
 static char *
-add_next_arg(char *p, XMsgArgs *msgArgs, ErrNum *err)
+add_next_arg(char *p, MsgArgsParser *parser, ErrNum *err)
 {
   p = skip_space(p);
   if (*p == '\0') return p;
   const char *arg = p;
   while (!isspace(*p) && *p != '\0') p++;
   if (*p != '\0') *p++ = '\0';
-  ensure_arg1_space(msgArgs, err);
+  ensure_arg1_space(parser, err);
   if (*err != NO_ERR) return NULL;
-  assert(msgArgs->msgArgs.nArgs < msgArgs->argsSize);
-  msgArgs->msgArgs.args[msgArgs->msgArgs.nArgs++] = arg;
+  assert(parser->msgArgs.nArgs < parser->argsSize);
+  parser->msgArgs.args[parser->msgArgs.nArgs++] = arg;
   return p;
 }
 
 static void
-add_args(char *line, XMsgArgs *msgArgs, ErrNum *err)
+add_args(char *line, MsgArgsParser *parser, ErrNum *err)
 {
   *err = NO_ERR;
   char *p = line;
   while (*p != '\0') {
-    p = add_next_arg(p, msgArgs, err);
+    p = add_next_arg(p, parser, err);
     if (*err != NO_ERR) return;
   }
 }
 
+/** append bytes[n] to parser->buf, growing it geometrically */
 static void
-ensure_buf_space(size_t nc, XMsgArgs *msgArgs, ErrNum *err)
+append_bytes(MsgArgsParser *parser, const char *bytes, size_t n, ErrNum *err)
 {
   enum { INIT_BUF_SIZE = 8 };
-  if (nc == msgArgs->bufSize) {
-    size_t newSize =
-      msgArgs->bufSize == 0 ? INIT_BUF_SIZE : 2 * msgArgs->bufSize;
-    char *buf = realloc(msgArgs->buf, newSize*sizeof(char));
+  const size_t size = parser->nc + n + 1;
+  if (size > parser->bufSize) {
+    size_t newSize = parser->bufSize == 0 ? INIT_BUF_SIZE : parser->bufSize;
+    while (newSize < size) newSize *= 2;
+    char *buf = realloc_tag(MEM_TAG_MSG, parser->buf, newSize*sizeof(char));
     if (buf == NULL) {
       *err = MEM_ERR;
+      return;
     }
-    else {
-      msgArgs->buf = buf; msgArgs->bufSize = newSize;
-    }
+    parser->buf = buf; parser->bufSize = newSize;
   }
+  memcpy(&parser->buf[parser->nc], bytes, n);
+  parser->nc += n;
+  parser->buf[parser->nc] = '\0';
 }
 
+/** set up parser->msgArgs for the first len chars of parser->buf:
+ *  args from the first line and msg from the remaining lines.
+ */
+static void
+make_msg_args(MsgArgsParser *parser, size_t len, ErrNum *err)
+{
+  char *buf = parser->buf;
+  buf[len] = '\0';
+  //unterminated last line at EOF may not have a newline
+  const char *nlP = strchr(buf, '\n');
+  size_t line1Len = nlP ? nlP - buf : strlen(buf);
+  buf[line1Len] = '\0';  //replace first newline
+  add_args(buf, parser, err);
+  if (*err != NO_ERR) return;
+  parser->msgArgs.msg = (len > line1Len + 1) ? buf + line1Len + 1 : NULL;
+}
 
-static size_t
-read_lines(FILE *in, XMsgArgs *msgArgs, ErrNum *err)
+/** set up parser->msgArgs for the single line in parser->buf: as
+ *  for make_msg_args() if it starts with a ? or %, otherwise as for a
+ *  `+` command with initial `#words` added to args.
+ */
+static void
+make_line_args(MsgArgsParser *parser, ErrNum *err)
+{
+  char *p = skip_space(parser->buf);
+  if ((p[0] == '?' || p[0] == '%') && isspace(p[1])) {
+    add_args(parser->buf, parser, err);
+    return;
+  }
+  const char* fixedArgs[] = { "+", NULL, NULL };
+  for (int i = 0; i < sizeof(fixedArgs)/sizeof(fixedArgs[0]); i++) {
+    ensure_arg1_space(parser, err);
+    if (*err != NO_ERR) return;
+    parser->msgArgs.args[parser->msgArgs.nArgs++] = fixedArgs[i];
+  }
+  while (*p == '#') {
+    p = add_next_arg(p, parser, err);
+    if (*err != NO_ERR) return;
+    p = skip_space(p);
+  }
+  parser->msgArgs.msg = p;
+}
+
+/** process the newline-terminated line which was just appended to
+ *  parser->buf.
+ */
+static PushStatus
+end_line(MsgArgsParser *parser, ErrNum *err)
 {
   enum { TERM_CHAR = '.' };
-  int c;
-  char lastC = '\n';
-  size_t nc = 0;
-  while ((c = fgetc(in)) != EOF) {
-    ensure_buf_space(nc, msgArgs, err);
-    if (*err != NO_ERR) return 0;
-    assert(nc < msgArgs->bufSize);
-    if (c == '\n') {
-      if (lastC == TERM_CHAR) {
-        msgArgs->buf[nc - 1] = '\0'; //replace TERM_CHAR with str terminator
-        return nc - 1;
-      }
-      else {
-        lastC = '\n';
-      }
-    }
-    else if (c == TERM_CHAR && lastC == '\n') {
-      lastC = TERM_CHAR; //only set to TERM_CHAR immediately after '\n'
+  const char *line = &parser->buf[parser->lineStart];
+  const size_t n = parser->nc - parser->lineStart;
+  if (!parser->isLine) {
+    if (n == 2 && line[0] == TERM_CHAR) {
+      //terminating line is not included
+      if (parser->lineStart == 0) return HAVE_EMPTY;
+      make_msg_args(parser, parser->lineStart, err);
+      return HAVE_ARGS;
     }
-    else {
-      lastC = '\0';
+    parser->lineStart = parser->nc;
+  }
+  else {
+    for (size_t i = 0; i < n; i++) {
+      if (!isspace(line[i])) {
+        make_line_args(parser, err);
+        return HAVE_ARGS;
+      }
     }
-    msgArgs->buf[nc++] = c;
+    parser->nc = 0; //skip whitespace line
+  }
+  return NEED_MORE;
+}
+
+/** reset parser if a command was returned by the previous call */
+static void
+start_push(MsgArgsParser *parser, ErrNum *err)
+{
+  *err = NO_ERR;
+  if (parser->isDone) {
+    parser->msgArgs.nArgs = 0; parser->msgArgs.msg = NULL;
+    parser->nc = parser->lineStart = 0;
+    parser->isDone = false;
   }
-  if (ferror(in)) *err = IO_ERR;
-  return nc;
 }
 
-static XMsgArgs *
-getXMsgArgs(MsgArgs *lastMsgArgs, ErrNum *err)
+/** push line[n] into parser, where line[n] contains no newline
+ *  except possibly at its end.
+ */
+static PushStatus
+push_line(MsgArgsParser *parser, const char *line, size_t n, ErrNum *err)
 {
-  XMsgArgs *msgArgs = (XMsgArgs *)lastMsgArgs;
-  if (msgArgs == NULL) {
-    msgArgs = calloc(1, sizeof(XMsgArgs));
-    if (msgArgs == NULL) {
-      *err = MEM_ERR;
-      return NULL;
-    }
+  start_push(parser, err);
+  append_bytes(parser, line, n, err);
+  if (*err != NO_ERR || line[n - 1] != '\n') return NEED_MORE;
+  PushStatus status = end_line(parser, err);
+  if (*err != NO_ERR) return NEED_MORE;
+  parser->isDone = (status != NEED_MORE);
+  return status;
+}
+
+/** push bytes[n] into parser, stopping after the first line which
+ *  completes a command.  Set *nConsumed to the # of bytes used.
+ */
+static PushStatus
+push_bytes(MsgArgsParser *parser, const char *bytes, size_t n,
+           size_t *nConsumed, ErrNum *err)
+{
+  PushStatus status = NEED_MORE;
+  size_t i = 0;
+  *err = NO_ERR;
+  while (i < n && status == NEED_MORE && *err == NO_ERR) {
+    const char *nlP = memchr(&bytes[i], '\n', n - i);
+    const size_t end = nlP ? nlP - bytes + 1 : n;
+    status = push_line(parser, &bytes[i], end - i, err);
+    i = end;
+  }
+  *nConsumed = i;
+  return status;
+}
+
+/** complete any pending command at end of input */
+static PushStatus
+end_bytes(MsgArgsParser *parser, ErrNum *err)
+{
+  start_push(parser, err);
+  parser->isDone = true;
+  if (parser->nc == 0) return HAVE_EMPTY;
+  if (parser->isLine) {
+    make_line_args(parser, err);
+  }
+  else {
+    make_msg_args(parser, parser->nc, err);
+  }
+  return (*err == NO_ERR) ? HAVE_ARGS : NEED_MORE;
+}
+
+/** Return a new parser for input pushed incrementally using
+ *  push_msg_args_parser().  If isLine, then the input is parsed as
+ *  for read_line_args(), otherwise as for read_msg_args().
+ *
+ *  Returns NULL with *err set to MEM_ERR on a memory error.
+ */
+MsgArgsParser *
+make_msg_args_parser(bool isLine, ErrNum *err)
+{
+  *err = NO_ERR;
+  MsgArgsParser *parser = calloc_tag(MEM_TAG_MSG, 1, sizeof(MsgArgsParser));
+  if (parser == NULL) {
+    *err = MEM_ERR;
+    return NULL;
+  }
+  parser->isLine = isLine;
+  return parser;
+}
+
+/** Push bytes[n] into parser.  Never blocks.  Consumes bytes up to
+ *  the end of the first complete command and returns its MsgArgs,
+ *  setting *nConsumed to the # of bytes used; the remaining bytes
+ *  should be pushed again.  Returns NULL after consuming all of
+ *  bytes[n] without completing a command; state is retained until
+ *  the next call.
+ *
+ *  The returned MsgArgs belongs to parser and is only valid until
+ *  the next call on parser.  Empty commands are skipped.
+ *
+ *  Returns NULL with *err set to MEM_ERR on a memory error.
+ */
+const MsgArgs *
+push_msg_args_parser(MsgArgsParser *parser, const char *bytes, size_t n,
+                     size_t *nConsumed, ErrNum *err)
+{
+  *nConsumed = 0;
+  while (*nConsumed < n) {
+    size_t m;
+    PushStatus status =
+      push_bytes(parser, &bytes[*nConsumed], n - *nConsumed, &m, err);
+    *nConsumed += m;
+    if (*err != NO_ERR) return NULL;
+    if (status == HAVE_ARGS) return &parser->msgArgs;
   }
-  msgArgs->msgArgs.nArgs = 0; msgArgs->msgArgs.msg = NULL;
-  return msgArgs;
+  return NULL;
+}
+
+/** Signal end of input to parser.  Returns MsgArgs for any pending
+ *  incomplete command (as read_msg_args() and read_line_args() do on
+ *  EOF), or NULL if there is none.  The parser can be reused for
+ *  new input after this call.
+ *
+ *  Same ownership and error returns as push_msg_args_parser().
+ */
+const MsgArgs *
+end_msg_args_parser(MsgArgsParser *parser, ErrNum *err)
+{
+  return end_bytes(parser, err) == HAVE_ARGS ? &parser->msgArgs : NULL;
+}
+
+/** Free all memory used by parser */
+void
+free_msg_args_parser(MsgArgsParser *parser)
+{
+  free_tag(parser->buf);
+  free(parser->line);            //allocated by getline()
+  free_tag(parser->msgArgs.args);
+  free_tag(parser);
+}
+
+/** read next line from in into parser->line, returning its length
+ *  (including any terminating newline); 0 on EOF or error.
+ *
+ *  getline() scans the stdio buffer for the newline using memchr()
+ *  and copies whole blocks, avoiding per-character fgetc() calls,
+ *  while not consuming anything from in beyond the line.
+ */
+static size_t
+next_line(FILE *in, MsgArgsParser *parser, ErrNum *err)
+{
+  errno = 0;
+  ssize_t n = getline(&parser->line, &parser->lineSize, in);
+  if (n < 0) {
+    if (ferror(in)) *err = IO_ERR;
+    else if (errno == ENOMEM) *err = MEM_ERR;
+    return 0;
+  }
+  return n;
+}
+
+/** read a command from in by pushing its lines into a parser */
+static MsgArgs *
+read_args(FILE *in, MsgArgs *lastMsgArgs, bool isLine, ErrNum *err)
+{
+  *err = NO_ERR;
+  MsgArgsParser *parser = (MsgArgsParser *)lastMsgArgs;
+  if (parser == NULL && (parser = make_msg_args_parser(isLine, err)) == NULL) {
+    return NULL;
+  }
+  parser->isLine = isLine;
+  PushStatus status = NEED_MORE;
+  size_t n;
+  while (status == NEED_MORE && (n = next_line(in, parser, err)) > 0) {
+    status = push_line(parser, parser->line, n, err);
+  }
+  if (*err == NO_ERR && status == NEED_MORE) status = end_bytes(parser, err);
+  if (*err != NO_ERR || status != HAVE_ARGS) {
+    free_msg_args_parser(parser);
+    return NULL;
+  }
+  return (MsgArgs *)parser;
 }
 
 /** Read lines from `in` until a line containg only a single period
@@ -164,102 +390,156 @@ getXMsgArgs(MsgArgs *lastMsgArgs, ErrNum *err)
  */
 MsgArgs *
 read_msg_args(FILE *in, MsgArgs *lastMsgArgs, ErrNum *err)
+{
+  return read_args(in, lastMsgArgs, false, err);
+}
+
+/** Read a *single* line from `in`, skipping empty lines.  If line
+ *  starts with a ? or %, then read rest of line as for
+ *  read_msg_args().  Otherwise, set up args as for a `+` command,
+ *  with initial `#words` added to args.
+ *
+ *  Same memory allocation strategy, error returns and usage
+ *  as read_msg_args().
+ */
+MsgArgs *
+read_line_args(FILE *in, MsgArgs *lastMsgArgs, ErrNum *err)
+{
+  return read_args(in, lastMsgArgs, true, err);
+}
+
+/** Free all memory used by msgArgs */
+void
+free_msg_args(MsgArgs *msgArgs)
+{
+  free_msg_args_parser((MsgArgsParser *)msgArgs);
+}
+
+/***************************** Mapped Input ****************************/
+
+/** clients should regard insides as private */
+struct _MsgArgsMap {
+  MsgArgsView view;    //returned by next_msg_args_map()
+  size_t argsSize;
+  CharsView *args;     //args[argsSize] for view
+  const char *chars;   //mapped file contents; NULL if empty
+  size_t size;         //# of bytes mapped
+  size_t next;         //index in chars[] of start of next command
+};
+
+/** Map the file at path into memory for parsing in place using
+ *  next_msg_args_map().
+ *
+ *  Returns NULL with *err set to IO_ERR if the file cannot be opened
+ *  or mapped, or MEM_ERR on a memory error.
+ */
+MsgArgsMap *
+make_msg_args_map(const char *path, ErrNum *err)
 {
   *err = NO_ERR;
-  XMsgArgs *msgArgs = getXMsgArgs(lastMsgArgs, err);
-  if (msgArgs == NULL) return NULL;
-  size_t nc = read_lines(in, msgArgs, err);
-  if (nc == 0 || *err != NO_ERR) {
-    free_msg_args((MsgArgs *)msgArgs);
+  MsgArgsMap *map = calloc_tag(MEM_TAG_MSG, 1, sizeof(MsgArgsMap));
+  if (map == NULL) {
+    *err = MEM_ERR;
     return NULL;
   }
-  const char *nlP = strchr(msgArgs->buf, '\n');
-  assert(nlP != NULL);
-  size_t line1Len = nlP - msgArgs->buf;
-  msgArgs->buf[line1Len] = '\0';  //replace first newline
-  add_args(msgArgs->buf, msgArgs, err);
-  if (*err != NO_ERR) {
-    free_msg_args((MsgArgs *)msgArgs);
-    return NULL;
+  int fd = open(path, O_RDONLY);
+  struct stat statBuf;
+  if (fd < 0 || fstat(fd, &statBuf) < 0) goto IO_FAIL;
+  map->size = statBuf.st_size;
+  if (map->size > 0) {
+    void *chars = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (chars == MAP_FAILED) goto IO_FAIL;
+    madvise(chars, map->size, MADV_SEQUENTIAL);
+    map->chars = chars;
   }
-  msgArgs->msgArgs.msg =
-    (nc > line1Len + 1) ? msgArgs->buf + line1Len + 1 : NULL;
-  return (MsgArgs *)msgArgs;
+  close(fd);
+  return map;
+ IO_FAIL:
+  if (fd >= 0) close(fd);
+  free_tag(map);
+  *err = IO_ERR;
+  return NULL;
 }
 
-static size_t
-read_line(FILE *in, XMsgArgs *msgArgs, ErrNum *err)
+/** add args from line[n] to map->view */
+static void
+add_arg_views(MsgArgsMap *map, const char *line, size_t n, ErrNum *err)
 {
-  int c;
-  size_t nc = 0;
-  bool seenNonSpace = false;
-  while ((c = fgetc(in)) != EOF) {
-    seenNonSpace = seenNonSpace || !isspace(c);
-    ensure_buf_space(nc, msgArgs, err);
-    if (*err != NO_ERR) return 0;
-    assert(nc < msgArgs->bufSize);
-    msgArgs->buf[nc++] = c;
-    if (c == '\n') {
-      if (seenNonSpace) break;
-      nc = 0; //skip whitespace line
+  enum { INIT_ARGS_SIZE = 4, };
+  MsgArgsView *view = &map->view;
+  for (size_t i = 0; i < n; ) {
+    while (i < n && isspace(line[i])) i++;
+    if (i == n) break;
+    const size_t start = i;
+    while (i < n && !isspace(line[i])) i++;
+    if (view->nArgs == map->argsSize) {
+      size_t newSize = map->argsSize == 0 ? INIT_ARGS_SIZE : 2*map->argsSize;
+      CharsView *args = realloc_tag(MEM_TAG_MSG, map->args,
+                                     newSize*sizeof(CharsView));
+      if (args == NULL) {
+        *err = MEM_ERR;
+        return;
+      }
+      map->args = args; map->argsSize = newSize;
+      view->args = args;
     }
+    map->args[view->nArgs++] =
+      (CharsView) { .chars = &line[start], .len = i - start };
   }
-  if (ferror(in)) { *err = IO_ERR; return 0; }
-  ensure_buf_space(nc, msgArgs, err);
-  if (*err != NO_ERR) return 0;
-   msgArgs->buf[nc] = '\0';
-  return nc;
 }
 
-/** Read a *single* line from `in`, skipping empty lines.  If line
- *  starts with a ?, then read rest of line as for read_msg_args().
- *  Otherwise, set up args as for a `+` command, with initial `#words`
- *  added to args.
+/** Return a view of the next command in map, parsed as for
+ *  read_msg_args() but without copying: args[] and msg are
+ *  length-delimited views into the mapped file and are not
+ *  NUL-terminated.  msg.chars is NULL if there is no msg.
  *
- *  Same memory allocation strategy, error returns and usage
- *  as read_msg_args().
+ *  The returned view belongs to map and is only valid until the
+ *  next call on map.  Returns NULL at end of input or if the next
+ *  command is simply a "." line.  Will set *err to MEM_ERR on a
+ *  memory error.
  */
-MsgArgs *
-read_line_args(FILE *in, MsgArgs *lastMsgArgs, ErrNum *err)
+const MsgArgsView *
+next_msg_args_map(MsgArgsMap *map, ErrNum *err)
 {
+  enum { TERM_CHAR = '.' };
   *err = NO_ERR;
-  XMsgArgs *msgArgs = getXMsgArgs(lastMsgArgs, err);
-  if (msgArgs == NULL) return NULL;
-  size_t nc = read_line(in, msgArgs, err);
-  if (nc == 0 || *err != NO_ERR) goto FAIL;
-  char *p = skip_space(msgArgs->buf);
-  if (p[0] == '?' && isspace(p[1])) {
-    add_args(msgArgs->buf, msgArgs, err);
-    if (*err != NO_ERR) goto FAIL;
+  if (map->next >= map->size) return NULL;
+  const char *start = &map->chars[map->next];
+  const size_t avail = map->size - map->next;
+  if (avail >= 2 && start[0] == TERM_CHAR && start[1] == '\n') {
+    map->next += 2;
+    return NULL;
   }
-  else {
-    const char* fixedArgs[] = { "+", NULL, NULL };
-    for (int i = 0; i < sizeof(fixedArgs)/sizeof(fixedArgs[0]); i++) {
-      ensure_arg1_space(msgArgs, err);
-      if (*err != NO_ERR) goto FAIL;
-      msgArgs->msgArgs.args[msgArgs->msgArgs.nArgs++] = fixedArgs[i];
+  //command is terminated by a line containing only TERM_CHAR, or EOF
+  const char *termP = NULL;
+  for (const char *p = start, *end = start + avail;
+       (p = memchr(p, '\n', end - p)) != NULL && end - p >= 3; p++) {
+    if (p[1] == TERM_CHAR && p[2] == '\n') {
+      termP = p;
+      break;
     }
-    while (*p == '#') {
-      p = add_next_arg(p, msgArgs, err);
-      if (*err != NO_ERR) goto FAIL;
-      p = skip_space(p);
-    }
-    msgArgs->msgArgs.msg = p;
   }
-  return (MsgArgs*)msgArgs;
- FAIL:
-  if (msgArgs != NULL) free_msg_args((MsgArgs *)msgArgs);
-  return NULL;
+  const size_t len = termP ? termP + 1 - start : avail;
+  map->next += termP ? len + 2 : len;
+  const char *nlP = memchr(start, '\n', len);
+  const size_t line1Len = nlP ? nlP - start : len;
+  MsgArgsView *view = &map->view;
+  view->nArgs = 0;
+  add_arg_views(map, start, line1Len, err);
+  if (*err != NO_ERR) return NULL;
+  view->msg = (len > line1Len + 1)
+    ? (CharsView) { .chars = start + line1Len + 1, .len = len - line1Len - 1 }
+    : (CharsView) { .chars = NULL, .len = 0 };
+  return view;
 }
 
-/** Free all memory used by msgArgs */
+/** Unmap and free all memory used by map */
 void
-free_msg_args(MsgArgs *msgArgs0)
+free_msg_args_map(MsgArgsMap *map)
 {
-  XMsgArgs *msgArgs = (XMsgArgs *)msgArgs0;
-  free(msgArgs->buf);
-  free(msgArgs->msgArgs.args);
-  free(msgArgs);
+  if (map->chars) munmap((void *)map->chars, map->size);
+  free_tag(map->args);
+  free_tag(map);
 }
 
 // must be in same order as ErrNum enum
@@ -318,21 +598,94 @@ print_msg_args(FILE *out, const MsgArgs *msgArgs) {
 typedef MsgArgs *MsgArgsFn(FILE *in, MsgArgs *lastMsgArgs, ErrNum *err);
 
 static MsgArgsFn *msgArgFns[] = { read_msg_args, read_line_args };
+
+/** parse in by pushing it into a parser in small chunks of varying
+ *  sizes, writing results on out.
+ */
+static void
+push_test(FILE *in, bool isLine, FILE *out)
+{
+  ErrNum err;
+  MsgArgsParser *parser = make_msg_args_parser(isLine, &err);
+  if (!parser) fatal("%s", errnum_to_string(err));
+  char chunk[8];
+  size_t n;
+  for (int i = 0; (n = fread(chunk, 1, 1 + i % sizeof(chunk), in)) > 0; i++) {
+    for (size_t nConsumed, j = 0; j < n; j += nConsumed) {
+      const MsgArgs *msgArgs =
+        push_msg_args_parser(parser, &chunk[j], n - j, &nConsumed, &err);
+      if (err != NO_ERR) fatal("%s", errnum_to_string(err));
+      if (msgArgs) print_msg_args(out, msgArgs);
+    }
+  }
+  const MsgArgs *msgArgs = end_msg_args_parser(parser, &err);
+  if (err != NO_ERR) fatal("%s", errnum_to_string(err));
+  if (msgArgs) print_msg_args(out, msgArgs);
+  free_msg_args_parser(parser);
+}
+
+/** parse in by copying it to a temporary file and viewing commands
+ *  in place using a MsgArgsMap, writing results on out.
+ */
+static void
+map_test(FILE *in, FILE *out)
+{
+  char path[] = "/tmp/test-msgargs-XXXXXX";
+  int fd = mkstemp(path);
+  FILE *tmp = (fd < 0) ? NULL : fdopen(fd, "w");
+  if (!tmp) fatal("cannot create temp file:");
+  int c;
+  while ((c = fgetc(in)) != EOF) fputc(c, tmp);
+  fclose(tmp);
+  ErrNum err;
+  MsgArgsMap *map = make_msg_args_map(path, &err);
+  remove(path);
+  if (!map) fatal("%s", errnum_to_string(err));
+  const MsgArgsView *view;
+  while ((view = next_msg_args_map(map, &err)) != NULL) {
+    for (int i = 0; i < view->nArgs; i++) {
+      fprintf(out, "%.*s\n", (int)view->args[i].len, view->args[i].chars);
+    }
+    if (view->msg.chars == NULL) {
+      fprintf(out, "NO_MSG\n");
+    }
+    else {
+      fprintf(out, "%.*s", (int)view->msg.len, view->msg.chars);
+    }
+  }
+  if (err != NO_ERR) fatal("%s", errnum_to_string(err));
+  free_msg_args_map(map);
+}
+
 int
 main(int argc, const char *argv[])
 {
-  if (argc < 2 || argc > 3) fatal("usage: %s msg|line [ANYTHING]", argv[0]);
-  int fnIndex = strcmp(argv[1], "line") == 0;
+  if (argc < 2 || argc > 3) {
+    fatal("usage: %s msg|line|msg-push|line-push|msg-map [ANYTHING]",
+          argv[0]);
+  }
+  int fnIndex = strncmp(argv[1], "line", 4) == 0;
+  bool isPush = strstr(argv[1], "-push") != NULL;
+  bool isMap = strstr(argv[1], "-map") != NULL;
+  if (isMap && fnIndex != 0) fatal("only msg input can be mapped");
   bool useStdin = argc > 2;
   char *lines = testLines[fnIndex];
   FILE *in = (useStdin) ? stdin : fmemopen(lines, strlen(lines), "r");
   MsgArgsFn *fn = msgArgFns[fnIndex];
   FILE *out = stdout;
-  MsgArgs *msgArgs = NULL;
-  ErrNum err;
-  while ((msgArgs = fn(in, msgArgs, &err)) != NULL) {
-    if (err != NO_ERR) { fatal("%s", errnum_to_string(err)); }
-    print_msg_args(out, msgArgs);
+  if (isPush) {
+    push_test(in, fnIndex, out);
+  }
+  else if (isMap) {
+    map_test(in, out);
+  }
+  else {
+    MsgArgs *msgArgs = NULL;
+    ErrNum err;
+    while ((msgArgs = fn(in, msgArgs, &err)) != NULL) {
+      if (err != NO_ERR) { fatal("%s", errnum_to_string(err)); }
+      print_msg_args(out, msgArgs);
+    }
   }
   if (argc == 2) fclose(in);
 }
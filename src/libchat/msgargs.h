@@ -1,6 +1,7 @@
 #ifndef MSGARGS_H_
 #define MSGARGS_H_
 
+#include <stdbool.h>
 #include <stdio.h>
 
 typedef enum {
@@ -50,9 +51,9 @@ typedef struct {
 MsgArgs *read_msg_args(FILE *in, MsgArgs *lastMsgArgs, ErrNum *err);
 
 /** Read a line from `in`, skipping empty lines.  If line starts with
- *  a ?, then read rest of line as for read_msg_args().  Otherwise,
- *  set up args as for a `+` command, with initial `#words` added
- *  to args.
+ *  a ? or %, then read rest of line as for read_msg_args().
+ *  Otherwise, set up args as for a `+` command, with initial `#words`
+ *  added to args.
  *
  *  Same memory allocation strategy, error returns and usage
  *  as read_msg_args().
@@ -62,4 +63,103 @@ MsgArgs *read_line_args(FILE *in, MsgArgs *lastMsgArgs, ErrNum *err);
 /** Free all memory used by msgArgs */
 void free_msg_args(MsgArgs *msgArgs);
 
+/** Push-style parser for commands which are read incrementally,
+ *  for example by an event loop.  read_msg_args() and
+ *  read_line_args() are implemented on top of it.
+ */
+typedef struct _MsgArgsParser MsgArgsParser;
+
+/** Return a new parser for input pushed incrementally using
+ *  push_msg_args_parser().  If isLine, then the input is parsed as
+ *  for read_line_args(), otherwise as for read_msg_args().
+ *
+ *  Returns NULL with *err set to MEM_ERR on a memory error.
+ */
+MsgArgsParser *make_msg_args_parser(bool isLine, ErrNum *err);
+
+/** Push bytes[n] into parser.  Never blocks.  Consumes bytes up to
+ *  the end of the first complete command and returns its MsgArgs,
+ *  setting *nConsumed to the # of bytes used; the remaining bytes
+ *  should be pushed again.  Returns NULL after consuming all of
+ *  bytes[n] without completing a command; state is retained until
+ *  the next call.
+ *
+ *  The returned MsgArgs belongs to parser and is only valid until
+ *  the next call on parser.  Empty commands are skipped.
+ *
+ *  Returns NULL with *err set to MEM_ERR on a memory error.
+ *
+ *  Typical usage for bytes[n] read from a non-blocking source:
+ *
+ *  for (size_t nConsumed, i = 0; i < n; i += nConsumed) {
+ *    const MsgArgs *msgArgs =
+ *      push_msg_args_parser(parser, &bytes[i], n - i, &nConsumed, &err);
+ *    if (msgArgs) //process msgArgs
+ *  }
+ */
+const MsgArgs *push_msg_args_parser(MsgArgsParser *parser,
+                                    const char *bytes, size_t n,
+                                    size_t *nConsumed, ErrNum *err);
+
+/** Signal end of input to parser.  Returns MsgArgs for any pending
+ *  incomplete command (as read_msg_args() and read_line_args() do on
+ *  EOF), or NULL if there is none.  The parser can be reused for
+ *  new input after this call.
+ *
+ *  Same ownership and error returns as push_msg_args_parser().
+ */
+const MsgArgs *end_msg_args_parser(MsgArgsParser *parser, ErrNum *err);
+
+/** Free all memory used by parser */
+void free_msg_args_parser(MsgArgsParser *parser);
+
+/** length-delimited view of chars; not NUL-terminated */
+typedef struct {
+  const char *chars;
+  size_t len;
+} CharsView;
+
+/** a command parsed in place: as for MsgArgs, but with views */
+typedef struct {
+  size_t nArgs;          /** # of arguments in args[] */
+  const CharsView *args; /** args[nArgs] */
+  CharsView msg;         /** msg if any (msg.chars NULL if none) */
+} MsgArgsView;
+
+/** Memory-mapped command file which is parsed in place, without
+ *  copying, for replaying large command scripts.
+ */
+typedef struct _MsgArgsMap MsgArgsMap;
+
+/** Map the file at path into memory for parsing in place using
+ *  next_msg_args_map().
+ *
+ *  Returns NULL with *err set to IO_ERR if the file cannot be opened
+ *  or mapped, or MEM_ERR on a memory error.
+ */
+MsgArgsMap *make_msg_args_map(const char *path, ErrNum *err);
+
+/** Return a view of the next command in map, parsed as for
+ *  read_msg_args() but without copying: args[] and msg are
+ *  length-delimited views into the mapped file and are not
+ *  NUL-terminated.  msg.chars is NULL if there is no msg.
+ *
+ *  The returned view belongs to map and is only valid until the
+ *  next call on map.  Returns NULL at end of input or if the next
+ *  command is simply a "." line.  Will set *err to MEM_ERR on a
+ *  memory error.
+ *
+ *  Typical usage:
+ *
+ *  const MsgArgsView *view;
+ *  while ((view = next_msg_args_map(map, &err)) != NULL) {
+ *    //process view
+ *  }
+ *  free_msg_args_map(map);
+ */
+const MsgArgsView *next_msg_args_map(MsgArgsMap *map, ErrNum *err);
+
+/** Unmap and free all memory used by map */
+void free_msg_args_map(MsgArgsMap *map);
+
 #endif // #ifndef MSGARGS_H_
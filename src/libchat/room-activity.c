@@ -0,0 +1,439 @@
+#include "room-activity.h"
+
+#include <hyper-log-log.h>
+#include <memalloc.h>
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/** Sliding-window activity aggregates for chat rooms: for each room,
+ *  the # of messages, an approximate # of distinct users and the
+ *  most mentioned topics over a recent window of time.
+ *
+ *  The window is divided into N_ACTIVITY_BUCKETS equal time buckets
+ *  and slides one bucket at a time: chats are counted in the bucket
+ *  for their timestamp and a bucket's counts are subtracted out when
+ *  it leaves the window.  The topics for a room are kept ordered by
+ *  their windowed count, so that the top K topics can be read in
+ *  O(K) time.  Each count change moves a topic only within the run
+ *  of topics having its old count, which is found by binary search.
+ */
+
+enum { INIT_N_SLOTS = 16 };
+
+#define EMPTY_TOPIC_ID UINT32_MAX
+
+/** 64-bit FNV-1a hash of name ignoring ASCII case */
+static uint64_t
+hash_name(const char *name)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (const char *p = name; *p != '\0'; p++) {
+    h ^= tolower((unsigned char)*p);
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+/** murmur3 finalizer: spreads small ids over all bits */
+static uint64_t
+hash_id(uint32_t id)
+{
+  uint64_t h = id;
+  h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/******************************** Names ********************************/
+
+static void
+free_names(ActivityNames *names)
+{
+  for (size_t i = 0; i < names->nNames; i++) free_tag(names->names[i]);
+  free_tag(names->names);
+  free_tag(names->slots);
+}
+
+/** set *id to id of name and return true if name is in names */
+static bool
+find_name(const ActivityNames *names, const char *name, uint32_t *id)
+{
+  if (names->nSlots == 0) return false;
+  const size_t mask = names->nSlots - 1;
+  for (size_t i = hash_name(name) & mask; names->slots[i] != 0;
+       i = (i + 1) & mask) {
+    const uint32_t id1 = names->slots[i] - 1;
+    if (strcasecmp(names->names[id1], name) == 0) {
+      *id = id1;
+      return true;
+    }
+  }
+  return false;
+}
+
+/** put id for names->names[id] into a free slot of names */
+static void
+put_name_slot(ActivityNames *names, uint32_t id)
+{
+  const size_t mask = names->nSlots - 1;
+  size_t i = hash_name(names->names[id]) & mask;
+  while (names->slots[i] != 0) i = (i + 1) & mask;
+  names->slots[i] = id + 1;
+}
+
+/** set *id to id of name, adding it to names if not already present.
+ *  Returns non-zero on memory allocation error.
+ */
+static int
+intern_name(ActivityNames *names, const char *name, uint32_t *id)
+{
+  if (find_name(names, name, id)) return 0;
+  if (2 * (names->nNames + 1) > names->nSlots) {
+    const size_t nSlots = names->nSlots ? 2 * names->nSlots : INIT_N_SLOTS;
+    uint32_t *slots = calloc_tag(MEM_TAG_DB, nSlots, sizeof(uint32_t));
+    if (!slots) return 1;
+    free_tag(names->slots);
+    names->slots = slots;
+    names->nSlots = nSlots;
+    for (uint32_t i = 0; i < names->nNames; i++) put_name_slot(names, i);
+  }
+  if (names->nNames == names->namesCapacity) {
+    const size_t capacity =
+      names->namesCapacity ? 2 * names->namesCapacity : INIT_N_SLOTS;
+    char **p = realloc_tag(MEM_TAG_DB, names->names,
+                           capacity * sizeof(char *));
+    if (!p) return 1;
+    names->names = p;
+    names->namesCapacity = capacity;
+  }
+  const size_t len = strlen(name);
+  char *copy = malloc_tag(MEM_TAG_DB, len + 1);
+  if (!copy) return 1;
+  memcpy(copy, name, len + 1);
+  for (char *p = copy; *p != '\0'; p++) *p = tolower((unsigned char)*p);
+  *id = names->nNames;
+  names->names[names->nNames++] = copy;
+  put_name_slot(names, *id);
+  return 0;
+}
+
+/***************************** Topic Ranks *****************************/
+
+/** return slot for topicId in act->rankSlots[], or the empty slot
+ *  where it should be added if not present.
+ */
+static RankSlot *
+find_rank_slot(const RoomActivity *act, uint32_t topicId)
+{
+  const size_t mask = act->nRankSlots - 1;
+  size_t i = hash_id(topicId) & mask;
+  while (act->rankSlots[i].topicId != topicId &&
+         act->rankSlots[i].topicId != EMPTY_TOPIC_ID) {
+    i = (i + 1) & mask;
+  }
+  return &act->rankSlots[i];
+}
+
+/** refill act->rankSlots[] from act->ranks[] */
+static void
+reindex_rank_slots(RoomActivity *act)
+{
+  for (size_t i = 0; i < act->nRankSlots; i++) {
+    act->rankSlots[i] = (RankSlot) { .topicId = EMPTY_TOPIC_ID };
+  }
+  for (size_t i = 0; i < act->nRanks; i++) {
+    *find_rank_slot(act, act->ranks[i].topicId) = (RankSlot) {
+      .topicId = act->ranks[i].topicId, .rankIndex = i,
+    };
+  }
+}
+
+/** grow act->rankSlots[] to nSlots slots.  Returns non-zero on memory
+ *  allocation error.
+ */
+static int
+grow_rank_slots(RoomActivity *act, size_t nSlots)
+{
+  RankSlot *slots = realloc_tag(MEM_TAG_DB, act->rankSlots,
+                                 nSlots * sizeof(RankSlot));
+  if (!slots) return 1;
+  act->rankSlots = slots;
+  act->nRankSlots = nSlots;
+  reindex_rank_slots(act);
+  return 0;
+}
+
+/** return index of first entry in act->ranks[] with count <= count */
+static size_t
+first_rank_at_most(const RoomActivity *act, uint32_t count)
+{
+  size_t lo = 0, hi = act->nRanks;
+  while (lo < hi) {
+    const size_t mid = (lo + hi) / 2;
+    if (act->ranks[mid].count > count) lo = mid + 1; else hi = mid;
+  }
+  return lo;
+}
+
+/** swap act->ranks[i] and act->ranks[j], updating their slots */
+static void
+swap_ranks(RoomActivity *act, size_t i, size_t j)
+{
+  if (i == j) return;
+  const TopicRank t = act->ranks[i];
+  act->ranks[i] = act->ranks[j];
+  act->ranks[j] = t;
+  find_rank_slot(act, act->ranks[i].topicId)->rankIndex = i;
+  find_rank_slot(act, act->ranks[j].topicId)->rankIndex = j;
+}
+
+/** increment count for topicId in act, adding it if necessary.
+ *  Returns non-zero on memory allocation error.
+ */
+static int
+increment_topic(RoomActivity *act, uint32_t topicId)
+{
+  if (2 * (act->nRanks + 1) > act->nRankSlots) {
+    const size_t nSlots = act->nRankSlots ? 2*act->nRankSlots : INIT_N_SLOTS;
+    if (grow_rank_slots(act, nSlots) != 0) return 1;
+  }
+  RankSlot *slot = find_rank_slot(act, topicId);
+  if (slot->topicId == EMPTY_TOPIC_ID) {
+    if (act->nRanks == act->ranksCapacity) {
+      const size_t capacity =
+        act->ranksCapacity ? 2 * act->ranksCapacity : INIT_N_SLOTS;
+      TopicRank *p = realloc_tag(MEM_TAG_DB, act->ranks,
+                                   capacity * sizeof(TopicRank));
+      if (!p) return 1;
+      act->ranks = p;
+      act->ranksCapacity = capacity;
+    }
+    //a 0 count is the smallest, so new topic goes at end
+    act->ranks[act->nRanks] = (TopicRank) { .topicId = topicId, .count = 0 };
+    *slot = (RankSlot) { .topicId = topicId, .rankIndex = act->nRanks++ };
+    act->nZeroRanks++;
+  }
+  const size_t i = slot->rankIndex;
+  const uint32_t count = act->ranks[i].count;
+  //move to front of run of topics with same count, then increment
+  const size_t j = first_rank_at_most(act, count);
+  swap_ranks(act, i, j);
+  act->ranks[j].count++;
+  if (count == 0) act->nZeroRanks--;
+  return 0;
+}
+
+/** decrement count for topicId in act, which must be non-zero */
+static void
+decrement_topic(RoomActivity *act, uint32_t topicId)
+{
+  const RankSlot *slot = find_rank_slot(act, topicId);
+  assert(slot->topicId == topicId);
+  const size_t i = slot->rankIndex;
+  const uint32_t count = act->ranks[i].count;
+  assert(count > 0);
+  //move to back of run of topics with same count, then decrement
+  const size_t j = first_rank_at_most(act, count - 1) - 1;
+  swap_ranks(act, i, j);
+  act->ranks[j].count--;
+  if (count == 1) act->nZeroRanks++;
+}
+
+/** drop topics with 0 counts (at end of act->ranks[]) if they make up
+ *  most of act->ranks[].
+ */
+static void
+compact_ranks(RoomActivity *act)
+{
+  if (act->nZeroRanks <= INIT_N_SLOTS || 2*act->nZeroRanks <= act->nRanks) {
+    return;
+  }
+  act->nRanks -= act->nZeroRanks;
+  act->nZeroRanks = 0;
+  reindex_rank_slots(act);
+}
+
+/**************************** Time Buckets *****************************/
+
+static void
+init_room_activity(RoomActivity *act)
+{
+  *act = (RoomActivity) { .lastBucketNo = -1 };
+  for (int i = 0; i < N_ACTIVITY_BUCKETS; i++) {
+    act->buckets[i].bucketNo = -1;
+  }
+}
+
+static void
+free_room_activity(RoomActivity *act)
+{
+  for (int i = 0; i < N_ACTIVITY_BUCKETS; i++) {
+    free_tag(act->buckets[i].topicIds);
+  }
+  free_tag(act->ranks);
+  free_tag(act->rankSlots);
+}
+
+/** subtract out all counts for bucket from act and empty it */
+static void
+expire_bucket(RoomActivity *act, ActivityBucket *bucket)
+{
+  act->nChats -= bucket->nChats;
+  for (size_t i = 0; i < bucket->nTopicIds; i++) {
+    decrement_topic(act, bucket->topicIds[i]);
+  }
+  bucket->nChats = 0;
+  bucket->nTopicIds = 0;
+  clear_hyper_log_log(&bucket->users);
+}
+
+/** slide window for act forward so that it ends with bucketNo */
+static void
+slide_window(RoomActivity *act, int64_t bucketNo)
+{
+  if (bucketNo <= act->lastBucketNo) return;
+  int64_t b = act->lastBucketNo + 1;
+  if (bucketNo - b >= N_ACTIVITY_BUCKETS) b = bucketNo - N_ACTIVITY_BUCKETS + 1;
+  for (; b <= bucketNo; b++) {
+    ActivityBucket *bucket = &act->buckets[b % N_ACTIVITY_BUCKETS];
+    expire_bucket(act, bucket);
+    bucket->bucketNo = b;
+  }
+  act->lastBucketNo = bucketNo;
+  compact_ranks(act);
+}
+
+/****************************** Public API *****************************/
+
+/** initialize activities to track chats within the last windowMillis
+ *  (rounded up to a multiple of N_ACTIVITY_BUCKETS).  Returns non-zero
+ *  on error.
+ */
+int
+init_room_activities(RoomActivities *activities, TimeMillis windowMillis)
+{
+  if (windowMillis <= 0) return 1;
+  *activities = (RoomActivities) {
+    .bucketMillis =
+      (windowMillis + N_ACTIVITY_BUCKETS - 1) / N_ACTIVITY_BUCKETS,
+  };
+  return 0;
+}
+
+/** free all dynamic memory used by activities.  Note that this routine
+ *  does not free the activities structure itself, as its lifetime is
+ *  assumed to be controlled by the client.
+ */
+void
+free_room_activities(RoomActivities *activities)
+{
+  for (size_t i = 0; i < activities->rooms.nNames; i++) {
+    free_room_activity(&activities->activities[i]);
+  }
+  free_tag(activities->activities);
+  free_names(&activities->rooms);
+  free_names(&activities->topics);
+}
+
+/** add a chat by user in room with topics[nTopics] created at
+ *  timestamp to activities.  Chats which are already outside the
+ *  window are ignored, as are repeated topics.  Returns non-zero on
+ *  memory allocation error.
+ */
+int
+add_room_activities(RoomActivities *activities, const char *user,
+                    const char *room, size_t nTopics,
+                    const char *topics[nTopics], TimeMillis timestamp)
+{
+  if (timestamp < 0) return 0;
+  const int64_t bucketNo = timestamp / activities->bucketMillis;
+  if (activities->rooms.nNames == activities->activitiesCapacity) {
+    const size_t capacity = activities->activitiesCapacity
+      ? 2 * activities->activitiesCapacity
+      : INIT_N_SLOTS;
+    RoomActivity *p =
+      realloc_tag(MEM_TAG_DB, activities->activities,
+                  capacity * sizeof(RoomActivity));
+    if (!p) return 1;
+    activities->activities = p;
+    activities->activitiesCapacity = capacity;
+  }
+  uint32_t roomId;
+  const size_t nRooms = activities->rooms.nNames;
+  if (intern_name(&activities->rooms, room, &roomId) != 0) return 1;
+  RoomActivity *act = &activities->activities[roomId];
+  if (roomId == nRooms) init_room_activity(act);
+  slide_window(act, bucketNo);
+  if (bucketNo <= act->lastBucketNo - N_ACTIVITY_BUCKETS) return 0;
+  ActivityBucket *bucket = &act->buckets[bucketNo % N_ACTIVITY_BUCKETS];
+  assert(bucket->bucketNo == bucketNo);
+  bucket->nChats++;
+  act->nChats++;
+  add_hyper_log_log(&bucket->users, user, strlen(user), true);
+  for (size_t i = 0; i < nTopics; i++) {
+    bool isRepeat = false;
+    for (size_t j = 0; !isRepeat && j < i; j++) {
+      isRepeat = strcasecmp(topics[i], topics[j]) == 0;
+    }
+    if (isRepeat) continue;
+    uint32_t topicId;
+    if (intern_name(&activities->topics, topics[i], &topicId) != 0) return 1;
+    if (bucket->nTopicIds == bucket->topicIdsCapacity) {
+      const size_t capacity =
+        bucket->topicIdsCapacity ? 2 * bucket->topicIdsCapacity : INIT_N_SLOTS;
+      uint32_t *p = realloc_tag(MEM_TAG_DB, bucket->topicIds,
+                                capacity * sizeof(uint32_t));
+      if (!p) return 1;
+      bucket->topicIds = p;
+      bucket->topicIdsCapacity = capacity;
+    }
+    if (increment_topic(act, topicId) != 0) return 1;
+    bucket->topicIds[bucket->nTopicIds++] = topicId;
+  }
+  return 0;
+}
+
+/** fill in *stats for room for the window ending at now, with up to k
+ *  of its most mentioned topics in topTopics[k].  The topic names in
+ *  topTopics[] remain valid until activities is freed.  Runs in
+ *  O(k) time (plus time to slide the window).
+ */
+void
+stats_room_activities(RoomActivities *activities, const char *room,
+                      TimeMillis now, size_t k, TopicCount topTopics[k],
+                      RoomStats *stats)
+{
+  const TimeMillis bucketMillis = activities->bucketMillis;
+  *stats = (RoomStats) { .windowMillis = N_ACTIVITY_BUCKETS * bucketMillis };
+  uint32_t roomId;
+  if (now < 0 || !find_name(&activities->rooms, room, &roomId)) return;
+  RoomActivity *act = &activities->activities[roomId];
+  slide_window(act, now / bucketMillis);
+  stats->nChats = act->nChats;
+  //window covers earlier buckets completely and current one partially
+  const TimeMillis elapsed =
+    (N_ACTIVITY_BUCKETS - 1) * bucketMillis + now % bucketMillis + 1;
+  stats->chatsPerMinute = act->nChats * 60000.0 / elapsed;
+  HyperLogLog users = { 0 };
+  for (int i = 0; i < N_ACTIVITY_BUCKETS; i++) {
+    if (act->buckets[i].nChats > 0) {
+      merge_hyper_log_log(&users, &act->buckets[i].users);
+    }
+  }
+  stats->nUsers = estimate_hyper_log_log(&users);
+  const size_t nTopics = act->nRanks - act->nZeroRanks;
+  stats->nTopTopics = (k < nTopics) ? k : nTopics;
+  for (size_t i = 0; i < stats->nTopTopics; i++) {
+    topTopics[i] = (TopicCount) {
+      .topic = activities->topics.names[act->ranks[i].topicId],
+      .count = act->ranks[i].count,
+    };
+  }
+}
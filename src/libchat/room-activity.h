@@ -0,0 +1,113 @@
+#ifndef ROOM_ACTIVITY_H_
+#define ROOM_ACTIVITY_H_
+
+#include "chat-db.h"
+
+#include <hyper-log-log.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Sliding-window activity aggregates for chat rooms: for each room,
+ *  the # of messages, an approximate # of distinct users and the
+ *  most mentioned topics over a recent window of time.
+ *
+ *  The window is divided into N_ACTIVITY_BUCKETS equal time buckets
+ *  and slides one bucket at a time: chats are counted in the bucket
+ *  for their timestamp and a bucket's counts are subtracted out when
+ *  it leaves the window.  The topics for a room are kept ordered by
+ *  their windowed count, so that the top K topics can be read in
+ *  O(K) time.  Each count change moves a topic only within the run
+ *  of topics having its old count, which is found by binary search.
+ */
+
+/** # of time buckets in a window */
+enum { N_ACTIVITY_BUCKETS = 12 };
+
+// clients responsible for allocation/deallocation of these structures.
+// note that clients should regard the insides of these structs as
+// private.
+
+/** a topic and its count in the window of a room */
+typedef struct {
+  uint32_t topicId;             //index into RoomActivities.topics.names[]
+  uint32_t count;               //# of chats in window having topic
+} TopicRank;
+
+/** a time bucket for a room */
+typedef struct {
+  int64_t bucketNo;             //timestamp / bucketMillis; -1 if unused
+  size_t nChats;                //# of chats in bucket
+  HyperLogLog users;            //users of chats in bucket
+  size_t nTopicIds;             //# of entries in topicIds[]
+  size_t topicIdsCapacity;
+  uint32_t *topicIds;           //topic ids of chats in bucket
+} ActivityBucket;
+
+/** open-addressed hash table mapping lower-cased names to ids */
+typedef struct {
+  size_t nNames;                //# of names; names have ids [0, nNames)
+  size_t namesCapacity;
+  char **names;                 //names[nNames]: dynamically allocated
+  size_t nSlots;                //power of 2; 0 if no slots allocated
+  uint32_t *slots;              //id + 1 for each name; 0 if slot empty
+} ActivityNames;
+
+/** open-addressed hash table mapping topic ids to positions in ranks */
+typedef struct {
+  uint32_t topicId;             //UINT32_MAX if slot empty
+  uint32_t rankIndex;           //index of topicId in RoomActivity.ranks[]
+} RankSlot;
+
+typedef struct {
+  int64_t lastBucketNo;         //most recent bucket in window
+  size_t nChats;                //# of chats in window
+  ActivityBucket buckets[N_ACTIVITY_BUCKETS]; //indexed by bucketNo % N
+  size_t nRanks;                //# of entries in ranks[]
+  size_t nZeroRanks;            //# of entries in ranks[] with 0 count
+  size_t ranksCapacity;
+  TopicRank *ranks;             //sorted by non-increasing count
+  size_t nRankSlots;            //power of 2
+  RankSlot *rankSlots;          //index of each topic in ranks[]
+} RoomActivity;
+
+typedef struct {
+  TimeMillis bucketMillis;      //duration of each bucket
+  ActivityNames rooms;          //ids index into activities[]
+  ActivityNames topics;
+  size_t activitiesCapacity;
+  RoomActivity *activities;     //activities[rooms.nNames]
+} RoomActivities;
+
+/** initialize activities to track chats within the last windowMillis
+ *  (rounded up to a multiple of N_ACTIVITY_BUCKETS).  Returns non-zero
+ *  on error.
+ */
+int init_room_activities(RoomActivities *activities, TimeMillis windowMillis);
+
+/** free all dynamic memory used by activities.  Note that this routine
+ *  does not free the activities structure itself, as its lifetime is
+ *  assumed to be controlled by the client.
+ */
+void free_room_activities(RoomActivities *activities);
+
+/** add a chat by user in room with topics[nTopics] created at
+ *  timestamp to activities.  Chats which are already outside the
+ *  window are ignored, as are repeated topics.  Returns non-zero on
+ *  memory allocation error.
+ */
+int add_room_activities(RoomActivities *activities, const char *user,
+                        const char *room, size_t nTopics,
+                        const char *topics[nTopics], TimeMillis timestamp);
+
+/** fill in *stats for room for the window ending at now, with up to k
+ *  of its most mentioned topics in topTopics[k].  The topic names in
+ *  topTopics[] remain valid until activities is freed.  Runs in
+ *  O(k) time (plus time to slide the window).
+ */
+void stats_room_activities(RoomActivities *activities, const char *room,
+                           TimeMillis now, size_t k, TopicCount topTopics[k],
+                           RoomStats *stats);
+
+#endif //#ifndef ROOM_ACTIVITY_H_
@@ -3,11 +3,13 @@
 -- minimally normalized schema
 
 
+-- message encoding is 0 for plain text, 1 for LZ-compressed (see lz.h)
 
   CREATE TABLE IF NOT EXISTS chats ( 
     id INTEGER PRIMARY KEY, 
     user TEXT, 
     room TEXT, 
+    encoding INTEGER DEFAULT 0, 
     message TEXT, 
     creationTime INTEGER 
       DEFAULT (CAST(1000*(STRFTIME('%s', 'NOW') + 
@@ -26,3 +28,15 @@
   CREATE INDEX IF NOT EXISTS topicx ON topics(topic); 
   CREATE UNIQUE INDEX IF NOT EXISTS utopicx ON topics(chatId, topic);
 
+
+-- persisted copies of in-memory filters of known names, keyed by name
+-- of filter.  All chats with id <= syncedChatId are reflected in bits.
+  CREATE TABLE IF NOT EXISTS filters ( 
+    name TEXT PRIMARY KEY, 
+    nHashes INTEGER, 
+    nItems INTEGER, 
+    capacity INTEGER, 
+    syncedChatId INTEGER, 
+    bits BLOB 
+  );
+
@@ -13,12 +13,14 @@
 #define STR(s) STRINGIFY(s)
 
 
+// message encoding is 0 for plain text, 1 for LZ-compressed (see lz.h)
 #define CHATS_TABLE "chats"
 #define CREATE_CHATS_SQL \
   CREATE TABLE IF NOT EXISTS chats ( \
     id INTEGER PRIMARY KEY, \
     user TEXT, \
     room TEXT, \
+    encoding INTEGER DEFAULT 0, \
     message TEXT, \
     creationTime INTEGER \
       DEFAULT (CAST(1000*(STRFTIME('%s', 'NOW') + \
@@ -41,3 +43,18 @@
   CREATE UNIQUE INDEX IF NOT EXISTS utopicx ON topics(chatId, topic);
 
 #define CREATE_TOPICS_SQL_STR STR(CREATE_TOPICS_SQL)
+
+// persisted copies of in-memory filters of known names, keyed by name
+// of filter.  All chats with id <= syncedChatId are reflected in bits.
+#define FILTERS_TABLE "filters"
+#define CREATE_FILTERS_SQL \
+  CREATE TABLE IF NOT EXISTS filters ( \
+    name TEXT PRIMARY KEY, \
+    nHashes INTEGER, \
+    nItems INTEGER, \
+    capacity INTEGER, \
+    syncedChatId INTEGER, \
+    bits BLOB \
+  );
+
+#define CREATE_FILTERS_SQL_STR STR(CREATE_FILTERS_SQL)
@@ -0,0 +1,313 @@
+#include "arena.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Arena (bump) allocator.  Memory is allocated by bumping a pointer
+ *  through large chunks obtained from malloc(); individual
+ *  allocations are never freed.  Instead, the arena can be rewound to
+ *  an earlier mark, or reset, releasing everything allocated since.
+ *  Chunks are retained for reuse, so that once an arena has grown to
+ *  the size needed by a request, handling further requests does no
+ *  malloc() at all.  Chunks are obtained from malloc_tag() (see
+ *  memalloc.h) and charged to the arena's tag, MEM_TAG_OTHER unless
+ *  changed by set_tag_arena().
+ */
+
+// Chunks form a singly-linked list in the order in which they are
+// allocated from.  Chunks after current are free and are reused
+// before any new chunk is malloc()'d.
+
+struct _ArenaChunk {
+  ArenaChunk *next;
+  size_t size;                       //# of bytes in mem[]
+  alignas(max_align_t) char mem[];
+};
+
+#ifdef TEST_ARENA
+  enum { DEFAULT_CHUNK_SIZE = 64 };
+#else
+  enum { DEFAULT_CHUNK_SIZE = 4096 };
+#endif
+
+/** initialize arena to allocate from chunks of at least chunkSize
+ *  bytes (a default size is used if 0).  No memory is allocated until
+ *  the first allocation.
+ *
+ *  No error return.
+ */
+void
+init_arena(Arena *arena, size_t chunkSize)
+{
+  *arena = (Arena) {
+    .chunkSize = (chunkSize == 0) ? DEFAULT_CHUNK_SIZE : chunkSize,
+  };
+}
+
+/** charge chunks subsequently allocated by arena to tag; chunks
+ *  already allocated remain charged to the previous tag.
+ *
+ *  No error return.
+ */
+void
+set_tag_arena(Arena *arena, MemTag tag)
+{
+  arena->tag = tag;
+}
+
+/** free all chunks used by arena.  *MUST* be called when arena is no
+ *  longer needed.  Does not free the Arena structure itself.
+ *
+ *  No error return.
+ */
+void
+free_arena(Arena *arena)
+{
+  ArenaChunk *next;
+  for (ArenaChunk *chunk = arena->chunks; chunk != NULL; chunk = next) {
+    next = chunk->next;
+    free_tag(chunk);
+  }
+  const MemTag tag = arena->tag;
+  init_arena(arena, arena->chunkSize);
+  arena->tag = tag;
+}
+
+/** return offset in chunk->mem[] of size bytes aligned to align
+ *  starting at or after used; chunk->size + 1 if they do not fit.
+ */
+static size_t
+fit_offset(const ArenaChunk *chunk, size_t used, size_t size, size_t align)
+{
+  const uintptr_t base = (uintptr_t)chunk->mem;
+  const size_t offset = ((base + used + align - 1) & ~(uintptr_t)(align - 1))
+    - base;
+  return (offset <= chunk->size && size <= chunk->size - offset)
+    ? offset : chunk->size + 1;
+}
+
+/** return pointer to size bytes from arena aligned to align, which
+ *  must be a power of 2.  Returns NULL on a memory allocation error.
+ */
+void *
+alloc_align_arena(Arena *arena, size_t size, size_t align)
+{
+  assert(align > 0 && (align & (align - 1)) == 0);
+  while (true) {
+    ArenaChunk *current = arena->current;
+    if (current) {
+      const size_t offset = fit_offset(current, arena->used, size, align);
+      if (offset <= current->size) {
+        arena->used = offset + size;
+        return &current->mem[offset];
+      }
+    }
+    //move on to next free chunk if it is big enough
+    ArenaChunk *next = current ? current->next : arena->chunks;
+    if (next && fit_offset(next, 0, size, align) <= next->size) {
+      arena->current = next; arena->used = 0;
+      continue;
+    }
+    //insert a new chunk before next
+    const size_t minSize = size + align;
+    const size_t chunkSize =
+      (arena->chunkSize > minSize) ? arena->chunkSize : minSize;
+    ArenaChunk *chunk = malloc_tag(arena->tag, sizeof(ArenaChunk) + chunkSize);
+    if (!chunk) return NULL;
+    chunk->size = chunkSize; chunk->next = next;
+    if (current) current->next = chunk; else arena->chunks = chunk;
+    arena->current = chunk; arena->used = 0;
+    arena->nMallocs++;
+  }
+}
+
+/** return pointer to size bytes from arena aligned to ARENA_ALIGN.
+ *  Returns NULL on a memory allocation error.
+ */
+void *
+alloc_arena(Arena *arena, size_t size)
+{
+  return alloc_align_arena(arena, size, ARENA_ALIGN);
+}
+
+/** grow ptr[oldSize], previously returned by alloc_arena() or
+ *  realloc_arena(), to newSize bytes aligned to ARENA_ALIGN.  If ptr
+ *  was the last allocation from arena and there is room, it is
+ *  extended in place; otherwise the contents are copied to a new
+ *  allocation.  ptr may be NULL when oldSize is 0.  Returns NULL on
+ *  a memory allocation error, leaving ptr unchanged.
+ */
+void *
+realloc_arena(Arena *arena, void *ptr, size_t oldSize, size_t newSize)
+{
+  ArenaChunk *current = arena->current;
+  if (ptr && current && (char *)ptr + oldSize == &current->mem[arena->used]) {
+    const size_t offset = (char *)ptr - current->mem;
+    if (newSize <= current->size - offset) {
+      arena->used = offset + newSize;
+      return ptr;
+    }
+  }
+  if (newSize <= oldSize) return ptr;
+  void *p = alloc_arena(arena, newSize);
+  if (p && oldSize > 0) memcpy(p, ptr, oldSize);
+  return p;
+}
+
+/** return the current position of arena for a later rewind_arena().
+ *
+ *  No error return.
+ */
+ArenaMark
+mark_arena(const Arena *arena)
+{
+  return (ArenaMark) { .chunk = arena->current, .used = arena->used };
+}
+
+/** release everything allocated from arena since mark was returned
+ *  by mark_arena().  The chunks are retained for reuse.
+ *
+ *  No error return.
+ */
+void
+rewind_arena(Arena *arena, ArenaMark mark)
+{
+  arena->current = mark.chunk; arena->used = mark.used;
+}
+
+/** release everything allocated from arena, retaining its chunks for
+ *  reuse.
+ *
+ *  No error return.
+ */
+void
+reset_arena(Arena *arena)
+{
+  arena->current = NULL; arena->used = 0;
+}
+
+/** return # of chunks malloc()'d by arena over its lifetime.
+ *
+ *  No error return.
+ */
+size_t
+n_mallocs_arena(const Arena *arena)
+{
+  return arena->nMallocs;
+}
+
+
+/**************************** Unit Tests *******************************/
+
+//whitebox testing
+
+#ifdef TEST_ARENA
+
+#include "unit-test.h"
+
+static void
+test_alloc_arena(void)
+{
+  Arena arena;
+  init_arena(&arena, 0);
+  char *p1 = alloc_arena(&arena, 10);
+  char *p2 = alloc_arena(&arena, 10);
+  CHKF((uintptr_t)p2 % ARENA_ALIGN == 0, "ALIGN: %p", (void *)p2);
+  CHKF(p2 >= p1 + 10, "ORDER: %p < %p + 10", (void *)p2, (void *)p1);
+  CHKF(arena.nMallocs == 1, "N_MALLOCS1: %zu != 1", arena.nMallocs);
+  memset(p1, 'a', 10); memset(p2, 'b', 10);
+  char *p3 = alloc_align_arena(&arena, 1, 1);
+  char *p4 = alloc_align_arena(&arena, 1, 1);
+  CHKF(p4 == p3 + 1, "ALIGN1: %p != %p + 1", (void *)p4, (void *)p3);
+  char *big = alloc_arena(&arena, 10*DEFAULT_CHUNK_SIZE);
+  CHKF(big != NULL, "BIG: %p", (void *)big);
+  memset(big, 'c', 10*DEFAULT_CHUNK_SIZE);
+  CHKF(arena.nMallocs == 2, "N_MALLOCS2: %zu != 2", arena.nMallocs);
+  CHKF(p1[9] == 'a' && p2[0] == 'b', "CONTENTS: %c %c", p1[9], p2[0]);
+  char *p5 = alloc_align_arena(&arena, 8, 64);
+  CHKF((uintptr_t)p5 % 64 == 0, "ALIGN64: %p", (void *)p5);
+  free_arena(&arena);
+}
+
+static void
+test_reset_arena(void)
+{
+  Arena arena;
+  init_arena(&arena, 0);
+  for (int round = 0; round < 5; round++) {
+    for (int i = 0; i < 100; i++) {
+      char *p = alloc_arena(&arena, 1 + i % 40);
+      CHKF(p != NULL, "RESET_ALLOC_%d_%d: NULL", round, i);
+      memset(p, i, 1 + i % 40);
+    }
+    char *big = alloc_arena(&arena, 3*DEFAULT_CHUNK_SIZE);
+    CHKF(big != NULL, "RESET_BIG_%d: NULL", round);
+    const size_t nMallocs = n_mallocs_arena(&arena);
+    reset_arena(&arena);
+    if (round > 0) {
+      CHKF(nMallocs == n_mallocs_arena(&arena),
+           "RESET_STEADY_%d: %zu != %zu", round, nMallocs,
+           n_mallocs_arena(&arena));
+    }
+  }
+  free_arena(&arena);
+}
+
+static void
+test_rewind_arena(void)
+{
+  Arena arena;
+  init_arena(&arena, 0);
+  ArenaMark mark0 = mark_arena(&arena);
+  char *p1 = alloc_arena(&arena, 16);
+  strcpy(p1, "hello");
+  ArenaMark mark1 = mark_arena(&arena);
+  char *p2 = alloc_arena(&arena, 16);
+  for (int i = 0; i < 10; i++) alloc_arena(&arena, DEFAULT_CHUNK_SIZE/2);
+  rewind_arena(&arena, mark1);
+  char *p3 = alloc_arena(&arena, 16);
+  CHKF(p3 == p2, "REWIND1: %p != %p", (void *)p3, (void *)p2);
+  CHKF(strcmp(p1, "hello") == 0, "REWIND1_KEEP: \"%s\"", p1);
+  const size_t nMallocs = n_mallocs_arena(&arena);
+  for (int i = 0; i < 10; i++) alloc_arena(&arena, DEFAULT_CHUNK_SIZE/2);
+  CHKF(nMallocs == n_mallocs_arena(&arena), "REWIND_REUSE: %zu != %zu",
+       nMallocs, n_mallocs_arena(&arena));
+  rewind_arena(&arena, mark0);
+  char *p4 = alloc_arena(&arena, 16);
+  CHKF(p4 == p1, "REWIND0: %p != %p", (void *)p4, (void *)p1);
+  free_arena(&arena);
+}
+
+static void
+test_realloc_arena(void)
+{
+  Arena arena;
+  init_arena(&arena, 0);
+  char *p = realloc_arena(&arena, NULL, 0, 8);
+  memcpy(p, "abcdefg", 8);
+  char *q = realloc_arena(&arena, p, 8, 16);
+  CHKF(q == p, "REALLOC_IN_PLACE: %p != %p", (void *)q, (void *)p);
+  char *other = alloc_arena(&arena, 4);
+  CHKF(other != NULL, "REALLOC_OTHER: %p", (void *)other);
+  char *r = realloc_arena(&arena, q, 16, 32);
+  CHKF(r != q, "REALLOC_COPY: %p == %p", (void *)r, (void *)q);
+  CHKF(strcmp(r, "abcdefg") == 0, "REALLOC_CONTENTS: \"%s\"", r);
+  char *s = realloc_arena(&arena, r, 32, 4*DEFAULT_CHUNK_SIZE);
+  CHKF(strcmp(s, "abcdefg") == 0, "REALLOC_BIG_CONTENTS: \"%s\"", s);
+  free_arena(&arena);
+}
+
+int
+main()
+{
+  test_alloc_arena();
+  test_reset_arena();
+  test_rewind_arena();
+  test_realloc_arena();
+}
+
+#endif //#ifdef TEST_ARENA
@@ -0,0 +1,110 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include "memalloc.h"
+
+#include <stdalign.h>
+#include <stddef.h>
+
+/** Arena (bump) allocator.  Memory is allocated by bumping a pointer
+ *  through large chunks obtained from malloc(); individual
+ *  allocations are never freed.  Instead, the arena can be rewound to
+ *  an earlier mark, or reset, releasing everything allocated since.
+ *  Chunks are retained for reuse, so that once an arena has grown to
+ *  the size needed by a request, handling further requests does no
+ *  malloc() at all.  Chunks are obtained from malloc_tag() (see
+ *  memalloc.h) and charged to the arena's tag, MEM_TAG_OTHER unless
+ *  changed by set_tag_arena().
+ */
+
+/** default alignment of allocations */
+#define ARENA_ALIGN alignof(max_align_t)
+
+typedef struct _ArenaChunk ArenaChunk;
+
+// clients responsible for allocation/deallocation of this structure.
+// note that clients should regard the insides of this struct as
+// private.
+typedef struct {
+  size_t chunkSize;      /** minimum size of chunks */
+  ArenaChunk *chunks;    /** first chunk; all chunks in a list */
+  ArenaChunk *current;   /** chunk being allocated from; NULL if none */
+  size_t used;           /** # of bytes used in current */
+  size_t nMallocs;       /** # of chunks malloc()'d over lifetime */
+  MemTag tag;            /** tag charged for chunks */
+} Arena;
+
+/** position in an arena returned by mark_arena() */
+typedef struct {
+  ArenaChunk *chunk;
+  size_t used;
+} ArenaMark;
+
+/** initialize arena to allocate from chunks of at least chunkSize
+ *  bytes (a default size is used if 0).  No memory is allocated until
+ *  the first allocation.
+ *
+ *  No error return.
+ */
+void init_arena(Arena *arena, size_t chunkSize);
+
+/** charge chunks subsequently allocated by arena to tag; chunks
+ *  already allocated remain charged to the previous tag.
+ *
+ *  No error return.
+ */
+void set_tag_arena(Arena *arena, MemTag tag);
+
+/** free all chunks used by arena.  *MUST* be called when arena is no
+ *  longer needed.  Does not free the Arena structure itself.
+ *
+ *  No error return.
+ */
+void free_arena(Arena *arena);
+
+/** return pointer to size bytes from arena aligned to align, which
+ *  must be a power of 2.  Returns NULL on a memory allocation error.
+ */
+void *alloc_align_arena(Arena *arena, size_t size, size_t align);
+
+/** return pointer to size bytes from arena aligned to ARENA_ALIGN.
+ *  Returns NULL on a memory allocation error.
+ */
+void *alloc_arena(Arena *arena, size_t size);
+
+/** grow ptr[oldSize], previously returned by alloc_arena() or
+ *  realloc_arena(), to newSize bytes aligned to ARENA_ALIGN.  If ptr
+ *  was the last allocation from arena and there is room, it is
+ *  extended in place; otherwise the contents are copied to a new
+ *  allocation.  ptr may be NULL when oldSize is 0.  Returns NULL on
+ *  a memory allocation error, leaving ptr unchanged.
+ */
+void *realloc_arena(Arena *arena, void *ptr, size_t oldSize, size_t newSize);
+
+/** return the current position of arena for a later rewind_arena().
+ *
+ *  No error return.
+ */
+ArenaMark mark_arena(const Arena *arena);
+
+/** release everything allocated from arena since mark was returned
+ *  by mark_arena().  The chunks are retained for reuse.
+ *
+ *  No error return.
+ */
+void rewind_arena(Arena *arena, ArenaMark mark);
+
+/** release everything allocated from arena, retaining its chunks for
+ *  reuse.
+ *
+ *  No error return.
+ */
+void reset_arena(Arena *arena);
+
+/** return # of chunks malloc()'d by arena over its lifetime.
+ *
+ *  No error return.
+ */
+size_t n_mallocs_arena(const Arena *arena);
+
+#endif //#ifndef ARENA_H_
@@ -0,0 +1,288 @@
+#include "bloom.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Bloom filter over arbitrary byte-string keys.  A negative answer
+ *  from maybe_has_bloom_filter() is definite; a positive answer may
+ *  be a false positive with probability approximately the fpRate
+ *  the filter was initialized with (as long as no more than
+ *  capacity keys have been added).
+ */
+
+// the nHashes bit positions for a key are derived from two base
+// hashes h1 and h2 as h1 + i*h2 (Kirsch & Mitzenmacher), so each key
+// is hashed only once.
+
+enum { BITS_PER_WORD = 64 };
+
+// 1/ln(2): optimal # of bits per key is nHashes/ln(2)
+#define INV_LN_2 1.4426950408889634
+
+static inline uint8_t
+fold(uint8_t c, bool ignoreCase)
+{
+  return (ignoreCase && c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+/** 64-bit FNV-1a hash of key[keyLen] */
+static uint64_t
+hash_key(const void *key, size_t keyLen, bool ignoreCase)
+{
+  const uint8_t *p = key;
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < keyLen; i++) {
+    h ^= fold(p[i], ignoreCase);
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+/** murmur3 finalizer used to derive second hash from first */
+static uint64_t
+mix_hash(uint64_t h)
+{
+  h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/** return # of hash functions which would be used for fpRate */
+unsigned
+n_hashes_bloom_filter(double fpRate)
+{
+  //ceil(log2(1/fpRate)) without needing libm
+  unsigned k = 0;
+  for (double p = 1.0; p > fpRate && k < 64; p /= 2) k++;
+  return (k == 0) ? 1 : k;
+}
+
+static int
+alloc_bits(BloomFilter *bloom, size_t nBits, unsigned nHashes,
+           bool ignoreCase)
+{
+  assert(nBits % BITS_PER_WORD == 0);
+  uint64_t *bits = calloc(nBits/BITS_PER_WORD, sizeof(uint64_t));
+  if (!bits) return 1;
+  *bloom = (BloomFilter) {
+    .nBits = nBits, .nHashes = nHashes, .nItems = 0,
+    .ignoreCase = ignoreCase, .bits = bits,
+  };
+  return 0;
+}
+
+/** initialize bloom to hold capacity keys with a false-positive rate
+ *  of at most fpRate (0 < fpRate < 1).  If ignoreCase, then keys
+ *  which differ only in ASCII case are regarded as identical.
+ *
+ *  Returns 0 if ok, non-zero on bad fpRate or memory allocation error.
+ */
+int
+init_bloom_filter(BloomFilter *bloom, size_t capacity, double fpRate,
+                  bool ignoreCase)
+{
+  if (!(fpRate > 0 && fpRate < 1)) return 1;
+  unsigned nHashes = n_hashes_bloom_filter(fpRate);
+  size_t nBits = (size_t)(capacity * nHashes * INV_LN_2) + 1;
+  nBits = (nBits + BITS_PER_WORD - 1) / BITS_PER_WORD * BITS_PER_WORD;
+  return alloc_bits(bloom, nBits, nHashes, ignoreCase);
+}
+
+/** initialize bloom from nBytes bytes of bits previously obtained
+ *  using bits_bloom_filter() on a filter which had nHashes hash
+ *  functions and nItems items.
+ *
+ *  Returns 0 if ok, non-zero on memory allocation error.
+ */
+int
+load_bloom_filter(BloomFilter *bloom, unsigned nHashes, size_t nItems,
+                  bool ignoreCase, size_t nBytes, const void *bits)
+{
+  const size_t wordSize = sizeof(uint64_t);
+  if (nBytes == 0 || nBytes % wordSize != 0 || nHashes == 0) return 1;
+  if (alloc_bits(bloom, nBytes * 8, nHashes, ignoreCase) != 0) return 1;
+  memcpy(bloom->bits, bits, nBytes);
+  bloom->nItems = nItems;
+  return 0;
+}
+
+/** free all dynamic memory used by bloom.  Note that this routine does
+ *  not free the bloom structure itself, as its lifetime is assumed to
+ *  be controlled by the client.
+ *
+ *  No error return.
+ */
+void
+free_bloom_filter(BloomFilter *bloom)
+{
+  free(bloom->bits);
+  *bloom = (BloomFilter) { .bits = NULL };
+}
+
+/** clear all keys from bloom.  No error return. */
+void
+clear_bloom_filter(BloomFilter *bloom)
+{
+  memset(bloom->bits, 0, bloom->nBits/8);
+  bloom->nItems = 0;
+}
+
+/** add key[keyLen] to bloom.  No error return. */
+void
+add_bloom_filter(BloomFilter *bloom, const void *key, size_t keyLen)
+{
+  const uint64_t h1 = hash_key(key, keyLen, bloom->ignoreCase);
+  const uint64_t h2 = mix_hash(h1) | 1;
+  bool isNew = false;
+  for (unsigned i = 0; i < bloom->nHashes; i++) {
+    const size_t bit = (h1 + i*h2) % bloom->nBits;
+    const uint64_t mask = 1ULL << (bit % BITS_PER_WORD);
+    uint64_t *word = &bloom->bits[bit / BITS_PER_WORD];
+    isNew = isNew || !(*word & mask);
+    *word |= mask;
+  }
+  if (isNew) bloom->nItems++;
+}
+
+/** return false if key[keyLen] was definitely never added to bloom,
+ *  true if it may have been added.
+ */
+bool
+maybe_has_bloom_filter(const BloomFilter *bloom,
+                       const void *key, size_t keyLen)
+{
+  const uint64_t h1 = hash_key(key, keyLen, bloom->ignoreCase);
+  const uint64_t h2 = mix_hash(h1) | 1;
+  for (unsigned i = 0; i < bloom->nHashes; i++) {
+    const size_t bit = (h1 + i*h2) % bloom->nBits;
+    const uint64_t mask = 1ULL << (bit % BITS_PER_WORD);
+    if (!(bloom->bits[bit / BITS_PER_WORD] & mask)) return false;
+  }
+  return true;
+}
+
+/** return # of distinct keys added to bloom (approximate, since a key
+ *  which is a false positive when added is not counted).
+ */
+size_t
+n_items_bloom_filter(const BloomFilter *bloom)
+{
+  return bloom->nItems;
+}
+
+/** set *nBytes to the size of the bit array of bloom and return a
+ *  pointer to it.  Suitable for persisting bloom for a subsequent
+ *  load_bloom_filter().
+ */
+const void *
+bits_bloom_filter(const BloomFilter *bloom, size_t *nBytes)
+{
+  *nBytes = bloom->nBits/8;
+  return bloom->bits;
+}
+
+/** fill in *stats for bloom.  No error return. */
+void
+stats_bloom_filter(const BloomFilter *bloom, BloomStats *stats)
+{
+  size_t nSet = 0;
+  for (size_t i = 0; i < bloom->nBits/BITS_PER_WORD; i++) {
+    nSet += __builtin_popcountll(bloom->bits[i]);
+  }
+  //probability that all nHashes probes hit a set bit
+  const double fill = (double)nSet / bloom->nBits;
+  double fpRate = 1.0;
+  for (unsigned i = 0; i < bloom->nHashes; i++) fpRate *= fill;
+  *stats = (BloomStats) {
+    .nBits = bloom->nBits,
+    .nHashes = bloom->nHashes,
+    .nItems = bloom->nItems,
+    .fpRate = fpRate,
+  };
+}
+
+
+/**************************** Unit Tests *******************************/
+
+#ifdef TEST_BLOOM
+
+#include "unit-test.h"
+
+#include <stdio.h>
+
+static void
+test_no_false_negatives(void)
+{
+  enum { N = 2000 };
+  BloomFilter bloom;
+  int rc = init_bloom_filter(&bloom, N, 0.01, false);
+  CHKF(rc == 0, "INIT: rc %d != 0", rc);
+  char key[32];
+  for (int i = 0; i < N; i++) {
+    int n = snprintf(key, sizeof(key), "key-%d", i);
+    add_bloom_filter(&bloom, key, n);
+  }
+  for (int i = 0; i < N; i++) {
+    int n = snprintf(key, sizeof(key), "key-%d", i);
+    CHKF(maybe_has_bloom_filter(&bloom, key, n), "FALSE_NEG: %s", key);
+  }
+  int nFalsePos = 0;
+  for (int i = N; i < 11*N; i++) {
+    int n = snprintf(key, sizeof(key), "key-%d", i);
+    nFalsePos += maybe_has_bloom_filter(&bloom, key, n);
+  }
+  // expect ~1% of 10*N; allow generous slack
+  CHKF(nFalsePos < 10*N/50, "FP_RATE: %d false positives in %d",
+       nFalsePos, 10*N);
+  BloomStats stats;
+  stats_bloom_filter(&bloom, &stats);
+  CHKF(stats.fpRate < 0.02, "EST_FP_RATE: %g >= 0.02", stats.fpRate);
+  CHKF(stats.nItems <= N && stats.nItems > N - N/50,
+       "N_ITEMS: %zu not near %d", stats.nItems, N);
+  free_bloom_filter(&bloom);
+}
+
+static void
+test_ignore_case(void)
+{
+  BloomFilter bloom;
+  init_bloom_filter(&bloom, 16, 0.001, true);
+  add_bloom_filter(&bloom, "SysProg", 7);
+  CHK(maybe_has_bloom_filter(&bloom, "sysprog", 7), "IGNORE_CASE_LOWER");
+  CHK(maybe_has_bloom_filter(&bloom, "SYSPROG", 7), "IGNORE_CASE_UPPER");
+  CHK(!maybe_has_bloom_filter(&bloom, "sysprog1", 8), "IGNORE_CASE_OTHER");
+  free_bloom_filter(&bloom);
+}
+
+static void
+test_load(void)
+{
+  BloomFilter bloom, bloom1;
+  init_bloom_filter(&bloom, 100, 0.01, false);
+  add_bloom_filter(&bloom, "#db", 3);
+  size_t nBytes;
+  const void *bits = bits_bloom_filter(&bloom, &nBytes);
+  int rc = load_bloom_filter(&bloom1, bloom.nHashes, bloom.nItems, false,
+                             nBytes, bits);
+  CHKF(rc == 0, "LOAD: rc %d != 0", rc);
+  CHK(maybe_has_bloom_filter(&bloom1, "#db", 3), "LOAD_HAS");
+  CHKF(bloom1.nItems == 1, "LOAD_N_ITEMS: %zu != 1", bloom1.nItems);
+  clear_bloom_filter(&bloom1);
+  CHK(!maybe_has_bloom_filter(&bloom1, "#db", 3), "CLEAR");
+  free_bloom_filter(&bloom);
+  free_bloom_filter(&bloom1);
+}
+
+int
+main()
+{
+  test_no_false_negatives();
+  test_ignore_case();
+  test_load();
+}
+
+#endif //#ifdef TEST_BLOOM
@@ -0,0 +1,89 @@
+#ifndef BLOOM_H_
+#define BLOOM_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Bloom filter over arbitrary byte-string keys.  A negative answer
+ *  from maybe_has_bloom_filter() is definite; a positive answer may
+ *  be a false positive with probability approximately the fpRate
+ *  the filter was initialized with (as long as no more than
+ *  capacity keys have been added).
+ */
+
+// clients responsible for allocation/deallocation of this structure.
+// note that clients should regard the insides of this struct as
+// private.
+typedef struct {
+  size_t nBits;      /** # of bits in bits[] */
+  unsigned nHashes;  /** # of bit positions set per key */
+  size_t nItems;     /** # of keys added which were not already present */
+  bool ignoreCase;   /** if true, ASCII case is ignored when hashing keys */
+  uint64_t *bits;    /** dynamically allocated bit array */
+} BloomFilter;
+
+/** statistics for a bloom filter */
+typedef struct {
+  size_t nBits;      /** # of bits in filter */
+  unsigned nHashes;  /** # of hash functions */
+  size_t nItems;     /** # of distinct keys added (approximate) */
+  double fpRate;     /** current false-positive rate estimated from fill */
+} BloomStats;
+
+/** initialize bloom to hold capacity keys with a false-positive rate
+ *  of at most fpRate (0 < fpRate < 1).  If ignoreCase, then keys
+ *  which differ only in ASCII case are regarded as identical.
+ *
+ *  Returns 0 if ok, non-zero on bad fpRate or memory allocation error.
+ */
+int init_bloom_filter(BloomFilter *bloom, size_t capacity, double fpRate,
+                      bool ignoreCase);
+
+/** initialize bloom from nBytes bytes of bits previously obtained
+ *  using bits_bloom_filter() on a filter which had nHashes hash
+ *  functions and nItems items.
+ *
+ *  Returns 0 if ok, non-zero on memory allocation error.
+ */
+int load_bloom_filter(BloomFilter *bloom, unsigned nHashes, size_t nItems,
+                      bool ignoreCase, size_t nBytes, const void *bits);
+
+/** free all dynamic memory used by bloom.  Note that this routine does
+ *  not free the bloom structure itself, as its lifetime is assumed to
+ *  be controlled by the client.
+ *
+ *  No error return.
+ */
+void free_bloom_filter(BloomFilter *bloom);
+
+/** clear all keys from bloom.  No error return. */
+void clear_bloom_filter(BloomFilter *bloom);
+
+/** add key[keyLen] to bloom.  No error return. */
+void add_bloom_filter(BloomFilter *bloom, const void *key, size_t keyLen);
+
+/** return false if key[keyLen] was definitely never added to bloom,
+ *  true if it may have been added.
+ */
+bool maybe_has_bloom_filter(const BloomFilter *bloom,
+                            const void *key, size_t keyLen);
+
+/** return # of distinct keys added to bloom (approximate, since a key
+ *  which is a false positive when added is not counted).
+ */
+size_t n_items_bloom_filter(const BloomFilter *bloom);
+
+/** return # of hash functions which would be used for fpRate */
+unsigned n_hashes_bloom_filter(double fpRate);
+
+/** set *nBytes to the size of the bit array of bloom and return a
+ *  pointer to it.  Suitable for persisting bloom for a subsequent
+ *  load_bloom_filter().
+ */
+const void *bits_bloom_filter(const BloomFilter *bloom, size_t *nBytes);
+
+/** fill in *stats for bloom.  No error return. */
+void stats_bloom_filter(const BloomFilter *bloom, BloomStats *stats);
+
+#endif //#ifndef BLOOM_H_
@@ -0,0 +1,662 @@
+#define _GNU_SOURCE     //for CPU affinity
+
+#include "executor.h"
+
+#include "ring.h"       //for CACHE_LINE_SIZE
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/** A work-stealing executor which runs tasks on a fixed set of worker
+ *  threads.  Each worker has its own deque of tasks: a task submitted
+ *  by a worker is pushed on that worker's deque and a task submitted
+ *  by any other thread is pushed on the deque of the next worker in
+ *  round-robin order.  A worker runs tasks from its own deque in LIFO
+ *  order; when its deque is empty it steals the oldest half of the
+ *  tasks from another worker's deque, and sleeps only when there are
+ *  no pending tasks anywhere.
+ */
+
+// Each deque is a growable circular buffer protected by its own
+// mutex, which is only contended when a thief steals from it; a
+// lock-free deque could not hand over half its tasks in one step.
+// A thief moves the stolen tasks into its own deque after releasing
+// the victim's lock, so no thread ever holds two deque locks.
+//
+// Workers sleep on a single condition variable.  A submitter only
+// takes idleLock to signal when some worker may be idle: since
+// nPending and nIdle are sequentially consistent, either the
+// submitter sees the incremented nIdle or the worker sees the
+// incremented nPending before it waits.
+
+enum {
+  INIT_DEQUE_CAPACITY = 64,     //must be a power of 2
+  MAX_STEAL = 64,               //max # of tasks stolen at a time
+};
+
+typedef struct {
+  TaskFn *fn;
+  void *arg;
+  Future *future;
+} Task;
+
+struct _ExecutorWorker {
+  alignas(CACHE_LINE_SIZE) pthread_mutex_t lock; //protects deque
+  Task *tasks;                  //circular buffer [capacity]
+  size_t capacity;              //power of 2
+  size_t top;                   //index of oldest task
+  size_t bottom;                //index after newest task
+  Executor *executor;
+  pthread_t tid;
+  uint64_t seed;                //for choosing victims
+  //only written by worker thread; atomic only so stats can read them
+  atomic_size_t nTasks;
+  atomic_size_t nSteals;
+  atomic_size_t nStolen;
+};
+
+/** worker running on the calling thread; NULL if none */
+static _Thread_local ExecutorWorker *currentWorker;
+
+
+/******************************* Futures *******************************/
+
+/** initialize future.  A future may be reused for another task only
+ *  after the previous task has completed.
+ */
+int
+init_future(Future *future)
+{
+  if (pthread_mutex_init(&future->lock, NULL) != 0) return 1;
+  if (pthread_cond_init(&future->cond, NULL) != 0) {
+    pthread_mutex_destroy(&future->lock);
+    return 1;
+  }
+  future->isDone = false;
+  return 0;
+}
+
+/** free all resources used by future.  Does not free the future
+ *  structure itself.
+ *
+ *  No error return.
+ */
+void
+free_future(Future *future)
+{
+  pthread_cond_destroy(&future->cond);
+  pthread_mutex_destroy(&future->lock);
+}
+
+/** block until the task for future has completed.
+ *
+ *  No error return.
+ */
+void
+wait_future(Future *future)
+{
+  pthread_mutex_lock(&future->lock);
+  while (!future->isDone) pthread_cond_wait(&future->cond, &future->lock);
+  pthread_mutex_unlock(&future->lock);
+}
+
+/** return true iff the task for future has completed.
+ *
+ *  No error return.
+ */
+bool
+is_done_future(Future *future)
+{
+  pthread_mutex_lock(&future->lock);
+  const bool isDone = future->isDone;
+  pthread_mutex_unlock(&future->lock);
+  return isDone;
+}
+
+static void
+complete_future(Future *future)
+{
+  pthread_mutex_lock(&future->lock);
+  future->isDone = true;
+  pthread_cond_broadcast(&future->cond);
+  pthread_mutex_unlock(&future->lock);
+}
+
+
+/******************************** Deques *******************************/
+
+/** increment counter which is only written by the calling thread */
+static inline void
+add_owned(atomic_size_t *counter, size_t n)
+{
+  atomic_store_explicit(counter,
+                        atomic_load_explicit(counter, memory_order_relaxed) + n,
+                        memory_order_relaxed);
+}
+
+/** push tasks[n] on bottom of worker's deque; deque must be locked */
+static int
+push_locked(ExecutorWorker *worker, const Task tasks[], size_t n)
+{
+  const size_t size = worker->bottom - worker->top;
+  if (size + n > worker->capacity) {
+    size_t capacity = worker->capacity;
+    while (size + n > capacity) capacity *= 2;
+    Task *p = malloc(capacity * sizeof(Task));
+    if (!p) return 1;
+    for (size_t i = 0; i < size; i++) {
+      p[i] = worker->tasks[(worker->top + i) & (worker->capacity - 1)];
+    }
+    free(worker->tasks);
+    worker->tasks = p;
+    worker->capacity = capacity;
+    worker->top = 0;
+    worker->bottom = size;
+  }
+  for (size_t i = 0; i < n; i++) {
+    worker->tasks[(worker->bottom++) & (worker->capacity - 1)] = tasks[i];
+  }
+  return 0;
+}
+
+static int
+push_deque(ExecutorWorker *worker, const Task tasks[], size_t n)
+{
+  pthread_mutex_lock(&worker->lock);
+  const int err = push_locked(worker, tasks, n);
+  pthread_mutex_unlock(&worker->lock);
+  return err;
+}
+
+/** pop newest task from worker's deque into *task; return false if
+ *  deque is empty.
+ */
+static bool
+pop_deque(ExecutorWorker *worker, Task *task)
+{
+  pthread_mutex_lock(&worker->lock);
+  const bool isEmpty = worker->bottom == worker->top;
+  if (!isEmpty) {
+    *task = worker->tasks[(--worker->bottom) & (worker->capacity - 1)];
+  }
+  pthread_mutex_unlock(&worker->lock);
+  return !isEmpty;
+}
+
+/** remove the oldest half (at most MAX_STEAL) of the tasks in victim's
+ *  deque into tasks[]; return # of tasks stolen.
+ */
+static size_t
+steal_half(ExecutorWorker *victim, Task tasks[MAX_STEAL])
+{
+  pthread_mutex_lock(&victim->lock);
+  size_t n = (victim->bottom - victim->top + 1) / 2;
+  if (n > MAX_STEAL) n = MAX_STEAL;
+  for (size_t i = 0; i < n; i++) {
+    tasks[i] = victim->tasks[(victim->top++) & (victim->capacity - 1)];
+  }
+  pthread_mutex_unlock(&victim->lock);
+  return n;
+}
+
+
+/******************************* Workers *******************************/
+
+/** xorshift64 */
+static uint64_t
+next_rand(uint64_t *state)
+{
+  uint64_t x = *state;
+  x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+  return *state = x;
+}
+
+static void
+run_task(ExecutorWorker *worker, const Task *task)
+{
+  atomic_fetch_sub(&worker->executor->nPending, 1);
+  task->fn(task->arg);
+  if (task->future) complete_future(task->future);
+  add_owned(&worker->nTasks, 1);
+}
+
+/** steal tasks from some other worker into worker's deque, returning
+ *  one of them in *task.  Returns false if no tasks were found.
+ */
+static bool
+steal(ExecutorWorker *worker, Task *task)
+{
+  Executor *executor = worker->executor;
+  const unsigned nWorkers = executor->nWorkers;
+  const unsigned start = next_rand(&worker->seed) % nWorkers;
+  for (unsigned i = 0; i < nWorkers; i++) {
+    ExecutorWorker *victim = &executor->workers[(start + i) % nWorkers];
+    if (victim == worker) continue;
+    Task tasks[MAX_STEAL];
+    const size_t n = steal_half(victim, tasks);
+    if (n == 0) continue;
+    add_owned(&worker->nSteals, 1);
+    add_owned(&worker->nStolen, n);
+    *task = tasks[0];
+    if (n > 1 && push_deque(worker, &tasks[1], n - 1) != 0) {
+      //cannot grow deque: run remaining stolen tasks right away
+      for (size_t j = 1; j < n; j++) run_task(worker, &tasks[j]);
+    }
+    return true;
+  }
+  return false;
+}
+
+/** wait until there is a pending task or executor is shut down;
+ *  return false if executor is shut down with no pending tasks.
+ */
+static bool
+wait_for_task(Executor *executor)
+{
+  pthread_mutex_lock(&executor->idleLock);
+  atomic_fetch_add(&executor->nIdle, 1);
+  while (atomic_load(&executor->nPending) == 0 &&
+         !atomic_load(&executor->isShutdown)) {
+    pthread_cond_wait(&executor->idleCond, &executor->idleLock);
+  }
+  atomic_fetch_sub(&executor->nIdle, 1);
+  const bool isDone = atomic_load(&executor->nPending) == 0;
+  pthread_mutex_unlock(&executor->idleLock);
+  return !isDone;
+}
+
+/** thread function for a worker */
+static void *
+worker_loop(void *arg)
+{
+  ExecutorWorker *worker = arg;
+  currentWorker = worker;
+  while (true) {
+    Task task;
+    if (pop_deque(worker, &task) || steal(worker, &task)) {
+      run_task(worker, &task);
+    }
+    else if (!wait_for_task(worker->executor)) {
+      break;
+    }
+  }
+  currentWorker = NULL;
+  return NULL;
+}
+
+/** set attr to pin a thread to the index'th CPU (modulo # of CPUs) on
+ *  which the process may run; return non-zero on error.
+ */
+static int
+pin_attr(pthread_attr_t *attr, unsigned index)
+{
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return 1;
+  const int nCpus = CPU_COUNT(&allowed);
+  if (nCpus == 0) return 1;
+  int k = index % nCpus;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &allowed) && k-- == 0) {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(cpu, &cpus);
+      return pthread_attr_setaffinity_np(attr, sizeof(cpus), &cpus);
+    }
+  }
+  return 1;
+}
+
+/** stop and free first nStarted workers of executor */
+static void
+stop_workers(Executor *executor, unsigned nStarted)
+{
+  pthread_mutex_lock(&executor->idleLock);
+  atomic_store(&executor->isShutdown, true);
+  pthread_cond_broadcast(&executor->idleCond);
+  pthread_mutex_unlock(&executor->idleLock);
+  for (unsigned i = 0; i < nStarted; i++) {
+    pthread_join(executor->workers[i].tid, NULL);
+  }
+  for (unsigned i = 0; i < executor->nWorkers; i++) {
+    ExecutorWorker *worker = &executor->workers[i];
+    pthread_mutex_destroy(&worker->lock);
+    free(worker->tasks);
+  }
+  free(executor->workers);
+  pthread_cond_destroy(&executor->idleCond);
+  pthread_mutex_destroy(&executor->idleLock);
+}
+
+
+/******************************* Executor ******************************/
+
+/** initialize executor and start its workers.  If options is NULL,
+ *  then default options are used.
+ */
+int
+init_executor(Executor *executor, const ExecutorOptions *options)
+{
+  const ExecutorOptions defaultOptions = { .nWorkers = 0, .doPin = false };
+  if (!options) options = &defaultOptions;
+  unsigned nWorkers = options->nWorkers;
+  if (nWorkers == 0) {
+    const long nCpus = sysconf(_SC_NPROCESSORS_ONLN);
+    nWorkers = (nCpus > 0) ? nCpus : 1;
+  }
+  const size_t size = nWorkers * sizeof(ExecutorWorker);
+  ExecutorWorker *workers =
+    aligned_alloc(CACHE_LINE_SIZE,
+                  (size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE
+                  * CACHE_LINE_SIZE);
+  if (!workers) return 1;
+  memset(workers, 0, size);
+  *executor = (Executor) { .nWorkers = nWorkers, .workers = workers };
+  atomic_init(&executor->nextWorker, 0);
+  atomic_init(&executor->nPending, 0);
+  atomic_init(&executor->nIdle, 0);
+  atomic_init(&executor->isShutdown, false);
+  pthread_mutex_init(&executor->idleLock, NULL);
+  pthread_cond_init(&executor->idleCond, NULL);
+  int err = 0;
+  for (unsigned i = 0; i < nWorkers; i++) {
+    ExecutorWorker *worker = &workers[i];
+    pthread_mutex_init(&worker->lock, NULL);
+    worker->capacity = INIT_DEQUE_CAPACITY;
+    worker->tasks = malloc(INIT_DEQUE_CAPACITY * sizeof(Task));
+    if (!worker->tasks) err = 1;
+    worker->executor = executor;
+    worker->seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+    atomic_init(&worker->nTasks, 0);
+    atomic_init(&worker->nSteals, 0);
+    atomic_init(&worker->nStolen, 0);
+  }
+  unsigned nStarted = 0;
+  for (; err == 0 && nStarted < nWorkers; nStarted++) {
+    ExecutorWorker *worker = &workers[nStarted];
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (options->doPin) err = pin_attr(&attr, nStarted);
+    if (err == 0) {
+      err = pthread_create(&worker->tid, &attr, worker_loop, worker);
+    }
+    pthread_attr_destroy(&attr);
+    if (err != 0) break;
+  }
+  if (err != 0) {
+    stop_workers(executor, nStarted);
+    return 1;
+  }
+  return 0;
+}
+
+/** shut down executor: wait for all submitted tasks, including those
+ *  submitted by tasks while shutting down, to complete, then stop its
+ *  workers and free all resources used by it.  *MUST* be called when
+ *  executor is no longer needed, and not from one of its own tasks.
+ *  Does not free the executor structure itself.
+ *
+ *  No error return.
+ */
+void
+free_executor(Executor *executor)
+{
+  assert(!is_worker_executor(executor));
+  stop_workers(executor, executor->nWorkers);
+}
+
+/** submit a task to run fn(arg) on executor.  If future is not NULL,
+ *  it must have been initialized and is completed when fn returns.
+ *  Once executor has started shutting down, only its own tasks may
+ *  submit further tasks.
+ */
+int
+submit_executor(Executor *executor, TaskFn *fn, void *arg, Future *future)
+{
+  ExecutorWorker *worker = currentWorker;
+  if (!worker || worker->executor != executor) {
+    if (atomic_load(&executor->isShutdown)) return 1;
+    const unsigned i = atomic_fetch_add_explicit(&executor->nextWorker, 1,
+                                                 memory_order_relaxed);
+    worker = &executor->workers[i % executor->nWorkers];
+  }
+  if (future) future->isDone = false;
+  const Task task = { .fn = fn, .arg = arg, .future = future };
+  //count task before it can be popped, so nPending never underflows
+  atomic_fetch_add(&executor->nPending, 1);
+  if (push_deque(worker, &task, 1) != 0) {
+    atomic_fetch_sub(&executor->nPending, 1);
+    return 1;
+  }
+  if (atomic_load(&executor->nIdle) > 0) {
+    pthread_mutex_lock(&executor->idleLock);
+    pthread_cond_signal(&executor->idleCond);
+    pthread_mutex_unlock(&executor->idleLock);
+  }
+  return 0;
+}
+
+/** run fn(arg) on executor and wait for it to complete.  When called
+ *  from one of executor's own tasks, fn(arg) is run directly, since a
+ *  worker which blocked waiting for another task could deadlock the
+ *  executor.
+ */
+int
+run_executor(Executor *executor, TaskFn *fn, void *arg)
+{
+  if (is_worker_executor(executor)) {
+    fn(arg);
+    return 0;
+  }
+  Future future;
+  if (init_future(&future) != 0) return 1;
+  const int err = submit_executor(executor, fn, arg, &future);
+  if (err == 0) wait_future(&future);
+  free_future(&future);
+  return err;
+}
+
+/** return true iff the caller is running on one of executor's workers.
+ *
+ *  No error return.
+ */
+bool
+is_worker_executor(const Executor *executor)
+{
+  return currentWorker && currentWorker->executor == executor;
+}
+
+/** return the index in [0, # of workers) of the worker of executor
+ *  running on the calling thread; -1 if the caller is not one of its
+ *  workers.  Lets tasks use per-worker resources without locking.
+ *
+ *  No error return.
+ */
+int
+worker_index_executor(const Executor *executor)
+{
+  return is_worker_executor(executor)
+    ? (int)(currentWorker - executor->workers) : -1;
+}
+
+/** set *stats to statistics for executor.
+ *
+ *  No error return.
+ */
+void
+stats_executor(Executor *executor, ExecutorStats *stats)
+{
+  *stats = (ExecutorStats) { .nWorkers = executor->nWorkers };
+  for (unsigned i = 0; i < executor->nWorkers; i++) {
+    ExecutorWorker *worker = &executor->workers[i];
+    stats->nTasks += atomic_load_explicit(&worker->nTasks,
+                                          memory_order_relaxed);
+    stats->nSteals += atomic_load_explicit(&worker->nSteals,
+                                           memory_order_relaxed);
+    stats->nStolen += atomic_load_explicit(&worker->nStolen,
+                                           memory_order_relaxed);
+  }
+}
+
+
+/**************************** Unit Tests *******************************/
+
+//whitebox testing
+
+#ifdef TEST_EXECUTOR
+
+#include "unit-test.h"
+
+#include <stdio.h>
+
+enum { N_TASKS = 10000 };
+
+static void
+incr_task(void *arg)
+{
+  atomic_fetch_add((atomic_size_t *)arg, 1);
+}
+
+static void
+test_futures(void)
+{
+  const ExecutorOptions options = { .nWorkers = 4 };
+  Executor executor;
+  CHK(init_executor(&executor, &options) == 0, "INIT: failed");
+  atomic_size_t count = 0;
+  Future futures[N_TASKS];
+  for (int i = 0; i < N_TASKS; i++) {
+    init_future(&futures[i]);
+    CHKF(submit_executor(&executor, incr_task, &count, &futures[i]) == 0,
+         "SUBMIT_%d: failed", i);
+  }
+  for (int i = 0; i < N_TASKS; i++) wait_future(&futures[i]);
+  CHKF(atomic_load(&count) == N_TASKS, "FUTURES: count = %zu",
+       atomic_load(&count));
+  bool isDone = true;
+  for (int i = 0; i < N_TASKS; i++) {
+    isDone = isDone && is_done_future(&futures[i]);
+    free_future(&futures[i]);
+  }
+  CHK(isDone, "IS_DONE: false");
+  ExecutorStats stats;
+  stats_executor(&executor, &stats);
+  CHKF(stats.nWorkers == 4 && stats.nTasks == N_TASKS, "STATS: %zu tasks",
+       stats.nTasks);
+  free_executor(&executor);
+}
+
+typedef struct {
+  Executor *executor;
+  atomic_size_t *nLeaves;
+  unsigned depth;
+  bool wasInline;       //set by inline_task
+} TreeArg;
+
+static void inline_task(void *arg) { ((TreeArg *)arg)->wasInline = true; }
+
+/** spawn a binary tree of tasks with 2^depth leaves */
+static void
+tree_task(void *arg)
+{
+  TreeArg *treeArg = arg;
+  if (treeArg->depth == 0) {
+    atomic_fetch_add(treeArg->nLeaves, 1);
+    free(treeArg);
+    return;
+  }
+  for (int i = 0; i < 2; i++) {
+    TreeArg *child = malloc(sizeof(TreeArg));
+    *child = *treeArg;
+    child->depth--;
+    submit_executor(treeArg->executor, tree_task, child, NULL);
+  }
+  //run_executor() from a task runs directly
+  treeArg->wasInline = false;
+  run_executor(treeArg->executor, inline_task, treeArg);
+  if (!treeArg->wasInline) atomic_fetch_add(treeArg->nLeaves, 1 << 30);
+  free(treeArg);
+}
+
+static void
+test_shutdown_drains(void)
+{
+  enum { DEPTH = 14 };
+  for (int doPin = 0; doPin < 2; doPin++) {
+    const ExecutorOptions options = { .nWorkers = 3, .doPin = doPin };
+    Executor executor;
+    CHKF(init_executor(&executor, &options) == 0, "INIT_%d: failed", doPin);
+    atomic_size_t nLeaves = 0;
+    TreeArg *root = malloc(sizeof(TreeArg));
+    *root = (TreeArg) {
+      .executor = &executor, .nLeaves = &nLeaves, .depth = DEPTH,
+    };
+    CHK(!is_worker_executor(&executor), "IS_WORKER: true");
+    submit_executor(&executor, tree_task, root, NULL);
+    //shutdown must run all tasks, including those submitted by tasks
+    free_executor(&executor);
+    CHKF(atomic_load(&nLeaves) == 1 << DEPTH, "TREE_%d: %zu leaves",
+         doPin, atomic_load(&nLeaves));
+  }
+}
+
+static void
+test_run_executor(void)
+{
+  Executor executor;
+  CHK(init_executor(&executor, NULL) == 0, "INIT: failed");
+  atomic_size_t count = 0;
+  for (int i = 0; i < 100; i++) {
+    CHK(run_executor(&executor, incr_task, &count) == 0, "RUN: failed");
+    CHKF(atomic_load(&count) == i + 1, "RUN_%d: not complete", i);
+  }
+  free_executor(&executor);
+}
+
+typedef struct {
+  Executor *executor;
+  atomic_int index;
+} IndexArg;
+
+static void
+index_task(void *arg)
+{
+  IndexArg *indexArg = arg;
+  atomic_store(&indexArg->index, worker_index_executor(indexArg->executor));
+}
+
+static void
+test_worker_index(void)
+{
+  enum { N_WORKERS = 3 };
+  const ExecutorOptions options = { .nWorkers = N_WORKERS };
+  Executor executor;
+  CHK(init_executor(&executor, &options) == 0, "INIT: failed");
+  CHKF(worker_index_executor(&executor) == -1, "NOT_WORKER: %d",
+       worker_index_executor(&executor));
+  for (int i = 0; i < 20; i++) {
+    IndexArg arg = { .executor = &executor, .index = -1 };
+    CHK(run_executor(&executor, index_task, &arg) == 0, "RUN: failed");
+    const int index = atomic_load(&arg.index);
+    CHKF(0 <= index && index < N_WORKERS, "INDEX_%d: %d", i, index);
+  }
+  free_executor(&executor);
+}
+
+int
+main()
+{
+  test_futures();
+  test_shutdown_drains();
+  test_run_executor();
+  test_worker_index();
+}
+
+#endif //#ifdef TEST_EXECUTOR
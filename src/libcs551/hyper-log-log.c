@@ -0,0 +1,149 @@
+#include "hyper-log-log.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/** HyperLogLog sketch for estimating the # of distinct byte-string
+ *  keys added to it using a fixed amount of memory.  The relative
+ *  standard error of the estimate is about 1.04/sqrt(2^HLL_BITS),
+ *  i.e. 6.5%.  Sketches can be merged to estimate the # of distinct
+ *  keys in their union.
+ */
+
+// the top HLL_BITS bits of the hash of a key select a register; the
+// register records the max over all its keys of the position of the
+// first 1-bit in the remaining hash bits (Flajolet et al., with the
+// linear-counting correction for small cardinalities).
+
+static inline uint8_t
+fold(uint8_t c, bool ignoreCase)
+{
+  return (ignoreCase && c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+/** 64-bit FNV-1a hash of key[keyLen] passed through the murmur3
+ *  finalizer, since HyperLogLog needs well-mixed high-order bits.
+ */
+static uint64_t
+hash_key(const void *key, size_t keyLen, bool ignoreCase)
+{
+  const uint8_t *p = key;
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < keyLen; i++) {
+    h ^= fold(p[i], ignoreCase);
+    h *= 0x100000001b3ULL;
+  }
+  h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/** clear all keys from hll.  No error return. */
+void
+clear_hyper_log_log(HyperLogLog *hll)
+{
+  memset(hll->registers, 0, sizeof(hll->registers));
+}
+
+/** add key[keyLen] to hll.  If ignoreCase, then keys which differ
+ *  only in ASCII case are regarded as identical.  No error return.
+ */
+void
+add_hyper_log_log(HyperLogLog *hll, const void *key, size_t keyLen,
+                  bool ignoreCase)
+{
+  const uint64_t h = hash_key(key, keyLen, ignoreCase);
+  const unsigned index = h >> (64 - HLL_BITS);
+  const uint64_t rest = h << HLL_BITS;
+  const uint8_t rank =
+    (rest == 0) ? 64 - HLL_BITS + 1 : __builtin_clzll(rest) + 1;
+  if (rank > hll->registers[index]) hll->registers[index] = rank;
+}
+
+/** add keys previously added to src into dest.  No error return. */
+void
+merge_hyper_log_log(HyperLogLog *dest, const HyperLogLog *src)
+{
+  for (int i = 0; i < HLL_N_REGISTERS; i++) {
+    if (src->registers[i] > dest->registers[i]) {
+      dest->registers[i] = src->registers[i];
+    }
+  }
+}
+
+/** return estimate of # of distinct keys added to hll */
+size_t
+estimate_hyper_log_log(const HyperLogLog *hll)
+{
+  const double m = HLL_N_REGISTERS;
+  double sum = 0;
+  int nZeros = 0;
+  for (int i = 0; i < HLL_N_REGISTERS; i++) {
+    sum += 1.0 / (1ULL << hll->registers[i]);
+    nZeros += (hll->registers[i] == 0);
+  }
+  const double alpha = 0.7213 / (1 + 1.079 / m);
+  double estimate = alpha * m * m / sum;
+  if (estimate <= 2.5 * m && nZeros > 0) {
+    estimate = m * log(m / nZeros);  //linear counting
+  }
+  return (size_t)(estimate + 0.5);
+}
+
+#ifdef TEST_HYPER_LOG_LOG
+
+#include "unit-test.h"
+
+#include <stdio.h>
+
+static void
+test_estimates(void)
+{
+  const size_t ns[] = { 0, 1, 10, 100, 1000, 10000, 100000 };
+  for (int t = 0; t < sizeof(ns)/sizeof(ns[0]); t++) {
+    HyperLogLog hll = { 0 };
+    char key[32];
+    for (size_t i = 0; i < ns[t]; i++) {
+      //add each key twice: duplicates should not count
+      int n = snprintf(key, sizeof(key), "key-%zu", i);
+      add_hyper_log_log(&hll, key, n, false);
+      add_hyper_log_log(&hll, key, n, false);
+    }
+    const size_t estimate = estimate_hyper_log_log(&hll);
+    //allow 4 standard errors of slack
+    const double err = (double)estimate - ns[t];
+    CHKF(err * err <= (0.26 * ns[t]) * (0.26 * ns[t]) + 1,
+         "ESTIMATE: %zu not near %zu", estimate, ns[t]);
+  }
+}
+
+static void
+test_merge_and_case(void)
+{
+  HyperLogLog hll1 = { 0 }, hll2 = { 0 };
+  char key[32];
+  for (int i = 0; i < 500; i++) {
+    int n = snprintf(key, sizeof(key), "USER-%d", i);
+    add_hyper_log_log(&hll1, key, n, true);
+    n = snprintf(key, sizeof(key), "user-%d", i + 250);
+    add_hyper_log_log(&hll2, key, n, true);
+  }
+  merge_hyper_log_log(&hll1, &hll2);
+  const size_t estimate = estimate_hyper_log_log(&hll1);
+  CHKF(estimate > 650 && estimate < 850, "MERGE: %zu not near 750", estimate);
+  clear_hyper_log_log(&hll1);
+  CHKF(estimate_hyper_log_log(&hll1) == 0, "CLEAR: %zu != 0",
+       estimate_hyper_log_log(&hll1));
+}
+
+int
+main()
+{
+  test_estimates();
+  test_merge_and_case();
+}
+
+#endif //#ifdef TEST_HYPER_LOG_LOG
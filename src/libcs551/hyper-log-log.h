@@ -0,0 +1,41 @@
+#ifndef HYPER_LOG_LOG_H_
+#define HYPER_LOG_LOG_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** HyperLogLog sketch for estimating the # of distinct byte-string
+ *  keys added to it using a fixed amount of memory.  The relative
+ *  standard error of the estimate is about 1.04/sqrt(2^HLL_BITS),
+ *  i.e. 6.5%.  Sketches can be merged to estimate the # of distinct
+ *  keys in their union.
+ */
+
+/** # of bits of a key hash used to select a register */
+enum { HLL_BITS = 8, HLL_N_REGISTERS = 1 << HLL_BITS };
+
+// clients responsible for allocation/deallocation of this structure.
+// note that clients should regard the insides of this struct as
+// private.  Since it contains no pointers, it can be copied freely;
+// a zero-initialized struct is an empty sketch.
+typedef struct {
+  uint8_t registers[HLL_N_REGISTERS];
+} HyperLogLog;
+
+/** clear all keys from hll.  No error return. */
+void clear_hyper_log_log(HyperLogLog *hll);
+
+/** add key[keyLen] to hll.  If ignoreCase, then keys which differ
+ *  only in ASCII case are regarded as identical.  No error return.
+ */
+void add_hyper_log_log(HyperLogLog *hll, const void *key, size_t keyLen,
+                       bool ignoreCase);
+
+/** add keys previously added to src into dest.  No error return. */
+void merge_hyper_log_log(HyperLogLog *dest, const HyperLogLog *src);
+
+/** return estimate of # of distinct keys added to hll */
+size_t estimate_hyper_log_log(const HyperLogLog *hll);
+
+#endif //#ifndef HYPER_LOG_LOG_H_
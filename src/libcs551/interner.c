@@ -0,0 +1,190 @@
+#include "interner.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Symbol table which interns NUL-terminated strings: each distinct
+ *  string is copied once and identified by a small integer id,
+ *  assigned consecutively from 0 in the order in which strings are
+ *  first interned.  Ids and interned strings remain valid until the
+ *  interner is freed.
+ */
+
+// Interned strings are copied into an arena, whose allocations never
+// move, so that they can be used as keys in the ids map.  The id of
+// each string is stored directly in the map value.
+
+enum { INIT_N_IDS = 16 };
+
+/** initialize interner, ignoring ASCII case of strings if ignoreCase.
+ *
+ *  No error return.
+ */
+void
+init_interner(Interner *interner, bool ignoreCase)
+{
+  *interner = (Interner) { .nStrs = 0 };
+  init_str_map(&interner->ids, ignoreCase);
+  init_arena(&interner->strs, 0);
+}
+
+/** free all dynamic memory used by interner, including all interned
+ *  strings.  *MUST* be called when interner is no longer needed.
+ *  Does not free the interner structure itself.
+ *
+ *  No error return.
+ */
+void
+free_interner(Interner *interner)
+{
+  const bool ignoreCase = interner->ids.ignoreCase;
+  free_str_map(&interner->ids);
+  free_arena(&interner->strs);
+  free(interner->byId);
+  init_interner(interner, ignoreCase);
+}
+
+/** set *id to the id of str in interner, interning a copy of str if
+ *  it has not been seen before.
+ */
+int
+add_interner(Interner *interner, const char *str, unsigned *id)
+{
+  const uint64_t hash = hash_str_map(&interner->ids, str);
+  void *value;
+  if (get_hashed_str_map(&interner->ids, str, hash, &value)) {
+    *id = (unsigned)(uintptr_t)value;
+    return 0;
+  }
+  if (interner->nStrs == interner->capacity) {
+    const size_t capacity =
+      (interner->capacity == 0) ? INIT_N_IDS : 2 * interner->capacity;
+    const char **byId = realloc(interner->byId, capacity * sizeof(char *));
+    if (!byId) return 1;
+    interner->byId = byId; interner->capacity = capacity;
+  }
+  const size_t len = strlen(str);
+  char *copy = alloc_align_arena(&interner->strs, len + 1, 1);
+  if (!copy) return 1;
+  memcpy(copy, str, len + 1);
+  //an arena allocation cannot be individually freed, so copy is
+  //simply abandoned if the put fails
+  const unsigned newId = interner->nStrs;
+  if (put_hashed_str_map(&interner->ids, copy, hash,
+                         (void *)(uintptr_t)newId) != 0) {
+    return 1;
+  }
+  interner->byId[interner->nStrs++] = copy;
+  *id = newId;
+  return 0;
+}
+
+/** return true iff str has been interned, setting *id (if id is not
+ *  NULL) to its id.  Never adds str.
+ *
+ *  No error return.
+ */
+bool
+find_interner(const Interner *interner, const char *str, unsigned *id)
+{
+  void *value;
+  if (!get_str_map(&interner->ids, str, &value)) return false;
+  if (id) *id = (unsigned)(uintptr_t)value;
+  return true;
+}
+
+/** return the interned string for id, which must have been returned
+ *  by add_interner().
+ *
+ *  No error return.
+ */
+const char *
+str_interner(const Interner *interner, unsigned id)
+{
+  assert(id < interner->nStrs);
+  return interner->byId[id];
+}
+
+/** return # of strings interned; ids are 0 ... n_strs_interner() - 1.
+ *
+ *  No error return.
+ */
+size_t
+n_strs_interner(const Interner *interner)
+{
+  return interner->nStrs;
+}
+
+
+/**************************** Unit Tests *******************************/
+
+//whitebox testing
+
+#ifdef TEST_INTERNER
+
+#include "unit-test.h"
+
+#include <stdio.h>
+
+static void
+test_interner(void)
+{
+  enum { N = 500 };
+  Interner interner;
+  init_interner(&interner, false);
+  const char *firstStr = NULL;
+  for (int round = 0; round < 2; round++) {
+    for (unsigned i = 0; i < N; i++) {
+      char str[16];
+      snprintf(str, sizeof(str), "sym-%u", i);
+      unsigned id;
+      CHKF(add_interner(&interner, str, &id) == 0, "ADD_%u: alloc error", i);
+      CHKF(id == i, "ID_%u_%d: %u", i, round, id);
+      CHKF(strcmp(str_interner(&interner, id), str) == 0, "STR_%u: %s", i,
+           str_interner(&interner, id));
+    }
+    //strings are stable across growth
+    if (round == 0) firstStr = str_interner(&interner, 0);
+    CHKF(str_interner(&interner, 0) == firstStr, "STABLE: %p != %p",
+         (void *)str_interner(&interner, 0), (void *)firstStr);
+  }
+  CHKF(n_strs_interner(&interner) == N, "N_STRS: %zu",
+       n_strs_interner(&interner));
+  unsigned id;
+  CHKF(find_interner(&interner, "sym-7", &id) && id == 7, "FIND: %u", id);
+  CHKF(!find_interner(&interner, "SYM-7", NULL), "FIND_CASE: %s", "SYM-7");
+  CHKF(!find_interner(&interner, "sym", NULL), "FIND_ABSENT: %s", "sym");
+  CHKF(n_strs_interner(&interner) == N, "N_FIND: %zu",
+       n_strs_interner(&interner));
+  free_interner(&interner);
+}
+
+static void
+test_ignore_case_interner(void)
+{
+  Interner interner;
+  init_interner(&interner, true);
+  unsigned id1, id2, id3;
+  add_interner(&interner, "Alice", &id1);
+  add_interner(&interner, "ALICE", &id2);
+  add_interner(&interner, "bob", &id3);
+  CHKF(id1 == 0 && id2 == 0 && id3 == 1, "NOCASE_IDS: %u %u %u",
+       id1, id2, id3);
+  CHKF(strcmp(str_interner(&interner, id2), "Alice") == 0,
+       "NOCASE_STR: %s", str_interner(&interner, id2));
+  CHKF(find_interner(&interner, "BoB", &id1) && id1 == 1, "NOCASE_FIND: %u",
+       id1);
+  free_interner(&interner);
+}
+
+int
+main()
+{
+  test_interner();
+  test_ignore_case_interner();
+}
+
+#endif //#ifdef TEST_INTERNER
@@ -0,0 +1,77 @@
+#ifndef INTERNER_H_
+#define INTERNER_H_
+
+#include "arena.h"
+#include "str-map.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/** Symbol table which interns NUL-terminated strings: each distinct
+ *  string is copied once and identified by a small integer id,
+ *  assigned consecutively from 0 in the order in which strings are
+ *  first interned.  Ids and interned strings remain valid until the
+ *  interner is freed, so clients can compare and hash ids instead of
+ *  strings.
+ *
+ *  Optionally, an interner can be case-insensitive, in which case
+ *  strings which differ only in ASCII case have the same id, and the
+ *  string for an id is the first one interned.
+ */
+
+/** routines which return int use the return value to indicate the
+ *  error status.  0 if everything okay, non-zero for a memory
+ *  allocation error.
+ */
+
+// clients responsible for allocation/deallocation of this structure.
+// note that clients should regard the insides of this struct as
+// private.
+typedef struct {
+  StrMap ids;           /** map from interned string to id */
+  Arena strs;           /** storage for interned strings */
+  size_t nStrs;         /** # of interned strings */
+  size_t capacity;      /** # of allocated entries in byId[] */
+  const char **byId;    /** byId[nStrs]: interned string for each id */
+} Interner;
+
+/** initialize interner, ignoring ASCII case of strings if ignoreCase.
+ *
+ *  No error return.
+ */
+void init_interner(Interner *interner, bool ignoreCase);
+
+/** free all dynamic memory used by interner, including all interned
+ *  strings.  *MUST* be called when interner is no longer needed.
+ *  Does not free the interner structure itself.
+ *
+ *  No error return.
+ */
+void free_interner(Interner *interner);
+
+/** set *id to the id of str in interner, interning a copy of str if
+ *  it has not been seen before.
+ */
+int add_interner(Interner *interner, const char *str, unsigned *id);
+
+/** return true iff str has been interned, setting *id (if id is not
+ *  NULL) to its id.  Never adds str.
+ *
+ *  No error return.
+ */
+bool find_interner(const Interner *interner, const char *str, unsigned *id);
+
+/** return the interned string for id, which must have been returned
+ *  by add_interner().
+ *
+ *  No error return.
+ */
+const char *str_interner(const Interner *interner, unsigned id);
+
+/** return # of strings interned; ids are 0 ... n_strs_interner() - 1.
+ *
+ *  No error return.
+ */
+size_t n_strs_interner(const Interner *interner);
+
+#endif //#ifndef INTERNER_H_
@@ -0,0 +1,399 @@
+#include "len-str-space.h"
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Management of dynamically-allocated space for NUL-terminated
+ *  strings, like StrSpace, but with the length of each string stored
+ *  immediately before it.  This gives O(1) iteration and length
+ *  access, and appends which memcpy() strings of known length.
+ */
+
+// Each string str in buf is laid out as:
+//
+//   [ strlen(str) as size_t ][ str chars ][ NUL ]
+//
+// The length is accessed using memcpy() as it need not be aligned.
+
+enum { LEN_SIZE = sizeof(size_t) };
+
+#ifdef TEST_LEN_STR_SPACE
+  enum { INIT_STR_SPACE_SIZE = 2, SPRINTF_MIN_SPACE = 4 };
+#else
+  //SPRINTF_MIN_SPACE is the free space ensured before formatting so
+  //that typical formats fit first time.
+  enum { INIT_STR_SPACE_SIZE = 128, SPRINTF_MIN_SPACE = 64 };
+#endif
+
+static int
+ensure_space(LenStrSpace *strSpace, size_t needed) {
+  size_t available = strSpace->size - strSpace->index;
+  if (available >= needed) return 0;
+  size_t newSize = strSpace->size == 0 ? INIT_STR_SPACE_SIZE : 2*strSpace->size;
+  if (newSize - strSpace->index < needed) newSize = strSpace->index + needed;
+  char *buf = strSpace->arena
+    ? realloc_arena(strSpace->arena, strSpace->buf, strSpace->size, newSize)
+    : realloc(strSpace->buf, newSize);
+  if (buf == NULL) return 1;
+  strSpace->buf = buf;
+  strSpace->size = newSize;
+  return 0;
+}
+
+static size_t
+get_len(const char *lenP)
+{
+  size_t len;
+  memcpy(&len, lenP, LEN_SIZE);
+  return len;
+}
+
+static void
+set_len(char *lenP, size_t len)
+{
+  memcpy(lenP, &len, LEN_SIZE);
+}
+
+/** initialize this string space.  Must be called before first
+ *  use of this strSpace.
+ *
+ *  No error return.
+ */
+void
+init_len_str_space(LenStrSpace *strSpace)
+{
+  strSpace->index = strSpace->size = strSpace->last = strSpace->nStrs = 0;
+  strSpace->buf = NULL;
+  strSpace->arena = NULL;
+}
+
+/** initialize this string space to allocate its buffer from arena
+ *  rather than using malloc().  The buffer is released when arena is
+ *  reset or rewound, so free_len_str_space() is optional.
+ *
+ *  No error return.
+ */
+void
+init_len_str_space_with_arena(LenStrSpace *strSpace, Arena *arena)
+{
+  init_len_str_space(strSpace);
+  strSpace->arena = arena;
+}
+
+/** clear this string space so that it does not store any strings
+ *
+ *  No error return.
+ */
+void
+clear_len_str_space(LenStrSpace *strSpace)
+{
+  strSpace->index = strSpace->last = strSpace->nStrs = 0;
+}
+
+/** free all dynamic memory used by this strSpace.  *MUST* be called
+ *  when strSpace is no longer needed. Note that this routine does not
+ *  free the strSpace structure itself, as its lifetime is assumed to
+ *  be controlled by the client.
+ */
+void
+free_len_str_space(LenStrSpace *strSpace)
+{
+  if (!strSpace->arena) free(strSpace->buf);
+  init_len_str_space(strSpace);
+}
+
+/** add the n chars str[n] as a new NUL-terminated string to
+ *  strSpace.  str[n] need not be NUL-terminated and should not
+ *  contain a NUL.
+ */
+int
+add_n_len_str_space(LenStrSpace *strSpace, const char *str, size_t n)
+{
+  if (ensure_space(strSpace, LEN_SIZE + n + 1) != 0) return 1;
+  char *p = &strSpace->buf[strSpace->index];
+  set_len(p, n);
+  memcpy(p + LEN_SIZE, str, n);
+  p[LEN_SIZE + n] = '\0';
+  strSpace->last = strSpace->index;
+  strSpace->index += LEN_SIZE + n + 1;
+  strSpace->nStrs++;
+  assert(strSpace->index <= strSpace->size);
+  return 0;
+}
+
+/** add NUL-terminated string str to strSpace.  Note that str can be
+ *  "" to start a new string for append_len_str_space() or
+ *  append_sprintf_len_str_space().
+ */
+int
+add_len_str_space(LenStrSpace *strSpace, const char *str)
+{
+  return add_n_len_str_space(strSpace, str, strlen(str));
+}
+
+/** append the n chars str[n] to last str in strSpace.  If called
+ *  when strSpace is empty, then simply adds str[n] to strSpace.
+ */
+int
+append_n_len_str_space(LenStrSpace *strSpace, const char *str, size_t n)
+{
+  if (strSpace->nStrs == 0) return add_n_len_str_space(strSpace, str, n);
+  if (ensure_space(strSpace, n) != 0) return 1;
+  char *lenP = &strSpace->buf[strSpace->last];
+  memcpy(&strSpace->buf[strSpace->index - 1], str, n); //overwrite NUL
+  strSpace->index += n;
+  strSpace->buf[strSpace->index - 1] = '\0';
+  set_len(lenP, get_len(lenP) + n);
+  assert(strSpace->index <= strSpace->size);
+  return 0;
+}
+
+/** append NUL-terminated string str to last str in strSpace.  If called
+ *  when strSpace is empty, then simply adds string to strSpace.
+ */
+int
+append_len_str_space(LenStrSpace *strSpace, const char *str)
+{
+  return append_n_len_str_space(strSpace, str, strlen(str));
+}
+
+/** appends a string specified by a sprintf() string to the last
+ *  string in strSpace, or adds it if strSpace is empty.  The string
+ *  is formatted directly into strSpace and is only formatted a second
+ *  time if strSpace must grow to hold it.
+ */
+__attribute__ ((format(printf, 2, 3)))
+int
+append_sprintf_len_str_space(LenStrSpace *strSpace, const char *fmt, ...)
+{
+  if (strSpace->nStrs == 0 && add_n_len_str_space(strSpace, "", 0) != 0) {
+    return 1;
+  }
+  if (ensure_space(strSpace, SPRINTF_MIN_SPACE) != 0) return 1;
+  const size_t start = strSpace->index - 1;  //NUL of last string
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(&strSpace->buf[start], strSpace->size - start, fmt, ap);
+  va_end(ap);
+  if (n < 0) return 1;
+  if (n >= strSpace->size - start) {
+    if (ensure_space(strSpace, n) != 0) {
+      strSpace->buf[start] = '\0';
+      return 1;
+    }
+    va_start(ap, fmt);
+    vsnprintf(&strSpace->buf[start], n + 1, fmt, ap);
+    va_end(ap);
+  }
+  char *lenP = &strSpace->buf[strSpace->last];
+  set_len(lenP, get_len(lenP) + n);
+  strSpace->index += n;
+  assert(strSpace->index <= strSpace->size);
+  return 0;
+}
+
+/** External iterator used to iterate through strings in strSpace
+ *  using lastStr, as for iter_str_space().  Specifically, if called
+ *  with lastStr NULL, it returns a pointer to the first string in
+ *  strSpace; if called with non-NULL, then it returns a pointer to
+ *  the next string in strSpace after lastStr, NULL if none.  Each
+ *  step is O(1).
+ *
+ *  The results are undefined if strSpace is modified during the iteration.
+ *
+ *  No error return.
+ */
+const char *
+iter_len_str_space(const LenStrSpace *strSpace, const char *lastStr)
+{
+  if (strSpace->nStrs == 0) return NULL;
+  const char *next = (lastStr == NULL)
+    ? strSpace->buf
+    : lastStr + get_len(lastStr - LEN_SIZE) + 1;
+  return (next < &strSpace->buf[strSpace->index]) ? next + LEN_SIZE : NULL;
+}
+
+/** return the length of str, which must have been returned by
+ *  iter_len_str_space().  O(1).
+ *
+ *  No error return.
+ */
+size_t
+str_len_len_str_space(const char *str)
+{
+  return get_len(str - LEN_SIZE);
+}
+
+/** return the # of strings in strSpace.
+ *
+ *  No error return.
+ */
+size_t
+n_strs_len_str_space(const LenStrSpace *strSpace)
+{
+  return strSpace->nStrs;
+}
+
+
+/**************************** Unit Tests *******************************/
+
+//whitebox testing
+
+#ifdef TEST_LEN_STR_SPACE
+
+#include "unit-test.h"
+
+static void
+test_add_len_str_space(void)
+{
+  LenStrSpace s;
+  init_len_str_space(&s);
+
+  #define STR1 "hello"
+  add_len_str_space(&s, STR1);
+  CHKF(s.index == LEN_SIZE + strlen(STR1) + 1,
+       "ADD1_INDEX: %zu != %zu", s.index, LEN_SIZE + strlen(STR1) + 1);
+  CHKF(s.nStrs == 1, "ADD1_N_STRS: %zu != 1", s.nStrs);
+
+  add_n_len_str_space(&s, "worldwide", 5);
+  const char *str = iter_len_str_space(&s, NULL);
+  str = iter_len_str_space(&s, str);
+  CHKF(strcmp(str, "world") == 0, "ADD_N: \"%s\" != \"world\"", str);
+  CHKF(str_len_len_str_space(str) == 5,
+       "ADD_N_LEN: %zu != 5", str_len_len_str_space(str));
+  CHKF(n_strs_len_str_space(&s) == 2,
+       "ADD_N_N_STRS: %zu != 2", n_strs_len_str_space(&s));
+
+  clear_len_str_space(&s);
+  CHKF(iter_len_str_space(&s, NULL) == NULL,
+       "CLEAR: \"%s\" != NULL", iter_len_str_space(&s, NULL));
+  CHKF(s.nStrs == 0, "CLEAR_N_STRS: %zu != 0", s.nStrs);
+
+  free_len_str_space(&s);
+  #undef STR1
+}
+
+static void
+test_append_len_str_space(void)
+{
+  LenStrSpace s;
+  init_len_str_space(&s);
+
+  append_len_str_space(&s, "abc");
+  append_n_len_str_space(&s, "defghi", 3);
+  append_len_str_space(&s, "");
+  const char *str = iter_len_str_space(&s, NULL);
+  CHKF(strcmp(str, "abcdef") == 0, "APPEND1: \"%s\" != \"abcdef\"", str);
+  CHKF(str_len_len_str_space(str) == 6,
+       "APPEND1_LEN: %zu != 6", str_len_len_str_space(str));
+  CHKF(s.nStrs == 1, "APPEND1_N_STRS: %zu != 1", s.nStrs);
+
+  add_len_str_space(&s, "x");
+  append_len_str_space(&s, "yz");
+  str = iter_len_str_space(&s, iter_len_str_space(&s, NULL));
+  CHKF(strcmp(str, "xyz") == 0, "APPEND2: \"%s\" != \"xyz\"", str);
+  CHKF(str_len_len_str_space(str) == 3,
+       "APPEND2_LEN: %zu != 3", str_len_len_str_space(str));
+  str = iter_len_str_space(&s, str);
+  CHKF(str == NULL, "APPEND2_DONE: \"%s\" != NULL", str);
+
+  free_len_str_space(&s);
+}
+
+static void
+test_append_sprintf_len_str_space(void)
+{
+  LenStrSpace s;
+  init_len_str_space(&s);
+
+  append_sprintf_len_str_space(&s, "hello %s to ", "world");
+  #define STR1 "hello world to "
+  const char *str = iter_len_str_space(&s, NULL);
+  CHKF(strcmp(str, STR1) == 0, "SPRINTF1: \"%s\" != \"%s\"", str, STR1);
+
+  append_sprintf_len_str_space(&s, "%d girls and ", 5);
+  #define STR2 STR1 "5 girls and "
+  str = iter_len_str_space(&s, NULL);
+  CHKF(strcmp(str, STR2) == 0, "SPRINTF2: \"%s\" != \"%s\"", str, STR2);
+
+  append_sprintf_len_str_space(&s, "%d boys.", 3);
+  #define STR3 STR2 "3 boys."
+  str = iter_len_str_space(&s, NULL);
+  CHKF(strcmp(str, STR3) == 0, "SPRINTF3: \"%s\" != \"%s\"", str, STR3);
+  CHKF(str_len_len_str_space(str) == strlen(STR3),
+       "SPRINTF3_LEN: %zu != %zu", str_len_len_str_space(str), strlen(STR3));
+  CHKF(s.index == s.last + LEN_SIZE + strlen(STR3) + 1,
+       "SPRINTF3_INDEX: %zu != %zu", s.index,
+       s.last + LEN_SIZE + strlen(STR3) + 1);
+
+  add_len_str_space(&s, "");
+  append_sprintf_len_str_space(&s, "%s", "sayonara");
+  str = iter_len_str_space(&s, iter_len_str_space(&s, NULL));
+  CHKF(strcmp(str, "sayonara") == 0, "SPRINTF4: \"%s\" != \"sayonara\"", str);
+  CHKF(str_len_len_str_space(str) == 8,
+       "SPRINTF4_LEN: %zu != 8", str_len_len_str_space(str));
+
+  free_len_str_space(&s);
+  #undef STR1
+  #undef STR2
+  #undef STR3
+}
+
+static void
+test_iter_len_str_space(void)
+{
+  LenStrSpace s;
+  init_len_str_space(&s);
+  const char *strs[] = { "", "a", "", "bc", "long enough to grow the space" };
+  enum { N_STRS = sizeof(strs)/sizeof(strs[0]) };
+  for (int i = 0; i < N_STRS; i++) add_len_str_space(&s, strs[i]);
+  int i = 0;
+  for (const char *str = iter_len_str_space(&s, NULL); str != NULL;
+       str = iter_len_str_space(&s, str), i++) {
+    CHKF(i < N_STRS, "ITER_COUNT: %d >= %d", i, N_STRS);
+    if (i >= N_STRS) break;
+    CHKF(strcmp(str, strs[i]) == 0, "ITER_%d: \"%s\" != \"%s\"", i, str,
+         strs[i]);
+    CHKF(str_len_len_str_space(str) == strlen(strs[i]),
+         "ITER_LEN_%d: %zu != %zu", i, str_len_len_str_space(str),
+         strlen(strs[i]));
+  }
+  CHKF(i == N_STRS, "ITER_DONE: %d != %d", i, N_STRS);
+  free_len_str_space(&s);
+}
+
+static void
+test_arena_len_str_space(void)
+{
+  Arena arena;
+  init_arena(&arena, 0);
+  LenStrSpace s;
+  for (int round = 0; round < 3; round++) {
+    init_len_str_space_with_arena(&s, &arena);
+    for (int i = 0; i < 50; i++) add_len_str_space(&s, "topic");
+    append_sprintf_len_str_space(&s, "%d", round);
+    int n = 0;
+    for (const char *str = iter_len_str_space(&s, NULL); str != NULL;
+         str = iter_len_str_space(&s, str)) {
+      n++;
+    }
+    CHKF(n == 50, "ARENA_N_%d: %d != 50", round, n);
+    reset_arena(&arena);
+  }
+  free_arena(&arena);
+}
+
+int
+main()
+{
+  test_add_len_str_space();
+  test_arena_len_str_space();
+  test_append_len_str_space();
+  test_append_sprintf_len_str_space();
+  test_iter_len_str_space();
+}
+
+#endif //#ifdef TEST_LEN_STR_SPACE
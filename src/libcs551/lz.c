@@ -0,0 +1,286 @@
+#include "lz.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/** Small self-contained LZ77-family codec for byte strings, in the
+ *  style of LZ4: compressed data is a sequence of literal runs and
+ *  back-references into the previous 64K of output.  Compression is
+ *  a single greedy pass using a hash table of recent positions;
+ *  decompression is a simple copy loop.  Compressed data starts with
+ *  the length of the uncompressed data.
+ */
+
+// Format: the uncompressed length as a LEB128 varint, followed by
+// sequences.  Each sequence is a token byte whose high nibble is the
+// # of literals and low nibble is the match length - MIN_MATCH, the
+// literals and then a 2-byte little-endian match offset.  A nibble
+// of 15 is followed by extension bytes which are added to it, up to
+// and including the first byte which is not 255.  The last sequence
+// has only literals (possibly none) and ends the data.
+
+enum {
+  MIN_MATCH = 4,
+  MAX_OFFSET = 0xffff,
+  HASH_BITS = 12,
+  N_HASH = 1 << HASH_BITS,
+  MAX_VARINT_LEN = 10,
+};
+
+static inline uint32_t
+read32(const uint8_t *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline unsigned
+hash32(uint32_t v)
+{
+  return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+/** output n as a token nibble extension; return updated out */
+static uint8_t *
+put_length(uint8_t *out, size_t n)
+{
+  for (; n >= 255; n -= 255) *out++ = 255;
+  *out++ = n;
+  return out;
+}
+
+/** output sequence with literals lits[nLits], followed by a match of
+ *  matchLen bytes at offset if matchLen > 0; return updated out.
+ */
+static uint8_t *
+put_sequence(uint8_t *out, const uint8_t *lits, size_t nLits,
+             size_t offset, size_t matchLen)
+{
+  const size_t matchCode = (matchLen == 0) ? 0 : matchLen - MIN_MATCH;
+  uint8_t *token = out++;
+  *token = ((nLits < 15 ? nLits : 15) << 4) | (matchCode < 15 ? matchCode : 15);
+  if (nLits >= 15) out = put_length(out, nLits - 15);
+  memcpy(out, lits, nLits);
+  out += nLits;
+  if (matchLen > 0) {
+    *out++ = offset & 0xff;
+    *out++ = offset >> 8;
+    if (matchCode >= 15) out = put_length(out, matchCode - 15);
+  }
+  return out;
+}
+
+/** return an upper bound on the # of bytes output by compress_lz()
+ *  for inLen bytes of input.
+ */
+size_t
+max_compressed_size_lz(size_t inLen)
+{
+  return MAX_VARINT_LEN + 1 + inLen + inLen/255 + 1;
+}
+
+/** compress in[inLen] into out[max_compressed_size_lz(inLen)].
+ *  Returns # of bytes output.  No error return.
+ */
+size_t
+compress_lz(const void *in0, size_t inLen, void *out0)
+{
+  const uint8_t *in = in0;
+  uint8_t *out = out0;
+  uint8_t *p = out;
+  for (size_t n = inLen; ; n >>= 7) {
+    *p++ = (n & 0x7f) | (n >= 0x80 ? 0x80 : 0);
+    if (n < 0x80) break;
+  }
+  size_t table[N_HASH] = { 0 };  //position + 1 of last occurrence; 0 if none
+  size_t anchor = 0;             //start of pending literals
+  size_t i = 0;
+  while (i + MIN_MATCH <= inLen) {
+    const uint32_t v = read32(&in[i]);
+    const unsigned h = hash32(v);
+    const size_t candidate = table[h];
+    table[h] = i + 1;
+    if (candidate == 0 || i - (candidate - 1) > MAX_OFFSET ||
+        read32(&in[candidate - 1]) != v) {
+      i++;
+      continue;
+    }
+    const size_t m = candidate - 1;
+    size_t matchLen = MIN_MATCH;
+    while (i + matchLen < inLen && in[m + matchLen] == in[i + matchLen]) {
+      matchLen++;
+    }
+    p = put_sequence(p, &in[anchor], i - anchor, i - m, matchLen);
+    i += matchLen;
+    anchor = i;
+  }
+  p = put_sequence(p, &in[anchor], inLen - anchor, 0, 0);
+  return p - out;
+}
+
+/** set *value to varint at *p < end, advancing *p past it */
+static int
+get_varint(const uint8_t **p, const uint8_t *end, size_t *value)
+{
+  size_t v = 0;
+  for (int shift = 0; shift < 7*MAX_VARINT_LEN; shift += 7) {
+    if (*p >= end) return 1;
+    const uint8_t b = *(*p)++;
+    v |= (size_t)(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      *value = v;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/** add extension bytes at *p < end to *n, advancing *p past them */
+static int
+get_length(const uint8_t **p, const uint8_t *end, size_t *n)
+{
+  uint8_t b;
+  do {
+    if (*p >= end) return 1;
+    b = *(*p)++;
+    *n += b;
+  } while (b == 255);
+  return 0;
+}
+
+/** set *outLen to the uncompressed length of the data compressed in
+ *  in[inLen].  Returns non-zero if in[] does not start with a valid
+ *  length.
+ */
+int
+decompressed_size_lz(const void *in, size_t inLen, size_t *outLen)
+{
+  const uint8_t *p = in;
+  return get_varint(&p, p + inLen, outLen);
+}
+
+/** decompress in[inLen] into out[outSize].  Returns non-zero if in[]
+ *  is not valid compressed data or if its uncompressed length (as
+ *  given by decompressed_size_lz()) exceeds outSize.
+ */
+int
+decompress_lz(const void *in0, size_t inLen, void *out0, size_t outSize)
+{
+  const uint8_t *p = in0;
+  const uint8_t *const end = p + inLen;
+  uint8_t *const out = out0;
+  size_t len;
+  if (get_varint(&p, end, &len) != 0 || len > outSize) return 1;
+  uint8_t *op = out;
+  uint8_t *const oend = out + len;
+  bool isLast = false;
+  while (!isLast && p < end) {
+    const uint8_t token = *p++;
+    size_t nLits = token >> 4;
+    if (nLits == 15 && get_length(&p, end, &nLits) != 0) return 1;
+    if (nLits > end - p || nLits > oend - op) return 1;
+    memcpy(op, p, nLits);
+    op += nLits;
+    p += nLits;
+    isLast = (p == end);  //last sequence has no match
+    if (isLast) break;
+    if (end - p < 2) return 1;
+    const size_t offset = p[0] | (p[1] << 8);
+    p += 2;
+    size_t matchLen = token & 0xf;
+    if (matchLen == 15 && get_length(&p, end, &matchLen) != 0) return 1;
+    matchLen += MIN_MATCH;
+    if (offset == 0 || offset > op - out || matchLen > oend - op) return 1;
+    const uint8_t *match = op - offset;
+    if (offset >= matchLen) {
+      memcpy(op, match, matchLen);
+      op += matchLen;
+    }
+    else {
+      //overlapping match repeats the last offset bytes
+      for (size_t j = 0; j < matchLen; j++) *op++ = match[j];
+    }
+  }
+  return (isLast && op == oend) ? 0 : 1;
+}
+
+#ifdef TEST_LZ
+
+#include "unit-test.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/** compress and decompress in[inLen], returning compressed size */
+static size_t
+round_trip(const char *label, const void *in, size_t inLen)
+{
+  uint8_t *compressed = malloc(max_compressed_size_lz(inLen));
+  uint8_t *out = malloc(inLen + 1);
+  if (!compressed || !out) { perror("malloc"); exit(1); }
+  const size_t n = compress_lz(in, inLen, compressed);
+  CHKF(n <= max_compressed_size_lz(inLen), "%s: compressed size %zu too big",
+       label, n);
+  size_t len;
+  CHKF(decompressed_size_lz(compressed, n, &len) == 0 && len == inLen,
+       "%s: bad decompressed size", label);
+  CHKF(decompress_lz(compressed, n, out, inLen) == 0 &&
+       memcmp(in, out, inLen) == 0, "%s: round trip failed", label);
+  CHKF(inLen == 0 || decompress_lz(compressed, n, out, inLen - 1) != 0,
+       "%s: decompressed into too small buffer", label);
+  //proper prefixes of the compressed data must be rejected
+  int nAccepted = 0;
+  for (size_t i = 0; i < n; i += 1 + n/1024) {
+    nAccepted += (decompress_lz(compressed, i, out, inLen + 1) == 0);
+  }
+  CHKF(nAccepted == 0, "%s: %d truncations accepted", label, nAccepted);
+  free(compressed);
+  free(out);
+  return n;
+}
+
+static void
+test_round_trips(void)
+{
+  round_trip("empty", "", 0);
+  round_trip("short", "abc", 3);
+  const char *text =
+    "It was the best of times, it was the worst of times, it was the age "
+    "of wisdom, it was the age of foolishness, it was the epoch of belief";
+  const size_t n = round_trip("text", text, strlen(text));
+  CHKF(n < strlen(text), "text: %zu not compressed below %zu", n,
+       strlen(text));
+
+  enum { N = 200000 };
+  char *buf = malloc(N);
+  if (!buf) { perror("malloc"); exit(1); }
+  memset(buf, 'x', N);
+  CHK(round_trip("run", buf, N) < N/100, "run: poorly compressed");
+  uint64_t x = 88172645463325252ULL;
+  for (int i = 0; i < N; i++) {
+    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+    buf[i] = x;
+  }
+  round_trip("random", buf, N);
+  const char *words[] = {
+    "the ", "chat ", "room ", "message ", "topic ", "server ", "user ", "of ",
+  };
+  for (int i = 0; i < N; ) {
+    //random words from a small vocabulary
+    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+    const char *word = words[x % (sizeof(words)/sizeof(words[0]))];
+    for (const char *w = word; *w != '\0' && i < N; w++) buf[i++] = *w;
+  }
+  CHK(round_trip("words", buf, N) < N/2, "words: poorly compressed");
+  free(buf);
+}
+
+int
+main()
+{
+  test_round_trips();
+}
+
+#endif //#ifdef TEST_LZ
@@ -0,0 +1,36 @@
+#ifndef LZ_H_
+#define LZ_H_
+
+#include <stddef.h>
+
+/** Small self-contained LZ77-family codec for byte strings, in the
+ *  style of LZ4: compressed data is a sequence of literal runs and
+ *  back-references into the previous 64K of output.  Compression is
+ *  a single greedy pass using a hash table of recent positions;
+ *  decompression is a simple copy loop.  Compressed data starts with
+ *  the length of the uncompressed data.
+ */
+
+/** return an upper bound on the # of bytes output by compress_lz()
+ *  for inLen bytes of input.
+ */
+size_t max_compressed_size_lz(size_t inLen);
+
+/** compress in[inLen] into out[max_compressed_size_lz(inLen)].
+ *  Returns # of bytes output.  No error return.
+ */
+size_t compress_lz(const void *in, size_t inLen, void *out);
+
+/** set *outLen to the uncompressed length of the data compressed in
+ *  in[inLen].  Returns non-zero if in[] does not start with a valid
+ *  length.
+ */
+int decompressed_size_lz(const void *in, size_t inLen, size_t *outLen);
+
+/** decompress in[inLen] into out[outSize].  Returns non-zero if in[]
+ *  is not valid compressed data or if its uncompressed length (as
+ *  given by decompressed_size_lz()) exceeds outSize.
+ */
+int decompress_lz(const void *in, size_t inLen, void *out, size_t outSize);
+
+#endif //#ifndef LZ_H_
@@ -1,6 +1,18 @@
+#define _DEFAULT_SOURCE //for open_memstream()
+
+#include "memalloc.h"
+
 #include "errors.h"
 
+#include <assert.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 void *mallocChk(size_t size)
 {
@@ -22,3 +34,339 @@ void *callocChk(size_t nmemb, size_t size)
   if (!p) fatal("calloc failure for nmemb %zu of size %zu:", nmemb, size);
   return p;
 }
+
+
+/*************************** Accounting Allocator ***********************/
+
+// Each block is a MemHdr followed by the caller's memory.  The header
+// is padded to the alignment of max_align_t so that the caller's
+// memory is as aligned as that returned by malloc().  The statistics
+// for each tag are on their own cache line, so that subsystems which
+// allocate concurrently do not contend; high-water marks are only
+// updated (by compare-and-swap) when exceeded.
+
+typedef struct {
+  alignas(max_align_t) size_t size;     //# of bytes requested
+  uint32_t tag;
+  uint32_t magic;                       //MEM_MAGIC while allocated
+} MemHdr;
+
+enum { MEM_MAGIC = 0x6d656d74 };
+
+static struct {
+  alignas(64) atomic_size_t bytes;
+  atomic_size_t maxBytes;
+  atomic_size_t count;
+  atomic_size_t maxCount;
+  atomic_uint_fast64_t nAllocs;
+} tagStats[N_MEM_TAGS];
+
+static const char *TAG_NAMES[] = {
+  [MEM_TAG_OTHER] = "other",
+  [MEM_TAG_DB] = "db",
+  [MEM_TAG_QUERY] = "query",
+  [MEM_TAG_CONN] = "conn",
+  [MEM_TAG_MSG] = "msg",
+};
+
+#define RELAXED memory_order_relaxed
+
+static void
+update_max(atomic_size_t *max, size_t value)
+{
+  size_t current = atomic_load_explicit(max, RELAXED);
+  while (value > current &&
+         !atomic_compare_exchange_weak_explicit(max, &current, value,
+                                                RELAXED, RELAXED)) {
+  }
+}
+
+/** charge nBlocks blocks of total size bytes to tag */
+static void
+charge_tag(MemTag tag, size_t size, size_t nBlocks)
+{
+  __typeof__(tagStats[0]) *stats = &tagStats[tag];
+  update_max(&stats->maxBytes,
+             atomic_fetch_add_explicit(&stats->bytes, size, RELAXED) + size);
+  if (nBlocks > 0) {
+    update_max(&stats->maxCount,
+               atomic_fetch_add_explicit(&stats->count, nBlocks, RELAXED)
+               + nBlocks);
+    atomic_fetch_add_explicit(&stats->nAllocs, nBlocks, RELAXED);
+  }
+}
+
+/** credit nBlocks blocks of total size bytes to tag */
+static void
+credit_tag(MemTag tag, size_t size, size_t nBlocks)
+{
+  atomic_fetch_sub_explicit(&tagStats[tag].bytes, size, RELAXED);
+  atomic_fetch_sub_explicit(&tagStats[tag].count, nBlocks, RELAXED);
+}
+
+static void *
+init_block(MemHdr *hdr, MemTag tag, size_t size)
+{
+  hdr->size = size;
+  hdr->tag = tag;
+  hdr->magic = MEM_MAGIC;
+  charge_tag(tag, size, 1);
+  return hdr + 1;
+}
+
+static MemHdr *
+block_hdr(void *ptr)
+{
+  MemHdr *hdr = (MemHdr *)ptr - 1;
+  assert(hdr->magic == MEM_MAGIC && hdr->tag < N_MEM_TAGS);
+  return hdr;
+}
+
+/** return a block of size bytes charged to tag; NULL on error */
+void *
+malloc_tag(MemTag tag, size_t size)
+{
+  assert(tag < N_MEM_TAGS);
+  if (size > SIZE_MAX - sizeof(MemHdr)) return NULL;
+  MemHdr *hdr = malloc(sizeof(MemHdr) + size);
+  return hdr ? init_block(hdr, tag, size) : NULL;
+}
+
+/** return a zeroed block of nmemb * size bytes charged to tag; NULL
+ *  on error (including overflow).
+ */
+void *
+calloc_tag(MemTag tag, size_t nmemb, size_t size)
+{
+  assert(tag < N_MEM_TAGS);
+  if (size != 0 && nmemb > (SIZE_MAX - sizeof(MemHdr)) / size) return NULL;
+  MemHdr *hdr = calloc(1, sizeof(MemHdr) + nmemb * size);
+  return hdr ? init_block(hdr, tag, nmemb * size) : NULL;
+}
+
+/** resize block ptr (which may be NULL) returned by one of these
+ *  routines to size bytes, charging it to tag.  Returns NULL on
+ *  error, in which case ptr is unchanged.
+ */
+void *
+realloc_tag(MemTag tag, void *ptr, size_t size)
+{
+  assert(tag < N_MEM_TAGS);
+  if (!ptr) return malloc_tag(tag, size);
+  if (size > SIZE_MAX - sizeof(MemHdr)) return NULL;
+  MemHdr *hdr = block_hdr(ptr);
+  const MemTag oldTag = hdr->tag;
+  const size_t oldSize = hdr->size;
+  hdr = realloc(hdr, sizeof(MemHdr) + size);
+  if (!hdr) return NULL;
+  hdr->size = size;
+  hdr->tag = tag;
+  if (tag == oldTag) {
+    if (size >= oldSize) {
+      charge_tag(tag, size - oldSize, 0);
+    }
+    else {
+      credit_tag(tag, oldSize - size, 0);
+    }
+  }
+  else {
+    credit_tag(oldTag, oldSize, 1);
+    charge_tag(tag, size, 1);
+  }
+  return hdr + 1;
+}
+
+/** free block ptr returned by one of these routines; a NOP if ptr is
+ *  NULL.  Can be used as a destructor callback.
+ *
+ *  No error return.
+ */
+void
+free_tag(void *ptr)
+{
+  if (!ptr) return;
+  MemHdr *hdr = block_hdr(ptr);
+  credit_tag(hdr->tag, hdr->size, 1);
+  hdr->magic = 0;               //catch double frees
+  free(hdr);
+}
+
+/** return name of tag, like "query" for MEM_TAG_QUERY */
+const char *
+name_mem_tag(MemTag tag)
+{
+  return (tag < N_MEM_TAGS) ? TAG_NAMES[tag] : "unknown";
+}
+
+/** set *stats to the current statistics for tag.
+ *
+ *  No error return.
+ */
+void
+stats_mem_tag(MemTag tag, MemTagStats *stats)
+{
+  assert(tag < N_MEM_TAGS);
+  *stats = (MemTagStats) {
+    .bytes = atomic_load_explicit(&tagStats[tag].bytes, RELAXED),
+    .maxBytes = atomic_load_explicit(&tagStats[tag].maxBytes, RELAXED),
+    .count = atomic_load_explicit(&tagStats[tag].count, RELAXED),
+    .maxCount = atomic_load_explicit(&tagStats[tag].maxCount, RELAXED),
+    .nAllocs = atomic_load_explicit(&tagStats[tag].nAllocs, RELAXED),
+  };
+}
+
+/** write the statistics for all tags to out in the Prometheus text
+ *  format used by dump_metrics() (see metrics.h), labeled by tag
+ *  name.  Returns non-zero on an I/O error.
+ */
+int
+dump_mem_tags(FILE *out)
+{
+  static const struct {
+    const char *name;
+    const char *type;
+    const char *help;
+    size_t offset;
+  } FIELDS[] = {
+    { "mem_bytes", "gauge", "# of bytes allocated",
+      offsetof(MemTagStats, bytes) },
+    { "mem_max_bytes", "gauge", "high-water mark of bytes allocated",
+      offsetof(MemTagStats, maxBytes) },
+    { "mem_blocks", "gauge", "# of blocks allocated",
+      offsetof(MemTagStats, count) },
+    { "mem_max_blocks", "gauge", "high-water mark of blocks allocated",
+      offsetof(MemTagStats, maxCount) },
+  };
+  MemTagStats stats[N_MEM_TAGS];
+  for (int t = 0; t < N_MEM_TAGS; t++) stats_mem_tag(t, &stats[t]);
+  for (int i = 0; i < sizeof(FIELDS)/sizeof(FIELDS[0]); i++) {
+    fprintf(out, "# HELP %s %s\n", FIELDS[i].name, FIELDS[i].help);
+    fprintf(out, "# TYPE %s %s\n", FIELDS[i].name, FIELDS[i].type);
+    for (int t = 0; t < N_MEM_TAGS; t++) {
+      const size_t value =
+        *(const size_t *)((const char *)&stats[t] + FIELDS[i].offset);
+      fprintf(out, "%s{tag=\"%s\"} %zu\n", FIELDS[i].name, TAG_NAMES[t],
+              value);
+    }
+  }
+  fprintf(out, "# HELP mem_allocs_total # of blocks allocated\n");
+  fprintf(out, "# TYPE mem_allocs_total counter\n");
+  for (int t = 0; t < N_MEM_TAGS; t++) {
+    fprintf(out, "mem_allocs_total{tag=\"%s\"} %llu\n", TAG_NAMES[t],
+            (unsigned long long)stats[t].nAllocs);
+  }
+  return fflush(out) != 0 || ferror(out);
+}
+
+
+/**************************** Unit Tests *******************************/
+
+//whitebox testing
+
+#ifdef TEST_MEMALLOC
+
+#include "unit-test.h"
+
+#include <pthread.h>
+
+static void
+test_accounting(void)
+{
+  MemTagStats stats0, stats;
+  stats_mem_tag(MEM_TAG_QUERY, &stats0);
+  char *p = malloc_tag(MEM_TAG_QUERY, 100);
+  char *q = calloc_tag(MEM_TAG_QUERY, 10, 30);
+  CHK(p && q, "ALLOC: failed");
+  CHK((uintptr_t)p % alignof(max_align_t) == 0, "ALIGN: misaligned");
+  bool isZero = true;
+  for (int i = 0; i < 300; i++) isZero = isZero && q[i] == 0;
+  CHK(isZero, "CALLOC: not zeroed");
+  stats_mem_tag(MEM_TAG_QUERY, &stats);
+  CHKF(stats.bytes == 400 && stats.count == 2 && stats.maxBytes == 400 &&
+       stats.nAllocs == 2, "ALLOC: %zu bytes in %zu blocks",
+       stats.bytes, stats.count);
+  memset(p, 'a', 100);
+  p = realloc_tag(MEM_TAG_QUERY, p, 1000);
+  CHK(p && p[99] == 'a', "REALLOC: contents lost");
+  stats_mem_tag(MEM_TAG_QUERY, &stats);
+  CHKF(stats.bytes == 1300 && stats.count == 2 && stats.maxBytes == 1300,
+       "GROW: %zu bytes", stats.bytes);
+  p = realloc_tag(MEM_TAG_MSG, p, 50);   //moves p to another tag
+  MemTagStats msgStats;
+  stats_mem_tag(MEM_TAG_MSG, &msgStats);
+  stats_mem_tag(MEM_TAG_QUERY, &stats);
+  CHKF(stats.bytes == 300 && stats.count == 1 && stats.maxBytes == 1300 &&
+       msgStats.bytes == 50 && msgStats.count == 1,
+       "RETAG: %zu query bytes, %zu msg bytes", stats.bytes, msgStats.bytes);
+  free_tag(p);
+  free_tag(q);
+  free_tag(NULL);
+  stats_mem_tag(MEM_TAG_QUERY, &stats);
+  stats_mem_tag(MEM_TAG_MSG, &msgStats);
+  CHKF(stats.bytes == 0 && stats.count == 0 && stats.maxCount == 2 &&
+       msgStats.bytes == 0, "FREE: %zu bytes", stats.bytes);
+  CHK(malloc_tag(MEM_TAG_OTHER, SIZE_MAX) == NULL, "OVERFLOW: malloc");
+  CHK(calloc_tag(MEM_TAG_OTHER, SIZE_MAX/2, 4) == NULL, "OVERFLOW: calloc");
+}
+
+enum { N_THREADS = 4, N_BLOCKS = 1000 };
+
+static void *
+alloc_thread(void *arg)
+{
+  void *blocks[N_BLOCKS];
+  for (int i = 0; i < N_BLOCKS; i++) blocks[i] = malloc_tag(MEM_TAG_CONN, i);
+  for (int i = 0; i < N_BLOCKS; i++) free_tag(blocks[i]);
+  return NULL;
+}
+
+static void
+test_threads(void)
+{
+  pthread_t tids[N_THREADS];
+  for (int t = 0; t < N_THREADS; t++) {
+    pthread_create(&tids[t], NULL, alloc_thread, NULL);
+  }
+  for (int t = 0; t < N_THREADS; t++) pthread_join(tids[t], NULL);
+  MemTagStats stats;
+  stats_mem_tag(MEM_TAG_CONN, &stats);
+  const size_t threadBytes = N_BLOCKS * (N_BLOCKS - 1) / 2;
+  CHKF(stats.bytes == 0 && stats.count == 0 &&
+       stats.nAllocs == N_THREADS * N_BLOCKS &&
+       stats.maxBytes >= threadBytes &&
+       stats.maxBytes <= N_THREADS * threadBytes &&
+       stats.maxCount >= N_BLOCKS && stats.maxCount <= N_THREADS * N_BLOCKS,
+       "THREADS: %zu bytes, max %zu", stats.bytes, stats.maxBytes);
+}
+
+static void
+test_dump(void)
+{
+  void *p = malloc_tag(MEM_TAG_DB, 42);
+  char *text = NULL;
+  size_t textLen = 0;
+  FILE *out = open_memstream(&text, &textLen);
+  CHK(dump_mem_tags(out) == 0, "DUMP: failed");
+  fclose(out);
+  const char *expected[] = {
+    "# TYPE mem_bytes gauge\nmem_bytes{tag=\"other\"} 0\n"
+    "mem_bytes{tag=\"db\"} 42\n",
+    "mem_max_bytes{tag=\"query\"} 1300\n",
+    "mem_allocs_total{tag=\"conn\"} 4000\n",
+  };
+  for (int i = 0; i < sizeof(expected)/sizeof(expected[0]); i++) {
+    CHKF(strstr(text, expected[i]) != NULL, "DUMP_%d: %s", i, text);
+  }
+  free(text);
+  free_tag(p);
+}
+
+int
+main()
+{
+  test_accounting();
+  test_threads();
+  test_dump();
+}
+
+#endif //#ifdef TEST_MEMALLOC
@@ -0,0 +1,623 @@
+#define _DEFAULT_SOURCE //for strdup() and open_memstream()
+
+#include "metrics.h"
+
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Counters, gauges and log-linear histograms, together with a
+ *  registry which can dump them in a text exposition format.
+ */
+
+// Each thread is assigned a shard index round-robin on its first
+// update.  Since an update is a relaxed fetch-add on a shard which is
+// usually only written by its thread, its cache line stays in the
+// updating core.  Registration is rare, so a registry is simply a
+// list searched linearly under a lock.
+
+static atomic_uint nextShard;
+static _Thread_local unsigned threadShard = UINT_MAX;
+
+static inline unsigned
+shard_index(void)
+{
+  if (threadShard == UINT_MAX) threadShard = atomic_fetch_add(&nextShard, 1);
+  return threadShard;
+}
+
+#define RELAXED memory_order_relaxed
+
+
+/****************************** Counters *******************************/
+
+/** initialize counter to 0.
+ *
+ *  No error return.
+ */
+void
+init_counter(Counter *counter)
+{
+  for (int i = 0; i < N_COUNTER_SHARDS; i++) {
+    atomic_init(&counter->shards[i].value, 0);
+  }
+}
+
+/** add n to counter; a NOP if counter is NULL.
+ *
+ *  No error return.
+ */
+void
+add_counter(Counter *counter, uint64_t n)
+{
+  if (!counter) return;
+  atomic_fetch_add_explicit(
+    &counter->shards[shard_index() % N_COUNTER_SHARDS].value, n, RELAXED);
+}
+
+/** return current value of counter; 0 if counter is NULL.
+ *
+ *  No error return.
+ */
+uint64_t
+value_counter(const Counter *counter)
+{
+  if (!counter) return 0;
+  uint64_t value = 0;
+  for (int i = 0; i < N_COUNTER_SHARDS; i++) {
+    value += atomic_load_explicit(&counter->shards[i].value, RELAXED);
+  }
+  return value;
+}
+
+
+/******************************* Gauges ********************************/
+
+/** initialize gauge to 0.
+ *
+ *  No error return.
+ */
+void
+init_gauge(Gauge *gauge)
+{
+  atomic_init(&gauge->value, 0);
+}
+
+/** set gauge to value; a NOP if gauge is NULL.
+ *
+ *  No error return.
+ */
+void
+set_gauge(Gauge *gauge, int64_t value)
+{
+  if (gauge) atomic_store_explicit(&gauge->value, value, RELAXED);
+}
+
+/** add delta (which may be negative) to gauge; a NOP if gauge is NULL.
+ *
+ *  No error return.
+ */
+void
+add_gauge(Gauge *gauge, int64_t delta)
+{
+  if (gauge) atomic_fetch_add_explicit(&gauge->value, delta, RELAXED);
+}
+
+/** return current value of gauge; 0 if gauge is NULL.
+ *
+ *  No error return.
+ */
+int64_t
+value_gauge(const Gauge *gauge)
+{
+  return gauge ? atomic_load_explicit(&gauge->value, RELAXED) : 0;
+}
+
+
+/***************************** Histograms ******************************/
+
+enum {
+  N_EXACT = 1 << HISTOGRAM_SUB_BITS,            //values recorded exactly
+  N_SUB_BUCKETS = 1 << (HISTOGRAM_SUB_BITS - 1),//buckets per power of 2
+};
+
+/** return index of bucket for value */
+static inline unsigned
+bucket_index(uint64_t value)
+{
+  if (value < N_EXACT) return value;
+  const unsigned msb = 63 - __builtin_clzll(value);
+  if (msb >= HISTOGRAM_MAX_BITS) return N_HISTOGRAM_BUCKETS - 1;
+  const unsigned shift = msb - (HISTOGRAM_SUB_BITS - 1);
+  //value >> shift is in [N_SUB_BUCKETS, 2*N_SUB_BUCKETS)
+  return shift * N_SUB_BUCKETS + (value >> shift);
+}
+
+/** return largest value counted in bucket index */
+static uint64_t
+bucket_max(unsigned index)
+{
+  if (index < N_EXACT) return index;
+  if (index == N_HISTOGRAM_BUCKETS - 1) return UINT64_MAX;
+  const unsigned shift = index / N_SUB_BUCKETS - 1;
+  const uint64_t m = index % N_SUB_BUCKETS + N_SUB_BUCKETS;
+  return ((m + 1) << shift) - 1;
+}
+
+/** initialize histogram to empty.
+ *
+ *  No error return.
+ */
+void
+init_histogram(Histogram *histogram)
+{
+  memset(histogram, 0, sizeof(Histogram));
+}
+
+static void
+update_max(atomic_uint_fast64_t *max, uint64_t value)
+{
+  uint_fast64_t current = atomic_load_explicit(max, RELAXED);
+  while (value > current &&
+         !atomic_compare_exchange_weak_explicit(max, &current, value,
+                                                RELAXED, RELAXED)) {
+  }
+}
+
+/** record value in histogram; a NOP if histogram is NULL.
+ *
+ *  No error return.
+ */
+void
+record_histogram(Histogram *histogram, uint64_t value)
+{
+  if (!histogram) return;
+  __typeof__(histogram->shards[0]) *shard =
+    &histogram->shards[shard_index() % N_HISTOGRAM_SHARDS];
+  atomic_fetch_add_explicit(&shard->buckets[bucket_index(value)], 1, RELAXED);
+  atomic_fetch_add_explicit(&shard->count, 1, RELAXED);
+  atomic_fetch_add_explicit(&shard->sum, value, RELAXED);
+  update_max(&shard->notMin, ~value);
+  update_max(&shard->max, value);
+}
+
+/** initialize snapshot to an empty histogram.
+ *
+ *  No error return.
+ */
+void
+init_histogram_snapshot(HistogramSnapshot *snapshot)
+{
+  memset(snapshot, 0, sizeof(HistogramSnapshot));
+  snapshot->min = UINT64_MAX;
+}
+
+/** set *snapshot to the current contents of histogram, merged over all
+ *  shards.  Values recorded concurrently may or may not be included.
+ *
+ *  No error return.
+ */
+void
+snapshot_histogram(const Histogram *histogram, HistogramSnapshot *snapshot)
+{
+  init_histogram_snapshot(snapshot);
+  for (int i = 0; i < N_HISTOGRAM_SHARDS; i++) {
+    const __typeof__(histogram->shards[0]) *shard = &histogram->shards[i];
+    uint64_t count = 0;
+    for (int b = 0; b < N_HISTOGRAM_BUCKETS; b++) {
+      const uint64_t n = atomic_load_explicit(&shard->buckets[b], RELAXED);
+      snapshot->buckets[b] += n;
+      count += n;
+    }
+    if (count == 0) continue;
+    //use count of buckets so that count is consistent with buckets[]
+    snapshot->count += count;
+    snapshot->sum += atomic_load_explicit(&shard->sum, RELAXED);
+    const uint64_t min = ~atomic_load_explicit(&shard->notMin, RELAXED);
+    const uint64_t max = atomic_load_explicit(&shard->max, RELAXED);
+    if (min < snapshot->min) snapshot->min = min;
+    if (max > snapshot->max) snapshot->max = max;
+  }
+}
+
+/** merge the values of src into dest.
+ *
+ *  No error return.
+ */
+void
+merge_histogram_snapshot(HistogramSnapshot *dest, const HistogramSnapshot *src)
+{
+  for (int b = 0; b < N_HISTOGRAM_BUCKETS; b++) {
+    dest->buckets[b] += src->buckets[b];
+  }
+  dest->count += src->count;
+  dest->sum += src->sum;
+  if (src->min < dest->min) dest->min = src->min;
+  if (src->max > dest->max) dest->max = src->max;
+}
+
+/** return the value at percentile p (0 <= p <= 100) of snapshot: the
+ *  largest value in the bucket which contains the p'th percentile,
+ *  limited to [min, max].  Returns 0 if snapshot is empty.
+ *
+ *  No error return.
+ */
+uint64_t
+percentile_histogram_snapshot(const HistogramSnapshot *snapshot, double p)
+{
+  if (snapshot->count == 0) return 0;
+  //rank of the value at percentile p, in [1, count]
+  uint64_t rank = (uint64_t)(p / 100.0 * snapshot->count + 0.5);
+  if (rank < 1) rank = 1;
+  if (rank > snapshot->count) rank = snapshot->count;
+  uint64_t n = 0;
+  for (int b = 0; b < N_HISTOGRAM_BUCKETS; b++) {
+    n += snapshot->buckets[b];
+    if (n >= rank) {
+      const uint64_t value = bucket_max(b);
+      if (value < snapshot->min) return snapshot->min;
+      return (value > snapshot->max) ? snapshot->max : value;
+    }
+  }
+  return snapshot->max;
+}
+
+/** add the counts in snapshot to buckets[nBuckets], where buckets[i]
+ *  counts values in [2^i, 2^(i+1)), with buckets[0] also counting 0
+ *  and buckets[nBuckets - 1] also counting all larger values.
+ *
+ *  No error return.
+ */
+void
+log2_histogram_snapshot(const HistogramSnapshot *snapshot, size_t nBuckets,
+                        uint64_t buckets[nBuckets])
+{
+  for (unsigned b = 0; b < N_HISTOGRAM_BUCKETS; b++) {
+    if (snapshot->buckets[b] == 0) continue;
+    //all values in a bucket have the same most significant bit
+    const uint64_t max = bucket_max(b);
+    size_t i = (max <= 1) ? 0 : 63 - __builtin_clzll(max);
+    if (i >= nBuckets) i = nBuckets - 1;
+    buckets[i] += snapshot->buckets[b];
+  }
+}
+
+
+/****************************** Registry *******************************/
+
+struct _Metric {
+  Metric *next;
+  MetricType type;
+  char *name;
+  char *help;
+  alignas(CACHE_LINE_SIZE) char body[];   /** Counter, Gauge or Histogram */
+};
+
+static const size_t BODY_SIZES[] = {
+  [COUNTER_METRIC] = sizeof(Counter),
+  [GAUGE_METRIC] = sizeof(Gauge),
+  [HISTOGRAM_METRIC] = sizeof(Histogram),
+};
+
+/** initialize an empty registry */
+int
+init_metrics(Metrics *metrics)
+{
+  if (pthread_mutex_init(&metrics->lock, NULL) != 0) return 1;
+  metrics->metrics = NULL;
+  metrics->last = &metrics->metrics;
+  return 0;
+}
+
+/** free registry and all metrics registered in it.  Does not free the
+ *  metrics structure itself.
+ *
+ *  No error return.
+ */
+void
+free_metrics(Metrics *metrics)
+{
+  for (Metric *p = metrics->metrics, *next; p != NULL; p = next) {
+    next = p->next;
+    free(p->name);
+    free(p->help);
+    free(p);
+  }
+  pthread_mutex_destroy(&metrics->lock);
+}
+
+static Metrics globalMetrics;
+static bool isGlobalMetricsOk;
+static pthread_once_t globalMetricsOnce = PTHREAD_ONCE_INIT;
+
+static void
+init_global_metrics(void)
+{
+  isGlobalMetricsOk = init_metrics(&globalMetrics) == 0;
+}
+
+/** return process-wide registry, which is never freed; NULL on an
+ *  allocation error.
+ */
+Metrics *
+global_metrics(void)
+{
+  pthread_once(&globalMetricsOnce, init_global_metrics);
+  return isGlobalMetricsOk ? &globalMetrics : NULL;
+}
+
+/** return a new metric; NULL on an allocation error */
+static Metric *
+make_metric(MetricType type, const char *name, const char *help)
+{
+  const size_t size = sizeof(Metric) + BODY_SIZES[type];
+  Metric *metric = aligned_alloc(CACHE_LINE_SIZE,
+                                 (size + CACHE_LINE_SIZE - 1)
+                                 / CACHE_LINE_SIZE * CACHE_LINE_SIZE);
+  if (!metric) return NULL;
+  *metric = (Metric) { .type = type };
+  metric->name = strdup(name);
+  metric->help = strdup(help ? help : "");
+  if (!metric->name || !metric->help) {
+    free(metric->name);
+    free(metric->help);
+    free(metric);
+    return NULL;
+  }
+  switch (type) {
+  case COUNTER_METRIC: init_counter((Counter *)metric->body); break;
+  case GAUGE_METRIC: init_gauge((Gauge *)metric->body); break;
+  case HISTOGRAM_METRIC: init_histogram((Histogram *)metric->body); break;
+  }
+  return metric;
+}
+
+/** return body of metric with name and type in metrics, registering
+ *  a new metric if there is none; NULL on a type mismatch or an
+ *  allocation error.
+ */
+static void *
+register_metric(Metrics *metrics, MetricType type, const char *name,
+                const char *help)
+{
+  if (!metrics) return NULL;
+  pthread_mutex_lock(&metrics->lock);
+  Metric *metric = metrics->metrics;
+  while (metric && strcmp(metric->name, name) != 0) metric = metric->next;
+  if (!metric && (metric = make_metric(type, name, help))) {
+    *metrics->last = metric;
+    metrics->last = &metric->next;
+  }
+  pthread_mutex_unlock(&metrics->lock);
+  return (metric && metric->type == type) ? metric->body : NULL;
+}
+
+/** return counter registered in metrics under name, registering a new
+ *  counter with help text help if there is none.  Returns NULL if
+ *  metrics is NULL, name is registered with a different type, or on
+ *  an allocation error.
+ */
+Counter *
+counter_metrics(Metrics *metrics, const char *name, const char *help)
+{
+  return register_metric(metrics, COUNTER_METRIC, name, help);
+}
+
+/** like counter_metrics(), but for a gauge */
+Gauge *
+gauge_metrics(Metrics *metrics, const char *name, const char *help)
+{
+  return register_metric(metrics, GAUGE_METRIC, name, help);
+}
+
+/** like counter_metrics(), but for a histogram */
+Histogram *
+histogram_metrics(Metrics *metrics, const char *name, const char *help)
+{
+  return register_metric(metrics, HISTOGRAM_METRIC, name, help);
+}
+
+static const char *TYPE_NAMES[] = {
+  [COUNTER_METRIC] = "counter",
+  [GAUGE_METRIC] = "gauge",
+  [HISTOGRAM_METRIC] = "summary",
+};
+
+static void
+dump_histogram(const Metric *metric, FILE *out)
+{
+  static const char *QUANTILES[] = { "0.5", "0.9", "0.99", "0.999", "1" };
+  static const double PERCENTILES[] = { 50, 90, 99, 99.9, 100 };
+  HistogramSnapshot snapshot;
+  snapshot_histogram((const Histogram *)metric->body, &snapshot);
+  for (int i = 0; i < sizeof(PERCENTILES)/sizeof(PERCENTILES[0]); i++) {
+    fprintf(out, "%s{quantile=\"%s\"} %llu\n", metric->name, QUANTILES[i],
+            (unsigned long long)
+            percentile_histogram_snapshot(&snapshot, PERCENTILES[i]));
+  }
+  fprintf(out, "%s_sum %llu\n", metric->name,
+          (unsigned long long)snapshot.sum);
+  fprintf(out, "%s_count %llu\n", metric->name,
+          (unsigned long long)snapshot.count);
+}
+
+/** write all metrics in metrics to out in the Prometheus text format,
+ *  with each histogram written as a summary with its count, sum and
+ *  0.5, 0.9, 0.99, 0.999 and 1 quantiles.
+ */
+int
+dump_metrics(Metrics *metrics, FILE *out)
+{
+  pthread_mutex_lock(&metrics->lock);
+  for (const Metric *p = metrics->metrics; p != NULL; p = p->next) {
+    if (*p->help != '\0') fprintf(out, "# HELP %s %s\n", p->name, p->help);
+    fprintf(out, "# TYPE %s %s\n", p->name, TYPE_NAMES[p->type]);
+    switch (p->type) {
+    case COUNTER_METRIC:
+      fprintf(out, "%s %llu\n", p->name,
+              (unsigned long long)value_counter((const Counter *)p->body));
+      break;
+    case GAUGE_METRIC:
+      fprintf(out, "%s %lld\n", p->name,
+              (long long)value_gauge((const Gauge *)p->body));
+      break;
+    case HISTOGRAM_METRIC:
+      dump_histogram(p, out);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&metrics->lock);
+  return fflush(out) != 0 || ferror(out);
+}
+
+
+/**************************** Unit Tests *******************************/
+
+//whitebox testing
+
+#ifdef TEST_METRICS
+
+#include "unit-test.h"
+
+enum { N_THREADS = 4, N_ADDS = 100000 };
+
+static void *
+add_thread(void *arg)
+{
+  Counter *counter = counter_metrics(global_metrics(), "adds", "# of adds");
+  Histogram *histogram = histogram_metrics(global_metrics(), "values", NULL);
+  for (int i = 0; i < N_ADDS; i++) {
+    add_counter(counter, 1);
+    record_histogram(histogram, i % 1000);
+  }
+  return NULL;
+}
+
+static void
+test_counters_gauges(void)
+{
+  pthread_t tids[N_THREADS];
+  for (int t = 0; t < N_THREADS; t++) {
+    pthread_create(&tids[t], NULL, add_thread, NULL);
+  }
+  for (int t = 0; t < N_THREADS; t++) pthread_join(tids[t], NULL);
+  Counter *counter = counter_metrics(global_metrics(), "adds", NULL);
+  CHKF(value_counter(counter) == N_THREADS * N_ADDS, "COUNTER: %llu",
+       (unsigned long long)value_counter(counter));
+  CHK(gauge_metrics(global_metrics(), "adds", NULL) == NULL,
+      "TYPE_MISMATCH: registered");
+  Gauge *gauge = gauge_metrics(global_metrics(), "level", "current level");
+  set_gauge(gauge, 5);
+  add_gauge(gauge, -7);
+  CHKF(value_gauge(gauge) == -2, "GAUGE: %lld",
+       (long long)value_gauge(gauge));
+  add_counter(NULL, 1);         //NULL metrics are NOPs
+  CHK(value_gauge(NULL) == 0, "NULL_GAUGE: non-zero");
+}
+
+static void
+test_buckets(void)
+{
+  //bucket ranges are contiguous and increasing
+  unsigned nBad = 0;
+  for (unsigned b = 1; b < N_HISTOGRAM_BUCKETS - 1; b++) {
+    nBad += bucket_index(bucket_max(b - 1) + 1) != b ||
+      bucket_index(bucket_max(b)) != b;
+  }
+  CHKF(nBad == 0, "BUCKETS: %u bad", nBad);
+  CHK(bucket_index(1ULL << HISTOGRAM_MAX_BITS) == N_HISTOGRAM_BUCKETS - 1,
+      "BUCKETS: overflow");
+  //relative error of a bucket is at most 1/N_SUB_BUCKETS
+  for (uint64_t v = 1; v < (1ULL << 39); v = v * 3 + 1) {
+    const uint64_t max = bucket_max(bucket_index(v));
+    CHKF(max >= v && (max - v) * N_SUB_BUCKETS <= v, "ERROR: %llu",
+         (unsigned long long)v);
+  }
+}
+
+static void
+test_percentiles(void)
+{
+  Histogram *histogram = histogram_metrics(global_metrics(), "values", NULL);
+  HistogramSnapshot snapshot;
+  snapshot_histogram(histogram, &snapshot);
+  CHKF(snapshot.count == N_THREADS * N_ADDS && snapshot.min == 0 &&
+       snapshot.max == 999, "SNAPSHOT: %llu",
+       (unsigned long long)snapshot.count);
+  const uint64_t p50 = percentile_histogram_snapshot(&snapshot, 50);
+  const uint64_t p99 = percentile_histogram_snapshot(&snapshot, 99);
+  CHKF(p50 >= 499 && p50 <= 499 + 499/32, "P50: %llu",
+       (unsigned long long)p50);
+  CHKF(p99 >= 989 && p99 <= 999, "P99: %llu", (unsigned long long)p99);
+  CHK(percentile_histogram_snapshot(&snapshot, 100) == 999, "P100: not max");
+  uint64_t log2Buckets[10] = { 0 };
+  log2_histogram_snapshot(&snapshot, 10, log2Buckets);
+  CHKF(log2Buckets[0] == 2 * N_THREADS * N_ADDS / 1000 &&
+       log2Buckets[5] == 32 * N_THREADS * N_ADDS / 1000 &&
+       log2Buckets[9] == (1000 - 512) * N_THREADS * N_ADDS / 1000,
+       "LOG2: %llu %llu %llu", (unsigned long long)log2Buckets[0],
+       (unsigned long long)log2Buckets[5], (unsigned long long)log2Buckets[9]);
+
+  Histogram large;
+  init_histogram(&large);
+  for (uint64_t v = 1000000; v < 2000000; v += 1000) {
+    record_histogram(&large, v);
+  }
+  HistogramSnapshot largeSnapshot;
+  snapshot_histogram(&large, &largeSnapshot);
+  merge_histogram_snapshot(&snapshot, &largeSnapshot);
+  CHKF(snapshot.count == N_THREADS * N_ADDS + 1000 && snapshot.max == 1999000,
+       "MERGE: %llu", (unsigned long long)snapshot.count);
+  //all small values precede the large ones
+  const uint64_t p999 = percentile_histogram_snapshot(&snapshot, 99.9);
+  CHKF(p999 >= 1600000 && p999 <= 1600000 * 33 / 32, "P99.9: %llu",
+       (unsigned long long)p999);
+  HistogramSnapshot empty;
+  init_histogram_snapshot(&empty);
+  CHK(percentile_histogram_snapshot(&empty, 50) == 0, "EMPTY: non-zero");
+}
+
+static void
+test_dump(void)
+{
+  char *text = NULL;
+  size_t textLen = 0;
+  FILE *out = open_memstream(&text, &textLen);
+  CHK(dump_metrics(global_metrics(), out) == 0, "DUMP: failed");
+  fclose(out);
+  const char *expected[] = {
+    "# HELP adds # of adds\n# TYPE adds counter\nadds 400000\n",
+    "# TYPE values summary\nvalues{quantile=\"0.5\"} ",
+    "values{quantile=\"1\"} 999\n",
+    "values_count 400000\n",
+    "# TYPE level gauge\nlevel -2\n",
+  };
+  for (int i = 0; i < sizeof(expected)/sizeof(expected[0]); i++) {
+    CHKF(strstr(text, expected[i]) != NULL, "DUMP_%d: %s", i, text);
+  }
+  free(text);
+  Metrics metrics;
+  CHK(init_metrics(&metrics) == 0, "INIT: failed");
+  Counter *counter = counter_metrics(&metrics, "private", NULL);
+  CHK(counter && counter == counter_metrics(&metrics, "private", NULL),
+      "PRIVATE: not shared");
+  free_metrics(&metrics);
+}
+
+int
+main()
+{
+  test_counters_gauges();
+  test_buckets();
+  test_percentiles();
+  test_dump();
+}
+
+#endif //#ifdef TEST_METRICS
@@ -0,0 +1,599 @@
+#ifdef TEST_RING
+  #define _DEFAULT_SOURCE   //for fork(), mmap() and sched_yield() in tests
+#endif
+
+#include "ring.h"
+
+#include <assert.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Bounded lock-free ring buffers of fixed-size elements for handing
+ *  work between threads or processes.  Push and pop never block: they
+ *  transfer as many of the requested elements as possible and return
+ *  the # transferred.
+ */
+
+// head and tail are free-running indexes which are reduced modulo
+// capacity only to address elements, so that head == tail when a
+// ring is empty and tail - head == capacity when it is full.  Since a
+// ring may be in memory shared between processes, the atomics must
+// be lock-free (and hence address-free).
+
+static_assert(ATOMIC_LONG_LOCK_FREE == 2 && sizeof(size_t) == sizeof(long),
+              "ring indexes must be lock-free");
+
+static inline bool
+is_power_of_2(size_t n)
+{
+  return n > 0 && (n & (n - 1)) == 0;
+}
+
+static inline size_t
+round_up(size_t n, size_t multiple)
+{
+  return (n + multiple - 1) / multiple * multiple;
+}
+
+static inline size_t
+min_size(size_t a, size_t b)
+{
+  return (a < b) ? a : b;
+}
+
+/** return ring-like memory of size bytes from malloc(), aligned to a
+ *  cache line.
+ */
+static void *
+alloc_ring(size_t size)
+{
+  return aligned_alloc(CACHE_LINE_SIZE, round_up(size, CACHE_LINE_SIZE));
+}
+
+
+/****************************** SPSC Ring ******************************/
+
+// The producer only writes tail and the consumer only writes head.
+// Each caches the last value it read of the other's index, so that
+// the shared cache line is only read when the cached value indicates
+// that the ring may be full or empty.
+
+/** return # of bytes needed for a SpscRing with capacity elements of
+ *  elementSize bytes.
+ *
+ *  No error return.
+ */
+size_t
+mem_size_spsc_ring(size_t capacity, size_t elementSize)
+{
+  return sizeof(SpscRing) + capacity * elementSize;
+}
+
+/** initialize mem, which must have at least mem_size_spsc_ring() bytes
+ *  aligned to CACHE_LINE_SIZE, as a SpscRing.  Returns the ring; NULL
+ *  if capacity is not a power of 2.
+ */
+SpscRing *
+init_spsc_ring(void *mem, size_t capacity, size_t elementSize)
+{
+  if (!is_power_of_2(capacity)) return NULL;
+  assert((uintptr_t)mem % CACHE_LINE_SIZE == 0);
+  SpscRing *ring = mem;
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  ring->cachedHead = ring->cachedTail = 0;
+  ring->capacity = capacity;
+  ring->elementSize = elementSize;
+  return ring;
+}
+
+/** return a malloc()'d SpscRing; NULL if capacity is not a power of
+ *  2 or on an allocation error.
+ */
+SpscRing *
+make_spsc_ring(size_t capacity, size_t elementSize)
+{
+  if (!is_power_of_2(capacity)) return NULL;
+  void *mem = alloc_ring(mem_size_spsc_ring(capacity, elementSize));
+  return mem ? init_spsc_ring(mem, capacity, elementSize) : NULL;
+}
+
+/** free ring returned by make_spsc_ring().
+ *
+ *  No error return.
+ */
+void
+free_spsc_ring(SpscRing *ring)
+{
+  free(ring);
+}
+
+/** copy n elements between elements[n] and ring starting at index,
+ *  wrapping around the end of ring.
+ */
+static void
+copy_spsc_ring(SpscRing *ring, size_t index, void *elements, size_t n,
+               bool isPush)
+{
+  const size_t elementSize = ring->elementSize;
+  const size_t i = index & (ring->capacity - 1);
+  const size_t n1 = min_size(n, ring->capacity - i);
+  char *p = &ring->elements[i * elementSize];
+  char *q = elements;
+  if (isPush) {
+    memcpy(p, q, n1 * elementSize);
+    memcpy(ring->elements, q + n1 * elementSize, (n - n1) * elementSize);
+  }
+  else {
+    memcpy(q, p, n1 * elementSize);
+    memcpy(q + n1 * elementSize, ring->elements, (n - n1) * elementSize);
+  }
+}
+
+/** push up to n elements from elements[n] into ring; may only be
+ *  called by the producer.  Returns # of elements pushed, which is
+ *  less than n only if ring became full.
+ *
+ *  No error return.
+ */
+size_t
+push_spsc_ring(SpscRing *ring, const void *elements, size_t n)
+{
+  const size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  size_t nFree = ring->capacity - (tail - ring->cachedHead);
+  if (nFree < n) {
+    ring->cachedHead =
+      atomic_load_explicit(&ring->head, memory_order_acquire);
+    nFree = ring->capacity - (tail - ring->cachedHead);
+  }
+  const size_t m = min_size(n, nFree);
+  if (m == 0) return 0;
+  copy_spsc_ring(ring, tail, (void *)elements, m, true);
+  atomic_store_explicit(&ring->tail, tail + m, memory_order_release);
+  return m;
+}
+
+/** pop up to n elements from ring into elements[n]; may only be called
+ *  by the consumer.  Returns # of elements popped, which is less than
+ *  n only if ring became empty.
+ *
+ *  No error return.
+ */
+size_t
+pop_spsc_ring(SpscRing *ring, void *elements, size_t n)
+{
+  const size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  size_t nReady = ring->cachedTail - head;
+  if (nReady < n) {
+    ring->cachedTail =
+      atomic_load_explicit(&ring->tail, memory_order_acquire);
+    nReady = ring->cachedTail - head;
+  }
+  const size_t m = min_size(n, nReady);
+  if (m == 0) return 0;
+  copy_spsc_ring(ring, head, elements, m, false);
+  atomic_store_explicit(&ring->head, head + m, memory_order_release);
+  return m;
+}
+
+/** return # of elements in ring; may be out of date if called
+ *  concurrently with push or pop.
+ *
+ *  No error return.
+ */
+size_t
+n_elements_spsc_ring(const SpscRing *ring)
+{
+  const size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  const size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  return tail - head;
+}
+
+
+/****************************** MPMC Ring ******************************/
+
+// Slot i has sequence # i when it is ready for the producer of
+// element i and i + 1 when it is ready for the consumer of element i;
+// the consumer then sets it to i + capacity for the next producer.
+// A batch of n elements is claimed by checking that the next n slots
+// are all ready and then advancing tail (or head) by n with a single
+// CAS; since no other thread can claim those slots unless that CAS
+// fails, they stay ready.
+
+enum { SLOT_HDR_SIZE = alignof(max_align_t) };
+static_assert(SLOT_HDR_SIZE >= sizeof(atomic_size_t), "slot header too small");
+
+static inline atomic_size_t *
+slot_seq(const MpmcRing *ring, size_t index)
+{
+  return (atomic_size_t *)
+    &ring->slots[(index & (ring->capacity - 1)) * ring->slotSize];
+}
+
+static inline char *
+slot_element(MpmcRing *ring, size_t index)
+{
+  return &ring->slots[(index & (ring->capacity - 1)) * ring->slotSize
+                      + SLOT_HDR_SIZE];
+}
+
+/** return # of bytes needed for a MpmcRing with capacity elements of
+ *  elementSize bytes.
+ *
+ *  No error return.
+ */
+size_t
+mem_size_mpmc_ring(size_t capacity, size_t elementSize)
+{
+  return sizeof(MpmcRing) +
+    capacity * round_up(SLOT_HDR_SIZE + elementSize, SLOT_HDR_SIZE);
+}
+
+/** initialize mem, which must have at least mem_size_mpmc_ring() bytes
+ *  aligned to CACHE_LINE_SIZE, as a MpmcRing.  Returns the ring; NULL
+ *  if capacity is not a power of 2.
+ */
+MpmcRing *
+init_mpmc_ring(void *mem, size_t capacity, size_t elementSize)
+{
+  if (!is_power_of_2(capacity)) return NULL;
+  assert((uintptr_t)mem % CACHE_LINE_SIZE == 0);
+  MpmcRing *ring = mem;
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  ring->capacity = capacity;
+  ring->elementSize = elementSize;
+  ring->slotSize = round_up(SLOT_HDR_SIZE + elementSize, SLOT_HDR_SIZE);
+  for (size_t i = 0; i < capacity; i++) atomic_init(slot_seq(ring, i), i);
+  return ring;
+}
+
+/** return a malloc()'d MpmcRing; NULL if capacity is not a power of
+ *  2 or on an allocation error.
+ */
+MpmcRing *
+make_mpmc_ring(size_t capacity, size_t elementSize)
+{
+  if (!is_power_of_2(capacity)) return NULL;
+  void *mem = alloc_ring(mem_size_mpmc_ring(capacity, elementSize));
+  return mem ? init_mpmc_ring(mem, capacity, elementSize) : NULL;
+}
+
+/** free ring returned by make_mpmc_ring().
+ *
+ *  No error return.
+ */
+void
+free_mpmc_ring(MpmcRing *ring)
+{
+  free(ring);
+}
+
+/** claim up to n consecutive slots at *index (tail for producers with
+ *  seqOffset 0, head for consumers with seqOffset 1).  Returns # of
+ *  slots claimed, with the first at the returned *pos.
+ */
+static size_t
+claim_slots(MpmcRing *ring, atomic_size_t *index, size_t seqOffset,
+            size_t n, size_t *pos)
+{
+  size_t p = atomic_load_explicit(index, memory_order_relaxed);
+  while (true) {
+    size_t m = 0;
+    for (; m < n; m++) {
+      const size_t seq =
+        atomic_load_explicit(slot_seq(ring, p + m), memory_order_acquire);
+      if (seq != p + m + seqOffset) break;
+    }
+    if (m == 0) {
+      const size_t seq =
+        atomic_load_explicit(slot_seq(ring, p), memory_order_acquire);
+      //full (or empty) if slot is still waiting for the previous lap
+      if ((intptr_t)(seq - (p + seqOffset)) < 0) return 0;
+      p = atomic_load_explicit(index, memory_order_relaxed);
+      continue;
+    }
+    if (atomic_compare_exchange_weak_explicit(index, &p, p + m,
+                                              memory_order_relaxed,
+                                              memory_order_relaxed)) {
+      *pos = p;
+      return m;
+    }
+  }
+}
+
+/** push up to n elements from elements[n] into ring as consecutive
+ *  elements.  Returns # of elements pushed, which is less than n only
+ *  if ring did not have room for all of them.
+ *
+ *  No error return.
+ */
+size_t
+push_mpmc_ring(MpmcRing *ring, const void *elements, size_t n)
+{
+  if (n == 0) return 0;
+  size_t pos;
+  const size_t m = claim_slots(ring, &ring->tail, 0, n, &pos);
+  const char *p = elements;
+  for (size_t i = 0; i < m; i++) {
+    memcpy(slot_element(ring, pos + i), p + i * ring->elementSize,
+           ring->elementSize);
+    atomic_store_explicit(slot_seq(ring, pos + i), pos + i + 1,
+                          memory_order_release);
+  }
+  return m;
+}
+
+/** pop up to n consecutive elements from ring into elements[n].
+ *  Returns # of elements popped, which is less than n only if fewer
+ *  elements were ready.
+ *
+ *  No error return.
+ */
+size_t
+pop_mpmc_ring(MpmcRing *ring, void *elements, size_t n)
+{
+  if (n == 0) return 0;
+  size_t pos;
+  const size_t m = claim_slots(ring, &ring->head, 1, n, &pos);
+  char *p = elements;
+  for (size_t i = 0; i < m; i++) {
+    memcpy(p + i * ring->elementSize, slot_element(ring, pos + i),
+           ring->elementSize);
+    atomic_store_explicit(slot_seq(ring, pos + i), pos + i + ring->capacity,
+                          memory_order_release);
+  }
+  return m;
+}
+
+/** return approximate # of elements in ring.
+ *
+ *  No error return.
+ */
+size_t
+n_elements_mpmc_ring(const MpmcRing *ring)
+{
+  const size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  const size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  return (tail > head) ? tail - head : 0;
+}
+
+
+/**************************** Unit Tests *******************************/
+
+//whitebox testing
+
+#ifdef TEST_RING
+
+#include "unit-test.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static void
+test_spsc_ring(void)
+{
+  CHK(make_spsc_ring(6, sizeof(int)) == NULL, "POWER_OF_2: accepted 6");
+  SpscRing *ring = make_spsc_ring(8, sizeof(int));
+  int in[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 };
+  int out[10];
+  CHKF(pop_spsc_ring(ring, out, 1) == 0, "EMPTY: %d", out[0]);
+  CHKF(push_spsc_ring(ring, in, 10) == 8, "FULL: %zu",
+       n_elements_spsc_ring(ring));
+  CHKF(pop_spsc_ring(ring, out, 5) == 5 && out[4] == 5, "POP5: %d", out[4]);
+  //wraps around end of buffer
+  CHKF(push_spsc_ring(ring, &in[8], 2) == 2, "WRAP_PUSH: %zu",
+       n_elements_spsc_ring(ring));
+  CHKF(pop_spsc_ring(ring, out, 10) == 5, "WRAP_POP: %zu",
+       n_elements_spsc_ring(ring));
+  for (int i = 0; i < 5; i++) {
+    CHKF(out[i] == i + 6, "WRAP_%d: %d", i, out[i]);
+  }
+  free_spsc_ring(ring);
+}
+
+static void
+test_mpmc_ring(void)
+{
+  MpmcRing *ring = make_mpmc_ring(8, sizeof(int));
+  int in[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 };
+  int out[10];
+  CHKF(pop_mpmc_ring(ring, out, 1) == 0, "EMPTY: %d", out[0]);
+  CHKF(push_mpmc_ring(ring, in, 10) == 8, "FULL: %zu",
+       n_elements_mpmc_ring(ring));
+  CHKF(push_mpmc_ring(ring, in, 1) == 0, "PUSH_FULL: %zu",
+       n_elements_mpmc_ring(ring));
+  CHKF(pop_mpmc_ring(ring, out, 5) == 5 && out[4] == 5, "POP5: %d", out[4]);
+  CHKF(push_mpmc_ring(ring, &in[8], 2) == 2, "WRAP_PUSH: %zu",
+       n_elements_mpmc_ring(ring));
+  CHKF(pop_mpmc_ring(ring, out, 10) == 5, "WRAP_POP: %zu",
+       n_elements_mpmc_ring(ring));
+  for (int i = 0; i < 5; i++) {
+    CHKF(out[i] == i + 6, "WRAP_%d: %d", i, out[i]);
+  }
+  free_mpmc_ring(ring);
+}
+
+enum { N_ITEMS = 200000, BATCH = 7 };
+
+static void *
+spsc_producer(void *arg)
+{
+  SpscRing *ring = arg;
+  for (unsigned i = 0; i < N_ITEMS; ) {
+    unsigned batch[BATCH];
+    const unsigned n = (N_ITEMS - i < BATCH) ? N_ITEMS - i : 1 + i % BATCH;
+    for (unsigned j = 0; j < n; j++) batch[j] = i + j;
+    unsigned pushed = 0;
+    while (pushed < n) {
+      const size_t m = push_spsc_ring(ring, &batch[pushed], n - pushed);
+      if (m == 0) sched_yield();
+      pushed += m;
+    }
+    i += n;
+  }
+  return NULL;
+}
+
+/** pop N_ITEMS in order from ring; return # out of order */
+static unsigned
+spsc_consume(SpscRing *ring)
+{
+  unsigned nBad = 0;
+  for (unsigned i = 0; i < N_ITEMS; ) {
+    unsigned batch[BATCH];
+    const size_t m = pop_spsc_ring(ring, batch, BATCH);
+    if (m == 0) sched_yield();
+    for (size_t j = 0; j < m; j++) nBad += (batch[j] != i++);
+  }
+  return nBad;
+}
+
+static void
+test_spsc_threads(void)
+{
+  SpscRing *ring = make_spsc_ring(64, sizeof(unsigned));
+  pthread_t tid;
+  pthread_create(&tid, NULL, spsc_producer, ring);
+  const unsigned nBad = spsc_consume(ring);
+  pthread_join(tid, NULL);
+  CHKF(nBad == 0, "SPSC_THREADS: %u out of order", nBad);
+  free_spsc_ring(ring);
+}
+
+static void
+test_spsc_processes(void)
+{
+  const size_t size = mem_size_spsc_ring(64, sizeof(unsigned));
+  void *mem = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS,
+                   -1, 0);
+  CHK(mem != MAP_FAILED, "MMAP: failed");
+  SpscRing *ring = init_spsc_ring(mem, 64, sizeof(unsigned));
+  const pid_t pid = fork();
+  if (pid == 0) {
+    spsc_producer(ring);
+    _exit(0);
+  }
+  const unsigned nBad = spsc_consume(ring);
+  int status;
+  waitpid(pid, &status, 0);
+  CHKF(nBad == 0 && WIFEXITED(status), "SPSC_PROCESSES: %u out of order",
+       nBad);
+  munmap(mem, size);
+}
+
+enum { N_PRODUCERS = 3, N_CONSUMERS = 3 };
+
+typedef struct {
+  unsigned producer;
+  unsigned i;
+} Item;
+
+typedef struct {
+  MpmcRing *ring;
+  unsigned id;
+  atomic_uint *nConsumed;
+  unsigned nBad;
+  uint64_t sum;
+} MpmcArg;
+
+static void *
+mpmc_producer(void *arg)
+{
+  MpmcArg *mpmcArg = arg;
+  for (unsigned i = 0; i < N_ITEMS; ) {
+    Item batch[BATCH];
+    const unsigned n = (N_ITEMS - i < BATCH) ? N_ITEMS - i : 1 + i % BATCH;
+    for (unsigned j = 0; j < n; j++) {
+      batch[j] = (Item) { .producer = mpmcArg->id, .i = i + j };
+    }
+    unsigned pushed = 0;
+    while (pushed < n) {
+      const size_t m = push_mpmc_ring(mpmcArg->ring, &batch[pushed],
+                                      n - pushed);
+      if (m == 0) sched_yield();
+      pushed += m;
+    }
+    i += n;
+  }
+  return NULL;
+}
+
+static void *
+mpmc_consumer(void *arg)
+{
+  MpmcArg *mpmcArg = arg;
+  //each producer's items are seen in increasing order by each consumer
+  long last[N_PRODUCERS];
+  for (int p = 0; p < N_PRODUCERS; p++) last[p] = -1;
+  while (atomic_load(mpmcArg->nConsumed) < N_PRODUCERS * N_ITEMS) {
+    Item batch[BATCH];
+    const size_t m = pop_mpmc_ring(mpmcArg->ring, batch, BATCH);
+    if (m == 0) {
+      sched_yield();
+      continue;
+    }
+    atomic_fetch_add(mpmcArg->nConsumed, m);
+    for (size_t j = 0; j < m; j++) {
+      const Item *item = &batch[j];
+      if (item->producer >= N_PRODUCERS || item->i <= last[item->producer]) {
+        mpmcArg->nBad++;
+        continue;
+      }
+      last[item->producer] = item->i;
+      mpmcArg->sum += item->i;
+    }
+  }
+  return NULL;
+}
+
+static void
+test_mpmc_threads(void)
+{
+  MpmcRing *ring = make_mpmc_ring(64, sizeof(Item));
+  atomic_uint nConsumed = 0;
+  pthread_t tids[N_PRODUCERS + N_CONSUMERS];
+  MpmcArg args[N_PRODUCERS + N_CONSUMERS];
+  for (unsigned t = 0; t < N_PRODUCERS + N_CONSUMERS; t++) {
+    args[t] = (MpmcArg) {
+      .ring = ring, .id = t, .nConsumed = &nConsumed,
+    };
+    pthread_create(&tids[t], NULL,
+                   (t < N_PRODUCERS) ? mpmc_producer : mpmc_consumer,
+                   &args[t]);
+  }
+  unsigned nBad = 0;
+  uint64_t sum = 0;
+  for (unsigned t = 0; t < N_PRODUCERS + N_CONSUMERS; t++) {
+    pthread_join(tids[t], NULL);
+    nBad += args[t].nBad;
+    sum += args[t].sum;
+  }
+  const uint64_t expected = N_PRODUCERS * ((uint64_t)N_ITEMS*(N_ITEMS - 1)/2);
+  CHKF(nBad == 0, "MPMC_ORDER: %u bad", nBad);
+  CHKF(sum == expected, "MPMC_SUM: %llu != %llu", (unsigned long long)sum,
+       (unsigned long long)expected);
+  CHKF(n_elements_mpmc_ring(ring) == 0, "MPMC_EMPTY: %zu",
+       n_elements_mpmc_ring(ring));
+  free_mpmc_ring(ring);
+}
+
+int
+main()
+{
+  test_spsc_ring();
+  test_mpmc_ring();
+  test_spsc_threads();
+  test_spsc_processes();
+  test_mpmc_threads();
+}
+
+#endif //#ifdef TEST_RING
@@ -0,0 +1,160 @@
+#ifndef RING_H_
+#define RING_H_
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/** Bounded lock-free ring buffers of fixed-size elements for handing
+ *  work between threads or processes:
+ *
+ *    SpscRing: a single producer and a single consumer;
+ *    MpmcRing: any number of producers and consumers.
+ *
+ *  Push and pop never block: they transfer as many of the requested
+ *  elements as possible and return the # transferred, so that
+ *  clients choose how to wait (spin, yield, sleep or a semaphore).
+ *
+ *  A ring contains no pointers, so it can be placed in memory shared
+ *  between processes (for example, from mmap() with MAP_SHARED): use
+ *  mem_size_*_ring() to size the memory and init_*_ring() to
+ *  initialize it.  Alternately, make_*_ring() allocates a ring using
+ *  malloc().  The capacity of a ring must be a power of 2.
+ */
+
+/** size of a cache line; fields written by different threads are
+ *  kept on different cache lines.
+ */
+#define CACHE_LINE_SIZE 64
+
+
+/****************************** SPSC Ring ******************************/
+
+// note that clients should regard the insides of this struct as
+// private.
+typedef struct {
+  //written by consumer
+  alignas(CACHE_LINE_SIZE) atomic_size_t head;  /** index of next pop */
+  size_t cachedTail;    /** consumer's last view of tail */
+  //written by producer
+  alignas(CACHE_LINE_SIZE) atomic_size_t tail;  /** index of next push */
+  size_t cachedHead;    /** producer's last view of head */
+  //read-only after initialization
+  alignas(CACHE_LINE_SIZE) size_t capacity;
+  size_t elementSize;
+  alignas(CACHE_LINE_SIZE) char elements[];     /** [capacity][elementSize] */
+} SpscRing;
+
+/** return # of bytes needed for a SpscRing with capacity elements of
+ *  elementSize bytes.
+ *
+ *  No error return.
+ */
+size_t mem_size_spsc_ring(size_t capacity, size_t elementSize);
+
+/** initialize mem, which must have at least mem_size_spsc_ring() bytes
+ *  aligned to CACHE_LINE_SIZE, as a SpscRing.  Returns the ring; NULL
+ *  if capacity is not a power of 2.
+ */
+SpscRing *init_spsc_ring(void *mem, size_t capacity, size_t elementSize);
+
+/** return a malloc()'d SpscRing; NULL if capacity is not a power of
+ *  2 or on an allocation error.
+ */
+SpscRing *make_spsc_ring(size_t capacity, size_t elementSize);
+
+/** free ring returned by make_spsc_ring().
+ *
+ *  No error return.
+ */
+void free_spsc_ring(SpscRing *ring);
+
+/** push up to n elements from elements[n] into ring; may only be
+ *  called by the producer.  Returns # of elements pushed, which is
+ *  less than n only if ring became full.
+ *
+ *  No error return.
+ */
+size_t push_spsc_ring(SpscRing *ring, const void *elements, size_t n);
+
+/** pop up to n elements from ring into elements[n]; may only be called
+ *  by the consumer.  Returns # of elements popped, which is less than
+ *  n only if ring became empty.
+ *
+ *  No error return.
+ */
+size_t pop_spsc_ring(SpscRing *ring, void *elements, size_t n);
+
+/** return # of elements in ring; may be out of date if called
+ *  concurrently with push or pop.
+ *
+ *  No error return.
+ */
+size_t n_elements_spsc_ring(const SpscRing *ring);
+
+
+/****************************** MPMC Ring ******************************/
+
+// Each slot has a sequence # which tells producers and consumers
+// whether it is ready for them (Vyukov's bounded MPMC queue).
+
+// note that clients should regard the insides of this struct as
+// private.
+typedef struct {
+  alignas(CACHE_LINE_SIZE) atomic_size_t head;  /** index of next pop */
+  alignas(CACHE_LINE_SIZE) atomic_size_t tail;  /** index of next push */
+  //read-only after initialization
+  alignas(CACHE_LINE_SIZE) size_t capacity;
+  size_t elementSize;
+  size_t slotSize;      /** # of bytes for sequence # and element */
+  alignas(CACHE_LINE_SIZE) char slots[];        /** [capacity][slotSize] */
+} MpmcRing;
+
+/** return # of bytes needed for a MpmcRing with capacity elements of
+ *  elementSize bytes.
+ *
+ *  No error return.
+ */
+size_t mem_size_mpmc_ring(size_t capacity, size_t elementSize);
+
+/** initialize mem, which must have at least mem_size_mpmc_ring() bytes
+ *  aligned to CACHE_LINE_SIZE, as a MpmcRing.  Returns the ring; NULL
+ *  if capacity is not a power of 2.
+ */
+MpmcRing *init_mpmc_ring(void *mem, size_t capacity, size_t elementSize);
+
+/** return a malloc()'d MpmcRing; NULL if capacity is not a power of
+ *  2 or on an allocation error.
+ */
+MpmcRing *make_mpmc_ring(size_t capacity, size_t elementSize);
+
+/** free ring returned by make_mpmc_ring().
+ *
+ *  No error return.
+ */
+void free_mpmc_ring(MpmcRing *ring);
+
+/** push up to n elements from elements[n] into ring as consecutive
+ *  elements.  Returns # of elements pushed, which is less than n only
+ *  if ring did not have room for all of them.
+ *
+ *  No error return.
+ */
+size_t push_mpmc_ring(MpmcRing *ring, const void *elements, size_t n);
+
+/** pop up to n consecutive elements from ring into elements[n].
+ *  Returns # of elements popped, which is less than n only if fewer
+ *  elements were ready.
+ *
+ *  No error return.
+ */
+size_t pop_mpmc_ring(MpmcRing *ring, void *elements, size_t n);
+
+/** return approximate # of elements in ring.
+ *
+ *  No error return.
+ */
+size_t n_elements_mpmc_ring(const MpmcRing *ring);
+
+#endif //#ifndef RING_H_
@@ -0,0 +1,545 @@
+#include "slab.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Slab allocation of fixed-size objects.  A SlabPool carves objects
+ *  of a single size out of large slabs obtained from malloc(), and
+ *  recycles freed objects for later allocations of the same size
+ *  rather than returning them to malloc().  Slabs are only released
+ *  when the pool is freed.
+ *
+ *  Each thread using a pool has a small magazine of free objects from
+ *  which it allocates and to which it frees without locking; the pool
+ *  is locked only to move a batch of objects between a magazine and
+ *  the pool.
+ */
+
+// Free objects in the pool are kept in a singly-linked list threaded
+// through their first word.  A thread's magazine is found using
+// pthread_getspecific() and is returned to the pool by the key's
+// destructor when the thread exits.  Counts in a magazine are only
+// written by its thread; they are atomic only so that stats can be
+// read by other threads.
+
+enum {
+  SLAB_SIZE = 16*1024,          //default # of bytes in a slab
+  MIN_OBJS_PER_SLAB = 8,
+  MAGAZINE_SIZE = 32,           //max # of objects cached by a thread
+  MAGAZINE_BATCH = MAGAZINE_SIZE/2, //# of objects moved at a time
+};
+
+enum { OBJ_ALIGN = alignof(max_align_t) };
+
+typedef struct _Slab {
+  struct _Slab *next;
+  alignas(max_align_t) char objs[];
+} Slab;
+
+struct _SlabMagazine {
+  SlabPool *pool;
+  SlabMagazine *next;           //next magazine for pool
+  atomic_size_t nAllocs;
+  atomic_size_t nFrees;
+  size_t nObjs;                 //# of objects in objs[]
+  void *objs[MAGAZINE_SIZE];
+};
+
+static inline void *
+pop_obj(void **list)
+{
+  void *obj = *list;
+  *list = *(void **)obj;
+  return obj;
+}
+
+static inline void
+push_obj(void **list, void *obj)
+{
+  *(void **)obj = *list;
+  *list = obj;
+}
+
+/** increment counter which is only written by the calling thread */
+static inline void
+incr_owned(atomic_size_t *counter)
+{
+  atomic_store_explicit(counter,
+                        atomic_load_explicit(counter, memory_order_relaxed) + 1,
+                        memory_order_relaxed);
+}
+
+/** add a new slab to pool's free objects; pool must be locked */
+static int
+add_slab_locked(SlabPool *pool)
+{
+  Slab *slab = malloc(sizeof(Slab) + pool->nObjsPerSlab * pool->objSize);
+  if (!slab) return 1;
+  slab->next = pool->slabs; pool->slabs = slab;
+  for (size_t i = pool->nObjsPerSlab; i > 0; i--) {
+    push_obj(&pool->freeObjs, &slab->objs[(i - 1) * pool->objSize]);
+  }
+  pool->nSlabs++;
+  return 0;
+}
+
+/** move n objects from mag to pool; pool must be locked */
+static void
+flush_locked(SlabPool *pool, SlabMagazine *mag, size_t n)
+{
+  assert(n <= mag->nObjs);
+  for (size_t i = 0; i < n; i++) {
+    push_obj(&pool->freeObjs, mag->objs[--mag->nObjs]);
+  }
+}
+
+/** destructor for pool->key: return mag's objects and counts to its
+ *  pool when its thread exits.
+ */
+static void
+release_magazine(void *arg)
+{
+  SlabMagazine *mag = arg;
+  SlabPool *pool = mag->pool;
+  pthread_mutex_lock(&pool->lock);
+  flush_locked(pool, mag, mag->nObjs);
+  atomic_fetch_add_explicit(&pool->nAllocs, mag->nAllocs, memory_order_relaxed);
+  atomic_fetch_add_explicit(&pool->nFrees, mag->nFrees, memory_order_relaxed);
+  for (SlabMagazine **p = &pool->magazines; *p != NULL; p = &(*p)->next) {
+    if (*p == mag) {
+      *p = mag->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  free(mag);
+}
+
+/** return calling thread's magazine for pool, creating it if
+ *  necessary.  NULL if it cannot be created.
+ */
+static SlabMagazine *
+get_magazine(SlabPool *pool)
+{
+  SlabMagazine *mag = pthread_getspecific(pool->key);
+  if (mag) return mag;
+  mag = calloc(1, sizeof(SlabMagazine));
+  if (!mag) return NULL;
+  mag->pool = pool;
+  pthread_mutex_lock(&pool->lock);
+  mag->next = pool->magazines; pool->magazines = mag;
+  pthread_mutex_unlock(&pool->lock);
+  if (pthread_setspecific(pool->key, mag) != 0) {
+    release_magazine(mag);
+    return NULL;
+  }
+  return mag;
+}
+
+/** initialize pool for objects of objSize bytes.  Objects are
+ *  aligned to alignof(max_align_t).
+ */
+int
+init_slab_pool(SlabPool *pool, size_t objSize)
+{
+  const size_t size = (objSize == 0)
+    ? OBJ_ALIGN : (objSize + OBJ_ALIGN - 1) / OBJ_ALIGN * OBJ_ALIGN;
+  size_t nObjsPerSlab = (SLAB_SIZE - sizeof(Slab)) / size;
+  if (nObjsPerSlab < MIN_OBJS_PER_SLAB) nObjsPerSlab = MIN_OBJS_PER_SLAB;
+  *pool = (SlabPool) { .objSize = size, .nObjsPerSlab = nObjsPerSlab, };
+  if (pthread_key_create(&pool->key, release_magazine) != 0) return 1;
+  if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+    pthread_key_delete(pool->key);
+    return 1;
+  }
+  return 0;
+}
+
+/** free all memory used by pool, including all objects allocated from
+ *  it.  *MUST* be called when pool is no longer needed, and only when
+ *  no other thread is using it.  Does not free the pool structure
+ *  itself.
+ *
+ *  No error return.
+ */
+void
+free_slab_pool(SlabPool *pool)
+{
+  //deleting the key ensures that no destructor will run for the
+  //magazines freed below
+  pthread_key_delete(pool->key);
+  SlabMagazine *nextMag;
+  for (SlabMagazine *mag = pool->magazines; mag != NULL; mag = nextMag) {
+    nextMag = mag->next;
+    free(mag);
+  }
+  Slab *nextSlab;
+  for (Slab *slab = pool->slabs; slab != NULL; slab = nextSlab) {
+    nextSlab = slab->next;
+    free(slab);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  *pool = (SlabPool) { .objSize = pool->objSize };
+}
+
+/** return an object from pool; NULL on an allocation error */
+void *
+alloc_slab_pool(SlabPool *pool)
+{
+  SlabMagazine *mag = get_magazine(pool);
+  if (mag && mag->nObjs > 0) {
+    incr_owned(&mag->nAllocs);
+    return mag->objs[--mag->nObjs];
+  }
+  void *obj = NULL;
+  pthread_mutex_lock(&pool->lock);
+  if (pool->freeObjs == NULL && add_slab_locked(pool) != 0) goto UNLOCK;
+  if (!mag) {
+    //cannot use a magazine; allocate directly from pool
+    obj = pop_obj(&pool->freeObjs);
+    atomic_fetch_add_explicit(&pool->nAllocs, 1, memory_order_relaxed);
+    goto UNLOCK;
+  }
+  while (mag->nObjs < MAGAZINE_BATCH && pool->freeObjs != NULL) {
+    mag->objs[mag->nObjs++] = pop_obj(&pool->freeObjs);
+  }
+  obj = mag->objs[--mag->nObjs];
+  incr_owned(&mag->nAllocs);
+ UNLOCK:
+  pthread_mutex_unlock(&pool->lock);
+  return obj;
+}
+
+/** return obj, which must have been allocated from pool, to pool.
+ *
+ *  No error return.
+ */
+void
+dealloc_slab_pool(SlabPool *pool, void *obj)
+{
+  SlabMagazine *mag = get_magazine(pool);
+  if (!mag) {
+    pthread_mutex_lock(&pool->lock);
+    push_obj(&pool->freeObjs, obj);
+    atomic_fetch_add_explicit(&pool->nFrees, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&pool->lock);
+    return;
+  }
+  if (mag->nObjs == MAGAZINE_SIZE) {
+    pthread_mutex_lock(&pool->lock);
+    flush_locked(pool, mag, MAGAZINE_BATCH);
+    pthread_mutex_unlock(&pool->lock);
+  }
+  mag->objs[mag->nObjs++] = obj;
+  incr_owned(&mag->nFrees);
+}
+
+/** set *stats to statistics for pool.  Counts maintained by other
+ *  threads may be slightly out of date.
+ *
+ *  No error return.
+ */
+void
+stats_slab_pool(SlabPool *pool, SlabStats *stats)
+{
+  pthread_mutex_lock(&pool->lock);
+  size_t nAllocs = atomic_load_explicit(&pool->nAllocs, memory_order_relaxed);
+  size_t nFrees = atomic_load_explicit(&pool->nFrees, memory_order_relaxed);
+  for (const SlabMagazine *mag = pool->magazines; mag != NULL;
+       mag = mag->next) {
+    nAllocs += atomic_load_explicit(&mag->nAllocs, memory_order_relaxed);
+    nFrees += atomic_load_explicit(&mag->nFrees, memory_order_relaxed);
+  }
+  *stats = (SlabStats) {
+    .nSlabs = pool->nSlabs,
+    .nSlabBytes =
+      pool->nSlabs * (sizeof(Slab) + pool->nObjsPerSlab * pool->objSize),
+    .nAllocs = nAllocs,
+    .nFrees = nFrees,
+    .nInUse = nAllocs - nFrees,
+  };
+  pthread_mutex_unlock(&pool->lock);
+}
+
+
+/*************************** Slab Allocator ****************************/
+
+static const size_t SIZE_CLASSES[] = { SLAB_SIZE_CLASSES };
+
+static_assert(sizeof(SIZE_CLASSES)/sizeof(SIZE_CLASSES[0]) ==
+              N_SLAB_SIZE_CLASSES, "N_SLAB_SIZE_CLASSES inconsistent");
+
+/** return index in SIZE_CLASSES[] of smallest class >= size, where
+ *  0 < size <= MAX_SLAB_SIZE_CLASS.
+ */
+static inline unsigned
+size_class(size_t size)
+{
+  //classes are 16, 32, 48, 64, and then alternately 1.5 * 2^b and
+  //2^(b + 1) for b >= 6
+  if (size <= 64) return (size == 0) ? 0 : (size - 1) / 16;
+  const unsigned b = 63 - __builtin_clzll(size - 1);  //2^b < size <= 2^(b+1)
+  return 4 + 2*(b - 6) + (size > ((size_t)3 << (b - 1)));
+}
+
+/** initialize allocator.  No memory is allocated until the first
+ *  allocation.
+ */
+int
+init_slab_allocator(SlabAllocator *allocator)
+{
+  atomic_init(&allocator->nLarge, 0);
+  for (unsigned i = 0; i < N_SLAB_SIZE_CLASSES; i++) {
+    if (init_slab_pool(&allocator->pools[i], SIZE_CLASSES[i]) != 0) {
+      while (i-- > 0) free_slab_pool(&allocator->pools[i]);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/** free all memory used by allocator, including all objects allocated
+ *  from its pools, but not objects larger than MAX_SLAB_SIZE_CLASS.
+ *  *MUST* be called when allocator is no longer needed, and only when
+ *  no other thread is using it.  Does not free the allocator
+ *  structure itself.
+ *
+ *  No error return.
+ */
+void
+free_slab_allocator(SlabAllocator *allocator)
+{
+  for (unsigned i = 0; i < N_SLAB_SIZE_CLASSES; i++) {
+    free_slab_pool(&allocator->pools[i]);
+  }
+}
+
+/** return size bytes from the pool for the smallest size class which
+ *  can hold size, or from malloc() if size > MAX_SLAB_SIZE_CLASS.
+ *  NULL on an allocation error.
+ */
+void *
+alloc_slab_allocator(SlabAllocator *allocator, size_t size)
+{
+  if (size > MAX_SLAB_SIZE_CLASS) {
+    atomic_fetch_add_explicit(&allocator->nLarge, 1, memory_order_relaxed);
+    return malloc(size);
+  }
+  return alloc_slab_pool(&allocator->pools[size_class(size)]);
+}
+
+/** return ptr, which must have been returned by
+ *  alloc_slab_allocator() for the same size, to allocator.  ptr may
+ *  be NULL.
+ *
+ *  No error return.
+ */
+void
+dealloc_slab_allocator(SlabAllocator *allocator, void *ptr, size_t size)
+{
+  if (ptr == NULL) return;
+  if (size > MAX_SLAB_SIZE_CLASS) {
+    free(ptr);
+  }
+  else {
+    dealloc_slab_pool(&allocator->pools[size_class(size)], ptr);
+  }
+}
+
+/** set *stats to the sum of the statistics for all pools in
+ *  allocator, together with the # of large allocations.
+ *
+ *  No error return.
+ */
+void
+stats_slab_allocator(SlabAllocator *allocator, SlabStats *stats)
+{
+  *stats = (SlabStats) {
+    .nLarge = atomic_load_explicit(&allocator->nLarge, memory_order_relaxed),
+  };
+  for (unsigned i = 0; i < N_SLAB_SIZE_CLASSES; i++) {
+    SlabStats poolStats;
+    stats_slab_pool(&allocator->pools[i], &poolStats);
+    stats->nSlabs += poolStats.nSlabs;
+    stats->nSlabBytes += poolStats.nSlabBytes;
+    stats->nAllocs += poolStats.nAllocs;
+    stats->nFrees += poolStats.nFrees;
+    stats->nInUse += poolStats.nInUse;
+  }
+}
+
+
+/**************************** Unit Tests *******************************/
+
+//whitebox testing
+
+#ifdef TEST_SLAB
+
+#include "unit-test.h"
+
+#include <stdio.h>
+
+static void
+test_slab_pool(void)
+{
+  SlabPool pool;
+  CHK(init_slab_pool(&pool, 24) == 0, "INIT: cannot init pool");
+  CHKF(pool.objSize % OBJ_ALIGN == 0 && pool.objSize >= 24, "OBJ_SIZE: %zu",
+       pool.objSize);
+  enum { N = 1000 };
+  static char *objs[N];
+  for (int round = 0; round < 3; round++) {
+    for (int i = 0; i < N; i++) {
+      objs[i] = alloc_slab_pool(&pool);
+      CHKF(objs[i] != NULL, "ALLOC_%d: NULL", i);
+      CHKF((uintptr_t)objs[i] % OBJ_ALIGN == 0, "ALIGN_%d: %p", i,
+           (void *)objs[i]);
+      snprintf(objs[i], 24, "obj-%d", i);
+    }
+    for (int i = 0; i < N; i++) {
+      char expected[24];
+      snprintf(expected, sizeof(expected), "obj-%d", i);
+      CHKF(strcmp(objs[i], expected) == 0, "CONTENTS_%d: %s", i, objs[i]);
+    }
+    SlabStats stats;
+    stats_slab_pool(&pool, &stats);
+    CHKF(stats.nInUse == N, "N_IN_USE_%d: %zu", round, stats.nInUse);
+    const size_t nSlabs = stats.nSlabs;
+    //free in a different order from allocation
+    for (int i = 0; i < N; i += 2) dealloc_slab_pool(&pool, objs[i]);
+    for (int i = 1; i < N; i += 2) dealloc_slab_pool(&pool, objs[i]);
+    stats_slab_pool(&pool, &stats);
+    CHKF(stats.nInUse == 0, "N_IN_USE_FREED_%d: %zu", round, stats.nInUse);
+    CHKF(stats.nAllocs == (round + 1) * N, "N_ALLOCS_%d: %zu", round,
+         stats.nAllocs);
+    CHKF(stats.nSlabs == nSlabs, "N_SLABS_%d: %zu != %zu", round,
+         stats.nSlabs, nSlabs);
+    CHKF(stats.nSlabs <= N / pool.nObjsPerSlab + 2, "SLAB_REUSE_%d: %zu",
+         round, stats.nSlabs);
+  }
+  free_slab_pool(&pool);
+}
+
+static void
+test_size_class(void)
+{
+  for (size_t size = 1; size <= MAX_SLAB_SIZE_CLASS; size++) {
+    unsigned i = 0;
+    while (SIZE_CLASSES[i] < size) i++;
+    CHKF(size_class(size) == i, "SIZE_CLASS: %zu: %u != %u", size,
+         size_class(size), i);
+  }
+}
+
+static void
+test_slab_allocator(void)
+{
+  SlabAllocator allocator;
+  CHK(init_slab_allocator(&allocator) == 0, "INIT: cannot init allocator");
+  enum { N = 200 };
+  static char *ptrs[N];
+  for (int i = 0; i < N; i++) {
+    const size_t size = 1 + i * 17;
+    ptrs[i] = alloc_slab_allocator(&allocator, size);
+    CHKF(ptrs[i] != NULL, "ALLOC_%d: NULL", i);
+    memset(ptrs[i], i, size);
+  }
+  for (int i = 0; i < N; i++) {
+    const size_t size = 1 + i * 17;
+    CHKF(ptrs[i][size - 1] == (char)i, "CONTENTS_%d: %d", i,
+         ptrs[i][size - 1]);
+    dealloc_slab_allocator(&allocator, ptrs[i], size);
+  }
+  SlabStats stats;
+  stats_slab_allocator(&allocator, &stats);
+  const size_t nLarge = (N - 1) - (MAX_SLAB_SIZE_CLASS - 1) / 17;
+  CHKF(stats.nLarge == nLarge, "N_LARGE: %zu != %zu", stats.nLarge, nLarge);
+  CHKF(stats.nAllocs + stats.nLarge == N, "N_ALLOCS: %zu", stats.nAllocs);
+  CHKF(stats.nInUse == 0, "N_IN_USE: %zu", stats.nInUse);
+  free_slab_allocator(&allocator);
+}
+
+enum { N_THREADS = 4, N_THREAD_OBJS = 300, N_THREAD_ROUNDS = 50 };
+
+typedef struct {
+  SlabAllocator *allocator;
+  int id;
+  void *kept[N_THREAD_OBJS];      //left allocated for main to free
+} ThreadArg;
+
+static void *
+churn(void *arg)
+{
+  ThreadArg *threadArg = arg;
+  void *objs[N_THREAD_OBJS];
+  for (int round = 0; round < N_THREAD_ROUNDS; round++) {
+    for (int i = 0; i < N_THREAD_OBJS; i++) {
+      const size_t size = 8 + (i * 37 + threadArg->id) % 500;
+      objs[i] = alloc_slab_allocator(threadArg->allocator, size);
+      if (!objs[i]) return arg;
+      memset(objs[i], threadArg->id, size);
+    }
+    if (round == N_THREAD_ROUNDS - 1) {
+      memcpy(threadArg->kept, objs, sizeof(objs));
+      break;
+    }
+    for (int i = N_THREAD_OBJS - 1; i >= 0; i--) {
+      const size_t size = 8 + (i * 37 + threadArg->id) % 500;
+      if (*(char *)objs[i] != threadArg->id) return arg;
+      dealloc_slab_allocator(threadArg->allocator, objs[i], size);
+    }
+  }
+  return NULL;
+}
+
+static void
+test_threads_slab_allocator(void)
+{
+  SlabAllocator allocator;
+  init_slab_allocator(&allocator);
+  pthread_t tids[N_THREADS];
+  static ThreadArg args[N_THREADS];
+  for (int t = 0; t < N_THREADS; t++) {
+    args[t] = (ThreadArg) { .allocator = &allocator, .id = t + 1 };
+    CHKF(pthread_create(&tids[t], NULL, churn, &args[t]) == 0,
+         "CREATE_%d: failed", t);
+  }
+  for (int t = 0; t < N_THREADS; t++) {
+    void *ret;
+    pthread_join(tids[t], &ret);
+    CHKF(ret == NULL, "THREAD_%d: failed", t);
+  }
+  SlabStats stats;
+  stats_slab_allocator(&allocator, &stats);
+  CHKF(stats.nInUse == N_THREADS * N_THREAD_OBJS, "THREADS_IN_USE: %zu",
+       stats.nInUse);
+  //free objects allocated by exited threads
+  for (int t = 0; t < N_THREADS; t++) {
+    for (int i = 0; i < N_THREAD_OBJS; i++) {
+      const size_t size = 8 + (i * 37 + args[t].id) % 500;
+      dealloc_slab_allocator(&allocator, args[t].kept[i], size);
+    }
+  }
+  stats_slab_allocator(&allocator, &stats);
+  CHKF(stats.nInUse == 0, "THREADS_FREED: %zu", stats.nInUse);
+  CHKF(stats.nAllocs == N_THREADS * N_THREAD_OBJS * N_THREAD_ROUNDS,
+       "THREADS_N_ALLOCS: %zu", stats.nAllocs);
+  free_slab_allocator(&allocator);
+}
+
+int
+main()
+{
+  test_slab_pool();
+  test_size_class();
+  test_slab_allocator();
+  test_threads_slab_allocator();
+}
+
+#endif //#ifdef TEST_SLAB
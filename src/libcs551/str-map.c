@@ -0,0 +1,394 @@
+#include "str-map.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Hash map from NUL-terminated string keys to void * values using
+ *  open addressing with Robin Hood probing: entries are kept in a
+ *  single array, and each lookup scans a short run of adjacent
+ *  entries, comparing stored hashes before comparing keys.
+ *
+ *  Keys are not copied: a key must remain valid and unchanged while
+ *  it is in the map.
+ *
+ *  Optionally, a map can be case-insensitive, in which case keys are
+ *  hashed and compared ignoring ASCII case.
+ */
+
+// An entry is stored at or after its home slot hash & (capacity - 1).
+// On insertion, an entry which is further from its home than the
+// entry occupying a slot takes that slot, and the displaced entry
+// continues probing ("robbing the rich").  This keeps probe sequences
+// short and lets a failed lookup stop as soon as it sees an entry
+// closer to its home than the key being looked up would be.  Removal
+// shifts the following displaced entries back by one, so no
+// tombstones are needed.
+
+enum { INIT_CAPACITY = 16 };
+
+//max load factor is MAX_LOAD_NUM/MAX_LOAD_DENOM
+enum { MAX_LOAD_NUM = 7, MAX_LOAD_DENOM = 8 };
+
+static inline uint8_t
+fold(uint8_t c, bool ignoreCase)
+{
+  return (ignoreCase && c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+/** murmur3 finalizer to spread FNV bits into the low bits used for
+ *  slot selection.
+ */
+static uint64_t
+mix_hash(uint64_t h)
+{
+  h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/** return the hash of key used by map.  The result can be passed to
+ *  the *_hashed_str_map() routines to avoid rehashing a key which is
+ *  looked up repeatedly, possibly in several maps having the same
+ *  case sensitivity.
+ *
+ *  No error return.
+ */
+uint64_t
+hash_str_map(const StrMap *map, const char *key)
+{
+  const bool ignoreCase = map->ignoreCase;
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (const uint8_t *p = (const uint8_t *)key; *p != '\0'; p++) {
+    h ^= fold(*p, ignoreCase);
+    h *= 0x100000001b3ULL;
+  }
+  return mix_hash(h);
+}
+
+static bool
+is_equal_key(const StrMap *map, const char *key1, const char *key2)
+{
+  if (!map->ignoreCase) return strcmp(key1, key2) == 0;
+  const uint8_t *p1 = (const uint8_t *)key1;
+  const uint8_t *p2 = (const uint8_t *)key2;
+  for (; *p1 != '\0'; p1++, p2++) {
+    if (fold(*p1, true) != fold(*p2, true)) return false;
+  }
+  return *p2 == '\0';
+}
+
+/** initialize map, ignoring ASCII case of keys if ignoreCase.
+ *  No memory is allocated until the first key is added.
+ *
+ *  No error return.
+ */
+void
+init_str_map(StrMap *map, bool ignoreCase)
+{
+  *map = (StrMap) { .ignoreCase = ignoreCase };
+}
+
+/** free all dynamic memory used by map.  *MUST* be called when map is
+ *  no longer needed.  Does not free the keys or values, nor the map
+ *  structure itself.
+ *
+ *  No error return.
+ */
+void
+free_str_map(StrMap *map)
+{
+  free(map->entries);
+  init_str_map(map, map->ignoreCase);
+}
+
+/** remove all keys from map, retaining its memory for reuse.
+ *
+ *  No error return.
+ */
+void
+clear_str_map(StrMap *map)
+{
+  if (map->capacity > 0) {
+    memset(map->entries, 0, map->capacity * sizeof(StrMapEntry));
+  }
+  map->nEntries = 0;
+}
+
+/** return entry for key in map; NULL if none */
+static StrMapEntry *
+find_entry(const StrMap *map, const char *key, uint64_t hash)
+{
+  if (map->capacity == 0) return NULL;
+  const size_t mask = map->capacity - 1;
+  const uint32_t hash32 = (uint32_t)hash;
+  for (size_t i = hash & mask, dist = 1; true; i = (i + 1) & mask, dist++) {
+    StrMapEntry *entry = &map->entries[i];
+    if (entry->dist < dist) return NULL;  //includes empty slot
+    if (entry->hash == hash32 && is_equal_key(map, entry->key, key)) {
+      return entry;
+    }
+  }
+}
+
+/** insert entry, which must not already be present, into
+ *  entries[mask + 1] which must have an empty slot.
+ */
+static void
+insert_entry(StrMapEntry entries[], size_t mask, StrMapEntry entry)
+{
+  entry.dist = 1;
+  for (size_t i = entry.hash & mask; true; i = (i + 1) & mask, entry.dist++) {
+    StrMapEntry *slot = &entries[i];
+    if (slot->dist == 0) {
+      *slot = entry;
+      return;
+    }
+    if (slot->dist < entry.dist) {
+      const StrMapEntry displaced = *slot;
+      *slot = entry;
+      entry = displaced;
+    }
+  }
+}
+
+static int
+grow_map(StrMap *map)
+{
+  const size_t capacity =
+    (map->capacity == 0) ? INIT_CAPACITY : 2 * map->capacity;
+  if (capacity > SIZE_MAX / sizeof(StrMapEntry)) return 1;
+  StrMapEntry *entries = calloc(capacity, sizeof(StrMapEntry));
+  if (!entries) return 1;
+  for (size_t i = 0; i < map->capacity; i++) {
+    if (map->entries[i].dist != 0) {
+      insert_entry(entries, capacity - 1, map->entries[i]);
+    }
+  }
+  free(map->entries);
+  map->entries = entries; map->capacity = capacity;
+  return 0;
+}
+
+/** set the value of key in map to value, adding key if not already
+ *  present.  If key is already present, the key originally added is
+ *  retained.
+ */
+int
+put_str_map(StrMap *map, const char *key, void *value)
+{
+  return put_hashed_str_map(map, key, hash_str_map(map, key), value);
+}
+
+/** put_str_map() with precomputed hash == hash_str_map(map, key) */
+int
+put_hashed_str_map(StrMap *map, const char *key, uint64_t hash, void *value)
+{
+  StrMapEntry *entry = find_entry(map, key, hash);
+  if (entry) {
+    entry->value = value;
+    return 0;
+  }
+  if ((map->nEntries + 1) * MAX_LOAD_DENOM > map->capacity * MAX_LOAD_NUM &&
+      grow_map(map) != 0) {
+    return 1;
+  }
+  insert_entry(map->entries, map->capacity - 1,
+               (StrMapEntry) { .key = key, .value = value,
+                               .hash = (uint32_t)hash });
+  map->nEntries++;
+  return 0;
+}
+
+/** return true iff key is in map, setting *value (if value is not
+ *  NULL) to its value.
+ *
+ *  No error return.
+ */
+bool
+get_str_map(const StrMap *map, const char *key, void **value)
+{
+  return get_hashed_str_map(map, key, hash_str_map(map, key), value);
+}
+
+/** get_str_map() with precomputed hash == hash_str_map(map, key) */
+bool
+get_hashed_str_map(const StrMap *map, const char *key, uint64_t hash,
+                   void **value)
+{
+  const StrMapEntry *entry = find_entry(map, key, hash);
+  if (entry && value) *value = entry->value;
+  return entry != NULL;
+}
+
+/** remove key from map.  Returns true iff key was present.
+ *
+ *  No error return.
+ */
+bool
+remove_str_map(StrMap *map, const char *key)
+{
+  StrMapEntry *entry = find_entry(map, key, hash_str_map(map, key));
+  if (!entry) return false;
+  const size_t mask = map->capacity - 1;
+  size_t i = entry - map->entries;
+  for (size_t j = (i + 1) & mask; map->entries[j].dist > 1;
+       i = j, j = (j + 1) & mask) {
+    map->entries[i] = map->entries[j];
+    map->entries[i].dist--;
+  }
+  map->entries[i] = (StrMapEntry) { .dist = 0 };
+  map->nEntries--;
+  return true;
+}
+
+/** return # of keys in map.
+ *
+ *  No error return.
+ */
+size_t
+n_entries_str_map(const StrMap *map)
+{
+  return map->nEntries;
+}
+
+/** External iterator over the entries in map in an unspecified order.
+ *  If called with lastEntry NULL, returns the first entry; otherwise
+ *  returns the entry after lastEntry, NULL if none.
+ *
+ *  The results are undefined if map is modified during the iteration.
+ *
+ *  No error return.
+ */
+const StrMapEntry *
+iter_str_map(const StrMap *map, const StrMapEntry *lastEntry)
+{
+  const size_t start = lastEntry ? lastEntry - map->entries + 1 : 0;
+  for (size_t i = start; i < map->capacity; i++) {
+    if (map->entries[i].dist != 0) return &map->entries[i];
+  }
+  return NULL;
+}
+
+
+/**************************** Unit Tests *******************************/
+
+//whitebox testing
+
+#ifdef TEST_STR_MAP
+
+#include "unit-test.h"
+
+#include <stdio.h>
+
+enum { N_KEYS = 1000 };
+
+static void
+make_keys(char keys[N_KEYS][16])
+{
+  for (int i = 0; i < N_KEYS; i++) snprintf(keys[i], 16, "Key-%d", i);
+}
+
+static void
+test_put_get_str_map(void)
+{
+  static char keys[N_KEYS][16];
+  make_keys(keys);
+  StrMap map;
+  init_str_map(&map, false);
+  void *value;
+  CHKF(!get_str_map(&map, "Key-0", &value), "EMPTY_GET: %p", value);
+  for (int i = 0; i < N_KEYS; i++) {
+    CHKF(put_str_map(&map, keys[i], &keys[i]) == 0, "PUT_%d: alloc error", i);
+  }
+  CHKF(n_entries_str_map(&map) == N_KEYS, "N_ENTRIES: %zu",
+       n_entries_str_map(&map));
+  for (int i = 0; i < N_KEYS; i++) {
+    char key[16];
+    snprintf(key, sizeof(key), "Key-%d", i);
+    CHKF(get_str_map(&map, key, &value) && value == &keys[i],
+         "GET_%d: %p", i, value);
+    const uint64_t hash = hash_str_map(&map, key);
+    CHKF(get_hashed_str_map(&map, key, hash, NULL), "GET_HASHED_%d: %s",
+         i, key);
+  }
+  CHKF(!get_str_map(&map, "key-0", NULL), "CASE: %s", "key-0");
+  CHKF(!get_str_map(&map, "Key-", NULL), "PREFIX: %s", "Key-");
+  put_str_map(&map, "Key-0", NULL);
+  CHKF(get_str_map(&map, keys[0], &value) && value == NULL,
+       "OVERWRITE: %p", value);
+  CHKF(n_entries_str_map(&map) == N_KEYS, "N_OVERWRITE: %zu",
+       n_entries_str_map(&map));
+  free_str_map(&map);
+}
+
+static void
+test_ignore_case_str_map(void)
+{
+  StrMap map;
+  init_str_map(&map, true);
+  put_str_map(&map, "Hello", "1");
+  put_str_map(&map, "WORLD", "2");
+  void *value;
+  CHKF(get_str_map(&map, "hELLo", &value) && strcmp(value, "1") == 0,
+       "NOCASE1: %p", value);
+  CHKF(get_str_map(&map, "world", &value) && strcmp(value, "2") == 0,
+       "NOCASE2: %p", value);
+  put_str_map(&map, "HELLO", "3");
+  CHKF(n_entries_str_map(&map) == 2, "NOCASE_N: %zu",
+       n_entries_str_map(&map));
+  const StrMapEntry *e = iter_str_map(&map, NULL);
+  if (strcmp(e->key, "WORLD") == 0) e = iter_str_map(&map, e);
+  CHKF(strcmp(e->key, "Hello") == 0 && strcmp(e->value, "3") == 0,
+       "NOCASE_KEEP: %s %s", e->key, (char *)e->value);
+  CHKF(!get_str_map(&map, "hell", NULL), "NOCASE_PREFIX: %s", "hell");
+  free_str_map(&map);
+}
+
+static void
+test_remove_str_map(void)
+{
+  static char keys[N_KEYS][16];
+  make_keys(keys);
+  StrMap map;
+  init_str_map(&map, false);
+  for (int round = 0; round < 2; round++) {
+    for (int i = 0; i < N_KEYS; i++) put_str_map(&map, keys[i], &keys[i]);
+    for (int i = 0; i < N_KEYS; i += 2) {
+      CHKF(remove_str_map(&map, keys[i]), "REMOVE_%d: %s", i, keys[i]);
+    }
+    CHKF(!remove_str_map(&map, keys[0]), "REMOVE_AGAIN: %s", keys[0]);
+    CHKF(n_entries_str_map(&map) == N_KEYS/2, "N_REMOVE: %zu",
+         n_entries_str_map(&map));
+    for (int i = 0; i < N_KEYS; i++) {
+      CHKF(get_str_map(&map, keys[i], NULL) == (i % 2 == 1),
+           "REMOVE_GET_%d: %s", i, keys[i]);
+    }
+    size_t n = 0;
+    for (const StrMapEntry *e = iter_str_map(&map, NULL); e != NULL;
+         e = iter_str_map(&map, e)) {
+      CHKF(e->value == e->key, "ITER: %s", e->key);
+      n++;
+    }
+    CHKF(n == N_KEYS/2, "N_ITER: %zu", n);
+    const size_t capacity = map.capacity;
+    clear_str_map(&map);
+    CHKF(n_entries_str_map(&map) == 0 && iter_str_map(&map, NULL) == NULL,
+         "CLEAR: %zu", n_entries_str_map(&map));
+    CHKF(map.capacity == capacity, "CLEAR_CAPACITY: %zu", map.capacity);
+  }
+  free_str_map(&map);
+}
+
+int
+main()
+{
+  test_put_get_str_map();
+  test_ignore_case_str_map();
+  test_remove_str_map();
+}
+
+#endif //#ifdef TEST_STR_MAP
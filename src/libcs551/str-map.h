@@ -0,0 +1,125 @@
+#ifndef STR_MAP_H_
+#define STR_MAP_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Hash map from NUL-terminated string keys to void * values using
+ *  open addressing with Robin Hood probing: entries are kept in a
+ *  single array, and each lookup scans a short run of adjacent
+ *  entries, comparing stored hashes before comparing keys.
+ *
+ *  Keys are not copied: a key must remain valid and unchanged while
+ *  it is in the map.
+ *
+ *  Optionally, a map can be case-insensitive, in which case keys are
+ *  hashed and compared ignoring ASCII case.
+ */
+
+/** routines which return int use the return value to indicate the
+ *  error status.  0 if everything okay, non-zero for a memory
+ *  allocation error.
+ */
+
+/** an entry in a map; clients may read key and value of entries
+ *  returned by iter_str_map() but should regard the rest as private.
+ */
+typedef struct {
+  const char *key;
+  void *value;
+  uint32_t hash;   /** low 32 bits of hash of key */
+  uint32_t dist;   /** 1 + distance from home slot; 0 if slot empty */
+} StrMapEntry;
+
+// clients responsible for allocation/deallocation of this structure.
+// note that clients should regard the insides of this struct as
+// private.
+typedef struct {
+  size_t nEntries;         /** # of keys in map */
+  size_t capacity;         /** # of slots in entries[]; 0 or power of 2 */
+  bool ignoreCase;         /** if true, ASCII case of keys is ignored */
+  StrMapEntry *entries;    /** dynamically allocated entries[capacity] */
+} StrMap;
+
+/** initialize map, ignoring ASCII case of keys if ignoreCase.
+ *  No memory is allocated until the first key is added.
+ *
+ *  No error return.
+ */
+void init_str_map(StrMap *map, bool ignoreCase);
+
+/** free all dynamic memory used by map.  *MUST* be called when map is
+ *  no longer needed.  Does not free the keys or values, nor the map
+ *  structure itself.
+ *
+ *  No error return.
+ */
+void free_str_map(StrMap *map);
+
+/** remove all keys from map, retaining its memory for reuse.
+ *
+ *  No error return.
+ */
+void clear_str_map(StrMap *map);
+
+/** return the hash of key used by map.  The result can be passed to
+ *  the *_hashed_str_map() routines to avoid rehashing a key which is
+ *  looked up repeatedly, possibly in several maps having the same
+ *  case sensitivity.
+ *
+ *  No error return.
+ */
+uint64_t hash_str_map(const StrMap *map, const char *key);
+
+/** set the value of key in map to value, adding key if not already
+ *  present.  If key is already present, the key originally added is
+ *  retained.
+ */
+int put_str_map(StrMap *map, const char *key, void *value);
+
+/** put_str_map() with precomputed hash == hash_str_map(map, key) */
+int put_hashed_str_map(StrMap *map, const char *key, uint64_t hash,
+                       void *value);
+
+/** return true iff key is in map, setting *value (if value is not
+ *  NULL) to its value.
+ *
+ *  No error return.
+ */
+bool get_str_map(const StrMap *map, const char *key, void **value);
+
+/** get_str_map() with precomputed hash == hash_str_map(map, key) */
+bool get_hashed_str_map(const StrMap *map, const char *key, uint64_t hash,
+                        void **value);
+
+/** remove key from map.  Returns true iff key was present.
+ *
+ *  No error return.
+ */
+bool remove_str_map(StrMap *map, const char *key);
+
+/** return # of keys in map.
+ *
+ *  No error return.
+ */
+size_t n_entries_str_map(const StrMap *map);
+
+/** External iterator over the entries in map in an unspecified order.
+ *  If called with lastEntry NULL, returns the first entry; otherwise
+ *  returns the entry after lastEntry, NULL if none.
+ *
+ *  To iterate over all entries in map:
+ *  for (const StrMapEntry *e = iter_str_map(map, NULL); e != NULL;
+ *       e = iter_str_map(map, e)) {
+ *    // do something with e->key and e->value
+ *  }
+ *
+ *  The results are undefined if map is modified during the iteration.
+ *
+ *  No error return.
+ */
+const StrMapEntry *iter_str_map(const StrMap *map,
+                                const StrMapEntry *lastEntry);
+
+#endif //#ifndef STR_MAP_H_
@@ -20,6 +20,7 @@ typedef struct {
   size_t size;   /** # of allocated bytes in str */
   size_t index;  /** index of next free location in str */
   char *buf;     /** dynamically allocated buffer, NUL-terminated if not empty */
+  Arena *arena;  /** if non-NULL, buf is allocated from arena */
 } _StrSpace; //definition from header file repeated here for easy access
 
 #ifdef TEST_STR_SPACE
@@ -34,7 +35,11 @@ ensure_space(StrSpace *strSpace, size_t needed) {
   if (available >= needed) return 0;
   size_t newSize = strSpace->size == 0 ? INIT_STR_SPACE_SIZE : 2*strSpace->size;
   if (newSize - strSpace->index < needed) newSize = strSpace->index + needed;
-  if ((strSpace->buf = realloc(strSpace->buf, newSize)) == NULL) return 1;
+  char *buf = strSpace->arena
+    ? realloc_arena(strSpace->arena, strSpace->buf, strSpace->size, newSize)
+    : realloc(strSpace->buf, newSize);
+  if (buf == NULL) return 1;
+  strSpace->buf = buf;
   strSpace->size = newSize;
   return 0;
 }
@@ -49,6 +54,20 @@ init_str_space(StrSpace *strSpace)
 {
   strSpace->index = strSpace->size = 0;
   strSpace->buf = NULL;
+  strSpace->arena = NULL;
+}
+
+/** initialize this string space to allocate its buffer from arena
+ *  rather than using malloc().  The buffer is released when arena is
+ *  reset or rewound, so free_str_space() is optional.
+ *
+ *  No error return.
+ */
+void
+init_str_space_with_arena(StrSpace *strSpace, Arena *arena)
+{
+  init_str_space(strSpace);
+  strSpace->arena = arena;
 }
 
 /** clear this string space so that it does not store any strings
@@ -69,7 +88,7 @@ clear_str_space(StrSpace *strSpace)
 void
 free_str_space(StrSpace *strSpace)
 {
-  free(strSpace->buf);
+  if (!strSpace->arena) free(strSpace->buf);
   init_str_space(strSpace);
 }
 
@@ -357,10 +376,30 @@ test_iter_str_space(void)
   free_str_space(&s);
 }
 
+static void
+test_arena_str_space(void)
+{
+  Arena arena;
+  init_arena(&arena, 0);
+  StrSpace s;
+  for (int round = 0; round < 3; round++) {
+    init_str_space_with_arena(&s, &arena);
+    add_str_space(&s, "hello");
+    for (int i = 0; i < 100; i++) append_sprintf_str_space(&s, " %d", i);
+    const char *str = iter_str_space(&s, NULL);
+    CHKF(strncmp(str, "hello 0 1 2", 11) == 0, "ARENA_%d: \"%s\"", round, str);
+    CHKF(strlen(str) == 5 + 10*2 + 90*3,
+         "ARENA_LEN_%d: %zu", round, strlen(str));
+    reset_arena(&arena);
+  }
+  free_arena(&arena);
+}
+
 int
 main()
 {
   test_ensure_space();
+  test_arena_str_space();
   test_add_str_space();
   test_append_str_space();
   test_append_sprintf_str_space();
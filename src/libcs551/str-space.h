@@ -1,6 +1,8 @@
 #ifndef STR_SPACE_H_
 #define STR_SPACE_H_
 
+#include "arena.h"
+
 #include <stddef.h>
 
 /** Management of dynamically-allocated space for NUL-terminated strings */
@@ -17,6 +19,7 @@ typedef struct {
   size_t size;   /** # of allocated bytes in str */
   size_t index;  /** index of next free location in str */
   char *buf;     /** dynamically allocated buffer, NUL-terminated if not empty */
+  Arena *arena;  /** if non-NULL, buf is allocated from arena */
 } StrSpace;
 
 
@@ -27,6 +30,14 @@ typedef struct {
  */
 void init_str_space(StrSpace *strSpace);
 
+/** initialize this string space to allocate its buffer from arena
+ *  rather than using malloc().  The buffer is released when arena is
+ *  reset or rewound, so free_str_space() is optional.
+ *
+ *  No error return.
+ */
+void init_str_space_with_arena(StrSpace *strSpace, Arena *arena);
+
 /** free all dynamic memory used by this strSpace.  *MUST* be called
  *  when strSpace is no longer needed. Note that this routine does not
  *  free the strSpace structure itself, as its lifetime is assumed to
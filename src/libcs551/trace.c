@@ -0,0 +1,415 @@
+#define _DEFAULT_SOURCE //for sigaction() with SA_RESTART and clock_gettime()
+
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Binary tracing into per-thread ring buffers.  When tracing is
+ *  enabled, each TRACE() appends a fixed-size record to a ring owned
+ *  by the calling thread, so recording takes no locks and does no
+ *  formatting or I/O.  The rings can be dumped to a file which is
+ *  decoded offline by the trace-decode tool.
+ */
+
+// Each ring is written only by its owning thread, which publishes
+// each record by a release store of head.  Rings are kept on a
+// lock-free list and are never freed: when a thread exits its ring is
+// marked free, and is reused (with a new thread id) by the next
+// thread which traces, so that a dump still contains the records of
+// threads which have exited until they are overwritten.
+//
+// Call sites are assigned ids when first recorded; since a site is a
+// static within its TRACE(), sites[] is simply a table of pointers.
+// A dump only uses write() and reads these structures, so it can be
+// done in a signal handler.
+
+enum {
+  TRACE_RING_SIZE = 2048,       //# of records per thread; power of 2
+  MAX_TRACE_SITES = 4096,
+};
+
+typedef struct _TraceRing {
+  struct _TraceRing *next;      //next ring in rings list
+  atomic_bool isInUse;
+  atomic_uint threadId;
+  atomic_size_t head;           //# of records ever written
+  TraceRecord records[TRACE_RING_SIZE];
+} TraceRing;
+
+atomic_int traceIsOn = 0;
+
+static _Atomic(TraceRing *) rings;
+static atomic_uint nThreads;
+
+static _Atomic(TraceSite *) sites[MAX_TRACE_SITES];
+static atomic_uint nSites;
+
+static pthread_once_t ringKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t ringKey;
+
+static _Thread_local TraceRing *threadRing;
+
+//path prefix for dumps triggered by CS551_TRACE
+static char *dumpPath;
+
+
+/****************************** Recording ******************************/
+
+static void
+release_ring(void *ring)
+{
+  atomic_store(&((TraceRing *)ring)->isInUse, false);
+}
+
+static void
+make_ring_key(void)
+{
+  pthread_key_create(&ringKey, release_ring);
+}
+
+/** return a ring for the calling thread, reusing a free ring if
+ *  possible; NULL on an allocation error.
+ */
+static TraceRing *
+acquire_ring(void)
+{
+  pthread_once(&ringKeyOnce, make_ring_key);
+  TraceRing *ring = NULL;
+  for (TraceRing *p = atomic_load(&rings); p != NULL; p = p->next) {
+    bool isInUse = false;
+    if (atomic_compare_exchange_strong(&p->isInUse, &isInUse, true)) {
+      ring = p;
+      break;
+    }
+  }
+  if (!ring) {
+    ring = calloc(1, sizeof(TraceRing));
+    if (!ring) return NULL;
+    atomic_init(&ring->isInUse, true);
+    ring->next = atomic_load(&rings);
+    while (!atomic_compare_exchange_weak(&rings, &ring->next, ring)) { }
+  }
+  atomic_store(&ring->threadId, atomic_fetch_add(&nThreads, 1) + 1);
+  pthread_setspecific(ringKey, ring);
+  return ring;
+}
+
+/** return id for site, assigning one if necessary; 0 if there are too
+ *  many sites.
+ */
+static unsigned
+site_id(TraceSite *site)
+{
+  unsigned id = atomic_load_explicit(&site->id, memory_order_acquire);
+  if (id != 0) return id;
+  const unsigned newId = atomic_fetch_add(&nSites, 1) + 1;
+  if (newId > MAX_TRACE_SITES) return 0;
+  atomic_store_explicit(&sites[newId - 1], site, memory_order_release);
+  //if another thread won the race, its id is used and newId is unused
+  return atomic_compare_exchange_strong(&site->id, &id, newId) ? newId : id;
+}
+
+/** append a record for site with args[nArgs] to the calling thread's
+ *  ring.  Called by TRACE() only when tracing is enabled.
+ *
+ *  No error return.
+ */
+void
+record_trace(TraceSite *site, unsigned nArgs, const uint64_t args[])
+{
+  TraceRing *ring = threadRing;
+  if (!ring && !(ring = threadRing = acquire_ring())) return;
+  const unsigned id = site_id(site);
+  if (id == 0) return;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  const size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  TraceRecord *record = &ring->records[head & (TRACE_RING_SIZE - 1)];
+  record->timestamp = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  record->siteId = id;
+  record->nArgs = (nArgs < TRACE_MAX_ARGS) ? nArgs : TRACE_MAX_ARGS;
+  memcpy(record->args, args, record->nArgs * sizeof(uint64_t));
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/** enable tracing if isOn, else disable it.
+ *
+ *  No error return.
+ */
+void
+enable_trace(bool isOn)
+{
+  atomic_store(&traceIsOn, isOn);
+}
+
+
+/******************************** Dumps ********************************/
+
+/** write all n bytes from buf to fd; return non-zero on error */
+static int
+write_all(int fd, const void *buf, size_t n)
+{
+  const char *p = buf;
+  while (n > 0) {
+    const ssize_t m = write(fd, p, n);
+    if (m < 0) {
+      if (errno == EINTR) continue;
+      return 1;
+    }
+    p += m;
+    n -= m;
+  }
+  return 0;
+}
+
+static int
+dump_sites(int fd)
+{
+  unsigned n = atomic_load(&nSites);
+  if (n > MAX_TRACE_SITES) n = MAX_TRACE_SITES;
+  const TraceFileHdr fileHdr = {
+    .magic = TRACE_MAGIC, .version = TRACE_VERSION, .nSites = n,
+  };
+  if (write_all(fd, &fileHdr, sizeof(fileHdr)) != 0) return 1;
+  for (unsigned i = 0; i < n; i++) {
+    //a site which lost the race for an id is dumped as an empty site
+    const TraceSite *site = atomic_load_explicit(&sites[i],
+                                                 memory_order_acquire);
+    const bool isValid = site && atomic_load(&site->id) == i + 1;
+    const TraceSiteHdr siteHdr = {
+      .id = i + 1,
+      .line = isValid ? site->line : 0,
+      .fileLen = isValid ? strlen(site->file) : 0,
+      .funcLen = isValid ? strlen(site->func) : 0,
+      .fmtLen = isValid ? strlen(site->fmt) : 0,
+    };
+    if (write_all(fd, &siteHdr, sizeof(siteHdr)) != 0) return 1;
+    if (!isValid) continue;
+    if (write_all(fd, site->file, siteHdr.fileLen) != 0 ||
+        write_all(fd, site->func, siteHdr.funcLen) != 0 ||
+        write_all(fd, site->fmt, siteHdr.fmtLen) != 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int
+dump_ring(int fd, const TraceRing *ring)
+{
+  const size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  //omit the oldest record, which its thread may be overwriting
+  const size_t n = (head < TRACE_RING_SIZE) ? head : TRACE_RING_SIZE - 1;
+  if (n == 0) return 0;
+  const TraceRingHdr ringHdr = {
+    .threadId = atomic_load(&ring->threadId), .nRecords = n,
+  };
+  if (write_all(fd, &ringHdr, sizeof(ringHdr)) != 0) return 1;
+  const size_t first = (head - n) & (TRACE_RING_SIZE - 1);
+  const size_t n1 =
+    (first + n <= TRACE_RING_SIZE) ? n : TRACE_RING_SIZE - first;
+  if (write_all(fd, &ring->records[first], n1 * sizeof(TraceRecord)) != 0 ||
+      write_all(fd, ring->records, (n - n1) * sizeof(TraceRecord)) != 0) {
+    return 1;
+  }
+  return 0;
+}
+
+/** write the rings of all threads to a new file at path.  Records
+ *  made while dumping may be torn.  Async-signal-safe.  Returns
+ *  non-zero on an I/O error.
+ */
+int
+dump_trace(const char *path)
+{
+  const int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+  if (fd < 0) return 1;
+  int err = dump_sites(fd);
+  for (const TraceRing *p = atomic_load(&rings); err == 0 && p != NULL;
+       p = p->next) {
+    err = dump_ring(fd, p);
+  }
+  return (close(fd) != 0) || err;
+}
+
+
+/************************** Runtime Control ****************************/
+
+/** dump to dumpPath.PID; async-signal-safe */
+static void
+dump_to_pid_path(void)
+{
+  char path[strlen(dumpPath) + 24];
+  char digits[20];
+  int nDigits = 0;
+  for (unsigned long pid = getpid(); pid > 0 || nDigits == 0; pid /= 10) {
+    digits[nDigits++] = '0' + pid % 10;
+  }
+  char *p = stpcpy(path, dumpPath);
+  *p++ = '.';
+  while (nDigits > 0) *p++ = digits[--nDigits];
+  *p = '\0';
+  dump_trace(path);
+}
+
+static void
+toggle_trace_handler(int sig)
+{
+  const int savedErrno = errno;
+  if (atomic_exchange(&traceIsOn, !atomic_load(&traceIsOn))) {
+    dump_to_pid_path();
+  }
+  errno = savedErrno;
+}
+
+static void
+dump_at_exit(void)
+{
+  //avoid empty dumps, for example from the parent of a daemon
+  if (atomic_load(&nSites) > 0) dump_to_pid_path();
+}
+
+/** if CS551_TRACE is set in the environment, enable tracing and
+ *  arrange for dumps on SIGUSR2 and at exit.
+ */
+__attribute__((constructor)) static void
+init_trace_from_env(void)
+{
+  const char *path = getenv("CS551_TRACE");
+  if (!path || *path == '\0') return;
+  if (!(dumpPath = strdup(path))) return;
+  struct sigaction action = { .sa_handler = toggle_trace_handler };
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;  //do not interrupt traced system calls
+  sigaction(SIGUSR2, &action, NULL);
+  atexit(dump_at_exit);
+  enable_trace(true);
+}
+
+
+/**************************** Unit Tests *******************************/
+
+//whitebox testing
+
+#ifdef TEST_TRACE
+
+#define DO_TRACE
+#include "trace.h"
+
+#include "unit-test.h"
+
+#include <stdio.h>
+
+enum { N_THREADS = 3, N_RECORDS = 3000 };
+
+//keeps all threads alive together, so that each gets its own ring
+static pthread_barrier_t barrier;
+
+static void *
+trace_thread(void *arg)
+{
+  const uintptr_t t = (uintptr_t)arg;
+  pthread_barrier_wait(&barrier);
+  for (int i = 0; i < N_RECORDS; i++) {
+    TRACE("thread %d: i = %d", (int)t, i);
+  }
+  pthread_barrier_wait(&barrier);
+  return NULL;
+}
+
+/** read dump at path and check it contains the records made by
+ *  trace_thread() and test_trace().
+ */
+static void
+check_dump(const char *path)
+{
+  FILE *f = fopen(path, "r");
+  CHK(f != NULL, "DUMP: cannot open");
+  TraceFileHdr fileHdr;
+  CHK(fread(&fileHdr, sizeof(fileHdr), 1, f) == 1, "DUMP: no header");
+  CHKF(memcmp(fileHdr.magic, TRACE_MAGIC, 8) == 0 && fileHdr.nSites == 3,
+       "DUMP: bad header with %u sites", fileHdr.nSites);
+  unsigned threadSite = 0;
+  for (unsigned i = 0; i < fileHdr.nSites; i++) {
+    TraceSiteHdr siteHdr;
+    CHK(fread(&siteHdr, sizeof(siteHdr), 1, f) == 1, "DUMP: no site");
+    char strs[siteHdr.fileLen + siteHdr.funcLen + siteHdr.fmtLen + 1];
+    const size_t n = sizeof(strs) - 1;
+    CHK(fread(strs, 1, n, f) == n, "DUMP: short site");
+    strs[n] = '\0';
+    if (strstr(strs, "trace_threadthread %d: i = %d")) threadSite = siteHdr.id;
+  }
+  CHK(threadSite != 0, "DUMP: no trace_thread site");
+  unsigned nRings = 0;
+  TraceRingHdr ringHdr;
+  while (fread(&ringHdr, sizeof(ringHdr), 1, f) == 1) {
+    TraceRecord records[ringHdr.nRecords];
+    CHK(fread(records, sizeof(TraceRecord), ringHdr.nRecords, f) ==
+        ringHdr.nRecords, "DUMP: short ring");
+    if (records[0].siteId != threadSite) continue;
+    nRings++;
+    //ring wrapped, so only the last TRACE_RING_SIZE - 1 records remain
+    CHKF(ringHdr.nRecords == TRACE_RING_SIZE - 1, "RING: %u records",
+         ringHdr.nRecords);
+    unsigned nBad = 0;
+    for (unsigned i = 0; i < ringHdr.nRecords; i++) {
+      const TraceRecord *r = &records[i];
+      nBad += r->nArgs != 2 ||
+        r->args[1] != N_RECORDS - ringHdr.nRecords + i ||
+        (i > 0 && r->timestamp < records[i - 1].timestamp);
+    }
+    CHKF(nBad == 0, "RING: %u bad records", nBad);
+  }
+  CHKF(nRings == N_THREADS, "DUMP: %u thread rings", nRings);
+  fclose(f);
+}
+
+static void
+test_trace(void)
+{
+  //disabled TRACE() does not evaluate its args or record anything
+  int nEvals = 0;
+  TRACE("disabled %d", nEvals++);
+  CHKF(nEvals == 0 && atomic_load(&nSites) == 0, "DISABLED: %d evals",
+       nEvals);
+  enable_trace(true);
+  TRACE("no args");
+  TRACE("eight args %d %d %d %d %d %d %d %s", 1, 2, 3, 4, 5, 6, 7, "x");
+  pthread_t tids[N_THREADS];
+  pthread_barrier_init(&barrier, NULL, N_THREADS);
+  for (uintptr_t t = 0; t < N_THREADS; t++) {
+    pthread_create(&tids[t], NULL, trace_thread, (void *)t);
+  }
+  for (int t = 0; t < N_THREADS; t++) pthread_join(tids[t], NULL);
+  pthread_barrier_destroy(&barrier);
+  enable_trace(false);
+  const TraceRing *ring = threadRing;
+  CHK(ring != NULL && atomic_load(&ring->head) == 2, "MAIN: no records");
+  const TraceRecord *r = &ring->records[1];
+  CHKF(r->nArgs == 8 && r->args[6] == 7, "EIGHT_ARGS: %u args", r->nArgs);
+  char path[] = "/tmp/test-trace-XXXXXX";
+  const int fd = mkstemp(path);
+  CHK(fd >= 0, "MKSTEMP: failed");
+  close(fd);
+  CHK(dump_trace(path) == 0, "DUMP: failed");
+  check_dump(path);
+  unlink(path);
+}
+
+int
+main()
+{
+  test_trace();
+}
+
+#endif //#ifdef TEST_TRACE
@@ -1,18 +1,152 @@
 /** Supports printf() style TRACE() statements in code.  They are
- *  activated only if the DO_TRACE macro is defined before this
+ *  compiled in only if the DO_TRACE macro is defined before this
  *  file in #include'd into the program.  Can be included multiple
  *  timed into the same compilation unit.
+ *
+ *  A compiled-in TRACE() does not format anything: when tracing is
+ *  enabled, it appends a binary record containing a timestamp, the
+ *  id of its call site and up to TRACE_MAX_ARGS integer args to a
+ *  ring buffer owned by the calling thread, overwriting the oldest
+ *  record when the ring is full.  When tracing is disabled, it costs
+ *  a single predictable branch.  Args are recorded as 64-bit
+ *  integers: pointers (including strings) are recorded as addresses
+ *  and floating point values are truncated.
+ *
+ *  Tracing is disabled until enable_trace() is called, or until it
+ *  is enabled at runtime by setting the CS551_TRACE environment
+ *  variable to a PATH when the program is started.  In that case:
+ *
+ *    + Tracing starts enabled.
+ *
+ *    + Sending the process SIGUSR2 toggles tracing; when tracing is
+ *      disabled, the rings of all threads are dumped to PATH.PID.
+ *
+ *    + The rings are also dumped to PATH.PID when the process exits
+ *      normally.
+ *
+ *  A dump can be decoded offline by the trace-decode tool, which
+ *  prints all records in timestamp order, formatted using the format
+ *  strings of their call sites.
  */
 
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/** max # of args recorded by a TRACE() */
+enum { TRACE_MAX_ARGS = 8 };
+
+/** static information for a TRACE() call site */
+typedef struct {
+  const char *file;
+  const char *func;
+  const char *fmt;
+  unsigned line;
+  atomic_uint id;       /** 0 until first recorded */
+} TraceSite;
+
+/** a single binary trace record */
+typedef struct {
+  uint64_t timestamp;   /** CLOCK_MONOTONIC nanoseconds */
+  uint32_t siteId;
+  uint32_t nArgs;
+  uint64_t args[TRACE_MAX_ARGS];
+} TraceRecord;
+
+/** non-zero iff tracing is enabled; read by TRACE() */
+extern atomic_int traceIsOn;
+
+/** append a record for site with args[nArgs] to the calling thread's
+ *  ring.  Called by TRACE() only when tracing is enabled.
+ *
+ *  No error return.
+ */
+void record_trace(TraceSite *site, unsigned nArgs, const uint64_t args[]);
+
+/** enable tracing if isOn, else disable it.
+ *
+ *  No error return.
+ */
+void enable_trace(bool isOn);
+
+/** write the rings of all threads to a new file at path.  Records
+ *  made while dumping may be torn.  Async-signal-safe.  Returns
+ *  non-zero on an I/O error.
+ */
+int dump_trace(const char *path);
+
+
+/** Dump file format: a TraceFileHdr, followed by nSites sites, each
+ *  a TraceSiteHdr followed by the file, func and fmt strings (without
+ *  NUL terminators), followed by any # of rings, each a TraceRingHdr
+ *  followed by nRecords TraceRecords in the order they were recorded.
+ *  All integers are in host byte order.
+ */
+
+#define TRACE_MAGIC "CS551TRC"
+enum { TRACE_VERSION = 1 };
+
+typedef struct {
+  char magic[8];        /** TRACE_MAGIC */
+  uint32_t version;     /** TRACE_VERSION */
+  uint32_t nSites;
+} TraceFileHdr;
+
+typedef struct {
+  uint32_t id;
+  uint32_t line;
+  uint32_t fileLen;
+  uint32_t funcLen;
+  uint32_t fmtLen;
+  uint32_t pad;
+} TraceSiteHdr;
+
+typedef struct {
+  uint32_t threadId;    /** sequence # of thread which made records */
+  uint32_t nRecords;
+} TraceRingHdr;
+
+
+//helper macros used by TRACE() to count its args and convert each
+//arg to a uint64_t
+#define TRACE_N_ARGS_(...) \
+  TRACE_N_ARGS__(0 __VA_OPT__(,) __VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define TRACE_N_ARGS__(_0, _1, _2, _3, _4, _5, _6, _7, _8, n, ...) n
+#define TRACE_CAT_(a, b) TRACE_CAT__(a, b)
+#define TRACE_CAT__(a, b) a##b
+#define TRACE_ARG_(a) ((uint64_t)(uintptr_t)(a)),
+#define TRACE_ARGS_0()
+#define TRACE_ARGS_1(a) TRACE_ARG_(a)
+#define TRACE_ARGS_2(a, ...) TRACE_ARG_(a) TRACE_ARGS_1(__VA_ARGS__)
+#define TRACE_ARGS_3(a, ...) TRACE_ARG_(a) TRACE_ARGS_2(__VA_ARGS__)
+#define TRACE_ARGS_4(a, ...) TRACE_ARG_(a) TRACE_ARGS_3(__VA_ARGS__)
+#define TRACE_ARGS_5(a, ...) TRACE_ARG_(a) TRACE_ARGS_4(__VA_ARGS__)
+#define TRACE_ARGS_6(a, ...) TRACE_ARG_(a) TRACE_ARGS_5(__VA_ARGS__)
+#define TRACE_ARGS_7(a, ...) TRACE_ARG_(a) TRACE_ARGS_6(__VA_ARGS__)
+#define TRACE_ARGS_8(a, ...) TRACE_ARG_(a) TRACE_ARGS_7(__VA_ARGS__)
+
+#endif //#ifndef TRACE_H_
+
 #undef TRACE
 #ifdef DO_TRACE
 
-#include <stdio.h>
-
-//first arg must be a literal string, not a var
-#define TRACE(fmt, ...) do {                \
-  fprintf(stderr, "%s:%d: %s(): " fmt "\n", \
-          __FILE__, __LINE__, __func__, ##__VA_ARGS__); \
+//first arg must be a literal string, not a var; at most TRACE_MAX_ARGS
+//other args.  Args are only evaluated when tracing is enabled.
+#define TRACE(format, ...) do {                                         \
+  if (__builtin_expect(atomic_load_explicit(&traceIsOn,                 \
+                                            memory_order_relaxed), 0)) { \
+    static TraceSite traceSite_ = {                                     \
+      .file = __FILE__, .func = __func__, .fmt = format,                \
+      .line = __LINE__,                                                 \
+    };                                                                  \
+    const uint64_t traceArgs_[] = {                                     \
+      TRACE_CAT_(TRACE_ARGS_, TRACE_N_ARGS_(__VA_ARGS__))(__VA_ARGS__) 0 \
+    };                                                                  \
+    record_trace(&traceSite_, TRACE_N_ARGS_(__VA_ARGS__), traceArgs_);  \
+  }                                                                     \
 } while (0)
 
 #else
@@ -15,7 +15,8 @@ typedef struct {
   size_t len;
   size_t elementSize;
   size_t capacity;
-  void **elements;      //dynamically managed by this module
+  char *elements;       //dynamically managed by this module
+  Arena *arena;         //if non-NULL, elements allocated from arena
 } _Vector; //definition from header file repeated here for easy access
 
 
@@ -26,6 +27,19 @@ init_vector(Vector *vec, size_t elementSize)
   vec->len = vec->capacity = 0;
   vec->elementSize = elementSize;
   vec->elements = NULL;
+  vec->arena = NULL;
+}
+
+/** initialize vec as for init_vector(), but to allocate its elements
+ *  from arena rather than using malloc().  The elements are released
+ *  when arena is reset or rewound, so free_vector() is optional.
+ *  No error return.
+ */
+void
+init_vector_with_arena(Vector *vec, size_t elementSize, Arena *arena)
+{
+  init_vector(vec, elementSize);
+  vec->arena = arena;
 }
 
 /** clear out vec */
@@ -45,7 +59,7 @@ clear_vector(Vector *vec)
 void
 free_vector(Vector *vec)
 {
-  free(vec->elements);
+  if (!vec->arena) free(vec->elements);
   init_vector(vec, 0);
 }
 
@@ -58,12 +72,16 @@ add_vector(Vector *vec, void *entry)
   enum { INIT_VEC_SIZE = 16 };
   if (vec->len == vec->capacity) {
     size_t newSize = vec->capacity == 0 ? INIT_VEC_SIZE : 2*vec->capacity;
-    void *p = realloc(vec->elements, newSize * vec->elementSize);
+    void *p = vec->arena
+      ? realloc_arena(vec->arena, vec->elements,
+                      vec->capacity * vec->elementSize,
+                      newSize * vec->elementSize)
+      : realloc(vec->elements, newSize * vec->elementSize);
     if (!p) return 1;
     vec->capacity = newSize; vec->elements = p;
   }
   assert(vec->len < vec->capacity);
-  memcpy(&vec->elements[vec->len], entry, vec->elementSize);
+  memcpy(&vec->elements[vec->len * vec->elementSize], entry, vec->elementSize);
   vec->len++;
   return 0;
 }
@@ -82,7 +100,7 @@ int
 get_element_vector(const Vector *vec, size_t index, void *element)
 {
   if (index >= vec->len) return 1;
-  memcpy(element, &vec->elements[index], vec->elementSize);
+  memcpy(element, &vec->elements[index * vec->elementSize], vec->elementSize);
   return 0;
 }
 
@@ -92,3 +110,111 @@ get_base_vector(const Vector *vec)
 {
   return vec->elements;
 }
+
+
+/**************************** Unit Tests *******************************/
+
+#ifdef TEST_VECTOR
+
+#include "unit-test.h"
+
+typedef struct {
+  int id;
+  char name[20];
+} Item;
+
+static void
+test_vector(void)
+{
+  Vector vec;
+  init_vector(&vec, sizeof(Item));
+  enum { N = 100 };
+  for (int i = 0; i < N; i++) {
+    Item item = { .id = i };
+    snprintf(item.name, sizeof(item.name), "item-%d", i);
+    CHKF(add_vector(&vec, &item) == 0, "ADD_%d: alloc error", i);
+  }
+  CHKF(n_elements_vector(&vec) == N, "N_ELEMENTS: %zu != %d",
+       n_elements_vector(&vec), N);
+  const Item *items = get_base_vector(&vec);
+  for (int i = 0; i < N; i++) {
+    Item item;
+    CHKF(get_element_vector(&vec, i, &item) == 0, "GET_%d: bad index", i);
+    char name[20];
+    snprintf(name, sizeof(name), "item-%d", i);
+    CHKF(item.id == i && strcmp(item.name, name) == 0,
+         "GET_%d: %d %s", i, item.id, item.name);
+    CHKF(items[i].id == i, "BASE_%d: %d", i, items[i].id);
+  }
+  Item item;
+  CHKF(get_element_vector(&vec, N, &item) != 0, "GET_BAD_INDEX: %d", N);
+  free_vector(&vec);
+
+  init_vector(&vec, 1);
+  for (char c = 'a'; c <= 'z'; c++) add_vector(&vec, &c);
+  const char *chars = get_base_vector(&vec);
+  CHKF(strncmp(chars, "abcdefghijklmnopqrstuvwxyz", 26) == 0,
+       "CHARS: %.26s", chars);
+  free_vector(&vec);
+}
+
+DEFINE_VECTOR(IntVector, int, 4)
+DEFINE_VECTOR(ItemVector, Item, 2)
+
+static void
+test_typed_vector(void)
+{
+  IntVector ints;
+  init_IntVector(&ints);
+  for (int i = 0; i < 4; i++) add_IntVector(&ints, i);
+  CHKF(get_base_IntVector(&ints) == ints.inlineElements,
+       "INLINE: %p", (void *)get_base_IntVector(&ints));
+  add_IntVector(&ints, 4);
+  CHKF(get_base_IntVector(&ints) != ints.inlineElements,
+       "HEAP: %p", (void *)get_base_IntVector(&ints));
+  CHKF(reserve_IntVector(&ints, 100) == 0, "RESERVE: %d", 100);
+  const int *view = get_base_IntVector(&ints);
+  for (int i = 5; i < 100; i++) add_IntVector(&ints, i);
+  CHKF(view == get_base_IntVector(&ints), "STABLE: %p != %p",
+       (void *)view, (void *)get_base_IntVector(&ints));
+  for (int i = 0; i < 100; i++) {
+    CHKF(get_IntVector(&ints, i) == i, "GET_%d: %d", i,
+         get_IntVector(&ints, i));
+  }
+  CHKF(shrink_IntVector(&ints) == 0 && ints.capacity == 100,
+       "SHRINK: %zu", ints.capacity);
+  clear_IntVector(&ints);
+  add_IntVector(&ints, 42);
+  CHKF(shrink_IntVector(&ints) == 0 &&
+       get_base_IntVector(&ints) == ints.inlineElements &&
+       get_IntVector(&ints, 0) == 42, "SHRINK_INLINE: %d",
+       get_IntVector(&ints, 0));
+  free_IntVector(&ints);
+
+  Arena arena;
+  init_arena(&arena, 0);
+  ItemVector items;
+  init_ItemVector_with_arena(&items, &arena);
+  for (int i = 0; i < 50; i++) {
+    CHKF(add_ItemVector(&items, (Item){ .id = i, .name = "x" }) == 0,
+         "ARENA_ADD_%d: alloc error", i);
+  }
+  for (int i = 0; i < 50; i++) {
+    const Item item = get_ItemVector(&items, i);
+    CHKF(item.id == i && strcmp(item.name, "x") == 0, "ARENA_GET_%d: %d",
+         i, item.id);
+  }
+  CHKF(n_elements_ItemVector(&items) == 50, "ARENA_N: %zu",
+       n_elements_ItemVector(&items));
+  free_ItemVector(&items);
+  free_arena(&arena);
+}
+
+int
+main()
+{
+  test_vector();
+  test_typed_vector();
+}
+
+#endif //#ifdef TEST_VECTOR
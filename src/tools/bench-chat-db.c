@@ -0,0 +1,547 @@
+#include <chat-db.h>
+#include <errors.h>
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Benchmark chat-db using a synthetic workload.  A mix of adds,
+ *  queries and room/topic counts is run against a chat-db
+ *  (optionally preloaded with messages) and the throughput and
+ *  latency percentiles for each kind of operation are written on
+ *  stdout as JSON.
+ *
+ *  Rooms and users are chosen uniformly; topics are chosen with
+ *  Zipf-distributed popularity.  Message sizes are exponentially
+ *  distributed about a specified mean; their text is random words
+ *  or is taken from a corpus file.
+ */
+
+/** workload parameters */
+typedef struct {
+  const char *dbPath;     //relative path; NULL for in-memory db
+  size_t nOps;            //# of timed operations
+  size_t nPreload;        //# of messages added before timing
+  size_t nRooms;
+  size_t nUsers;
+  size_t nTopics;         //# of distinct topics
+  double zipfS;           //Zipf exponent for topic popularity
+  size_t maxMsgTopics;    //# of topics per message uniform in [0, this]
+  size_t meanMsgSize;     //mean message size in bytes
+  size_t maxMsgSize;      //messages truncated to this size
+  unsigned writePct;      //% of operations which are adds
+  unsigned queryPct;      //% of operations which are queries
+  size_t queryCount;      //count param for queries
+  uint64_t seed;
+  bool isDbStats;         //report chat-db statement latencies
+  size_t slowMicros;      //if non-zero, log slower SQL on stderr
+  size_t compressMinSize; //if non-zero, compress messages this long
+  const char *textPath;   //if non-NULL, message text corpus file
+} Workload;
+
+static const Workload DEFAULT_WORKLOAD = {
+  .dbPath = NULL,
+  .nOps = 20000,
+  .nPreload = 10000,
+  .nRooms = 20,
+  .nUsers = 100,
+  .nTopics = 200,
+  .zipfS = 1.0,
+  .maxMsgTopics = 3,
+  .meanMsgSize = 100,
+  .maxMsgSize = 4096,
+  .writePct = 20,
+  .queryPct = 60,
+  .queryCount = 10,
+  .seed = 1,
+};
+
+typedef enum {
+  ADD_OP, QUERY_OP, COUNT_ROOM_OP, COUNT_TOPIC_OP, N_OPS
+} OpType;
+
+static const char *OP_NAMES[] = {
+  "add", "query", "countRoom", "countTopic",
+};
+
+/** latencies recorded for one kind of operation */
+typedef struct {
+  size_t n;
+  uint64_t *nanos;        //nanos[n] latencies
+} Latencies;
+
+/*************************** Random Generation *************************/
+
+/** xorshift64* generator: deterministic for a given seed */
+static uint64_t
+next_random(uint64_t *state)
+{
+  uint64_t x = *state;
+  x ^= x >> 12; x ^= x << 25; x ^= x >> 27;
+  *state = x;
+  return x * 0x2545F4914F6CDD1DULL;
+}
+
+/** return uniformly distributed double in [0, 1) */
+static double
+random_unit(uint64_t *state)
+{
+  return (next_random(state) >> 11) * (1.0 / (1ULL << 53));
+}
+
+/** return uniformly distributed integer in [0, n) */
+static size_t
+random_below(uint64_t *state, size_t n)
+{
+  return (n == 0) ? 0 : next_random(state) % n;
+}
+
+/** set cdf[n] to the cumulative Zipf distribution with exponent s */
+static void
+make_zipf_cdf(size_t n, double s, double cdf[n])
+{
+  double sum = 0;
+  for (size_t i = 0; i < n; i++) cdf[i] = (sum += 1.0 / pow(i + 1, s));
+  for (size_t i = 0; i < n; i++) cdf[i] /= sum;
+}
+
+/** return index in [0, n) sampled from cdf[n] */
+static size_t
+random_zipf(uint64_t *state, size_t n, const double cdf[n])
+{
+  const double u = random_unit(state);
+  size_t lo = 0, hi = n - 1;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (cdf[mid] < u) lo = mid + 1; else hi = mid;
+  }
+  return lo;
+}
+
+/** workload state used for generating operations */
+typedef struct {
+  const Workload *workload;
+  uint64_t rand;
+  double *topicsCdf;
+  char *text;             //source of message text
+  char (*topicNames)[32];
+  char (*roomNames)[32];
+  char (*userNames)[32];
+} Generator;
+
+/** fill text[n] by repeating the contents of file path with newlines
+ *  replaced by spaces.
+ */
+static void
+fill_text(const char *path, size_t n, char text[n])
+{
+  FILE *in = fopen(path, "r");
+  if (!in) fatal("cannot read %s:", path);
+  size_t i = 0;
+  while (i < n) {
+    const int c = fgetc(in);
+    if (c == EOF) {
+      if (i == 0) fatal("no text in %s", path);
+      rewind(in);
+      continue;
+    }
+    text[i++] = (c == '\n' || c == '\0') ? ' ' : c;
+  }
+  fclose(in);
+}
+
+static void
+init_generator(Generator *gen, const Workload *workload)
+{
+  const size_t maxNames =
+    workload->nTopics + workload->nRooms + workload->nUsers;
+  *gen = (Generator) {
+    .workload = workload,
+    .rand = workload->seed ? workload->seed : 1,
+    .topicsCdf = malloc(workload->nTopics * sizeof(double)),
+    .text = malloc(workload->maxMsgSize + 1),
+    .topicNames = malloc(maxNames * sizeof(*gen->topicNames)),
+  };
+  if (!gen->topicsCdf || !gen->text || !gen->topicNames) {
+    fatal("cannot allocate generator:");
+  }
+  gen->roomNames = gen->topicNames + workload->nTopics;
+  gen->userNames = gen->roomNames + workload->nRooms;
+  make_zipf_cdf(workload->nTopics, workload->zipfS, gen->topicsCdf);
+  for (size_t i = 0; i < workload->nTopics; i++) {
+    snprintf(gen->topicNames[i], sizeof(gen->topicNames[i]), "#topic%zu", i);
+  }
+  for (size_t i = 0; i < workload->nRooms; i++) {
+    snprintf(gen->roomNames[i], sizeof(gen->roomNames[i]), "room%zu", i);
+  }
+  for (size_t i = 0; i < workload->nUsers; i++) {
+    snprintf(gen->userNames[i], sizeof(gen->userNames[i]), "@user%zu", i);
+  }
+  if (workload->textPath) {
+    fill_text(workload->textPath, workload->maxMsgSize, gen->text);
+  }
+  else {
+    for (size_t i = 0; i < workload->maxMsgSize; i++) {
+      gen->text[i] = (i % 7 == 6) ? ' ' : 'a' + random_below(&gen->rand, 26);
+    }
+  }
+  gen->text[workload->maxMsgSize] = '\0';
+}
+
+static void
+free_generator(Generator *gen)
+{
+  free(gen->topicsCdf);
+  free(gen->text);
+  free(gen->topicNames);
+}
+
+static const char *
+random_room(Generator *gen)
+{
+  return gen->roomNames[random_below(&gen->rand, gen->workload->nRooms)];
+}
+
+static const char *
+random_topic(Generator *gen)
+{
+  const size_t n = gen->workload->nTopics;
+  return gen->topicNames[random_zipf(&gen->rand, n, gen->topicsCdf)];
+}
+
+/** set topics[] to random topics, returning # of topics */
+static size_t
+random_topics(Generator *gen, size_t maxTopics, const char *topics[])
+{
+  size_t n = random_below(&gen->rand, maxTopics + 1);
+  for (size_t i = 0; i < n; i++) topics[i] = random_topic(gen);
+  return n;
+}
+
+/** return message with exponentially distributed size; points into
+ *  gen->text which is modified by the next call.
+ */
+static const char *
+random_message(Generator *gen, size_t *lastLen)
+{
+  const Workload *w = gen->workload;
+  gen->text[*lastLen] = ' ';  //undo NUL from last call
+  size_t len =
+    (size_t)(-log(1.0 - random_unit(&gen->rand)) * w->meanMsgSize) + 1;
+  if (len > w->maxMsgSize) len = w->maxMsgSize;
+  const size_t start = random_below(&gen->rand, w->maxMsgSize - len + 1);
+  *lastLen = start + len;
+  gen->text[*lastLen] = '\0';
+  return &gen->text[start];
+}
+
+/****************************** Benchmark ******************************/
+
+static uint64_t
+now_nanos(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+ignore_result(const ChatInfo *result, void *ctx)
+{
+  (*(size_t *)ctx)++;
+  return 0;
+}
+
+static void
+preload(ChatDb *chatDb, Generator *gen)
+{
+  enum { BATCH = 1000 };
+  const Workload *w = gen->workload;
+  ChatInfo chats[BATCH];
+  const char *topics[BATCH][w->maxMsgTopics + 1];
+  char *messages[BATCH];
+  size_t lastLen = 0;
+  for (size_t i = 0; i < w->nPreload; i += BATCH) {
+    size_t n = (w->nPreload - i < BATCH) ? w->nPreload - i : BATCH;
+    for (size_t j = 0; j < n; j++) {
+      messages[j] = strdup(random_message(gen, &lastLen));
+      if (!messages[j]) fatal("cannot allocate message:");
+      chats[j] = (ChatInfo) {
+        .user = gen->userNames[random_below(&gen->rand, w->nUsers)],
+        .room = random_room(gen),
+        .nTopics = random_topics(gen, w->maxMsgTopics, topics[j]),
+        .topics = topics[j],
+        .message = messages[j],
+      };
+    }
+    if (add_chats_chat_db(chatDb, n, chats) != 0) {
+      fatal("preload: %s", error_chat_db(chatDb));
+    }
+    for (size_t j = 0; j < n; j++) free(messages[j]);
+  }
+}
+
+/** run one random operation, adding its latency to latencies[] */
+static void
+run_op(ChatDb *chatDb, Generator *gen, size_t *lastLen,
+       Latencies latencies[N_OPS])
+{
+  const Workload *w = gen->workload;
+  const unsigned pct = random_below(&gen->rand, 100);
+  const OpType op =
+    (pct < w->writePct) ? ADD_OP
+    : (pct < w->writePct + w->queryPct) ? QUERY_OP
+    : (pct % 2 == 0) ? COUNT_ROOM_OP
+    : COUNT_TOPIC_OP;
+  const char *topics[w->maxMsgTopics + 1];
+  const char *room = random_room(gen);
+  const char *user = gen->userNames[random_below(&gen->rand, w->nUsers)];
+  size_t nTopics = random_topics(gen, w->maxMsgTopics, topics);
+  const char *message = (op == ADD_OP) ? random_message(gen, lastLen) : NULL;
+  size_t count = 0;
+  int rc = 0;
+  const uint64_t t0 = now_nanos();
+  switch (op) {
+  case ADD_OP:
+    rc = add_chat_db(chatDb, user, room, nTopics, topics, message);
+    break;
+  case QUERY_OP:
+    //queries for more than one topic rarely match
+    nTopics = nTopics > 1 ? 1 : nTopics;
+    rc = query_chat_db(chatDb, room, nTopics, topics, w->queryCount,
+                       ignore_result, &count);
+    break;
+  case COUNT_ROOM_OP:
+    rc = count_room_chat_db(chatDb, room, &count);
+    break;
+  case COUNT_TOPIC_OP:
+    rc = count_topic_chat_db(chatDb, random_topic(gen), &count);
+    break;
+  default:
+    break;
+  }
+  const uint64_t t1 = now_nanos();
+  if (rc != 0) fatal("%s: %s", OP_NAMES[op], error_chat_db(chatDb));
+  Latencies *lat = &latencies[op];
+  lat->nanos[lat->n++] = t1 - t0;
+}
+
+static int
+cmp_nanos(const void *p1, const void *p2)
+{
+  const uint64_t a = *(const uint64_t *)p1, b = *(const uint64_t *)p2;
+  return (a > b) - (a < b);
+}
+
+/** return p'th percentile (0 < p < 100) of sorted nanos[n] in micros */
+static double
+percentile_micros(size_t n, const uint64_t nanos[n], double p)
+{
+  if (n == 0) return 0;
+  size_t i = (size_t)(p / 100 * n);
+  return nanos[i < n ? i : n - 1] / 1000.0;
+}
+
+static void
+out_latencies(FILE *out, const char *name, Latencies *lat, double secs,
+              bool isLast)
+{
+  qsort(lat->nanos, lat->n, sizeof(uint64_t), cmp_nanos);
+  fprintf(out, "    \"%s\": { \"n\": %zu, \"opsPerSec\": %.1f, "
+          "\"p50Us\": %.2f, \"p99Us\": %.2f, \"p999Us\": %.2f }%s\n",
+          name, lat->n, lat->n / secs,
+          percentile_micros(lat->n, lat->nanos, 50),
+          percentile_micros(lat->n, lat->nanos, 99),
+          percentile_micros(lat->n, lat->nanos, 99.9),
+          isLast ? "" : ",");
+}
+
+/** context for out_db_stats() */
+typedef struct {
+  FILE *out;
+  size_t n;               //# of histograms output so far
+} DbStatsCtx;
+
+static int
+out_db_stats(const char *name, const LatencyHistogram *histogram, void *ctx)
+{
+  DbStatsCtx *statsCtx = ctx;
+  FILE *out = statsCtx->out;
+  const double mean =
+    histogram->count ? histogram->totalNanos / 1000.0 / histogram->count : 0;
+  fprintf(out, "%s    \"%s\": { \"n\": %ju, \"meanUs\": %.2f, "
+          "\"p50Us\": %.2f, \"p99Us\": %.2f, \"p999Us\": %.2f, "
+          "\"maxUs\": %.2f }",
+          statsCtx->n++ ? ",\n" : "", name, (uintmax_t)histogram->count, mean,
+          percentile_latency_histogram(histogram, 50) / 1000.0,
+          percentile_latency_histogram(histogram, 99) / 1000.0,
+          percentile_latency_histogram(histogram, 99.9) / 1000.0,
+          histogram->maxNanos / 1000.0);
+  return 0;
+}
+
+static void
+out_results(FILE *out, const Workload *w, ChatDb *chatDb, double secs,
+            Latencies latencies[N_OPS])
+{
+  fprintf(out, "{\n");
+  fprintf(out, "  \"workload\": { \"db\": \"%s\", \"nOps\": %zu, "
+          "\"nPreload\": %zu, \"nRooms\": %zu, \"nUsers\": %zu, "
+          "\"nTopics\": %zu, \"zipfS\": %g, \"maxMsgTopics\": %zu, "
+          "\"meanMsgSize\": %zu, \"maxMsgSize\": %zu, \"writePct\": %u, "
+          "\"queryPct\": %u, \"queryCount\": %zu, \"seed\": %llu },\n",
+          w->dbPath ? w->dbPath : ":memory:", w->nOps, w->nPreload,
+          w->nRooms, w->nUsers, w->nTopics, w->zipfS, w->maxMsgTopics,
+          w->meanMsgSize, w->maxMsgSize, w->writePct, w->queryPct,
+          w->queryCount, (unsigned long long)w->seed);
+  if (w->compressMinSize > 0 || w->textPath) {
+    ChatDbCompressionStats stats;
+    compression_stats_chat_db(chatDb, &stats);
+    const double ratio = stats.nStoredBytes
+      ? (double)stats.nMessageBytes / stats.nStoredBytes : 0;
+    fprintf(out, "  \"compression\": { \"text\": \"%s\", \"minSize\": %zu, "
+            "\"nMessages\": %zu, \"nCompressed\": %zu, "
+            "\"messageBytes\": %ju, \"storedBytes\": %ju, "
+            "\"ratio\": %.3f },\n",
+            w->textPath ? w->textPath : "", stats.minSize, stats.nMessages,
+            stats.nCompressed, (uintmax_t)stats.nMessageBytes,
+            (uintmax_t)stats.nStoredBytes, ratio);
+  }
+  fprintf(out, "  \"elapsedSecs\": %.3f,\n", secs);
+  fprintf(out, "  \"opsPerSec\": %.1f,\n", w->nOps / secs);
+  //all ops together
+  Latencies all = { .n = 0, .nanos = malloc(w->nOps * sizeof(uint64_t)) };
+  if (!all.nanos) fatal("cannot allocate latencies:");
+  for (int op = 0; op < N_OPS; op++) {
+    memcpy(&all.nanos[all.n], latencies[op].nanos,
+           latencies[op].n * sizeof(uint64_t));
+    all.n += latencies[op].n;
+  }
+  fprintf(out, "  \"ops\": {\n");
+  out_latencies(out, "all", &all, secs, false);
+  for (int op = 0; op < N_OPS; op++) {
+    out_latencies(out, OP_NAMES[op], &latencies[op], secs, op == N_OPS - 1);
+  }
+  fprintf(out, "  }");
+  if (w->isDbStats) {
+    //percentiles from chat-db histograms are upper bounds within 2x
+    fprintf(out, ",\n  \"dbStats\": {\n");
+    iter_stats_chat_db(chatDb, out_db_stats, &(DbStatsCtx) { .out = out });
+    fprintf(out, "\n  }");
+  }
+  fprintf(out, "\n}\n");
+  free(all.nanos);
+}
+
+/****************************** Arguments ******************************/
+
+static void
+usage(const char *prog)
+{
+  fatal("usage: %s [-d DB_PATH] [-n N_OPS] [-p N_PRELOAD] [-r N_ROOMS] "
+        "[-u N_USERS] [-t N_TOPICS] [-z ZIPF_S] [-k MAX_MSG_TOPICS] "
+        "[-m MEAN_MSG_SIZE] [-M MAX_MSG_SIZE] [-w WRITE_PCT] "
+        "[-q QUERY_PCT] [-c QUERY_COUNT] [-s SEED] [-l] [-L SLOW_MICROS] "
+        "[-C COMPRESS_MIN_SIZE] [-T TEXT_FILE]\n"
+        "  operations which are neither writes nor queries are split "
+        "evenly\n  between room and topic counts\n"
+        "  -l reports chat-db statement latencies; -L logs slower SQL "
+        "on stderr\n"
+        "  -C compresses messages of at least COMPRESS_MIN_SIZE bytes; "
+        "-T takes\n  message text from TEXT_FILE", prog);
+}
+
+static size_t
+size_arg(const char *prog, const char *arg, size_t min)
+{
+  char *p;
+  unsigned long long v = strtoull(arg, &p, 10);
+  if (*p != '\0' || v < min) usage(prog);
+  return v;
+}
+
+static void
+parse_args(int argc, char *argv[], Workload *w)
+{
+  *w = DEFAULT_WORKLOAD;
+  int c;
+  const char *opts = "d:n:p:r:u:t:z:k:m:M:w:q:c:s:lL:C:T:";
+  while ((c = getopt(argc, argv, opts)) != -1) {
+    switch (c) {
+    case 'd': w->dbPath = optarg; break;
+    case 'n': w->nOps = size_arg(argv[0], optarg, 1); break;
+    case 'p': w->nPreload = size_arg(argv[0], optarg, 0); break;
+    case 'r': w->nRooms = size_arg(argv[0], optarg, 1); break;
+    case 'u': w->nUsers = size_arg(argv[0], optarg, 1); break;
+    case 't': w->nTopics = size_arg(argv[0], optarg, 1); break;
+    case 'z': w->zipfS = atof(optarg); break;
+    case 'k': w->maxMsgTopics = size_arg(argv[0], optarg, 0); break;
+    case 'm': w->meanMsgSize = size_arg(argv[0], optarg, 1); break;
+    case 'M': w->maxMsgSize = size_arg(argv[0], optarg, 1); break;
+    case 'w': w->writePct = size_arg(argv[0], optarg, 0); break;
+    case 'q': w->queryPct = size_arg(argv[0], optarg, 0); break;
+    case 'c': w->queryCount = size_arg(argv[0], optarg, 1); break;
+    case 's': w->seed = size_arg(argv[0], optarg, 0); break;
+    case 'l': w->isDbStats = true; break;
+    case 'L': w->slowMicros = size_arg(argv[0], optarg, 1); break;
+    case 'C': w->compressMinSize = size_arg(argv[0], optarg, 1); break;
+    case 'T': w->textPath = optarg; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind != argc || w->writePct + w->queryPct > 100) usage(argv[0]);
+}
+
+int
+main(int argc, char *argv[])
+{
+  Workload workload;
+  parse_args(argc, argv, &workload);
+  if (workload.dbPath) remove(workload.dbPath);
+  const ChatDbOptions dbOptions = {
+    .compressMinSize = workload.compressMinSize,
+  };
+  MakeChatDbResult result;
+  if (make_chat_db_with_options(workload.dbPath, &dbOptions, &result) != 0) {
+    fatal("cannot create db: %s", result.err);
+  }
+  ChatDb *chatDb = result.chatDb;
+  Generator gen;
+  init_generator(&gen, &workload);
+  preload(chatDb, &gen);
+  if (workload.isDbStats || workload.slowMicros > 0) {
+    const ChatDbStatsOptions options = {
+      .isEnabled = true,
+      .slowNanos = workload.slowMicros * 1000,
+      .slowLog = stderr,
+    };
+    if (set_stats_chat_db(chatDb, &options) != 0) {
+      fatal("cannot enable db stats: %s", error_chat_db(chatDb));
+    }
+  }
+
+  Latencies latencies[N_OPS];
+  for (int op = 0; op < N_OPS; op++) {
+    latencies[op] = (Latencies) {
+      .n = 0, .nanos = malloc(workload.nOps * sizeof(uint64_t)),
+    };
+    if (!latencies[op].nanos) fatal("cannot allocate latencies:");
+  }
+  size_t lastLen = 0;
+  const uint64_t t0 = now_nanos();
+  for (size_t i = 0; i < workload.nOps; i++) {
+    run_op(chatDb, &gen, &lastLen, latencies);
+  }
+  const double secs = (now_nanos() - t0) / 1e9;
+  out_results(stdout, &workload, chatDb, secs, latencies);
+
+  for (int op = 0; op < N_OPS; op++) free(latencies[op].nanos);
+  free_generator(&gen);
+  free_chat_db(chatDb);
+  return 0;
+}
@@ -0,0 +1,191 @@
+#include <chat-db.h>
+#include <errors.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Microbenchmark for timestamp_to_iso8601().  Formats a sequence of
+ *  increasing timestamps (as returned by a query) in each of several
+ *  threads using:
+ *
+ *    strftime:  localtime_r() + strftime() for every timestamp (the
+ *               original implementation);
+ *    cached:    timestamp_to_iso8601();
+ *    batch:     timestamps_to_iso8601() on blocks of timestamps.
+ *
+ *  Results are written on stdout as JSON.
+ */
+
+enum { BATCH_SIZE = 64 };
+
+typedef enum { STRFTIME_FMT, CACHED_FMT, BATCH_FMT, N_FMTS } FmtType;
+
+static const char *FMT_NAMES[] = { "strftime", "cached", "batch" };
+
+/** benchmark parameters */
+typedef struct {
+  size_t n;               //# of timestamps formatted per thread
+  size_t nThreads;
+  TimeMillis stepMillis;  //mean difference between successive timestamps
+} Params;
+
+static const Params DEFAULT_PARAMS = {
+  .n = 2000000, .nThreads = 1, .stepMillis = 250,
+};
+
+/** per-thread context */
+typedef struct {
+  const Params *params;
+  FmtType fmt;
+  const TimeMillis *timestamps;
+  uint64_t checksum;      //prevents formatting being optimized away
+} ThreadCtx;
+
+static uint64_t
+now_nanos(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** original formatter */
+static void
+strftime_iso8601(TimeMillis timestamp, char buf[ISO_8601_LEN + 1])
+{
+  time_t t = timestamp/1000;
+  int millis = timestamp%1000;
+  struct tm brokenDownTime;
+  localtime_r(&t, &brokenDownTime);
+  size_t n = strftime(buf, ISO_8601_LEN + 1, "%Y-%m-%dT%H:%M:%S",
+                      &brokenDownTime);
+  snprintf(&buf[n], ISO_8601_LEN + 1 - n, ".%03d", millis);
+}
+
+static void *
+run_thread(void *arg)
+{
+  ThreadCtx *ctx = arg;
+  const size_t n = ctx->params->n;
+  char bufs[BATCH_SIZE][ISO_8601_LEN + 1];
+  for (size_t i = 0; i < n; i += BATCH_SIZE) {
+    const size_t nBatch = (n - i < BATCH_SIZE) ? n - i : BATCH_SIZE;
+    switch (ctx->fmt) {
+    case STRFTIME_FMT:
+      for (size_t j = 0; j < nBatch; j++) {
+        strftime_iso8601(ctx->timestamps[i + j], bufs[j]);
+      }
+      break;
+    case CACHED_FMT:
+      for (size_t j = 0; j < nBatch; j++) {
+        timestamp_to_iso8601(ctx->timestamps[i + j], sizeof(bufs[j]), bufs[j]);
+      }
+      break;
+    case BATCH_FMT:
+      timestamps_to_iso8601(nBatch, &ctx->timestamps[i], bufs);
+      break;
+    default:
+      break;
+    }
+    for (size_t j = 0; j < nBatch; j++) {
+      for (const char *p = bufs[j]; *p != '\0'; p++) {
+        ctx->checksum = ctx->checksum*31 + *p;
+      }
+    }
+  }
+  return NULL;
+}
+
+/** return elapsed secs for formatting timestamps[] in each thread */
+static double
+run_fmt(const Params *params, FmtType fmt, const TimeMillis *timestamps,
+        uint64_t *checksum)
+{
+  pthread_t threads[params->nThreads];
+  ThreadCtx ctxs[params->nThreads];
+  const uint64_t t0 = now_nanos();
+  for (size_t i = 0; i < params->nThreads; i++) {
+    ctxs[i] = (ThreadCtx) {
+      .params = params, .fmt = fmt, .timestamps = timestamps,
+    };
+    if (pthread_create(&threads[i], NULL, run_thread, &ctxs[i]) != 0) {
+      fatal("cannot create thread:");
+    }
+  }
+  *checksum = 0;
+  for (size_t i = 0; i < params->nThreads; i++) {
+    pthread_join(threads[i], NULL);
+    *checksum += ctxs[i].checksum;
+  }
+  return (now_nanos() - t0) / 1e9;
+}
+
+static void
+usage(const char *prog)
+{
+  fatal("usage: %s [-n N_PER_THREAD] [-t N_THREADS] [-s STEP_MILLIS]",
+        prog);
+}
+
+static size_t
+size_arg(const char *prog, const char *arg, size_t min)
+{
+  char *p;
+  unsigned long long v = strtoull(arg, &p, 10);
+  if (*p != '\0' || v < min) usage(prog);
+  return v;
+}
+
+int
+main(int argc, char *argv[])
+{
+  Params params = DEFAULT_PARAMS;
+  int c;
+  while ((c = getopt(argc, argv, "n:t:s:")) != -1) {
+    switch (c) {
+    case 'n': params.n = size_arg(argv[0], optarg, 1); break;
+    case 't': params.nThreads = size_arg(argv[0], optarg, 1); break;
+    case 's': params.stepMillis = size_arg(argv[0], optarg, 0); break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind != argc) usage(argv[0]);
+
+  TimeMillis *timestamps = malloc(params.n * sizeof(TimeMillis));
+  if (!timestamps) fatal("cannot allocate timestamps:");
+  uint64_t x = 88172645463325252ULL;
+  TimeMillis t = 1700000000000;
+  for (size_t i = 0; i < params.n; i++) {
+    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+    timestamps[i] = t;
+    t += params.stepMillis ? x % (2*params.stepMillis) : 0;
+  }
+
+  printf("{\n");
+  printf("  \"params\": { \"n\": %zu, \"nThreads\": %zu, "
+         "\"stepMillis\": %lld },\n", params.n, params.nThreads,
+         (long long)params.stepMillis);
+  double secs[N_FMTS];
+  uint64_t checksums[N_FMTS];
+  for (FmtType fmt = 0; fmt < N_FMTS; fmt++) {
+    secs[fmt] = run_fmt(&params, fmt, timestamps, &checksums[fmt]);
+    const double nsPerOp = secs[fmt] * 1e9 / params.n; //wall time per thread
+    printf("  \"%s\": { \"secs\": %.3f, \"nsPerOp\": %.1f, "
+           "\"speedup\": %.2f }%s\n", FMT_NAMES[fmt], secs[fmt], nsPerOp,
+           secs[STRFTIME_FMT] / secs[fmt], fmt == N_FMTS - 1 ? "" : ",");
+  }
+  printf("}\n");
+  for (FmtType fmt = 1; fmt < N_FMTS; fmt++) {
+    if (checksums[fmt] != checksums[STRFTIME_FMT]) {
+      fatal("%s output differs from %s", FMT_NAMES[fmt],
+            FMT_NAMES[STRFTIME_FMT]);
+    }
+  }
+  free(timestamps);
+  return 0;
+}
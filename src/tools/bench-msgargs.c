@@ -0,0 +1,176 @@
+#include <errors.h>
+#include <msgargs.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Throughput benchmark for read_msg_args(), read_line_args() and
+ *  MsgArgsMap.  Parses a file of commands (by default, a generated
+ *  file of synthetic add commands with multi-line messages) several
+ *  times and writes the best throughput on stdout as JSON.
+ */
+
+/** benchmark parameters */
+typedef struct {
+  const char *path;       //input file; NULL for generated input
+  bool isLine;            //use read_line_args() rather than read_msg_args()
+  bool isMap;             //parse in place using a MsgArgsMap
+  size_t nCmds;           //# of commands in generated input
+  size_t nMsgLines;       //# of message lines per generated command
+  size_t lineLen;         //length of generated message lines
+  size_t nRuns;
+} Params;
+
+static const Params DEFAULT_PARAMS = {
+  .nCmds = 100000, .nMsgLines = 4, .lineLen = 60, .nRuns = 5,
+};
+
+static uint64_t
+now_nanos(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** write generated commands to out */
+static void
+generate_input(const Params *params, FILE *out)
+{
+  uint64_t x = 88172645463325252ULL;
+  for (size_t i = 0; i < params->nCmds; i++) {
+    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+    if (params->isLine) {
+      fprintf(out, "#topic%zu ", (size_t)(x % 50));
+    }
+    else {
+      fprintf(out, "+ @user%zu room%zu #topic%zu\n", (size_t)(x % 100),
+              (size_t)(x >> 8) % 20, (size_t)(x >> 16) % 50);
+    }
+    const size_t nLines = params->isLine ? 1 : params->nMsgLines;
+    for (size_t j = 0; j < nLines; j++) {
+      for (size_t k = 0; k < params->lineLen; k++) {
+        fputc((k % 7 == 6) ? ' ' : 'a' + (i + j + k) % 26, out);
+      }
+      fputc('\n', out);
+    }
+    if (!params->isLine) fputs(".\n", out);
+  }
+}
+
+/** parse all of path in place, returning # of commands read */
+static size_t
+parse_map(const char *path, uint64_t *checksum)
+{
+  ErrNum err;
+  MsgArgsMap *map = make_msg_args_map(path, &err);
+  if (!map) fatal("cannot map %s: %s", path, errnum_to_string(err));
+  const MsgArgsView *view;
+  size_t n = 0;
+  while ((view = next_msg_args_map(map, &err)) != NULL) {
+    n++;
+    *checksum += view->nArgs + view->msg.len;
+  }
+  if (err != NO_ERR) fatal("parse error: %s", errnum_to_string(err));
+  free_msg_args_map(map);
+  return n;
+}
+
+/** parse all of in, returning # of commands read */
+static size_t
+parse_all(FILE *in, bool isLine, uint64_t *checksum)
+{
+  MsgArgs *msgArgs = NULL;
+  ErrNum err;
+  size_t n = 0;
+  while ((msgArgs = (isLine ? read_line_args : read_msg_args)(in, msgArgs,
+                                                               &err))) {
+    n++;
+    *checksum += msgArgs->nArgs + (msgArgs->msg ? strlen(msgArgs->msg) : 0);
+  }
+  if (err != NO_ERR) fatal("parse error: %s", errnum_to_string(err));
+  return n;
+}
+
+static void
+usage(const char *prog)
+{
+  fatal("usage: %s [-f FILE] [-l | -M] [-n N_CMDS] [-m N_MSG_LINES] "
+        "[-w LINE_LEN] [-r N_RUNS]\n"
+        "  -l uses read_line_args() rather than read_msg_args()\n"
+        "  -M parses in place using a MsgArgsMap", prog);
+}
+
+static size_t
+size_arg(const char *prog, const char *arg, size_t min)
+{
+  char *p;
+  unsigned long long v = strtoull(arg, &p, 10);
+  if (*p != '\0' || v < min) usage(prog);
+  return v;
+}
+
+int
+main(int argc, char *argv[])
+{
+  Params params = DEFAULT_PARAMS;
+  int c;
+  while ((c = getopt(argc, argv, "f:lMn:m:w:r:")) != -1) {
+    switch (c) {
+    case 'f': params.path = optarg; break;
+    case 'l': params.isLine = true; break;
+    case 'M': params.isMap = true; break;
+    case 'n': params.nCmds = size_arg(argv[0], optarg, 1); break;
+    case 'm': params.nMsgLines = size_arg(argv[0], optarg, 0); break;
+    case 'w': params.lineLen = size_arg(argv[0], optarg, 1); break;
+    case 'r': params.nRuns = size_arg(argv[0], optarg, 1); break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind != argc || (params.isLine && params.isMap)) usage(argv[0]);
+
+  char tmpPath[] = "/tmp/bench-msgargs-XXXXXX";
+  const char *path = params.path;
+  if (!path) {
+    int fd = mkstemp(tmpPath);
+    FILE *out = (fd < 0) ? NULL : fdopen(fd, "w");
+    if (!out) fatal("cannot create temp file:");
+    generate_input(&params, out);
+    fclose(out);
+    path = tmpPath;
+  }
+  FILE *in = fopen(path, "r");
+  if (!in) fatal("cannot open %s:", path);
+  fseek(in, 0, SEEK_END);
+  const long nBytes = ftell(in);
+
+  double bestSecs = 0;
+  size_t nParsed = 0;
+  uint64_t checksum = 0;
+  for (size_t r = 0; r < params.nRuns; r++) {
+    rewind(in);
+    checksum = 0;
+    const uint64_t t0 = now_nanos();
+    nParsed = params.isMap
+      ? parse_map(path, &checksum)
+      : parse_all(in, params.isLine, &checksum);
+    const double secs = (now_nanos() - t0) / 1e9;
+    if (r == 0 || secs < bestSecs) bestSecs = secs;
+  }
+  fclose(in);
+  if (!params.path) remove(tmpPath);
+  printf("{ \"fn\": \"%s\", \"input\": \"%s\", \"bytes\": %ld, "
+         "\"nParsed\": %zu, \"secs\": %.4f, \"mbPerSec\": %.1f, "
+         "\"parsedPerSec\": %.0f, \"checksum\": %llu }\n",
+         params.isMap ? "next_msg_args_map"
+         : params.isLine ? "read_line_args" : "read_msg_args",
+         params.path ? params.path : "generated", nBytes, nParsed, bestSecs,
+         nBytes / bestSecs / 1e6, nParsed / bestSecs,
+         (unsigned long long)checksum);
+  return 0;
+}
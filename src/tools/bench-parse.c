@@ -0,0 +1,272 @@
+#include <chat-cmd.h>
+#include <errors.h>
+#include <msgargs.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Throughput benchmark for the client parsing path: msgargs followed
+ *  by parse_cmd().  Generates in-memory corpora of commands of
+ *  different shapes:
+ *
+ *    short:   short add, query and stats commands;
+ *    topics:  add and query commands with many topics;
+ *    long:    add commands with multi-KB messages;
+ *
+ *  and parses each corpus several times using:
+ *
+ *    stream:  read_msg_args() on a memory stream;
+ *    push:    a MsgArgsParser fed fixed-size chunks.
+ *
+ *  The best commands/sec and MB/sec are written on stdout as JSON.
+ */
+
+typedef enum { SHORT_CORPUS, TOPICS_CORPUS, LONG_CORPUS, N_CORPORA } Corpus;
+
+static const char *CORPUS_NAMES[] = { "short", "topics", "long" };
+
+typedef enum { STREAM_PARSE, PUSH_PARSE, N_PARSES } ParseType;
+
+static const char *PARSE_NAMES[] = { "stream", "push" };
+
+/** benchmark parameters */
+typedef struct {
+  size_t nCmds;           //# of commands in each corpus
+  size_t nTopics;         //# of topics per command in topics corpus
+  size_t msgSize;         //approx. message size in long corpus
+  size_t chunkSize;       //size of chunks pushed into MsgArgsParser
+  size_t nRuns;
+} Params;
+
+static const Params DEFAULT_PARAMS = {
+  .nCmds = 100000, .nTopics = 32, .msgSize = 4096, .chunkSize = 4096,
+  .nRuns = 5,
+};
+
+/** result of parsing a corpus */
+typedef struct {
+  size_t nCmds;           //# of commands parsed
+  size_t nOk;             //# of commands accepted by parse_cmd()
+  uint64_t checksum;
+} Result;
+
+static uint64_t
+now_nanos(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t
+next_rand(uint64_t *x)
+{
+  *x ^= *x << 13; *x ^= *x >> 7; *x ^= *x << 17;
+  return *x;
+}
+
+/** write message of about size bytes in lines of at most 72 chars */
+static void
+generate_msg(size_t size, uint64_t *x, FILE *out)
+{
+  size_t col = 0;
+  for (size_t i = 0; i < size; i++) {
+    const uint64_t r = next_rand(x) % 64;
+    if (col == 72 || (col > 40 && r == 0)) {
+      fputc('\n', out); col = 0;
+    }
+    else {
+      fputc(r < 10 ? ' ' : 'a' + r % 26, out); col++;
+    }
+  }
+  fputc('\n', out);
+}
+
+/** write command i of corpus to out */
+static void
+generate_cmd(const Params *params, Corpus corpus, size_t i, uint64_t *x,
+             FILE *out)
+{
+  const uint64_t r = next_rand(x);
+  const size_t nTopics = (corpus == TOPICS_CORPUS) ? params->nTopics : r % 3;
+  if (corpus == LONG_CORPUS || i % 4 < 2) {
+    fprintf(out, "+ @User%zu Room%zu", (size_t)(r % 100),
+            (size_t)(r >> 8) % 20);
+  }
+  else if (corpus == SHORT_CORPUS && i % 4 == 3) {
+    fprintf(out, "%% room%zu %zu\n.\n", (size_t)(r >> 8) % 20,
+            (size_t)(r >> 16) % 10);
+    return;
+  }
+  else {
+    fprintf(out, "? room%zu %zu", (size_t)(r >> 8) % 20,
+            (size_t)(r >> 16) % 10 + 1);
+  }
+  for (size_t t = 0; t < nTopics; t++) {
+    fprintf(out, " #Topic%zu", (size_t)(next_rand(x) % 50));
+  }
+  fputc('\n', out);
+  if (corpus == LONG_CORPUS) {
+    generate_msg(params->msgSize / 2 + r % params->msgSize, x, out);
+  }
+  else if (i % 4 < 2) {
+    generate_msg(20 + r % 60, x, out);
+  }
+  fputs(".\n", out);
+}
+
+/** return malloc()'d corpus, setting *nBytes to its size */
+static char *
+generate_corpus(const Params *params, Corpus corpus, size_t *nBytes)
+{
+  char *chars = NULL;
+  FILE *out = open_memstream(&chars, nBytes);
+  if (!out) fatal("cannot open memory stream:");
+  uint64_t x = 88172645463325252ULL;
+  for (size_t i = 0; i < params->nCmds; i++) {
+    generate_cmd(params, corpus, i, &x, out);
+  }
+  if (fclose(out) != 0) fatal("cannot generate corpus:");
+  return chars;
+}
+
+/** parse msgArgs as a command, accumulating into *result */
+static void
+do_cmd(const MsgArgs *msgArgs, FILE *err, Result *result)
+{
+  ChatCmd cmd;
+  result->nCmds++;
+  if (parse_cmd(msgArgs, &cmd, err) != 0) return;
+  result->nOk++;
+  switch (cmd.type) {
+  case ADD_CMD:
+    result->checksum += cmd.add.nTopics + strlen(cmd.add.message);
+    break;
+  case QUERY_CMD:
+    result->checksum += cmd.query.nRooms + cmd.query.nTopics + cmd.query.count;
+    break;
+  case STATS_CMD:
+    result->checksum += cmd.stats.count;
+    break;
+  default:
+    break;
+  }
+}
+
+static Result
+parse_stream(const char *chars, size_t nBytes, FILE *err)
+{
+  FILE *in = fmemopen((void *)chars, nBytes, "r");
+  if (!in) fatal("cannot open memory stream:");
+  Result result = { 0 };
+  MsgArgs *msgArgs = NULL;
+  ErrNum errNum;
+  while ((msgArgs = read_msg_args(in, msgArgs, &errNum)) != NULL) {
+    do_cmd(msgArgs, err, &result);
+  }
+  if (errNum != NO_ERR) fatal("parse error: %s", errnum_to_string(errNum));
+  fclose(in);
+  return result;
+}
+
+static Result
+parse_push(const char *chars, size_t nBytes, size_t chunkSize, FILE *err)
+{
+  ErrNum errNum;
+  MsgArgsParser *parser = make_msg_args_parser(false, &errNum);
+  if (!parser) fatal("cannot create parser: %s", errnum_to_string(errNum));
+  Result result = { 0 };
+  for (size_t lo = 0; lo < nBytes; lo += chunkSize) {
+    const size_t n = (nBytes - lo < chunkSize) ? nBytes - lo : chunkSize;
+    for (size_t nConsumed, i = 0; i < n; i += nConsumed) {
+      const MsgArgs *msgArgs =
+        push_msg_args_parser(parser, &chars[lo + i], n - i, &nConsumed,
+                             &errNum);
+      if (errNum != NO_ERR) {
+        fatal("parse error: %s", errnum_to_string(errNum));
+      }
+      if (msgArgs) do_cmd(msgArgs, err, &result);
+    }
+  }
+  const MsgArgs *msgArgs = end_msg_args_parser(parser, &errNum);
+  if (msgArgs) do_cmd(msgArgs, err, &result);
+  free_msg_args_parser(parser);
+  return result;
+}
+
+static void
+usage(const char *prog)
+{
+  fatal("usage: %s [-n N_CMDS] [-t N_TOPICS] [-m MSG_SIZE] "
+        "[-c CHUNK_SIZE] [-r N_RUNS]", prog);
+}
+
+static size_t
+size_arg(const char *prog, const char *arg, size_t min)
+{
+  char *p;
+  unsigned long long v = strtoull(arg, &p, 10);
+  if (*p != '\0' || v < min) usage(prog);
+  return v;
+}
+
+int
+main(int argc, char *argv[])
+{
+  Params params = DEFAULT_PARAMS;
+  int c;
+  while ((c = getopt(argc, argv, "n:t:m:c:r:")) != -1) {
+    switch (c) {
+    case 'n': params.nCmds = size_arg(argv[0], optarg, 1); break;
+    case 't': params.nTopics = size_arg(argv[0], optarg, 0); break;
+    case 'm': params.msgSize = size_arg(argv[0], optarg, 1); break;
+    case 'c': params.chunkSize = size_arg(argv[0], optarg, 1); break;
+    case 'r': params.nRuns = size_arg(argv[0], optarg, 1); break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind != argc) usage(argv[0]);
+  FILE *err = fopen("/dev/null", "w");
+  if (!err) fatal("cannot open /dev/null:");
+
+  printf("{\n");
+  printf("  \"params\": { \"nCmds\": %zu, \"nTopics\": %zu, \"msgSize\": %zu, "
+         "\"chunkSize\": %zu },\n", params.nCmds, params.nTopics,
+         params.msgSize, params.chunkSize);
+  for (Corpus corpus = 0; corpus < N_CORPORA; corpus++) {
+    size_t nBytes;
+    char *chars = generate_corpus(&params, corpus, &nBytes);
+    printf("  \"%s\": { \"bytes\": %zu", CORPUS_NAMES[corpus], nBytes);
+    Result results[N_PARSES];
+    for (ParseType parse = 0; parse < N_PARSES; parse++) {
+      double bestSecs = 0;
+      for (size_t r = 0; r < params.nRuns; r++) {
+        const uint64_t t0 = now_nanos();
+        results[parse] = (parse == STREAM_PARSE)
+          ? parse_stream(chars, nBytes, err)
+          : parse_push(chars, nBytes, params.chunkSize, err);
+        const double secs = (now_nanos() - t0) / 1e9;
+        if (r == 0 || secs < bestSecs) bestSecs = secs;
+      }
+      printf(",\n    \"%s\": { \"nCmds\": %zu, \"nOk\": %zu, \"secs\": %.4f, "
+             "\"cmdsPerSec\": %.0f, \"mbPerSec\": %.1f }", PARSE_NAMES[parse],
+             results[parse].nCmds, results[parse].nOk, bestSecs,
+             results[parse].nCmds / bestSecs, nBytes / bestSecs / 1e6);
+    }
+    printf("\n  }%s\n", corpus == N_CORPORA - 1 ? "" : ",");
+    if (results[PUSH_PARSE].checksum != results[STREAM_PARSE].checksum ||
+        results[PUSH_PARSE].nOk != results[STREAM_PARSE].nOk) {
+      fatal("%s: push results differ from stream results",
+            CORPUS_NAMES[corpus]);
+    }
+    free(chars);
+  }
+  printf("}\n");
+  fclose(err);
+  return 0;
+}
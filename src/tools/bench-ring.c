@@ -0,0 +1,289 @@
+#include <errors.h>
+#include <ring.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Contention benchmark of ring buffers.  Each run has nProducers
+ *  threads each pushing nItems 8-byte items in batches of up to batch
+ *  items into a ring of capacity items, and nConsumers threads popping
+ *  them in batches of the same size.  A thread which finds the ring
+ *  full (or empty) yields the CPU before retrying.
+ *
+ *  Runs are made for a SpscRing with 1 producer and 1 consumer, and
+ *  for a MpmcRing and a ring protected by a mutex with 1, 2 and 4
+ *  producers and consumers, each with batch sizes of 1 and the
+ *  requested batch size.  Results are written on stdout as JSON.
+ */
+
+/** benchmark parameters */
+typedef struct {
+  size_t nItems;          //# of items pushed by each producer
+  size_t capacity;        //capacity of ring; must be a power of 2
+  size_t batch;           //max # of items per push or pop
+} Params;
+
+static const Params DEFAULT_PARAMS = {
+  .nItems = 1000000, .capacity = 1024, .batch = 32,
+};
+
+enum { MAX_BATCH = 1024, MAX_THREADS = 4 };
+
+typedef enum { SPSC_BENCH, MPMC_BENCH, MUTEX_BENCH, N_BENCHES } Bench;
+
+static const char *BENCH_NAMES[] = { "spsc", "mpmc", "mutex" };
+
+/** baseline ring: a circular buffer protected by a mutex */
+typedef struct {
+  pthread_mutex_t lock;
+  size_t head;
+  size_t tail;
+  size_t capacity;
+  uint64_t *items;
+} MutexRing;
+
+typedef struct {
+  Bench bench;
+  SpscRing *spsc;
+  MpmcRing *mpmc;
+  MutexRing *mutex;
+} Ring;
+
+typedef struct {
+  const Ring *ring;
+  size_t batch;
+  size_t nItems;          //# of items to push or pop
+  uint64_t seed;
+  uint64_t sum;           //sum of items pushed or popped
+  size_t nRetries;        //# of times ring was full or empty
+} ThreadArg;
+
+static uint64_t
+now_nanos(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** xorshift64 */
+static uint64_t
+next_rand(uint64_t *state)
+{
+  uint64_t x = *state;
+  x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+  return *state = x;
+}
+
+static size_t
+push_mutex_ring(MutexRing *ring, const uint64_t *items, size_t n)
+{
+  pthread_mutex_lock(&ring->lock);
+  size_t m = ring->capacity - (ring->tail - ring->head);
+  if (m > n) m = n;
+  for (size_t i = 0; i < m; i++) {
+    ring->items[(ring->tail + i) & (ring->capacity - 1)] = items[i];
+  }
+  ring->tail += m;
+  pthread_mutex_unlock(&ring->lock);
+  return m;
+}
+
+static size_t
+pop_mutex_ring(MutexRing *ring, uint64_t *items, size_t n)
+{
+  pthread_mutex_lock(&ring->lock);
+  size_t m = ring->tail - ring->head;
+  if (m > n) m = n;
+  for (size_t i = 0; i < m; i++) {
+    items[i] = ring->items[(ring->head + i) & (ring->capacity - 1)];
+  }
+  ring->head += m;
+  pthread_mutex_unlock(&ring->lock);
+  return m;
+}
+
+static size_t
+push_ring(const Ring *ring, const uint64_t *items, size_t n)
+{
+  switch (ring->bench) {
+  case SPSC_BENCH: return push_spsc_ring(ring->spsc, items, n);
+  case MPMC_BENCH: return push_mpmc_ring(ring->mpmc, items, n);
+  default: return push_mutex_ring(ring->mutex, items, n);
+  }
+}
+
+static size_t
+pop_ring(const Ring *ring, uint64_t *items, size_t n)
+{
+  switch (ring->bench) {
+  case SPSC_BENCH: return pop_spsc_ring(ring->spsc, items, n);
+  case MPMC_BENCH: return pop_mpmc_ring(ring->mpmc, items, n);
+  default: return pop_mutex_ring(ring->mutex, items, n);
+  }
+}
+
+static void *
+producer(void *threadArg)
+{
+  ThreadArg *arg = threadArg;
+  uint64_t items[MAX_BATCH];
+  for (size_t i = 0; i < arg->nItems; ) {
+    size_t n = arg->nItems - i;
+    if (n > arg->batch) n = arg->batch;
+    for (size_t j = 0; j < n; j++) {
+      items[j] = next_rand(&arg->seed);
+      arg->sum += items[j];
+    }
+    for (size_t pushed = 0; pushed < n; ) {
+      const size_t m = push_ring(arg->ring, &items[pushed], n - pushed);
+      if (m == 0) {
+        arg->nRetries++;
+        sched_yield();
+      }
+      pushed += m;
+    }
+    i += n;
+  }
+  return NULL;
+}
+
+static void *
+consumer(void *threadArg)
+{
+  ThreadArg *arg = threadArg;
+  uint64_t items[MAX_BATCH];
+  for (size_t i = 0; i < arg->nItems; ) {
+    size_t n = arg->nItems - i;
+    if (n > arg->batch) n = arg->batch;
+    const size_t m = pop_ring(arg->ring, items, n);
+    if (m == 0) {
+      arg->nRetries++;
+      sched_yield();
+    }
+    for (size_t j = 0; j < m; j++) arg->sum += items[j];
+    i += m;
+  }
+  return NULL;
+}
+
+/** run bench with nThreads producers and as many consumers, and print
+ *  its results.
+ */
+static void
+run_bench(Bench bench, size_t nThreads, size_t batch, const Params *params,
+          bool isFirst)
+{
+  Ring ring = { .bench = bench };
+  MutexRing mutex = { .capacity = params->capacity };
+  switch (bench) {
+  case SPSC_BENCH:
+    ring.spsc = make_spsc_ring(params->capacity, sizeof(uint64_t));
+    if (!ring.spsc) fatal("cannot make spsc ring:");
+    break;
+  case MPMC_BENCH:
+    ring.mpmc = make_mpmc_ring(params->capacity, sizeof(uint64_t));
+    if (!ring.mpmc) fatal("cannot make mpmc ring:");
+    break;
+  default:
+    pthread_mutex_init(&mutex.lock, NULL);
+    mutex.items = malloc(params->capacity * sizeof(uint64_t));
+    if (!mutex.items) fatal("cannot allocate mutex ring:");
+    ring.mutex = &mutex;
+    break;
+  }
+  pthread_t tids[2*nThreads];
+  ThreadArg args[2*nThreads];
+  const uint64_t t0 = now_nanos();
+  for (size_t t = 0; t < 2*nThreads; t++) {
+    args[t] = (ThreadArg) {
+      .ring = &ring, .batch = batch, .nItems = params->nItems,
+      .seed = 0x9e3779b97f4a7c15ULL * (t + 1),
+    };
+    if (pthread_create(&tids[t], NULL, (t < nThreads) ? producer : consumer,
+                       &args[t]) != 0) {
+      fatal("cannot create thread");
+    }
+  }
+  uint64_t pushSum = 0, popSum = 0;
+  size_t nRetries = 0;
+  for (size_t t = 0; t < 2*nThreads; t++) {
+    pthread_join(tids[t], NULL);
+    if (t < nThreads) pushSum += args[t].sum; else popSum += args[t].sum;
+    nRetries += args[t].nRetries;
+  }
+  const double secs = (now_nanos() - t0) / 1e9;
+  if (pushSum != popSum) fatal("%s: items lost", BENCH_NAMES[bench]);
+  const size_t nItems = nThreads * params->nItems;
+  printf("%s    { \"ring\": \"%s\", \"nProducers\": %zu, "
+         "\"nConsumers\": %zu, \"batch\": %zu, \"secs\": %.4f, "
+         "\"nsPerItem\": %.1f, \"mItemsPerSec\": %.2f, \"nRetries\": %zu }",
+         isFirst ? "" : ",\n", BENCH_NAMES[bench], nThreads, nThreads,
+         batch, secs, secs * 1e9 / nItems, nItems / secs / 1e6, nRetries);
+  fflush(stdout);
+  free_spsc_ring(ring.spsc);
+  free_mpmc_ring(ring.mpmc);
+  if (bench == MUTEX_BENCH) {
+    pthread_mutex_destroy(&mutex.lock);
+    free(mutex.items);
+  }
+}
+
+static void
+usage(const char *prog)
+{
+  fatal("usage: %s [-n N_ITEMS] [-c CAPACITY] [-b BATCH]", prog);
+}
+
+static size_t
+size_arg(const char *prog, const char *arg, size_t min, size_t max)
+{
+  char *p;
+  unsigned long long v = strtoull(arg, &p, 10);
+  if (*p != '\0' || v < min || v > max) usage(prog);
+  return v;
+}
+
+int
+main(int argc, char *argv[])
+{
+  Params params = DEFAULT_PARAMS;
+  int c;
+  while ((c = getopt(argc, argv, "n:c:b:")) != -1) {
+    switch (c) {
+    case 'n': params.nItems = size_arg(argv[0], optarg, 1, SIZE_MAX); break;
+    case 'c': params.capacity = size_arg(argv[0], optarg, 1, SIZE_MAX); break;
+    case 'b': params.batch = size_arg(argv[0], optarg, 1, MAX_BATCH); break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind != argc) usage(argv[0]);
+  if ((params.capacity & (params.capacity - 1)) != 0) usage(argv[0]);
+
+  printf("{\n");
+  printf("  \"params\": { \"nItems\": %zu, \"capacity\": %zu, "
+         "\"batch\": %zu, \"nCpus\": %ld },\n", params.nItems,
+         params.capacity, params.batch, sysconf(_SC_NPROCESSORS_ONLN));
+  printf("  \"runs\": [\n");
+  const size_t batches[] = { 1, params.batch };
+  const size_t nBatches = (params.batch == 1) ? 1 : 2;
+  bool isFirst = true;
+  for (Bench bench = 0; bench < N_BENCHES; bench++) {
+    for (size_t nThreads = 1; nThreads <= MAX_THREADS; nThreads *= 2) {
+      if (bench == SPSC_BENCH && nThreads > 1) break;
+      for (size_t b = 0; b < nBatches; b++) {
+        run_bench(bench, nThreads, batches[b], &params, isFirst);
+        isFirst = false;
+      }
+    }
+  }
+  printf("\n  ]\n}\n");
+  return 0;
+}
@@ -0,0 +1,249 @@
+#include <errors.h>
+#include <slab.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/** Benchmark of a connect/disconnect storm comparing malloc() with a
+ *  SlabAllocator.  Each of nThreads threads maintains a window of
+ *  live connections, each consisting of a connection struct, user
+ *  and room names, and a random # of message nodes of random sizes.
+ *  Each operation disconnects a random connection, freeing all its
+ *  allocations, and replaces it with a new connection.
+ *
+ *  Each allocator is run in a separate child process so that RSS is
+ *  measured independently.  Results are written on stdout as JSON.
+ */
+
+/** benchmark parameters */
+typedef struct {
+  size_t nThreads;
+  size_t nConns;          //# of live connections per thread
+  size_t nMsgs;           //max # of messages per connection
+  size_t nOps;            //# of disconnect/connect ops per thread
+} Params;
+
+static const Params DEFAULT_PARAMS = {
+  .nThreads = 4, .nConns = 256, .nMsgs = 32, .nOps = 200000,
+};
+
+enum {
+  CONN_SIZE = 320, NAME_SIZE = 24, MAX_MSG_SIZE = 1024, MAX_MSGS = 128,
+};
+
+typedef enum { MALLOC_BENCH, SLAB_BENCH, N_BENCHES } Bench;
+
+static const char *BENCH_NAMES[] = { "malloc", "slab" };
+
+typedef struct {
+  size_t nAllocs;
+  size_t size[3 + MAX_MSGS];  //sizes of allocations in ptrs[]
+  void *ptrs[3 + MAX_MSGS];   //conn, user, room, messages
+} Conn;
+
+typedef struct {
+  const Params *params;
+  Bench bench;
+  SlabAllocator *allocator;
+  uint64_t seed;
+  size_t nAllocs;         //# of allocations done by thread
+} ThreadArg;
+
+static uint64_t
+now_nanos(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** xorshift64 */
+static uint64_t
+next_rand(uint64_t *state)
+{
+  uint64_t x = *state;
+  x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+  return *state = x;
+}
+
+static void *
+do_alloc(ThreadArg *arg, size_t size)
+{
+  void *p = (arg->bench == SLAB_BENCH)
+    ? alloc_slab_allocator(arg->allocator, size) : malloc(size);
+  if (!p) fatal("cannot allocate %zu bytes:", size);
+  memset(p, 0, size < 64 ? size : 64);  //touch it as a client would
+  arg->nAllocs++;
+  return p;
+}
+
+static void
+do_free(ThreadArg *arg, void *p, size_t size)
+{
+  if (arg->bench == SLAB_BENCH) {
+    dealloc_slab_allocator(arg->allocator, p, size);
+  }
+  else {
+    free(p);
+  }
+}
+
+static void
+connect_conn(ThreadArg *arg, Conn *conn)
+{
+  const size_t nMsgs = next_rand(&arg->seed) % (arg->params->nMsgs + 1);
+  conn->nAllocs = 0;
+  conn->size[conn->nAllocs++] = CONN_SIZE;
+  conn->size[conn->nAllocs++] = NAME_SIZE;
+  conn->size[conn->nAllocs++] = NAME_SIZE;
+  for (size_t i = 0; i < nMsgs; i++) {
+    conn->size[conn->nAllocs++] =
+      32 + next_rand(&arg->seed) % (MAX_MSG_SIZE - 32);
+  }
+  for (size_t i = 0; i < conn->nAllocs; i++) {
+    conn->ptrs[i] = do_alloc(arg, conn->size[i]);
+  }
+}
+
+static void
+disconnect_conn(ThreadArg *arg, Conn *conn)
+{
+  for (size_t i = 0; i < conn->nAllocs; i++) {
+    do_free(arg, conn->ptrs[i], conn->size[i]);
+  }
+  conn->nAllocs = 0;
+}
+
+static void *
+storm(void *threadArg)
+{
+  ThreadArg *arg = threadArg;
+  const Params *params = arg->params;
+  Conn *conns = calloc(params->nConns, sizeof(Conn));
+  if (!conns) fatal("cannot allocate conns:");
+  for (size_t i = 0; i < params->nConns; i++) connect_conn(arg, &conns[i]);
+  for (size_t op = 0; op < params->nOps; op++) {
+    Conn *conn = &conns[next_rand(&arg->seed) % params->nConns];
+    disconnect_conn(arg, conn);
+    connect_conn(arg, conn);
+  }
+  for (size_t i = 0; i < params->nConns; i++) disconnect_conn(arg, &conns[i]);
+  free(conns);
+  return NULL;
+}
+
+/** return current resident set size in KB */
+static size_t
+rss_kb(void)
+{
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (!f) return 0;
+  size_t size, resident;
+  const int n = fscanf(f, "%zu %zu", &size, &resident);
+  fclose(f);
+  return (n == 2) ? resident * (sysconf(_SC_PAGESIZE) / 1024) : 0;
+}
+
+/** run bench and print its results; called in a child process */
+static void
+run_bench(Bench bench, const Params *params)
+{
+  SlabAllocator allocator;
+  if (init_slab_allocator(&allocator) != 0) fatal("cannot init allocator");
+  pthread_t tids[params->nThreads];
+  ThreadArg args[params->nThreads];
+  const uint64_t t0 = now_nanos();
+  for (size_t t = 0; t < params->nThreads; t++) {
+    args[t] = (ThreadArg) {
+      .params = params, .bench = bench, .allocator = &allocator,
+      .seed = 0x9e3779b97f4a7c15ULL * (t + 1),
+    };
+    if (pthread_create(&tids[t], NULL, storm, &args[t]) != 0) {
+      fatal("cannot create thread");
+    }
+  }
+  size_t nAllocs = 0;
+  for (size_t t = 0; t < params->nThreads; t++) {
+    pthread_join(tids[t], NULL);
+    nAllocs += args[t].nAllocs;
+  }
+  const double secs = (now_nanos() - t0) / 1e9;
+  const size_t rssKb = rss_kb();
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  //# of calls to the underlying malloc()
+  SlabStats stats;
+  stats_slab_allocator(&allocator, &stats);
+  const size_t nMallocs =
+    (bench == SLAB_BENCH) ? stats.nSlabs + stats.nLarge : nAllocs;
+  printf("  \"%s\": { \"secs\": %.4f, \"nsPerAlloc\": %.1f, "
+         "\"nAllocs\": %zu, \"nMallocs\": %zu, \"rssKb\": %zu, "
+         "\"maxRssKb\": %ld }", BENCH_NAMES[bench], secs,
+         secs * 1e9 / nAllocs, nAllocs, nMallocs, rssKb, usage.ru_maxrss);
+  free_slab_allocator(&allocator);
+}
+
+static void
+usage(const char *prog)
+{
+  fatal("usage: %s [-t N_THREADS] [-c N_CONNS] [-m N_MSGS] [-n N_OPS]",
+        prog);
+}
+
+static size_t
+size_arg(const char *prog, const char *arg, size_t min, size_t max)
+{
+  char *p;
+  unsigned long long v = strtoull(arg, &p, 10);
+  if (*p != '\0' || v < min || v > max) usage(prog);
+  return v;
+}
+
+int
+main(int argc, char *argv[])
+{
+  Params params = DEFAULT_PARAMS;
+  int c;
+  while ((c = getopt(argc, argv, "t:c:m:n:")) != -1) {
+    switch (c) {
+    case 't': params.nThreads = size_arg(argv[0], optarg, 1, 64); break;
+    case 'c': params.nConns = size_arg(argv[0], optarg, 1, SIZE_MAX); break;
+    case 'm': params.nMsgs = size_arg(argv[0], optarg, 0, MAX_MSGS); break;
+    case 'n': params.nOps = size_arg(argv[0], optarg, 1, SIZE_MAX); break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind != argc) usage(argv[0]);
+
+  printf("{\n");
+  printf("  \"params\": { \"nThreads\": %zu, \"nConns\": %zu, "
+         "\"nMsgs\": %zu, \"nOps\": %zu },\n", params.nThreads,
+         params.nConns, params.nMsgs, params.nOps);
+  for (Bench bench = 0; bench < N_BENCHES; bench++) {
+    fflush(stdout);
+    const pid_t pid = fork();
+    if (pid < 0) fatal("cannot fork:");
+    if (pid == 0) {
+      run_bench(bench, &params);
+      printf("%s\n", bench == N_BENCHES - 1 ? "" : ",");
+      fflush(stdout);
+      _exit(0);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+      fatal("%s benchmark failed", BENCH_NAMES[bench]);
+    }
+  }
+  printf("}\n");
+  return 0;
+}
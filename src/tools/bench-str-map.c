@@ -0,0 +1,271 @@
+#include <errors.h>
+#include <interner.h>
+#include <str-map.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Microbenchmark comparing lookups of names in a set of nNames
+ *  names using:
+ *
+ *    scan:      a linear scan with strcmp(), as done by prj5's
+ *               broadcast_to_room();
+ *    scanCase:  a linear scan with strcasecmp(), as done by prj1's
+ *               is_known_room();
+ *    map:       a StrMap;
+ *    mapCase:   a case-insensitive StrMap;
+ *    hashed:    a StrMap with the hash of each probe precomputed;
+ *    interner:  find_interner() on an Interner.
+ *
+ *  Half the lookups are for names in the set and half for names not
+ *  in it.  The sizes given by -n are benchmarked in turn, with the #
+ *  of lookups for each scaled so that all do roughly the same work.
+ *  Results are written on stdout as JSON.
+ */
+
+/** benchmark parameters */
+typedef struct {
+  size_t nLookups;        //# of lookups per run
+  size_t nameLen;         //approx length of names
+  size_t nRuns;
+} Params;
+
+static const Params DEFAULT_PARAMS = {
+  .nLookups = 2000000, .nameLen = 10, .nRuns = 5,
+};
+
+static const size_t DEFAULT_SIZES[] = { 4, 16, 64, 256, 1024 };
+enum { N_DEFAULT_SIZES = sizeof(DEFAULT_SIZES)/sizeof(DEFAULT_SIZES[0]) };
+enum { MAX_SIZES = 16 };
+
+static uint64_t
+now_nanos(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** xorshift64 */
+static uint64_t
+next_rand(uint64_t *state)
+{
+  uint64_t x = *state;
+  x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+  return *state = x;
+}
+
+/** return malloc()'d name i of approx length nameLen; names with odd
+ *  i are used only as probes which are not in the set.
+ */
+static char *
+make_name(size_t i, size_t nameLen)
+{
+  char *name = malloc(nameLen + 24);
+  if (!name) fatal("cannot allocate name:");
+  //common prefix makes strcmp() do some work, as for real names
+  size_t n = 0;
+  for (; n < nameLen / 2; n++) name[n] = 'a' + n % 26;
+  sprintf(&name[n], "%zu", i);
+  return name;
+}
+
+typedef struct {
+  size_t nNames;
+  char **names;           //names[nNames] in set
+  size_t nProbes;
+  const char **probes;    //probes[nProbes]: names to look up
+  uint64_t *hashes;       //hashes[nProbes] of probes for map
+  StrMap map;
+  StrMap mapCase;
+  Interner interner;
+} Data;
+
+static void
+make_data(Data *data, size_t nNames, size_t nameLen)
+{
+  enum { N_PROBES = 4096 };
+  data->nNames = nNames;
+  data->names = malloc(2 * nNames * sizeof(char *));
+  data->nProbes = N_PROBES;
+  data->probes = malloc(N_PROBES * sizeof(char *));
+  data->hashes = malloc(N_PROBES * sizeof(uint64_t));
+  if (!data->names || !data->probes || !data->hashes) {
+    fatal("cannot allocate data:");
+  }
+  init_str_map(&data->map, false);
+  init_str_map(&data->mapCase, true);
+  init_interner(&data->interner, false);
+  for (size_t i = 0; i < 2 * nNames; i++) {
+    data->names[i] = make_name(i, nameLen);
+    if (i % 2 == 1) continue;
+    unsigned id;
+    if (put_str_map(&data->map, data->names[i], data->names[i]) != 0 ||
+        put_str_map(&data->mapCase, data->names[i], data->names[i]) != 0 ||
+        add_interner(&data->interner, data->names[i], &id) != 0) {
+      fatal("cannot add name");
+    }
+  }
+  uint64_t state = 0x9e3779b97f4a7c15ULL;
+  for (size_t i = 0; i < N_PROBES; i++) {
+    data->probes[i] = data->names[next_rand(&state) % (2 * nNames)];
+    data->hashes[i] = hash_str_map(&data->map, data->probes[i]);
+  }
+}
+
+static void
+free_data(Data *data)
+{
+  free_str_map(&data->map);
+  free_str_map(&data->mapCase);
+  free_interner(&data->interner);
+  for (size_t i = 0; i < 2 * data->nNames; i++) free(data->names[i]);
+  free(data->names);
+  free(data->probes);
+  free(data->hashes);
+}
+
+typedef enum {
+  SCAN, SCAN_CASE, MAP, MAP_CASE, HASHED, INTERNER, N_BENCHES
+} Bench;
+
+static const char *BENCH_NAMES[] = {
+  "scan", "scanCase", "map", "mapCase", "hashed", "interner",
+};
+
+//results of timed runs are accumulated here so they are not optimized away
+static volatile uint64_t sink;
+
+/** return # of probes found in data using bench */
+static uint64_t
+run_bench(Bench bench, const Data *data, size_t nLookups)
+{
+  uint64_t nFound = 0;
+  const size_t mask = data->nProbes - 1;
+  for (size_t i = 0; i < nLookups; i++) {
+    const char *probe = data->probes[i & mask];
+    switch (bench) {
+    case SCAN:
+      for (size_t j = 0; j < 2 * data->nNames; j += 2) {
+        if (strcmp(data->names[j], probe) == 0) { nFound++; break; }
+      }
+      break;
+    case SCAN_CASE:
+      for (size_t j = 0; j < 2 * data->nNames; j += 2) {
+        if (strcasecmp(data->names[j], probe) == 0) { nFound++; break; }
+      }
+      break;
+    case MAP:
+      nFound += get_str_map(&data->map, probe, NULL);
+      break;
+    case MAP_CASE:
+      nFound += get_str_map(&data->mapCase, probe, NULL);
+      break;
+    case HASHED:
+      nFound += get_hashed_str_map(&data->map, probe, data->hashes[i & mask],
+                                   NULL);
+      break;
+    case INTERNER:
+      nFound += find_interner(&data->interner, probe, NULL);
+      break;
+    default:
+      break;
+    }
+  }
+  return nFound;
+}
+
+static void
+usage(const char *prog)
+{
+  fatal("usage: %s [-n N_NAMES[,N_NAMES...]] [-q N_LOOKUPS] [-l NAME_LEN] "
+        "[-r N_RUNS]", prog);
+}
+
+static size_t
+size_arg(const char *prog, const char *arg, size_t min)
+{
+  char *p;
+  unsigned long long v = strtoull(arg, &p, 10);
+  if (*p != '\0' || v < min) usage(prog);
+  return v;
+}
+
+int
+main(int argc, char *argv[])
+{
+  Params params = DEFAULT_PARAMS;
+  size_t sizes[MAX_SIZES];
+  size_t nSizes = N_DEFAULT_SIZES;
+  memcpy(sizes, DEFAULT_SIZES, sizeof(DEFAULT_SIZES));
+  int c;
+  while ((c = getopt(argc, argv, "n:q:l:r:")) != -1) {
+    switch (c) {
+    case 'n':
+      nSizes = 0;
+      for (char *saveP, *s = strtok_r(optarg, ",", &saveP); s != NULL;
+           s = strtok_r(NULL, ",", &saveP)) {
+        if (nSizes == MAX_SIZES) usage(argv[0]);
+        sizes[nSizes++] = size_arg(argv[0], s, 1);
+      }
+      if (nSizes == 0) usage(argv[0]);
+      break;
+    case 'q': params.nLookups = size_arg(argv[0], optarg, 1); break;
+    case 'l': params.nameLen = size_arg(argv[0], optarg, 1); break;
+    case 'r': params.nRuns = size_arg(argv[0], optarg, 1); break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind != argc) usage(argv[0]);
+
+  printf("{\n");
+  printf("  \"params\": { \"nLookups\": %zu, \"nameLen\": %zu },\n",
+         params.nLookups, params.nameLen);
+  printf("  \"results\": [\n");
+  for (size_t s = 0; s < nSizes; s++) {
+    Data data;
+    make_data(&data, sizes[s], params.nameLen);
+    //a scan costs O(nNames), so scale down its lookups for large sets
+    const size_t scanLookups =
+      params.nLookups / (1 + sizes[s] / DEFAULT_SIZES[0]);
+    double nsPerOp[N_BENCHES];
+    uint64_t nFound[N_BENCHES];
+    for (Bench bench = 0; bench < N_BENCHES; bench++) {
+      const bool isScan = (bench == SCAN || bench == SCAN_CASE);
+      const size_t nLookups = isScan ? scanLookups : params.nLookups;
+      double secs = 0;
+      for (size_t r = 0; r < params.nRuns; r++) {
+        const uint64_t t0 = now_nanos();
+        sink += run_bench(bench, &data, nLookups);
+        const double t = (now_nanos() - t0) / 1e9;
+        if (r == 0 || t < secs) secs = t;
+      }
+      nsPerOp[bench] = secs * 1e9 / nLookups;
+      //check results over the same lookups for all benches
+      nFound[bench] = run_bench(bench, &data, scanLookups);
+    }
+    printf("    { \"nNames\": %zu", sizes[s]);
+    for (Bench bench = 0; bench < N_BENCHES; bench++) {
+      printf(", \"%s\": { \"nsPerOp\": %.1f, \"speedup\": %.2f }",
+             BENCH_NAMES[bench], nsPerOp[bench],
+             nsPerOp[SCAN] / nsPerOp[bench]);
+    }
+    printf(" }%s\n", s == nSizes - 1 ? "" : ",");
+    for (Bench bench = 1; bench < N_BENCHES; bench++) {
+      if (nFound[bench] != nFound[SCAN]) {
+        fatal("%s found %llu names, but scan found %llu", BENCH_NAMES[bench],
+              (unsigned long long)nFound[bench],
+              (unsigned long long)nFound[SCAN]);
+      }
+    }
+    free_data(&data);
+  }
+  printf("  ]\n}\n");
+  return 0;
+}
@@ -0,0 +1,247 @@
+#include <errors.h>
+#include <len-str-space.h>
+#include <str-space.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Microbenchmark comparing StrSpace with LenStrSpace for the
+ *  patterns used by query_chat_db():
+ *
+ *    rows:  for each result row, clear the space, add the user, room
+ *           and topics (whose lengths are known from sqlite3), then
+ *           iterate over them to set up the result pointers;
+ *    sql:   build a chats query for a number of topics using
+ *           sprintf-style appends.
+ *
+ *  Results are written on stdout as JSON.
+ */
+
+enum { N_NAMES = 64 };
+
+/** benchmark parameters */
+typedef struct {
+  size_t nRows;           //# of rows materialized
+  size_t nTopics;         //# of topics per row and in each query
+  size_t nameLen;         //length of user, room and topic names
+  size_t nQueries;        //# of queries built
+  size_t nRuns;
+} Params;
+
+static const Params DEFAULT_PARAMS = {
+  .nRows = 2000000, .nTopics = 4, .nameLen = 12, .nQueries = 500000,
+  .nRuns = 5,
+};
+
+/** names with lengths, as returned by sqlite3_column_text/bytes() */
+typedef struct {
+  char *chars;
+  size_t len;
+} Name;
+
+static uint64_t
+now_nanos(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t
+rows_str_space(const Params *params, const Name names[N_NAMES])
+{
+  StrSpace space;
+  init_str_space(&space);
+  const char *results[params->nTopics + 2];
+  uint64_t checksum = 0;
+  for (size_t i = 0; i < params->nRows; i++) {
+    clear_str_space(&space);
+    for (size_t j = 0; j < params->nTopics + 2; j++) {
+      if (add_str_space(&space, names[(i + j) % N_NAMES].chars) != 0) {
+        fatal("cannot add to str-space");
+      }
+    }
+    size_t n = 0;
+    for (const char *str = iter_str_space(&space, NULL); str != NULL;
+         str = iter_str_space(&space, str)) {
+      results[n++] = str;
+    }
+    checksum += n + results[n - 1][0];
+  }
+  free_str_space(&space);
+  return checksum;
+}
+
+static uint64_t
+rows_len_str_space(const Params *params, const Name names[N_NAMES])
+{
+  LenStrSpace space;
+  init_len_str_space(&space);
+  const char *results[params->nTopics + 2];
+  uint64_t checksum = 0;
+  for (size_t i = 0; i < params->nRows; i++) {
+    clear_len_str_space(&space);
+    for (size_t j = 0; j < params->nTopics + 2; j++) {
+      const Name *name = &names[(i + j) % N_NAMES];
+      if (add_n_len_str_space(&space, name->chars, name->len) != 0) {
+        fatal("cannot add to len-str-space");
+      }
+    }
+    size_t n = 0;
+    for (const char *str = iter_len_str_space(&space, NULL); str != NULL;
+         str = iter_len_str_space(&space, str)) {
+      results[n++] = str;
+    }
+    checksum += n + results[n - 1][0];
+  }
+  free_len_str_space(&space);
+  return checksum;
+}
+
+#define SQL_PREFIX "SELECT user, room, message, creationTime, id FROM "
+
+static uint64_t
+sql_str_space(const Params *params)
+{
+  uint64_t checksum = 0;
+  for (size_t q = 0; q < params->nQueries; q++) {
+    StrSpace space;
+    init_str_space(&space);
+    int rc = append_sprintf_str_space(&space, SQL_PREFIX);
+    for (size_t i = 0; i < params->nTopics; i++) {
+      rc |= append_sprintf_str_space(&space, "topics T%zu, ", i);
+    }
+    rc |= append_str_space(&space, "chats WHERE ");
+    for (size_t i = 0; i < params->nTopics; i++) {
+      rc |= append_sprintf_str_space(&space, "T%zu.chatId = id AND "
+                                     "T%zu.topic = lower(?) AND ", i, i);
+    }
+    rc |= append_sprintf_str_space(&space, "room = lower(?) ORDER BY id %s;",
+                                   "DESC");
+    if (rc != 0) fatal("cannot build sql in str-space");
+    checksum += strlen(iter_str_space(&space, NULL));
+    free_str_space(&space);
+  }
+  return checksum;
+}
+
+static uint64_t
+sql_len_str_space(const Params *params)
+{
+  static const char WHERE[] = "chats WHERE ";
+  uint64_t checksum = 0;
+  for (size_t q = 0; q < params->nQueries; q++) {
+    LenStrSpace space;
+    init_len_str_space(&space);
+    int rc = append_sprintf_len_str_space(&space, SQL_PREFIX);
+    for (size_t i = 0; i < params->nTopics; i++) {
+      rc |= append_sprintf_len_str_space(&space, "topics T%zu, ", i);
+    }
+    rc |= append_n_len_str_space(&space, WHERE, sizeof(WHERE) - 1);
+    for (size_t i = 0; i < params->nTopics; i++) {
+      rc |= append_sprintf_len_str_space(&space, "T%zu.chatId = id AND "
+                                         "T%zu.topic = lower(?) AND ", i, i);
+    }
+    rc |= append_sprintf_len_str_space(&space,
+                                       "room = lower(?) ORDER BY id %s;",
+                                       "DESC");
+    if (rc != 0) fatal("cannot build sql in len-str-space");
+    checksum += str_len_len_str_space(iter_len_str_space(&space, NULL));
+    free_len_str_space(&space);
+  }
+  return checksum;
+}
+
+typedef enum { ROWS_STR, ROWS_LEN_STR, SQL_STR, SQL_LEN_STR, N_BENCHES } Bench;
+
+static const char *BENCH_NAMES[] = {
+  "rowsStrSpace", "rowsLenStrSpace", "sqlStrSpace", "sqlLenStrSpace",
+};
+
+static uint64_t
+run_bench(Bench bench, const Params *params, const Name names[N_NAMES])
+{
+  switch (bench) {
+  case ROWS_STR: return rows_str_space(params, names);
+  case ROWS_LEN_STR: return rows_len_str_space(params, names);
+  case SQL_STR: return sql_str_space(params);
+  case SQL_LEN_STR: return sql_len_str_space(params);
+  default: return 0;
+  }
+}
+
+static void
+usage(const char *prog)
+{
+  fatal("usage: %s [-n N_ROWS] [-t N_TOPICS] [-l NAME_LEN] [-q N_QUERIES] "
+        "[-r N_RUNS]", prog);
+}
+
+static size_t
+size_arg(const char *prog, const char *arg, size_t min)
+{
+  char *p;
+  unsigned long long v = strtoull(arg, &p, 10);
+  if (*p != '\0' || v < min) usage(prog);
+  return v;
+}
+
+int
+main(int argc, char *argv[])
+{
+  Params params = DEFAULT_PARAMS;
+  int c;
+  while ((c = getopt(argc, argv, "n:t:l:q:r:")) != -1) {
+    switch (c) {
+    case 'n': params.nRows = size_arg(argv[0], optarg, 1); break;
+    case 't': params.nTopics = size_arg(argv[0], optarg, 0); break;
+    case 'l': params.nameLen = size_arg(argv[0], optarg, 1); break;
+    case 'q': params.nQueries = size_arg(argv[0], optarg, 1); break;
+    case 'r': params.nRuns = size_arg(argv[0], optarg, 1); break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind != argc) usage(argv[0]);
+
+  Name names[N_NAMES];
+  for (size_t i = 0; i < N_NAMES; i++) {
+    const size_t len = params.nameLen / 2 + i % (params.nameLen + 1);
+    names[i].chars = malloc(len + 1);
+    if (!names[i].chars) fatal("cannot allocate names:");
+    for (size_t j = 0; j < len; j++) names[i].chars[j] = 'a' + (i + j) % 26;
+    names[i].chars[len] = '\0';
+    names[i].len = len;
+  }
+
+  printf("{\n");
+  printf("  \"params\": { \"nRows\": %zu, \"nTopics\": %zu, \"nameLen\": %zu, "
+         "\"nQueries\": %zu },\n", params.nRows, params.nTopics,
+         params.nameLen, params.nQueries);
+  double secs[N_BENCHES];
+  uint64_t checksums[N_BENCHES];
+  for (Bench bench = 0; bench < N_BENCHES; bench++) {
+    for (size_t r = 0; r < params.nRuns; r++) {
+      const uint64_t t0 = now_nanos();
+      checksums[bench] = run_bench(bench, &params, names);
+      const double s = (now_nanos() - t0) / 1e9;
+      if (r == 0 || s < secs[bench]) secs[bench] = s;
+    }
+    const size_t n = bench < SQL_STR ? params.nRows : params.nQueries;
+    const double base = secs[bench < SQL_STR ? ROWS_STR : SQL_STR];
+    printf("  \"%s\": { \"secs\": %.4f, \"nsPerOp\": %.1f, "
+           "\"speedup\": %.2f }%s\n", BENCH_NAMES[bench], secs[bench],
+           secs[bench] * 1e9 / n, base / secs[bench],
+           bench == N_BENCHES - 1 ? "" : ",");
+  }
+  printf("}\n");
+  if (checksums[ROWS_LEN_STR] != checksums[ROWS_STR] ||
+      checksums[SQL_LEN_STR] != checksums[SQL_STR]) {
+    fatal("len-str-space results differ from str-space results");
+  }
+  for (size_t i = 0; i < N_NAMES; i++) free(names[i].chars);
+  return 0;
+}
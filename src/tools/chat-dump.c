@@ -0,0 +1,466 @@
+#include "chat-dump.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Streaming binary dump format for chat messages.  See chat-dump.h
+ *  for the grammar.
+ */
+
+enum {
+  NAME_TAG = 'N',
+  CHAT_TAG = 'C',
+  END_TAG = 'E',
+};
+
+enum { INIT_NAMES_CAPACITY = 256 };
+
+/** max length of a string in a dump; a longer length prefix is taken
+ *  to be a corrupt dump rather than grounds for a huge allocation.
+ */
+enum { MAX_DUMP_STRING_LEN = 64 * 1024 * 1024 };
+
+/** return a static string explaining status */
+const char *
+dump_status_to_string(DumpStatus status)
+{
+  switch (status) {
+  case DUMP_OK: return "ok";
+  case DUMP_END: return "end of dump";
+  case DUMP_IO_ERR: return "I/O error";
+  case DUMP_FORMAT_ERR: return "bad dump format";
+  case DUMP_MEM_ERR: return "memory allocation error";
+  default: assert(0); return NULL;
+  }
+}
+
+/******************************* Varints *******************************/
+
+static DumpStatus
+write_varint(FILE *out, uint64_t value)
+{
+  do {
+    uint8_t byte = value & 0x7f;
+    value >>= 7;
+    if (value != 0) byte |= 0x80;
+    if (putc_unlocked(byte, out) == EOF) return DUMP_IO_ERR;
+  } while (value != 0);
+  return DUMP_OK;
+}
+
+static DumpStatus
+read_varint(FILE *in, uint64_t *value)
+{
+  uint64_t v = 0;
+  for (unsigned shift = 0; shift < 64; shift += 7) {
+    int c = getc_unlocked(in);
+    if (c == EOF) return ferror(in) ? DUMP_IO_ERR : DUMP_FORMAT_ERR;
+    v |= (uint64_t)(c & 0x7f) << shift;
+    if ((c & 0x80) == 0) { *value = v; return DUMP_OK; }
+  }
+  return DUMP_FORMAT_ERR;
+}
+
+static inline uint64_t
+zigzag(int64_t v)
+{
+  return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t
+unzigzag(uint64_t v)
+{
+  return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static DumpStatus
+write_bytes(FILE *out, const char *str, size_t len)
+{
+  DumpStatus status = write_varint(out, len);
+  if (status != DUMP_OK) return status;
+  return (fwrite(str, 1, len, out) == len) ? DUMP_OK : DUMP_IO_ERR;
+}
+
+/** read length-prefixed string into *buf (grown as needed), adding a
+ *  terminating NUL.
+ */
+static DumpStatus
+read_bytes(FILE *in, char **buf, size_t *capacity)
+{
+  uint64_t len;
+  DumpStatus status = read_varint(in, &len);
+  if (status != DUMP_OK) return status;
+  if (len > MAX_DUMP_STRING_LEN) return DUMP_FORMAT_ERR;
+  if (len + 1 > *capacity) {
+    size_t capacity1 = (*capacity == 0) ? 64 : *capacity;
+    while (capacity1 < len + 1) capacity1 *= 2;
+    char *buf1 = realloc(*buf, capacity1);
+    if (!buf1) return DUMP_MEM_ERR;
+    *buf = buf1;
+    *capacity = capacity1;
+  }
+  if (fread(*buf, 1, len, in) != len) {
+    return ferror(in) ? DUMP_IO_ERR : DUMP_FORMAT_ERR;
+  }
+  (*buf)[len] = '\0';
+  return DUMP_OK;
+}
+
+/******************************** Writer *******************************/
+
+/** 64-bit FNV-1a hash of NUL-terminated key */
+static uint64_t
+hash_name(const char *key)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (const char *p = key; *p != '\0'; p++) {
+    h ^= (uint8_t)*p;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+/** return slot in names[capacity] for key: either the slot containing
+ *  key or the empty slot where it should be inserted.
+ */
+static DumpName *
+find_name_slot(DumpName *names, size_t capacity, const char *key)
+{
+  size_t i = hash_name(key) & (capacity - 1);
+  while (names[i].key != NULL && strcmp(names[i].key, key) != 0) {
+    i = (i + 1) & (capacity - 1);
+  }
+  return &names[i];
+}
+
+static DumpStatus
+grow_names(ChatDumpWriter *writer)
+{
+  const size_t capacity = 2*writer->capacity;
+  DumpName *names = calloc(capacity, sizeof(DumpName));
+  if (!names) return DUMP_MEM_ERR;
+  for (size_t i = 0; i < writer->capacity; i++) {
+    const DumpName *name = &writer->names[i];
+    if (name->key) *find_name_slot(names, capacity, name->key) = *name;
+  }
+  free(writer->names);
+  writer->names = names;
+  writer->capacity = capacity;
+  return DUMP_OK;
+}
+
+/** set *index to dictionary index for name, writing out a NAME record
+ *  if name was not previously in the dictionary.
+ */
+static DumpStatus
+name_index(ChatDumpWriter *writer, const char *name, uint64_t *index)
+{
+  DumpName *slot = find_name_slot(writer->names, writer->capacity, name);
+  if (slot->key != NULL) {
+    *index = slot->index;
+    return DUMP_OK;
+  }
+  const size_t len = strlen(name);
+  char *key = malloc(len + 1);
+  if (!key) return DUMP_MEM_ERR;
+  memcpy(key, name, len + 1);
+  *slot = (DumpName) { .key = key, .index = writer->nNames++ };
+  *index = slot->index;
+  if (putc_unlocked(NAME_TAG, writer->out) == EOF) return DUMP_IO_ERR;
+  DumpStatus status = write_bytes(writer->out, name, len);
+  if (status != DUMP_OK) return status;
+  //keep load factor <= 1/2
+  return (2*writer->nNames > writer->capacity) ? grow_names(writer) : DUMP_OK;
+}
+
+/** initialize writer to write a dump on out, writing out the dump
+ *  header.
+ */
+DumpStatus
+init_chat_dump_writer(ChatDumpWriter *writer, FILE *out)
+{
+  DumpName *names = calloc(INIT_NAMES_CAPACITY, sizeof(DumpName));
+  if (!names) return DUMP_MEM_ERR;
+  *writer = (ChatDumpWriter) {
+    .out = out, .capacity = INIT_NAMES_CAPACITY, .names = names,
+  };
+  const size_t magicLen = strlen(CHAT_DUMP_MAGIC);
+  if (fwrite(CHAT_DUMP_MAGIC, 1, magicLen, out) != magicLen) {
+    return DUMP_IO_ERR;
+  }
+  return write_varint(out, CHAT_DUMP_VERSION);
+}
+
+/** write chat to the dump for writer */
+DumpStatus
+write_chat_dump(ChatDumpWriter *writer, const ChatInfo *chat)
+{
+  //names must be defined before the CHAT record which uses them
+  uint64_t user, room;
+  uint64_t topics[chat->nTopics > 0 ? chat->nTopics : 1];
+  DumpStatus status = name_index(writer, chat->user, &user);
+  if (status == DUMP_OK) status = name_index(writer, chat->room, &room);
+  for (size_t i = 0; status == DUMP_OK && i < chat->nTopics; i++) {
+    status = name_index(writer, chat->topics[i], &topics[i]);
+  }
+  if (status != DUMP_OK) return status;
+  FILE *out = writer->out;
+  const int64_t timeDelta = chat->timestamp - writer->lastTimestamp;
+  if (putc_unlocked(CHAT_TAG, out) == EOF) return DUMP_IO_ERR;
+  const uint64_t ints[] = { user, room, zigzag(timeDelta), chat->nTopics };
+  for (int i = 0; status == DUMP_OK && i < sizeof(ints)/sizeof(ints[0]); i++) {
+    status = write_varint(out, ints[i]);
+  }
+  for (size_t i = 0; status == DUMP_OK && i < chat->nTopics; i++) {
+    status = write_varint(out, topics[i]);
+  }
+  if (status == DUMP_OK) {
+    status = write_bytes(out, chat->message, strlen(chat->message));
+  }
+  if (status != DUMP_OK) return status;
+  writer->nChats++;
+  writer->lastTimestamp = chat->timestamp;
+  return DUMP_OK;
+}
+
+/** write the END record for writer and flush its output.  No chats
+ *  may be written after this.
+ */
+DumpStatus
+end_chat_dump_writer(ChatDumpWriter *writer)
+{
+  if (putc_unlocked(END_TAG, writer->out) == EOF) return DUMP_IO_ERR;
+  DumpStatus status = write_varint(writer->out, writer->nChats);
+  if (status != DUMP_OK) return status;
+  return (fflush(writer->out) == 0) ? DUMP_OK : DUMP_IO_ERR;
+}
+
+/** free all dynamic memory used by writer.  Does not close writer's
+ *  out stream.
+ */
+void
+free_chat_dump_writer(ChatDumpWriter *writer)
+{
+  for (size_t i = 0; i < writer->capacity; i++) free(writer->names[i].key);
+  free(writer->names);
+  writer->names = NULL;
+}
+
+/******************************** Reader *******************************/
+
+/** initialize reader to read a dump from in, reading and validating
+ *  the dump header.
+ */
+DumpStatus
+init_chat_dump_reader(ChatDumpReader *reader, FILE *in)
+{
+  *reader = (ChatDumpReader) { .in = in };
+  init_DumpNamesVector(&reader->names);
+  init_DumpTopicsVector(&reader->topics);
+  const size_t magicLen = strlen(CHAT_DUMP_MAGIC);
+  char magic[magicLen];
+  if (fread(magic, 1, magicLen, in) != magicLen) {
+    return ferror(in) ? DUMP_IO_ERR : DUMP_FORMAT_ERR;
+  }
+  if (memcmp(magic, CHAT_DUMP_MAGIC, magicLen) != 0) return DUMP_FORMAT_ERR;
+  uint64_t version;
+  DumpStatus status = read_varint(in, &version);
+  if (status != DUMP_OK) return status;
+  return (version == CHAT_DUMP_VERSION) ? DUMP_OK : DUMP_FORMAT_ERR;
+}
+
+static DumpStatus
+read_name(ChatDumpReader *reader)
+{
+  char *name = NULL;
+  size_t capacity = 0;
+  DumpStatus status = read_bytes(reader->in, &name, &capacity);
+  if (status == DUMP_OK && add_DumpNamesVector(&reader->names, name) != 0) {
+    status = DUMP_MEM_ERR;
+  }
+  if (status != DUMP_OK) free(name);
+  return status;
+}
+
+/** set *name to dictionary name for varint index read from reader */
+static DumpStatus
+read_name_ref(ChatDumpReader *reader, const char **name)
+{
+  uint64_t index;
+  DumpStatus status = read_varint(reader->in, &index);
+  if (status != DUMP_OK) return status;
+  if (index >= n_elements_DumpNamesVector(&reader->names)) {
+    return DUMP_FORMAT_ERR;
+  }
+  *name = get_DumpNamesVector(&reader->names, index);
+  return DUMP_OK;
+}
+
+static DumpStatus
+read_chat(ChatDumpReader *reader, ChatInfo *chat)
+{
+  FILE *in = reader->in;
+  uint64_t timeDelta, nTopics;
+  DumpStatus status = read_name_ref(reader, &chat->user);
+  if (status == DUMP_OK) status = read_name_ref(reader, &chat->room);
+  if (status == DUMP_OK) status = read_varint(in, &timeDelta);
+  if (status == DUMP_OK) status = read_varint(in, &nTopics);
+  if (status != DUMP_OK) return status;
+  clear_DumpTopicsVector(&reader->topics);
+  for (size_t i = 0; status == DUMP_OK && i < nTopics; i++) {
+    const char *topic;
+    status = read_name_ref(reader, &topic);
+    if (status == DUMP_OK &&
+        add_DumpTopicsVector(&reader->topics, topic) != 0) {
+      status = DUMP_MEM_ERR;
+    }
+  }
+  if (status == DUMP_OK) {
+    status = read_bytes(in, &reader->message, &reader->messageCapacity);
+  }
+  if (status != DUMP_OK) return status;
+  reader->lastTimestamp += unzigzag(timeDelta);
+  reader->nChats++;
+  chat->nTopics = nTopics;
+  chat->topics = get_base_DumpTopicsVector(&reader->topics);
+  chat->message = reader->message;
+  chat->timestamp = reader->lastTimestamp;
+  return DUMP_OK;
+}
+
+/** read the next chat from reader into *chat.  Returns DUMP_END after
+ *  the END record has been read.
+ *
+ *  The user, room and topic strings in *chat remain valid until reader
+ *  is freed; chat->topics[] and chat->message remain valid only until
+ *  the next read.
+ */
+DumpStatus
+read_chat_dump(ChatDumpReader *reader, ChatInfo *chat)
+{
+  while (true) {
+    int tag = getc_unlocked(reader->in);
+    DumpStatus status;
+    uint64_t nChats;
+    switch (tag) {
+    case NAME_TAG:
+      status = read_name(reader);
+      if (status != DUMP_OK) return status;
+      break;
+    case CHAT_TAG:
+      return read_chat(reader, chat);
+    case END_TAG:
+      status = read_varint(reader->in, &nChats);
+      if (status != DUMP_OK) return status;
+      return (nChats == reader->nChats) ? DUMP_END : DUMP_FORMAT_ERR;
+    case EOF:
+      return ferror(reader->in) ? DUMP_IO_ERR : DUMP_FORMAT_ERR;
+    default:
+      return DUMP_FORMAT_ERR;
+    }
+  }
+}
+
+/** free all dynamic memory used by reader.  Does not close reader's
+ *  in stream.
+ */
+void
+free_chat_dump_reader(ChatDumpReader *reader)
+{
+  DumpNamesVector *names = &reader->names;
+  for (size_t i = 0; i < n_elements_DumpNamesVector(names); i++) {
+    free(get_DumpNamesVector(names, i));
+  }
+  free_DumpNamesVector(names);
+  free_DumpTopicsVector(&reader->topics);
+  free(reader->message);
+  reader->message = NULL;
+  reader->messageCapacity = reader->nChats = 0;
+  reader->lastTimestamp = 0;
+}
+
+
+/**************************** Unit Tests *******************************/
+
+#ifdef TEST_CHAT_DUMP
+
+#include <unit-test.h>
+
+static void
+test_round_trip(void)
+{
+  const ChatInfo chats[] = {
+    { .user = "@zdu", .room = "sysprog", .nTopics = 2,
+      .topics = (const char *[]) { "#db", "#sqlite" },
+      .message = "sqlite is pretty cool", .timestamp = 1700000000123, },
+    { .user = "@tom", .room = "sysprog", .nTopics = 0,
+      .message = "", .timestamp = 1700000000100, },
+    { .user = "@zdu", .room = "misc", .nTopics = 1,
+      .topics = (const char *[]) { "#db" },
+      .message = "multi\nline\n", .timestamp = 1700000999999, },
+  };
+  const size_t nChats = sizeof(chats)/sizeof(chats[0]);
+  char *buf = NULL;
+  size_t bufSize = 0;
+  FILE *out = open_memstream(&buf, &bufSize);
+  ChatDumpWriter writer;
+  DumpStatus status = init_chat_dump_writer(&writer, out);
+  for (size_t i = 0; status == DUMP_OK && i < nChats; i++) {
+    status = write_chat_dump(&writer, &chats[i]);
+  }
+  if (status == DUMP_OK) status = end_chat_dump_writer(&writer);
+  CHKF(status == DUMP_OK, "WRITE: %s", dump_status_to_string(status));
+  CHKF(writer.nNames == 6, "N_NAMES: %zu != 6", writer.nNames);
+  free_chat_dump_writer(&writer);
+  fclose(out);
+
+  FILE *in = fmemopen(buf, bufSize, "r");
+  ChatDumpReader reader;
+  status = init_chat_dump_reader(&reader, in);
+  CHKF(status == DUMP_OK, "READER_INIT: %s", dump_status_to_string(status));
+  for (size_t i = 0; i < nChats; i++) {
+    ChatInfo chat;
+    status = read_chat_dump(&reader, &chat);
+    CHKF(status == DUMP_OK, "READ %zu: %s", i, dump_status_to_string(status));
+    if (status != DUMP_OK) break;
+    const ChatInfo *exp = &chats[i];
+    CHKF(strcmp(chat.user, exp->user) == 0, "USER %zu: %s", i, chat.user);
+    CHKF(strcmp(chat.room, exp->room) == 0, "ROOM %zu: %s", i, chat.room);
+    CHKF(strcmp(chat.message, exp->message) == 0, "MSG %zu: %s",
+         i, chat.message);
+    CHKF(chat.timestamp == exp->timestamp, "TIME %zu: %lld", i,
+         (long long)chat.timestamp);
+    CHKF(chat.nTopics == exp->nTopics, "N_TOPICS %zu: %zu", i, chat.nTopics);
+    for (size_t j = 0; j < chat.nTopics && j < exp->nTopics; j++) {
+      CHKF(strcmp(chat.topics[j], exp->topics[j]) == 0, "TOPIC %zu: %s",
+           i, chat.topics[j]);
+    }
+  }
+  ChatInfo chat;
+  status = read_chat_dump(&reader, &chat);
+  CHKF(status == DUMP_END, "END: %s", dump_status_to_string(status));
+  free_chat_dump_reader(&reader);
+  fclose(in);
+
+  //truncated dump must be detected
+  in = fmemopen(buf, bufSize - 2, "r");
+  status = init_chat_dump_reader(&reader, in);
+  while (status == DUMP_OK) status = read_chat_dump(&reader, &chat);
+  CHKF(status == DUMP_FORMAT_ERR, "TRUNCATED: %s",
+       dump_status_to_string(status));
+  free_chat_dump_reader(&reader);
+  fclose(in);
+  free(buf);
+}
+
+int
+main()
+{
+  test_round_trip();
+}
+
+#endif //#ifdef TEST_CHAT_DUMP
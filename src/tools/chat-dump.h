@@ -0,0 +1,115 @@
+#ifndef CHAT_DUMP_H_
+#define CHAT_DUMP_H_
+
+#include <chat-db.h>
+#include <vector.h>
+
+#include <stdint.h>
+#include <stdio.h>
+
+/** Streaming binary dump format for chat messages.  All integers are
+ *  unsigned LEB128 varints and all strings are length-prefixed (not
+ *  NUL-terminated).  User, room and topic names are dictionary
+ *  encoded: each distinct name is written once in a NAME record
+ *  which implicitly assigns it the next dictionary index (starting at
+ *  0), just before the first CHAT record which uses it.
+ *
+ *    DUMP    := MAGIC VERSION RECORD* END
+ *    MAGIC   := "CHATDUMP"
+ *    VERSION := varint
+ *    RECORD  := NAME | CHAT
+ *    NAME    := 'N' varint(len) bytes[len]
+ *    CHAT    := 'C' varint(user) varint(room) varint(zigzag(timeDelta))
+ *               varint(nTopics) varint(topic)[nTopics]
+ *               varint(len) bytes[len]
+ *    END     := 'E' varint(nChats)
+ *
+ *  where user, room and topic are dictionary indexes, timeDelta is
+ *  the difference between the chat timestamp and that of the
+ *  preceding chat (taken as 0 for the first chat) and nChats is the
+ *  total # of CHAT records.
+ */
+
+#define CHAT_DUMP_MAGIC "CHATDUMP"
+enum { CHAT_DUMP_VERSION = 1 };
+
+typedef enum {
+  DUMP_OK,
+  DUMP_END,          //END record read
+  DUMP_IO_ERR,
+  DUMP_FORMAT_ERR,
+  DUMP_MEM_ERR,
+} DumpStatus;
+
+/** return a static string explaining status */
+const char *dump_status_to_string(DumpStatus status);
+
+// clients responsible for allocation/deallocation of these structures.
+// note that clients should regard the insides of these structs as
+// private.
+
+typedef struct {
+  char *key;                    //dynamically allocated name
+  size_t index;                 //dictionary index for name
+} DumpName;
+
+typedef struct {
+  FILE *out;
+  size_t nNames;                //# of names in dictionary
+  size_t capacity;              //# of slots in names[]: power of 2
+  DumpName *names;              //open-addressed hash table
+  size_t nChats;                //# of CHAT records written
+  TimeMillis lastTimestamp;
+} ChatDumpWriter;
+
+DEFINE_VECTOR(DumpNamesVector, char *, 16)
+DEFINE_VECTOR(DumpTopicsVector, const char *, 8)
+
+typedef struct {
+  FILE *in;
+  DumpNamesVector names;        //dynamically allocated names, by index
+  size_t nChats;                //# of CHAT records read
+  TimeMillis lastTimestamp;
+  DumpTopicsVector topics;      //topics for last chat read
+  size_t messageCapacity;
+  char *message;                //message for last chat read
+} ChatDumpReader;
+
+/** initialize writer to write a dump on out, writing out the dump
+ *  header.
+ */
+DumpStatus init_chat_dump_writer(ChatDumpWriter *writer, FILE *out);
+
+/** write chat to the dump for writer */
+DumpStatus write_chat_dump(ChatDumpWriter *writer, const ChatInfo *chat);
+
+/** write the END record for writer and flush its output.  No chats
+ *  may be written after this.
+ */
+DumpStatus end_chat_dump_writer(ChatDumpWriter *writer);
+
+/** free all dynamic memory used by writer.  Does not close writer's
+ *  out stream.
+ */
+void free_chat_dump_writer(ChatDumpWriter *writer);
+
+/** initialize reader to read a dump from in, reading and validating
+ *  the dump header.
+ */
+DumpStatus init_chat_dump_reader(ChatDumpReader *reader, FILE *in);
+
+/** read the next chat from reader into *chat.  Returns DUMP_END after
+ *  the END record has been read.
+ *
+ *  The user, room and topic strings in *chat remain valid until reader
+ *  is freed; chat->topics[] and chat->message remain valid only until
+ *  the next read.
+ */
+DumpStatus read_chat_dump(ChatDumpReader *reader, ChatInfo *chat);
+
+/** free all dynamic memory used by reader.  Does not close reader's
+ *  in stream.
+ */
+void free_chat_dump_reader(ChatDumpReader *reader);
+
+#endif //#ifndef CHAT_DUMP_H_
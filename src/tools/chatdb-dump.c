@@ -0,0 +1,96 @@
+#include "chat-dump.h"
+
+#include <chat-db.h>
+#include <errors.h>
+#include <str-space.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/** Write all chats in a chat-db to a dump in the format described in
+ *  chat-dump.h.  The chats are dumped oldest first so that loading
+ *  the dump using chatdb-load preserves their relative order.
+ */
+
+static int
+add_room(const char *room, void *ctx)
+{
+  return add_str_space((StrSpace *)ctx, room);
+}
+
+static int
+dump_chat(const ChatInfo *chat, void *ctx)
+{
+  ChatDumpWriter *writer = ctx;
+  DumpStatus status = write_chat_dump(writer, chat);
+  if (status != DUMP_OK) {
+    fatal("write error: %s", dump_status_to_string(status));
+  }
+  return 0;
+}
+
+/** Invoked with one or two arguments:
+ *
+ *    DBFILE_PATH: path to the sqlite file.
+ *
+ *    DUMP_PATH: path of dump file to be written; stdout if not
+ *    specified.
+ */
+int
+main(int argc, const char *argv[])
+{
+  if (argc < 2 || argc > 3) fatal("usage: %s DBFILE_PATH [DUMP_PATH]", argv[0]);
+  const char *dbPath = argv[1];
+  FILE *out = stdout;
+  if (argc > 2 && (out = fopen(argv[2], "w")) == NULL) {
+    fatal("cannot open %s:", argv[2]);
+  }
+  MakeChatDbResult result;
+  if (make_chat_db(dbPath, &result) != 0) {
+    fatal("cannot open db at %s: %s", dbPath, result.err);
+  }
+  ChatDb *chatDb = result.chatDb;
+
+  StrSpace roomsSpace;
+  init_str_space(&roomsSpace);
+  if (iter_rooms_chat_db(chatDb, add_room, &roomsSpace) != 0) {
+    fatal("cannot read rooms: %s", error_chat_db(chatDb));
+  }
+  size_t nRooms = 0;
+  for (const char *r = iter_str_space(&roomsSpace, NULL); r != NULL;
+       r = iter_str_space(&roomsSpace, r)) {
+    nRooms++;
+  }
+  const char **rooms = malloc((nRooms > 0 ? nRooms : 1) * sizeof(char *));
+  if (!rooms) fatal("cannot allocate %zu rooms:", nRooms);
+  nRooms = 0;
+  for (const char *r = iter_str_space(&roomsSpace, NULL); r != NULL;
+       r = iter_str_space(&roomsSpace, r)) {
+    rooms[nRooms++] = r;
+  }
+
+  ChatDumpWriter writer;
+  DumpStatus status = init_chat_dump_writer(&writer, out);
+  if (status != DUMP_OK) {
+    fatal("write error: %s", dump_status_to_string(status));
+  }
+  const ChatQuery query = {
+    .nRooms = nRooms, .rooms = rooms,
+    .count = SIZE_MAX, .isOldestFirst = true,
+  };
+  if (run_query_chat_db(chatDb, &query, dump_chat, &writer) != 0) {
+    fatal("cannot query chats: %s", error_chat_db(chatDb));
+  }
+  status = end_chat_dump_writer(&writer);
+  if (status != DUMP_OK) {
+    fatal("write error: %s", dump_status_to_string(status));
+  }
+  free_chat_dump_writer(&writer);
+  free(rooms);
+  free_str_space(&roomsSpace);
+  free_chat_db(chatDb);
+  if (out != stdout && fclose(out) != 0) fatal("cannot close %s:", argv[2]);
+  return 0;
+}
@@ -0,0 +1,122 @@
+#include "chat-dump.h"
+
+#include <chat-db.h>
+#include <errors.h>
+#include <str-space.h>
+#include <vector.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Load chats from a dump produced by chatdb-dump into a chat-db.
+ *  The chats are added in batches, each within a single transaction,
+ *  with index maintenance suspended until all chats have been added.
+ */
+
+enum { BATCH_SIZE = 4096 };
+
+DEFINE_VECTOR(BatchTopicsVector, const char *, 8)
+
+/** chats buffered for a single add_chats_chat_db() */
+typedef struct {
+  size_t nChats;
+  ChatInfo chats[BATCH_SIZE];
+  size_t topicsIndex[BATCH_SIZE];  //index of first topic in topics[]
+  BatchTopicsVector topics;        //topics for all chats
+  StrSpace messages;               //messages for all chats, in order
+} Batch;
+
+/** add chat to batch, copying those parts of chat which do not
+ *  outlive the next read of the dump.
+ */
+static void
+add_batch(Batch *batch, const ChatInfo *chat)
+{
+  batch->topicsIndex[batch->nChats] =
+    n_elements_BatchTopicsVector(&batch->topics);
+  //topic names are owned by the dump reader's dictionary
+  for (size_t i = 0; i < chat->nTopics; i++) {
+    if (add_BatchTopicsVector(&batch->topics, chat->topics[i]) != 0) {
+      fatal("cannot add topic to batch:");
+    }
+  }
+  if (add_str_space(&batch->messages, chat->message) != 0) {
+    fatal("cannot add message to batch");
+  }
+  batch->chats[batch->nChats++] = *chat;
+}
+
+/** add all chats in batch to chatDb and clear batch */
+static void
+flush_batch(ChatDb *chatDb, Batch *batch)
+{
+  //messages and topics can be located only once the batch is complete
+  const char *message = iter_str_space(&batch->messages, NULL);
+  const char **topics = get_base_BatchTopicsVector(&batch->topics);
+  for (size_t i = 0; i < batch->nChats; i++) {
+    batch->chats[i].message = message;
+    batch->chats[i].topics = &topics[batch->topicsIndex[i]];
+    message = iter_str_space(&batch->messages, message);
+  }
+  if (add_chats_chat_db(chatDb, batch->nChats, batch->chats) != 0) {
+    fatal("cannot add chats: %s", error_chat_db(chatDb));
+  }
+  batch->nChats = 0;
+  clear_BatchTopicsVector(&batch->topics);
+  clear_str_space(&batch->messages);
+}
+
+/** Invoked with one or two arguments:
+ *
+ *    DBFILE_PATH: path to the sqlite file; created if it does not exist.
+ *
+ *    DUMP_PATH: path of dump file to be read; stdin if not specified.
+ */
+int
+main(int argc, const char *argv[])
+{
+  if (argc < 2 || argc > 3) fatal("usage: %s DBFILE_PATH [DUMP_PATH]", argv[0]);
+  const char *dbPath = argv[1];
+  FILE *in = stdin;
+  if (argc > 2 && (in = fopen(argv[2], "r")) == NULL) {
+    fatal("cannot open %s:", argv[2]);
+  }
+  MakeChatDbResult result;
+  if (make_chat_db(dbPath, &result) != 0) {
+    fatal("cannot open db at %s: %s", dbPath, result.err);
+  }
+  ChatDb *chatDb = result.chatDb;
+
+  ChatDumpReader reader;
+  DumpStatus status = init_chat_dump_reader(&reader, in);
+  if (status != DUMP_OK) fatal("read error: %s", dump_status_to_string(status));
+  if (begin_bulk_load_chat_db(chatDb) != 0) {
+    fatal("cannot begin bulk load: %s", error_chat_db(chatDb));
+  }
+  Batch *batch = calloc(1, sizeof(Batch));
+  if (!batch) fatal("cannot allocate batch:");
+  init_str_space(&batch->messages);
+  init_BatchTopicsVector(&batch->topics);
+  ChatInfo chat;
+  while ((status = read_chat_dump(&reader, &chat)) == DUMP_OK) {
+    add_batch(batch, &chat);
+    if (batch->nChats == BATCH_SIZE) flush_batch(chatDb, batch);
+  }
+  if (status != DUMP_END) {
+    fatal("read error after %zu chats: %s", reader.nChats,
+          dump_status_to_string(status));
+  }
+  flush_batch(chatDb, batch);
+  if (end_bulk_load_chat_db(chatDb) != 0) {
+    fatal("cannot end bulk load: %s", error_chat_db(chatDb));
+  }
+  free_str_space(&batch->messages);
+  free_BatchTopicsVector(&batch->topics);
+  free(batch);
+  free_chat_dump_reader(&reader);
+  free_chat_db(chatDb);
+  if (in != stdin) fclose(in);
+  return 0;
+}
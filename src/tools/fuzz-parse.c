@@ -0,0 +1,633 @@
+#include <chat-cmd.h>
+#include <errors.h>
+#include <msgargs.h>
+
+#include <ctype.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/** Fuzz driver for the msgargs and chat-cmd parsers.  Each input
+ *  (randomly generated, or read from the FILE arguments) is parsed
+ *  as commands and as lines using read_msg_args(), read_line_args(),
+ *  a MsgArgsParser fed random-sized chunks and a MsgArgsMap.  The
+ *  results are compared with those of the simple reference parser
+ *  below, which reads the whole input at once.  Every parsed command
+ *  is also run through parse_cmd() (or parse_loggedin_cmd() for
+ *  lines) and the normalized result checked against the original
+ *  args.
+ *
+ *  Inputs containing NUL characters are only checked for crashes,
+ *  since the stream parsers treat NUL as a terminator while the map
+ *  does not.  Any failing or crashing input is written to FAIL_FILE
+ *  so that it can be replayed by specifying it as an argument.
+ *
+ *  Build the fuzz-parse-asan target to run with the parsers compiled
+ *  with address and undefined-behavior sanitizers.
+ */
+
+/** fuzz parameters */
+typedef struct {
+  size_t nIters;          //# of random inputs
+  uint64_t seed;
+  size_t maxTokens;       //max # of tokens in a random input
+  const char *failPath;   //failing input written here
+} Params;
+
+static const Params DEFAULT_PARAMS = {
+  .nIters = 20000, .seed = 1, .maxTokens = 200,
+  .failPath = "fuzz-parse-fail.txt",
+};
+
+/** current input, saved by the signal handler on a crash */
+static struct {
+  const char *chars;
+  size_t n;
+  const char *failPath;
+} current;
+
+static FILE *devNull;
+
+static uint64_t
+next_rand(uint64_t *x)
+{
+  *x ^= *x << 13; *x ^= *x >> 7; *x ^= *x << 17;
+  return *x;
+}
+
+/** write chars[n] to path; async-signal-safe */
+static void
+write_input(const char *path, const char *chars, size_t n)
+{
+  int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (fd < 0) return;
+  for (ssize_t m; n > 0 && (m = write(fd, chars, n)) > 0; chars += m, n -= m) {
+  }
+  close(fd);
+}
+
+static void
+crash_handler(int sig)
+{
+  static const char msg[] = "fuzz-parse: crashed; input written to ";
+  write_input(current.failPath, current.chars, current.n);
+  write(STDERR_FILENO, msg, sizeof(msg) - 1);
+  write(STDERR_FILENO, current.failPath, strlen(current.failPath));
+  write(STDERR_FILENO, "\n", 1);
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+/************************** Canonical Output ***************************/
+
+/** write canonical representation of command with args[nArgs] and
+ *  msg[msgLen] (msg NULL if none) to out.  An arg may be NULL.
+ */
+static void
+out_cmd(FILE *out, size_t nArgs, const char *const args[],
+        const size_t argLens[], const char *msg, size_t msgLen)
+{
+  fprintf(out, "[");
+  for (size_t i = 0; i < nArgs; i++) {
+    if (args[i] == NULL) {
+      fprintf(out, " -");
+    }
+    else {
+      fprintf(out, " %zu:", argLens[i]);
+      fwrite(args[i], 1, argLens[i], out);
+    }
+  }
+  if (msg == NULL) {
+    fprintf(out, " | nomsg]\n");
+  }
+  else {
+    fprintf(out, " | %zu:", msgLen);
+    fwrite(msg, 1, msgLen, out);
+    fprintf(out, "]\n");
+  }
+}
+
+static void
+out_msg_args(FILE *out, const MsgArgs *msgArgs)
+{
+  const size_t n = msgArgs->nArgs;
+  size_t lens[n + 1];
+  for (size_t i = 0; i < n; i++) {
+    lens[i] = msgArgs->args[i] ? strlen(msgArgs->args[i]) : 0;
+  }
+  const char *msg = msgArgs->msg;
+  out_cmd(out, n, msgArgs->args, lens, msg, msg ? strlen(msg) : 0);
+}
+
+static void
+out_msg_args_view(FILE *out, const MsgArgsView *view)
+{
+  const size_t n = view->nArgs;
+  const char *args[n + 1];
+  size_t lens[n + 1];
+  for (size_t i = 0; i < n; i++) {
+    args[i] = view->args[i].chars; lens[i] = view->args[i].len;
+  }
+  out_cmd(out, n, args, lens, view->msg.chars, view->msg.len);
+}
+
+/************************** Reference Parser ***************************/
+
+/** write canonical form of args from text[n] to out */
+static void
+out_ref_args(FILE *out, const char *text, size_t n, const char *msg,
+             size_t msgLen)
+{
+  const char *args[n + 1];
+  size_t lens[n + 1];
+  size_t nArgs = 0;
+  for (size_t i = 0; i < n; ) {
+    if (isspace(text[i])) { i++; continue; }
+    const size_t start = i;
+    while (i < n && !isspace(text[i])) i++;
+    args[nArgs] = &text[start]; lens[nArgs++] = i - start;
+  }
+  out_cmd(out, nArgs, args, lens, msg, msgLen);
+}
+
+/** write canonical form of command text[n] to out */
+static void
+out_ref_cmd(FILE *out, const char *text, size_t n)
+{
+  const char *nlP = memchr(text, '\n', n);
+  const size_t line1Len = nlP ? nlP - text : n;
+  const bool hasMsg = n > line1Len + 1;
+  out_ref_args(out, text, line1Len, hasMsg ? &text[line1Len + 1] : NULL,
+               hasMsg ? n - line1Len - 1 : 0);
+}
+
+/** write canonical form of line[n] parsed as for read_line_args() */
+static void
+out_ref_line(FILE *out, const char *line, size_t n)
+{
+  size_t i = 0;
+  while (i < n && isspace(line[i])) i++;
+  if (i + 1 < n && (line[i] == '?' || line[i] == '%') &&
+      isspace(line[i + 1])) {
+    out_ref_args(out, line, n, NULL, 0);
+    return;
+  }
+  const char *args[n + 3];
+  size_t lens[n + 3];
+  args[0] = "+"; lens[0] = 1;
+  args[1] = args[2] = NULL; lens[1] = lens[2] = 0;
+  size_t nArgs = 3;
+  while (i < n && line[i] == '#') {
+    const size_t start = i;
+    while (i < n && !isspace(line[i])) i++;
+    args[nArgs] = &line[start]; lens[nArgs++] = i - start;
+    while (i < n && isspace(line[i])) i++;
+  }
+  out_cmd(out, nArgs, args, lens, &line[i], n - i);
+}
+
+/** output of reference parser */
+typedef struct {
+  FILE *firstOut;   //commands before the first "." command
+  FILE *allOut;     //all commands other than "." commands
+  bool isTerm;      //seen a "." command
+} RefOut;
+
+/** write canonical form of command text[n] or line[n] to ref */
+static void
+out_ref(RefOut *ref, bool isLine, const char *text, size_t n)
+{
+  FILE *outs[] = { ref->allOut, ref->isTerm ? NULL : ref->firstOut };
+  for (size_t i = 0; i < sizeof(outs)/sizeof(outs[0]); i++) {
+    if (!outs[i]) continue;
+    (isLine ? out_ref_line : out_ref_cmd)(outs[i], text, n);
+  }
+}
+
+/** write canonical form of all commands in chars[n] to ref.
+ *  Commands which are simply a "." line are not output, but stop
+ *  output to ref->firstOut.
+ */
+static void
+ref_parse(const char *chars, size_t n, bool isLine, RefOut *ref)
+{
+  size_t cmdStart = 0;
+  for (size_t lineStart = 0; lineStart < n; ) {
+    const char *nlP = memchr(&chars[lineStart], '\n', n - lineStart);
+    const size_t lineEnd = nlP ? nlP - chars + 1 : n;
+    const char *line = &chars[lineStart];
+    const size_t lineLen = lineEnd - lineStart;
+    if (isLine) {
+      bool isBlank = true;
+      for (size_t i = 0; i < lineLen && isBlank; i++) {
+        isBlank = isspace(line[i]);
+      }
+      //an unterminated last line is never skipped
+      if (!isBlank || !nlP) out_ref(ref, true, line, lineLen);
+    }
+    else if (lineLen == 2 && line[0] == '.' && line[1] == '\n') {
+      if (lineStart == cmdStart) {
+        ref->isTerm = true;
+      }
+      else {
+        out_ref(ref, false, &chars[cmdStart], lineStart - cmdStart);
+      }
+      cmdStart = lineEnd;
+    }
+    lineStart = lineEnd;
+  }
+  if (!isLine && cmdStart < n) {
+    out_ref(ref, false, &chars[cmdStart], n - cmdStart);
+  }
+}
+
+/*************************** Command Checks ****************************/
+
+static int
+has_upper(const char *s)
+{
+  for (; *s != '\0'; s++) {
+    if ('A' <= *s && *s <= 'Z') return 1;
+  }
+  return 0;
+}
+
+/** return non-zero if a and b differ ignoring ASCII case */
+static int
+fold_cmp(const char *a, const char *b)
+{
+  for (; *a != '\0' && *b != '\0'; a++, b++) {
+    const char ca = ('A' <= *a && *a <= 'Z') ? *a + 'a' - 'A' : *a;
+    const char cb = ('A' <= *b && *b <= 'Z') ? *b + 'a' - 'A' : *b;
+    if (ca != cb) return 1;
+  }
+  return *a != *b;
+}
+
+/** check add topics are the distinct case-folded orig[nOrig] in order */
+static int
+check_add_topics(const AddCmd *add, size_t nOrig, char *orig[nOrig])
+{
+  size_t n = 0;
+  for (size_t i = 0; i < nOrig; i++) {
+    size_t j = 0;
+    while (j < i && fold_cmp(orig[j], orig[i]) != 0) j++;
+    if (j < i) continue;
+    if (n >= add->nTopics || has_upper(add->topics[n]) ||
+        fold_cmp(add->topics[n], orig[i]) != 0) {
+      return 1;
+    }
+    n++;
+  }
+  return n != add->nTopics;
+}
+
+/** parse msgArgs using parse_cmd(), or parse_loggedin_cmd() if isLine,
+ *  and check the result.  Return non-zero on failure.
+ */
+static int
+check_cmd(const MsgArgs *msgArgs, bool isLine)
+{
+  static const char *user = "@Login", *room = "LoginRoom";
+  const size_t nArgs = msgArgs->nArgs;
+  char *orig[nArgs + 1];
+  for (size_t i = 0; i < nArgs; i++) {
+    orig[i] = msgArgs->args[i] ? strdup(msgArgs->args[i]) : NULL;
+  }
+  ChatCmd cmd;
+  const int rc = isLine
+    ? parse_loggedin_cmd(msgArgs, user, room, &cmd, devNull)
+    : parse_cmd(msgArgs, &cmd, devNull);
+  int nErrs = 0;
+  if (rc == 0) {
+    switch (cmd.type) {
+    case ADD_CMD:
+      if (isLine) {
+        nErrs += cmd.add.user != user || cmd.add.room != room;
+      }
+      else {
+        nErrs += has_upper(cmd.add.user) || has_upper(cmd.add.room);
+        nErrs += fold_cmp(cmd.add.user, orig[1]) ||
+          fold_cmp(cmd.add.room, orig[2]);
+      }
+      nErrs += check_add_topics(&cmd.add, nArgs - 3, &orig[3]);
+      nErrs += cmd.add.message != msgArgs->msg;
+      break;
+    case QUERY_CMD:
+      nErrs += cmd.query.nRooms < 1 || cmd.query.room != cmd.query.rooms[0];
+      nErrs += cmd.query.nRooms + cmd.query.nTopics > nArgs - 1;
+      for (size_t i = 0; i < cmd.query.nRooms; i++) {
+        nErrs += has_upper(cmd.query.rooms[i]);
+      }
+      for (size_t i = 0; i < cmd.query.nTopics; i++) {
+        nErrs += has_upper(cmd.query.topics[i]) ||
+          cmd.query.topics[i][0] != '#';
+      }
+      break;
+    case STATS_CMD:
+      nErrs += has_upper(cmd.stats.room) ||
+        fold_cmp(cmd.stats.room, orig[1]) != 0;
+      break;
+    default:
+      nErrs++;
+    }
+  }
+  for (size_t i = 0; i < nArgs; i++) free(orig[i]);
+  return nErrs;
+}
+
+/***************************** Fuzz Parsers ****************************/
+
+/** parsed output and # of check failures */
+typedef struct {
+  char *chars;
+  size_t n;
+  FILE *out;
+  size_t nCmds;
+  int nErrs;
+} Output;
+
+static void
+open_output(Output *output)
+{
+  *output = (Output) { .chars = NULL };
+  output->out = open_memstream(&output->chars, &output->n);
+  if (!output->out) fatal("cannot open memory stream:");
+}
+
+static void
+close_output(Output *output)
+{
+  if (fclose(output->out) != 0) fatal("cannot write memory stream:");
+}
+
+static void
+do_msg_args(const MsgArgs *msgArgs, bool isLine, Output *output)
+{
+  out_msg_args(output->out, msgArgs);
+  output->nCmds++;
+  output->nErrs += check_cmd(msgArgs, isLine);
+}
+
+/** parse chars[n] using read_msg_args() or read_line_args() */
+static void
+parse_stream(const char *chars, size_t n, bool isLine, Output *output)
+{
+  open_output(output);
+  FILE *in = fmemopen((void *)chars, n, "r");
+  if (!in) fatal("cannot open memory stream:");
+  MsgArgs *msgArgs = NULL;
+  ErrNum err;
+  while ((msgArgs = (isLine ? read_line_args : read_msg_args)(in, msgArgs,
+                                                               &err))) {
+    do_msg_args(msgArgs, isLine, output);
+  }
+  if (err != NO_ERR) fatal("read error: %s", errnum_to_string(err));
+  fclose(in);
+  close_output(output);
+}
+
+/** parse chars[n] by pushing random-sized chunks */
+static void
+parse_push(const char *chars, size_t n, bool isLine, uint64_t *x,
+           Output *output)
+{
+  open_output(output);
+  ErrNum err;
+  MsgArgsParser *parser = make_msg_args_parser(isLine, &err);
+  if (!parser) fatal("cannot create parser: %s", errnum_to_string(err));
+  for (size_t lo = 0; lo < n; ) {
+    const uint64_t r = next_rand(x);
+    size_t chunkSize = (r % 8 == 0) ? n : 1 + (r >> 8) % 16;
+    if (chunkSize > n - lo) chunkSize = n - lo;
+    for (size_t nConsumed, i = 0; i < chunkSize; i += nConsumed) {
+      const MsgArgs *msgArgs =
+        push_msg_args_parser(parser, &chars[lo + i], chunkSize - i,
+                             &nConsumed, &err);
+      if (err != NO_ERR) fatal("push error: %s", errnum_to_string(err));
+      if (msgArgs) do_msg_args(msgArgs, isLine, output);
+    }
+    lo += chunkSize;
+  }
+  const MsgArgs *msgArgs = end_msg_args_parser(parser, &err);
+  if (msgArgs) do_msg_args(msgArgs, isLine, output);
+  free_msg_args_parser(parser);
+  close_output(output);
+}
+
+/** parse file at path which contains chars[n] using a MsgArgsMap */
+static void
+parse_map(const char *path, Output *output)
+{
+  open_output(output);
+  ErrNum err;
+  MsgArgsMap *map = make_msg_args_map(path, &err);
+  if (!map) fatal("cannot map %s: %s", path, errnum_to_string(err));
+  const MsgArgsView *view;
+  while ((view = next_msg_args_map(map, &err)) != NULL) {
+    out_msg_args_view(output->out, view);
+  }
+  if (err != NO_ERR) fatal("map error: %s", errnum_to_string(err));
+  free_msg_args_map(map);
+  close_output(output);
+}
+
+/************************** Driver ****************************/
+
+/** result of fuzzing a single input */
+typedef struct {
+  size_t nInputs;
+  size_t nCmds;
+} Stats;
+
+/** fuzz parsers on chars[n] which is also contained in file at path.
+ *  Return non-zero on failure after writing a message on stderr.
+ */
+static int
+fuzz_input(const char *chars, size_t n, const char *path, uint64_t *x,
+           Stats *stats)
+{
+  current.chars = chars; current.n = n;
+  const bool hasNul = memchr(chars, '\0', n) != NULL;
+  int nErrs = 0;
+  stats->nInputs++;
+  for (int isLine = 0; isLine <= 1; isLine++) {
+    Output first, all, stream, push, map;
+    open_output(&first); open_output(&all);
+    RefOut ref = { .firstOut = first.out, .allOut = all.out };
+    ref_parse(chars, n, isLine, &ref);
+    close_output(&first); close_output(&all);
+    parse_stream(chars, n, isLine, &stream);
+    parse_push(chars, n, isLine, x, &push);
+    if (!isLine) parse_map(path, &map);
+    const char *name = isLine ? "line" : "msg";
+    if (stream.nErrs > 0 || push.nErrs > 0) {
+      fprintf(stderr, "%s: %d stream and %d push parse_cmd() check failures\n",
+              name, stream.nErrs, push.nErrs);
+      nErrs++;
+    }
+    if (!hasNul) {
+      //read_*_args() and the map stop at a "." command; push skips it
+      struct { const char *name; const Output *o; const Output *exp; }
+        cmps[] = {
+          { "stream", &stream, &first },
+          { "push", &push, &all },
+          { "map", isLine ? NULL : &map, &first },
+        };
+      for (size_t i = 0; i < sizeof(cmps)/sizeof(cmps[0]); i++) {
+        const Output *o = cmps[i].o, *exp = cmps[i].exp;
+        if (!o) continue;
+        if (o->n != exp->n || memcmp(o->chars, exp->chars, o->n) != 0) {
+          fprintf(stderr, "%s %s differs from reference\n--- reference:\n",
+                  name, cmps[i].name);
+          fwrite(exp->chars, 1, exp->n, stderr);
+          fprintf(stderr, "--- %s:\n", cmps[i].name);
+          fwrite(o->chars, 1, o->n, stderr);
+          nErrs++;
+        }
+      }
+    }
+    stats->nCmds += push.nCmds;
+    if (!isLine) free(map.chars);
+    free(first.chars); free(all.chars); free(stream.chars); free(push.chars);
+  }
+  return nErrs;
+}
+
+static const char *TOKENS[] = {
+  "+", "?", "%", " ", "  ", "\t", "\r", "\v", "\f", "\n", "\n", "\n",
+  ".\n", "\n.\n", ".", "..\n", "@", "@Us", "@user", "Room", "rOOm2", "r",
+  "#", "#Tp", "#tp", "#TP", "#a_Longer_Topic", "12", "0", "007", "x",
+  "\x80", "\xff", "\xc3\xa9",
+};
+
+/** return malloc()'d random input, setting *n to its length */
+static char *
+random_input(const Params *params, uint64_t *x, size_t *n)
+{
+  char *chars = NULL;
+  FILE *out = open_memstream(&chars, n);
+  if (!out) fatal("cannot open memory stream:");
+  const size_t nTokens = next_rand(x) % (params->maxTokens + 1);
+  const size_t nFixed = sizeof(TOKENS)/sizeof(TOKENS[0]);
+  for (size_t i = 0; i < nTokens; i++) {
+    const uint64_t r = next_rand(x);
+    if (r % 64 == 0) {
+      //long word with random case
+      const size_t len = (r >> 8) % 300;
+      for (size_t j = 0; j < len; j++) {
+        fputc(((r >> (j % 48)) & 1 ? 'A' : 'a') + j % 26, out);
+      }
+    }
+    else if (r % 97 == 1) {
+      fputc('\0', out);
+    }
+    else {
+      fputs(TOKENS[(r >> 8) % nFixed], out);
+    }
+  }
+  if (fclose(out) != 0) fatal("cannot generate input:");
+  return chars;
+}
+
+/** write chars[n] to tmp file at path for MsgArgsMap */
+static void
+write_tmp(const char *path, const char *chars, size_t n)
+{
+  FILE *out = fopen(path, "w");
+  if (!out || fwrite(chars, 1, n, out) != n || fclose(out) != 0) {
+    fatal("cannot write %s:", path);
+  }
+}
+
+/** return malloc()'d contents of file at path, setting *n to size */
+static char *
+read_file(const char *path, size_t *n)
+{
+  FILE *in = fopen(path, "r");
+  if (!in) fatal("cannot read %s:", path);
+  char *chars = NULL;
+  FILE *out = open_memstream(&chars, n);
+  if (!out) fatal("cannot open memory stream:");
+  char buf[4096];
+  for (size_t m; (m = fread(buf, 1, sizeof(buf), in)) > 0; ) {
+    fwrite(buf, 1, m, out);
+  }
+  fclose(in);
+  if (fclose(out) != 0) fatal("cannot read %s:", path);
+  return chars;
+}
+
+static void
+usage(const char *prog)
+{
+  fatal("usage: %s [-n N_ITERS] [-s SEED] [-t MAX_TOKENS] [-o FAIL_FILE] "
+        "[FILE...]\n"
+        "  FILEs are checked instead of random inputs", prog);
+}
+
+static size_t
+size_arg(const char *prog, const char *arg, size_t min)
+{
+  char *p;
+  unsigned long long v = strtoull(arg, &p, 10);
+  if (*p != '\0' || v < min) usage(prog);
+  return v;
+}
+
+int
+main(int argc, char *argv[])
+{
+  Params params = DEFAULT_PARAMS;
+  int c;
+  while ((c = getopt(argc, argv, "n:s:t:o:")) != -1) {
+    switch (c) {
+    case 'n': params.nIters = size_arg(argv[0], optarg, 1); break;
+    case 's': params.seed = size_arg(argv[0], optarg, 1); break;
+    case 't': params.maxTokens = size_arg(argv[0], optarg, 0); break;
+    case 'o': params.failPath = optarg; break;
+    default: usage(argv[0]);
+    }
+  }
+  devNull = fopen("/dev/null", "w");
+  if (!devNull) fatal("cannot open /dev/null:");
+  current.failPath = params.failPath;
+  signal(SIGSEGV, crash_handler); signal(SIGABRT, crash_handler);
+  signal(SIGBUS, crash_handler); signal(SIGFPE, crash_handler);
+
+  char tmpPath[] = "/tmp/fuzz-parse-XXXXXX";
+  int fd = mkstemp(tmpPath);
+  if (fd < 0) fatal("cannot create temp file:");
+  close(fd);
+  uint64_t x = params.seed * 0x9E3779B97F4A7C15ULL;
+  Stats stats = { 0 };
+  int nErrs = 0;
+  const bool isFiles = optind < argc;
+  const size_t nInputs = isFiles ? argc - optind : params.nIters;
+  for (size_t i = 0; i < nInputs && nErrs == 0; i++) {
+    size_t n;
+    char *chars = isFiles
+      ? read_file(argv[optind + i], &n)
+      : random_input(&params, &x, &n);
+    write_tmp(tmpPath, chars, n);
+    nErrs = fuzz_input(chars, n, tmpPath, &x, &stats);
+    if (nErrs > 0) {
+      write_input(params.failPath, chars, n);
+      fprintf(stderr, "input %zu failed; written to %s\n", i,
+              params.failPath);
+    }
+    free(chars);
+  }
+  remove(tmpPath);
+  fclose(devNull);
+  printf("{ \"seed\": %llu, \"nInputs\": %zu, \"nCmds\": %zu, "
+         "\"nFailures\": %d }\n", (unsigned long long)params.seed,
+         stats.nInputs, stats.nCmds, nErrs);
+  return nErrs > 0;
+}
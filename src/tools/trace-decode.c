@@ -0,0 +1,198 @@
+#include <errors.h>
+#include <trace.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Decode a binary trace dump written by dump_trace() (see trace.h).
+ *  All records from all threads are printed on stdout in timestamp
+ *  order, one per line, as:
+ *
+ *    +MICROS [THREAD] FILE:LINE: FUNC(): MESSAGE
+ *
+ *  where MICROS is the time since the first record and MESSAGE is
+ *  formatted from the call site's format string and the recorded
+ *  args.  Since only integers are recorded, %s args are printed as
+ *  the address of the string.
+ */
+
+typedef struct {
+  uint32_t line;
+  char *file;
+  char *func;
+  char *fmt;
+} Site;
+
+typedef struct {
+  uint32_t threadId;
+  TraceRecord record;
+} Entry;
+
+static void
+read_all(FILE *in, void *buf, size_t n, const char *path)
+{
+  if (fread(buf, 1, n, in) != n) fatal("%s: truncated trace", path);
+}
+
+static char *
+read_str(FILE *in, size_t len, const char *path)
+{
+  char *s = malloc(len + 1);
+  if (!s) fatal("cannot allocate %zu bytes:", len + 1);
+  read_all(in, s, len, path);
+  s[len] = '\0';
+  return s;
+}
+
+static int
+compare_entries(const void *p1, const void *p2)
+{
+  const Entry *e1 = p1, *e2 = p2;
+  const uint64_t t1 = e1->record.timestamp, t2 = e2->record.timestamp;
+  return (t1 < t2) ? -1 : (t1 > t2);
+}
+
+/** print message formatted from fmt using args[nArgs] */
+static void
+print_message(const char *fmt, uint32_t nArgs, const uint64_t args[])
+{
+  uint32_t argIndex = 0;
+  const char *p = fmt;
+  while (*p != '\0') {
+    if (*p != '%') {
+      putchar(*p++);
+      continue;
+    }
+    if (p[1] == '%') {
+      putchar('%');
+      p += 2;
+      continue;
+    }
+    //copy spec without length modifiers into spec[]
+    char spec[32];
+    size_t n = 0;
+    spec[n++] = *p++;
+    while (*p != '\0' && strchr("-+ #0123456789.*", *p)) {
+      if (*p == '*') {
+        //width or precision arg
+        const int v = (argIndex < nArgs) ? (int)args[argIndex++] : 0;
+        n += snprintf(&spec[n], sizeof(spec) - n - 4, "%d", v);
+        p++;
+      }
+      else if (n < sizeof(spec) - 4) {
+        spec[n++] = *p++;
+      }
+      else {
+        p++;
+      }
+    }
+    bool isLong = false;
+    while (*p != '\0' && strchr("hlqjzt", *p)) {
+      isLong = isLong || (*p != 'h');
+      p++;
+    }
+    const char conv = *p;
+    if (conv == '\0') break;
+    p++;
+    const uint64_t arg = (argIndex < nArgs) ? args[argIndex++] : 0;
+    switch (conv) {
+    case 'd': case 'i':
+      spec[n++] = 'l'; spec[n++] = 'l'; spec[n++] = conv; spec[n] = '\0';
+      printf(spec, isLong ? (long long)arg : (long long)(int)arg);
+      break;
+    case 'u': case 'x': case 'X': case 'o':
+      spec[n++] = 'l'; spec[n++] = 'l'; spec[n++] = conv; spec[n] = '\0';
+      printf(spec, isLong ? (unsigned long long)arg
+                          : (unsigned long long)(unsigned)arg);
+      break;
+    case 'c':
+      putchar((int)arg);
+      break;
+    case 's':
+      printf("<str %#llx>", (unsigned long long)arg);
+      break;
+    case 'p':
+      printf("%#llx", (unsigned long long)arg);
+      break;
+    default:
+      //floating point args were recorded as integers
+      printf("%lld", (long long)arg);
+      break;
+    }
+  }
+  putchar('\n');
+}
+
+static void
+decode(const char *path)
+{
+  FILE *in = fopen(path, "r");
+  if (!in) fatal("cannot read %s:", path);
+  TraceFileHdr fileHdr;
+  read_all(in, &fileHdr, sizeof(fileHdr), path);
+  if (memcmp(fileHdr.magic, TRACE_MAGIC, sizeof(fileHdr.magic)) != 0 ||
+      fileHdr.version != TRACE_VERSION) {
+    fatal("%s: not a version %d trace", path, TRACE_VERSION);
+  }
+  const uint32_t nSites = fileHdr.nSites;
+  Site *sites = calloc(nSites + 1, sizeof(Site));  //indexed by site id
+  if (!sites) fatal("cannot allocate %u sites:", nSites);
+  for (uint32_t i = 0; i < nSites; i++) {
+    TraceSiteHdr siteHdr;
+    read_all(in, &siteHdr, sizeof(siteHdr), path);
+    if (siteHdr.id == 0 || siteHdr.id > nSites) {
+      fatal("%s: bad site id %u", path, siteHdr.id);
+    }
+    Site *site = &sites[siteHdr.id];
+    site->line = siteHdr.line;
+    site->file = read_str(in, siteHdr.fileLen, path);
+    site->func = read_str(in, siteHdr.funcLen, path);
+    site->fmt = read_str(in, siteHdr.fmtLen, path);
+  }
+  Entry *entries = NULL;
+  size_t nEntries = 0;
+  TraceRingHdr ringHdr;
+  while (fread(&ringHdr, sizeof(ringHdr), 1, in) == 1) {
+    entries = realloc(entries, (nEntries + ringHdr.nRecords) * sizeof(Entry));
+    if (!entries) fatal("cannot allocate %u records:", ringHdr.nRecords);
+    for (uint32_t i = 0; i < ringHdr.nRecords; i++) {
+      Entry *entry = &entries[nEntries++];
+      entry->threadId = ringHdr.threadId;
+      read_all(in, &entry->record, sizeof(TraceRecord), path);
+    }
+  }
+  fclose(in);
+  qsort(entries, nEntries, sizeof(Entry), compare_entries);
+  const uint64_t t0 = (nEntries > 0) ? entries[0].record.timestamp : 0;
+  for (size_t i = 0; i < nEntries; i++) {
+    const Entry *entry = &entries[i];
+    const TraceRecord *record = &entry->record;
+    const uint32_t nArgs =
+      (record->nArgs <= TRACE_MAX_ARGS) ? record->nArgs : TRACE_MAX_ARGS;
+    printf("+%.3f [%u] ", (record->timestamp - t0) / 1e3, entry->threadId);
+    if (record->siteId == 0 || record->siteId > nSites ||
+        !sites[record->siteId].fmt) {
+      printf("unknown site %u\n", record->siteId);
+      continue;
+    }
+    const Site *site = &sites[record->siteId];
+    printf("%s:%u: %s(): ", site->file, site->line, site->func);
+    print_message(site->fmt, nArgs, record->args);
+  }
+  free(entries);
+  for (uint32_t i = 1; i <= nSites; i++) {
+    free(sites[i].file); free(sites[i].func); free(sites[i].fmt);
+  }
+  free(sites);
+}
+
+int
+main(int argc, char *argv[])
+{
+  if (argc != 2) fatal("usage: %s TRACE_FILE", argv[0]);
+  decode(argv[1]);
+  return 0;
+}